@@ -0,0 +1,816 @@
+#define OK_LIB_USE_THREADS
+#include "ok_lib.h"
+#include <stdio.h>
+
+/*
+ Map benchmarks. Build with optimizations, for example:
+
+     cmake -DCMAKE_BUILD_TYPE=Release .. && cmake --build . && ./ok-lib-benchmark
+
+ An optional argument sets the largest map size (default is 4000000).
+ */
+
+// MARK: Timing
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <sys/time.h>
+#define THREAD_RETURN_VALUE void *
+
+static int64_t ok_time_us(void) {
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return (int64_t)t.tv_sec * 1000000 + (int64_t)t.tv_usec;
+}
+
+#else
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+typedef HANDLE pthread_t;
+
+#define THREAD_RETURN_VALUE DWORD WINAPI
+
+static int64_t ok_time_us(void) {
+    FILETIME filetime;
+    ULARGE_INTEGER large_int;
+
+    GetSystemTimeAsFileTime(&filetime);
+    large_int.LowPart = filetime.dwLowDateTime;
+    large_int.HighPart = filetime.dwHighDateTime;
+    return large_int.QuadPart / 10; // Convert from 100-nanosecond intervals to 1 us intervals
+}
+
+static int pthread_create(HANDLE *thread, const void *attr,
+                          LPTHREAD_START_ROUTINE start_routine, void *arg) {
+    (void)attr;
+    *thread = CreateThread(NULL, 0, start_routine, arg, 0, NULL);
+    return (*thread == NULL);
+}
+
+static int pthread_join(HANDLE thread, void **value_ptr) {
+    (void)value_ptr;
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    return 0;
+}
+
+#endif
+
+static double ns_per_op(int64_t start_time, int64_t end_time, size_t count) {
+    return (double)(end_time - start_time) * 1000.0 / (double)count;
+}
+
+// MARK: Map benchmarks
+
+typedef struct ok_map_of(uint32_t, uint32_t) u32_map_t;
+
+// Multiplying by an odd constant is a bijection, so the keys are unique, and the keys in
+// [0, count) never equal the keys in [count, 2 * count).
+static uint32_t bench_key(size_t i) {
+    return (uint32_t)i * 2654435761u;
+}
+
+static void bench_map(const char *name, unsigned int options, size_t count) {
+    u32_map_t map;
+    if (!ok_map_init_custom_with_options(&map, ok_uint32_hash, ok_32bit_equals, 0, options)) {
+        printf("Error: Not enough memory\n");
+        return;
+    }
+    uint32_t sum = 0;
+
+    int64_t t0 = ok_time_us();
+    for (size_t i = 0; i < count; i++) {
+        ok_map_put(&map, bench_key(i), (uint32_t)i);
+    }
+    int64_t t1 = ok_time_us();
+    for (size_t i = 0; i < count; i++) {
+        sum += ok_map_get(&map, bench_key(i));
+    }
+    int64_t t2 = ok_time_us();
+    for (size_t i = count; i < count * 2; i++) {
+        sum += ok_map_contains(&map, bench_key(i));
+    }
+    int64_t t3 = ok_time_us();
+    uint32_t keys[256];
+    uint32_t values[256];
+    for (size_t i = 0; i < count; i += 256) {
+        size_t n = (count - i < 256) ? count - i : 256;
+        for (size_t j = 0; j < n; j++) {
+            keys[j] = bench_key(i + j);
+        }
+        ok_map_get_many(&map, keys, n, values);
+        for (size_t j = 0; j < n; j++) {
+            sum += values[j];
+        }
+    }
+    int64_t t4 = ok_time_us();
+    for (size_t i = 0; i < count; i++) {
+        ok_map_remove(&map, bench_key(i));
+    }
+    int64_t t5 = ok_time_us();
+
+    printf("%-16s %9zu | put %6.1f | get %6.1f | miss %6.1f | get_many %6.1f | remove %6.1f | "
+           "(%u)\n", name, count, ns_per_op(t0, t1, count), ns_per_op(t1, t2, count),
+           ns_per_op(t2, t3, count), ns_per_op(t3, t4, count), ns_per_op(t4, t5, count),
+           (unsigned int)(sum & 1));
+
+    ok_map_deinit(&map);
+}
+
+typedef struct {
+    uint32_t data[32];
+} big_value_t;
+
+typedef struct ok_map_of(uint32_t, big_value_t) u32_big_map_t;
+
+// Maps with 128-byte values, where probing touches fewer cache lines if the values are split.
+static void bench_map_big_values(const char *name, unsigned int options, size_t count) {
+    u32_big_map_t map;
+    if (!ok_map_init_custom_with_options(&map, ok_uint32_hash, ok_32bit_equals, 0, options)) {
+        printf("Error: Not enough memory\n");
+        return;
+    }
+    uint32_t sum = 0;
+    big_value_t value;
+    memset(&value, 0, sizeof(value));
+
+    int64_t t0 = ok_time_us();
+    for (size_t i = 0; i < count; i++) {
+        value.data[0] = (uint32_t)i;
+        ok_map_put(&map, bench_key(i), value);
+    }
+    int64_t t1 = ok_time_us();
+    for (size_t i = 0; i < count; i++) {
+        sum += ok_map_get_ptr(&map, bench_key(i))->data[0];
+    }
+    int64_t t2 = ok_time_us();
+    for (size_t i = count; i < count * 2; i++) {
+        sum += ok_map_contains(&map, bench_key(i));
+    }
+    int64_t t3 = ok_time_us();
+    for (size_t i = 0; i < count; i++) {
+        ok_map_remove(&map, bench_key(i));
+    }
+    int64_t t4 = ok_time_us();
+
+    printf("%-16s %9zu | put %6.1f | get_ptr %6.1f | miss %6.1f | remove %6.1f | (%u)\n", name,
+           count, ns_per_op(t0, t1, count), ns_per_op(t1, t2, count), ns_per_op(t2, t3, count),
+           ns_per_op(t3, t4, count), (unsigned int)(sum & 1));
+
+    ok_map_deinit(&map);
+}
+
+// Many maps with a few entries each, which are small maps.
+static void bench_map_tiny(size_t count) {
+    const size_t keys_per_map = 4;
+    size_t map_count = count / keys_per_map;
+    u32_map_t *maps = (u32_map_t *)malloc(map_count * sizeof(u32_map_t));
+    if (!maps) {
+        printf("Error: Not enough memory\n");
+        return;
+    }
+    uint32_t sum = 0;
+
+    int64_t t0 = ok_time_us();
+    for (size_t i = 0; i < map_count; i++) {
+        ok_map_init_custom(&maps[i], ok_uint32_hash, ok_32bit_equals);
+        for (size_t j = 0; j < keys_per_map; j++) {
+            ok_map_put(&maps[i], bench_key(i * keys_per_map + j), (uint32_t)j);
+        }
+    }
+    int64_t t1 = ok_time_us();
+    for (size_t i = 0; i < map_count; i++) {
+        for (size_t j = 0; j < keys_per_map; j++) {
+            sum += ok_map_get(&maps[i], bench_key(i * keys_per_map + j));
+        }
+        sum += ok_map_contains(&maps[i], bench_key(count + i));
+    }
+    int64_t t2 = ok_time_us();
+    for (size_t i = 0; i < map_count; i++) {
+        ok_map_deinit(&maps[i]);
+    }
+    int64_t t3 = ok_time_us();
+
+    printf("%9zu maps | init + put %6.1f | get %6.1f | deinit %6.1f | (%u)\n", map_count,
+           ns_per_op(t0, t1, map_count * keys_per_map),
+           ns_per_op(t1, t2, map_count * (keys_per_map + 1)), ns_per_op(t2, t3, map_count),
+           (unsigned int)(sum & 1));
+    free(maps);
+}
+
+// Counts occurrences of keys (each key occurs 8 times), like a group-by. The lookup-then-put loop
+// hashes and probes twice for each new key; ok_map_entry() does it once.
+static void bench_map_group_by(unsigned int options, size_t count) {
+    const size_t key_count = count / 8;
+    u32_map_t map;
+    ok_map_init_custom_with_options(&map, ok_uint32_hash, ok_32bit_equals, 0, options);
+    int64_t t0 = ok_time_us();
+    for (size_t i = 0; i < count; i++) {
+        uint32_t key = bench_key(i % key_count);
+        uint32_t *value = ok_map_get_ptr(&map, key);
+        if (value) {
+            (*value)++;
+        } else {
+            ok_map_put(&map, key, 1);
+        }
+    }
+    int64_t t1 = ok_time_us();
+    uint32_t sum = ok_map_get(&map, bench_key(0));
+    ok_map_deinit(&map);
+
+    ok_map_init_custom_with_options(&map, ok_uint32_hash, ok_32bit_equals, 0, options);
+    int64_t t2 = ok_time_us();
+    for (size_t i = 0; i < count; i++) {
+        uint32_t *value = ok_map_entry(&map, bench_key(i % key_count), NULL);
+        if (value) {
+            (*value)++;
+        }
+    }
+    int64_t t3 = ok_time_us();
+    sum += ok_map_get(&map, bench_key(0));
+    ok_map_deinit(&map);
+
+    printf("%9zu | get_ptr + put %6.1f | entry %6.1f | (%u)\n", count,
+           ns_per_op(t0, t1, count), ns_per_op(t2, t3, count), (unsigned int)(sum & 1));
+}
+
+// Measures one resize (doubling the capacity) of a full map, with a number of threads.
+static void bench_map_resize(const char *name, unsigned int options, size_t count) {
+    int64_t times[3] = { 0 };
+    const size_t thread_counts[3] = { 1, 2, 4 };
+    for (size_t i = 0; i < 3; i++) {
+        u32_map_t map;
+        ok_map_init_custom_with_options(&map, ok_uint32_hash, ok_32bit_equals, 0, options);
+        for (size_t j = 0; j < count; j++) {
+            ok_map_put(&map, bench_key(j), (uint32_t)j);
+        }
+        int64_t t0 = ok_time_us();
+        ok_map_reserve_parallel(&map, ok_map_capacity(&map), thread_counts[i]);
+        times[i] = ok_time_us() - t0;
+        ok_map_deinit(&map);
+    }
+    printf("%-16s %9zu | 1 thread %6.1f | 2 threads %6.1f | 4 threads %6.1f\n", name, count,
+           ns_per_op(0, times[0], count), ns_per_op(0, times[1], count),
+           ns_per_op(0, times[2], count));
+}
+
+// Compares a loop of puts with ok_map_build() from key and value arrays.
+static void bench_map_build(const char *name, unsigned int options, size_t count) {
+    uint32_t *keys = (uint32_t *)malloc(count * sizeof(uint32_t));
+    uint32_t *values = (uint32_t *)malloc(count * sizeof(uint32_t));
+    ok_hash_t *hashes = (ok_hash_t *)malloc(count * sizeof(ok_hash_t));
+    if (!keys || !values || !hashes) {
+        printf("Error: Not enough memory\n");
+        free(keys);
+        free(values);
+        free(hashes);
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = bench_key(i);
+        values[i] = (uint32_t)i;
+    }
+
+    u32_map_t map;
+    ok_map_init_custom_with_options(&map, ok_uint32_hash, ok_32bit_equals, 0, options);
+    int64_t t0 = ok_time_us();
+    for (size_t i = 0; i < count; i++) {
+        ok_map_put(&map, keys[i], values[i]);
+    }
+    int64_t t1 = ok_time_us();
+    ok_map_deinit(&map);
+
+    ok_map_init_custom_with_options(&map, ok_uint32_hash, ok_32bit_equals, 0, options);
+    int64_t t2 = ok_time_us();
+    ok_map_hash_many(&map, keys, count, hashes);
+    bool success = ok_map_build(&map, keys, hashes, values, count, OK_MAP_BUILD_LAST);
+    int64_t t3 = ok_time_us();
+    ok_map_deinit(&map);
+
+    if (!success) {
+        printf("Error: Not enough memory\n");
+    } else {
+        printf("%-16s %9zu | put %6.1f | build %6.1f\n", name, count,
+               ns_per_op(t0, t1, count), ns_per_op(t2, t3, count));
+    }
+    free(keys);
+    free(values);
+    free(hashes);
+}
+
+// Measures the slowest single put, which is dominated by resizing.
+static void bench_map_put_latency(const char *name, unsigned int options, size_t count) {
+    u32_map_t map;
+    if (!ok_map_init_custom_with_options(&map, ok_uint32_hash, ok_32bit_equals, 0, options)) {
+        printf("Error: Not enough memory\n");
+        return;
+    }
+    int64_t max_time = 0;
+    int64_t t0 = ok_time_us();
+    for (size_t i = 0; i < count; i++) {
+        int64_t put_start_time = ok_time_us();
+        ok_map_put(&map, bench_key(i), (uint32_t)i);
+        int64_t put_time = ok_time_us() - put_start_time;
+        if (put_time > max_time) {
+            max_time = put_time;
+        }
+    }
+    int64_t t1 = ok_time_us();
+
+    printf("%-16s %9zu | put %6.1f | max put latency %8lld us\n",
+           name, count, ns_per_op(t0, t1, count), (long long)max_time);
+
+    ok_map_deinit(&map);
+}
+
+// Compares lookups before and after ok_map_freeze().
+static void bench_map_frozen(size_t count) {
+    u32_map_t map;
+    if (!ok_map_init_custom(&map, ok_uint32_hash, ok_32bit_equals)) {
+        printf("Error: Not enough memory\n");
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        ok_map_put(&map, bench_key(i), (uint32_t)i);
+    }
+    uint32_t sum = 0;
+    for (int frozen = 0; frozen <= 1; frozen++) {
+        int64_t t0 = ok_time_us();
+        if (frozen && !ok_map_freeze(&map)) {
+            printf("Error: Not enough memory\n");
+            break;
+        }
+        int64_t t1 = ok_time_us();
+        for (size_t i = 0; i < count; i++) {
+            sum += ok_map_get(&map, bench_key(i));
+        }
+        int64_t t2 = ok_time_us();
+        for (size_t i = count; i < count * 2; i++) {
+            sum += ok_map_contains(&map, bench_key(i));
+        }
+        int64_t t3 = ok_time_us();
+        printf("%-16s %9zu | freeze %6.1f | get %6.1f | miss %6.1f | buckets %9zu | (%u)\n",
+               frozen ? "frozen" : "linear probing", count, ns_per_op(t0, t1, count),
+               ns_per_op(t1, t2, count), ns_per_op(t2, t3, count), ok_map_capacity(&map),
+               (unsigned int)(sum & 1));
+    }
+    ok_map_deinit(&map);
+}
+
+static void bench_map_scan_sum(const void *key, void *value, void *context) {
+    (void)key;
+    *(uint32_t *)context += *(uint32_t *)value;
+}
+
+// Compares ok_map_foreach_r() with a full ok_map_scan() in steps of 100 buckets, and measures the
+// slowest step.
+static void bench_map_scan(const char *name, unsigned int options, size_t count) {
+    u32_map_t map;
+    if (!ok_map_init_custom_with_options(&map, ok_uint32_hash, ok_32bit_equals, 0, options)) {
+        printf("Error: Not enough memory\n");
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        ok_map_put(&map, bench_key(i), (uint32_t)i);
+    }
+    uint32_t sum = 0;
+    uint32_t value;
+    int64_t t0 = ok_time_us();
+    ok_map_foreach_r(&map, NULL, &value) {
+        sum += value;
+    }
+    int64_t t1 = ok_time_us();
+    int64_t max_time = 0;
+    size_t cursor = 0;
+    do {
+        int64_t step_start_time = ok_time_us();
+        cursor = ok_map_scan(&map, cursor, 100, bench_map_scan_sum, &sum);
+        int64_t step_time = ok_time_us() - step_start_time;
+        if (step_time > max_time) {
+            max_time = step_time;
+        }
+    } while (cursor != 0);
+    int64_t t2 = ok_time_us();
+    printf("%-16s %9zu | foreach %6.1f | scan %6.1f | max scan step %6lld us | (%u)\n", name, count,
+           ns_per_op(t0, t1, count), ns_per_op(t1, t2, count), (long long)max_time,
+           (unsigned int)(sum & 1));
+    ok_map_deinit(&map);
+}
+
+// Compares building a map with opening a saved copy of it.
+static void bench_map_file(size_t count) {
+    const char *path = "ok_map_benchmark.bin";
+    u32_map_t map;
+    int64_t t0 = ok_time_us();
+    if (!ok_map_init_custom(&map, ok_uint32_hash, ok_32bit_equals)) {
+        printf("Error: Not enough memory\n");
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        ok_map_put(&map, bench_key(i), (uint32_t)i);
+    }
+    int64_t t1 = ok_time_us();
+    bool saved = ok_map_save(&map, path);
+    int64_t t2 = ok_time_us();
+    ok_map_deinit(&map);
+    if (!saved) {
+        printf("Error: Could not save %s\n", path);
+        return;
+    }
+    int64_t t3 = ok_time_us();
+    if (!ok_map_init_custom_from_file(&map, ok_uint32_hash, ok_32bit_equals, path)) {
+        printf("Error: Could not open %s\n", path);
+        remove(path);
+        return;
+    }
+    int64_t t4 = ok_time_us();
+    uint32_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += ok_map_get(&map, bench_key(i));
+    }
+    int64_t t5 = ok_time_us();
+    printf("%-16s %9zu | build %8.1f ms | save %8.1f ms | open %8.3f ms | get %6.1f ns | "
+           "(%u)\n", "linear probing", count, (double)(t1 - t0) / 1000.0,
+           (double)(t2 - t1) / 1000.0, (double)(t4 - t3) / 1000.0, ns_per_op(t4, t5, count),
+           (unsigned int)(sum & 1));
+    ok_map_deinit(&map);
+    remove(path);
+}
+
+// Cache accesses (a get, and a put on a miss) with a cache that holds a quarter of the keys. Half
+// of the accesses are to a hot eighth of the keys.
+static void bench_lru(size_t count) {
+    typedef struct ok_lru_of(uint32_t, uint32_t) u32_lru_t;
+    u32_lru_t lru;
+    if (!ok_lru_init_custom(&lru, ok_uint32_hash, ok_32bit_equals, count / 4)) {
+        printf("Error: Not enough memory\n");
+        return;
+    }
+    const size_t access_count = count * 4;
+    uint32_t random = 1;
+    uint32_t sum = 0;
+    int64_t t0 = ok_time_us();
+    for (size_t i = 0; i < access_count; i++) {
+        random = random * 1103515245u + 12345u;
+        size_t key_range = (random & 0x80000000u) ? count / 8 : count;
+        uint32_t key = bench_key((random >> 8) % key_range);
+        uint32_t *value = ok_lru_get_ptr(&lru, key);
+        if (value) {
+            sum += *value;
+        } else {
+            ok_lru_put(&lru, key, key);
+        }
+    }
+    int64_t t1 = ok_time_us();
+    printf("%-16s %9zu | access %6.1f | hit rate %5.1f%% | (%u)\n", "lru", count,
+           ns_per_op(t0, t1, access_count),
+           100.0 * (double)ok_lru_hits(&lru) / (double)access_count, (unsigned int)(sum & 1));
+    ok_lru_deinit(&lru);
+}
+
+// MARK: Hash benchmarks
+
+// The previous string hash (Jenkins one-at-a-time), for comparison
+static ok_hash_t one_at_a_time_hash(const char *key) {
+    ok_hash_t hash = 0;
+    char ch;
+    while ((ch = *key++) != 0) {
+        hash += (ok_hash_t)ch;
+        hash += (hash << 10);
+        hash ^= (hash >> 6);
+    }
+    hash += (hash << 3);
+    hash ^= (hash >> 11);
+    hash += (hash << 15);
+    return hash;
+}
+
+static double gb_per_sec(int64_t start_time, int64_t end_time, size_t bytes) {
+    int64_t duration = end_time - start_time;
+    return (double)bytes / (double)(duration > 0 ? duration : 1) / 1000.0;
+}
+
+static void bench_hashes(void) {
+    // Distinct strings, so the results can't be reused between iterations
+    enum { str_count = 64, max_length = 256 };
+    static char strs[str_count][max_length + 1];
+    static char strs2[str_count][max_length + 1];
+    static const size_t total_bytes = 1 << 28;
+
+    printf("String hash and equals, GB/s\n");
+    for (size_t length = 4; length <= max_length; length *= 2) {
+        for (size_t i = 0; i < str_count; i++) {
+            for (size_t j = 0; j < length; j++) {
+                strs[i][j] = (char)('a' + (i + j) % 26);
+            }
+            strs[i][length] = 0;
+            memcpy(strs2[i], strs[i], length + 1);
+        }
+        const size_t iterations = total_bytes / length;
+        ok_hash_t sum = 0;
+
+        int64_t t0 = ok_time_us();
+        for (size_t i = 0; i < iterations; i++) {
+            sum += one_at_a_time_hash(strs[i % str_count]);
+        }
+        int64_t t1 = ok_time_us();
+        for (size_t i = 0; i < iterations; i++) {
+            sum += ok_const_str_hash(strs[i % str_count]);
+        }
+        int64_t t2 = ok_time_us();
+        for (size_t i = 0; i < iterations; i++) {
+            sum += ok_hash_bytes(strs[i % str_count], length);
+        }
+        int64_t t3 = ok_time_us();
+        for (size_t i = 0; i < iterations; i++) {
+            const char *str = strs[i % str_count];
+            const char *str2 = strs2[i % str_count];
+            sum += ok_str_equals(&str, &str2);
+        }
+        int64_t t4 = ok_time_us();
+
+        printf("length %3zu | one-at-a-time %5.2f | ok_const_str_hash %5.2f | ok_hash_bytes %5.2f | "
+               "ok_str_equals %5.2f | (%u)\n", length,
+               gb_per_sec(t0, t1, iterations * length), gb_per_sec(t1, t2, iterations * length),
+               gb_per_sec(t2, t3, iterations * length), gb_per_sec(t3, t4, iterations * length),
+               (unsigned int)(sum & 1));
+    }
+    printf("\n");
+}
+
+// MARK: Concurrent map benchmarks
+
+#define CMAP_BENCH_KEY_COUNT 1000000
+#define CMAP_BENCH_OP_COUNT 4000000
+
+typedef struct ok_cmap_of(uint32_t, uint32_t) u32_cmap_t;
+
+typedef struct {
+    pthread_t thread;
+    u32_cmap_t *cmap;
+    u32_map_t *map; // If not NULL, use this map with a global lock instead of the cmap
+    OK_LOCK_TYPE *lock;
+    size_t first_op;
+    size_t op_count;
+    uint32_t sum;
+} cmap_bench_context;
+
+// 90% gets, 10% puts
+static THREAD_RETURN_VALUE cmap_bench_thread_entry(void *context) {
+    cmap_bench_context *c = context;
+    uint32_t sum = 0;
+    for (size_t i = c->first_op; i < c->first_op + c->op_count; i++) {
+        uint32_t key = bench_key(i % CMAP_BENCH_KEY_COUNT);
+        uint32_t value = (uint32_t)i;
+        bool put = (i % 10 == 0);
+        if (c->map) {
+            OK_LOCK(c->lock);
+            if (put) {
+                ok_map_put(c->map, key, value);
+            } else {
+                ok_map_get_r(c->map, &key, &value);
+            }
+            OK_UNLOCK(c->lock);
+        } else if (put) {
+            ok_cmap_put(c->cmap, &key, &value);
+        } else {
+            ok_cmap_get(c->cmap, &key, &value);
+        }
+        sum += value;
+    }
+    c->sum = sum;
+    return 0;
+}
+
+static double bench_cmap_threads(u32_cmap_t *cmap, u32_map_t *map, size_t thread_count) {
+    static cmap_bench_context contexts[64];
+    OK_LOCK_TYPE lock;
+    atomic_store(&lock, false);
+    int64_t t0 = ok_time_us();
+    for (size_t i = 0; i < thread_count; i++) {
+        contexts[i].cmap = cmap;
+        contexts[i].map = map;
+        contexts[i].lock = &lock;
+        contexts[i].op_count = CMAP_BENCH_OP_COUNT / thread_count;
+        contexts[i].first_op = i * contexts[i].op_count;
+        pthread_create(&contexts[i].thread, NULL, cmap_bench_thread_entry, &contexts[i]);
+    }
+    for (size_t i = 0; i < thread_count; i++) {
+        pthread_join(contexts[i].thread, NULL);
+    }
+    int64_t t1 = ok_time_us();
+    return (double)CMAP_BENCH_OP_COUNT / (double)(t1 - t0);
+}
+
+static void bench_cmap(void) {
+    u32_cmap_t cmap;
+    u32_map_t map;
+    if (!ok_cmap_init_custom(&cmap, ok_uint32_hash, ok_32bit_equals) ||
+        !ok_map_init_custom(&map, ok_uint32_hash, ok_32bit_equals)) {
+        printf("Error: Not enough memory\n");
+        return;
+    }
+    for (size_t i = 0; i < CMAP_BENCH_KEY_COUNT; i++) {
+        uint32_t key = bench_key(i);
+        uint32_t value = (uint32_t)i;
+        ok_cmap_put(&cmap, &key, &value);
+        ok_map_put(&map, key, value);
+    }
+
+    printf("Concurrent map (uint32_t keys and values, 90%% get, 10%% put), million ops per second\n");
+    for (size_t thread_count = 1; thread_count <= 64; thread_count *= 2) {
+        double cmap_ops = bench_cmap_threads(&cmap, NULL, thread_count);
+        double map_ops = bench_cmap_threads(NULL, &map, thread_count);
+        printf("threads %2zu | ok_cmap %6.2f | ok_map with global lock %6.2f\n",
+               thread_count, cmap_ops, map_ops);
+    }
+    printf("\n");
+
+    ok_cmap_deinit(&cmap);
+    ok_map_deinit(&map);
+}
+
+// MARK: Aggregator benchmarks
+
+typedef struct ok_agg_of(uint32_t, uint32_t) u32_agg_t;
+
+typedef struct {
+    pthread_t thread;
+    u32_agg_t *agg;
+    u32_cmap_t *cmap; // If not NULL, use this cmap instead of the aggregator
+    size_t worker;
+    size_t first_op;
+    size_t op_count;
+} agg_bench_context;
+
+static void agg_bench_increment(void *value, bool exists, void *context) {
+    (void)exists;
+    (void)context;
+    (*(uint32_t *)value)++;
+}
+
+static void agg_bench_add(void *value, const void *new_value, void *context) {
+    (void)context;
+    *(uint32_t *)value += *(const uint32_t *)new_value;
+}
+
+// Counts occurrences of keys
+static THREAD_RETURN_VALUE agg_bench_thread_entry(void *context) {
+    agg_bench_context *c = context;
+    for (size_t i = c->first_op; i < c->first_op + c->op_count; i++) {
+        uint32_t key = bench_key(i % CMAP_BENCH_KEY_COUNT);
+        if (c->cmap) {
+            ok_cmap_update(c->cmap, &key, agg_bench_increment, NULL);
+        } else {
+            uint32_t *count = ok_agg_entry(c->agg, c->worker, &key, NULL);
+            if (count) {
+                (*count)++;
+            }
+        }
+    }
+    return 0;
+}
+
+// Returns million ops per second, including the merge. Sets `merge_ms` to the time of the merge.
+static double bench_agg_threads(u32_cmap_t *cmap, size_t thread_count, double *merge_ms) {
+    static agg_bench_context contexts[64];
+    u32_agg_t agg;
+    if (!ok_agg_init_custom(&agg, ok_uint32_hash, ok_32bit_equals, thread_count)) {
+        return 0.0;
+    }
+    int64_t t0 = ok_time_us();
+    for (size_t i = 0; i < thread_count; i++) {
+        contexts[i].agg = &agg;
+        contexts[i].cmap = cmap;
+        contexts[i].worker = i;
+        contexts[i].op_count = CMAP_BENCH_OP_COUNT / thread_count;
+        contexts[i].first_op = i * contexts[i].op_count;
+        pthread_create(&contexts[i].thread, NULL, agg_bench_thread_entry, &contexts[i]);
+    }
+    for (size_t i = 0; i < thread_count; i++) {
+        pthread_join(contexts[i].thread, NULL);
+    }
+    int64_t t1 = ok_time_us();
+    if (!cmap) {
+        ok_agg_merge(&agg, agg_bench_add, NULL);
+    }
+    int64_t t2 = ok_time_us();
+    ok_agg_deinit(&agg);
+    *merge_ms = (double)(t2 - t1) / 1000.0;
+    return (double)CMAP_BENCH_OP_COUNT / (double)(t2 - t0);
+}
+
+static void bench_agg(void) {
+    printf("Group-by count (uint32_t keys and values, 4 per key), million ops per second\n");
+    for (size_t thread_count = 1; thread_count <= 16; thread_count *= 2) {
+        u32_cmap_t cmap;
+        if (!ok_cmap_init_custom(&cmap, ok_uint32_hash, ok_32bit_equals)) {
+            printf("Error: Not enough memory\n");
+            return;
+        }
+        double merge_ms = 0.0;
+        double cmap_merge_ms = 0.0;
+        double agg_ops = bench_agg_threads(NULL, thread_count, &merge_ms);
+        double cmap_ops = bench_agg_threads(&cmap, thread_count, &cmap_merge_ms);
+        printf("threads %2zu | ok_agg %6.2f (merge %7.1f ms) | ok_cmap_update %6.2f\n",
+               thread_count, agg_ops, merge_ms, cmap_ops);
+        ok_cmap_deinit(&cmap);
+    }
+    printf("\n");
+}
+
+// MARK: Main
+
+static void bench_maps(size_t max_count) {
+    printf("Map (uint32_t keys and values), ns per operation\n");
+    for (size_t count = 1000; count <= max_count; count *= 10) {
+        bench_map("linear probing", OK_MAP_OPTION_NONE, count);
+        bench_map("group probing", OK_MAP_OPTION_GROUP_PROBING, count);
+        bench_map("incremental", OK_MAP_OPTION_INCREMENTAL_RESIZE, count);
+        bench_map("robin hood", OK_MAP_OPTION_ROBIN_HOOD, count);
+        bench_map("insertion order", OK_MAP_OPTION_INSERTION_ORDER, count);
+    }
+    printf("\n");
+
+    printf("Map (uint32_t keys, 128-byte values), ns per operation\n");
+    for (size_t count = 1000; count <= max_count; count *= 10) {
+        bench_map_big_values("linear probing", OK_MAP_OPTION_NONE, count);
+        bench_map_big_values("split values", OK_MAP_OPTION_SPLIT_VALUES, count);
+        bench_map_big_values("group + split", OK_MAP_OPTION_GROUP_PROBING |
+                             OK_MAP_OPTION_SPLIT_VALUES, count);
+    }
+    printf("\n");
+
+    printf("Tiny maps (4 entries each), ns per operation\n");
+    for (size_t count = 1000; count <= max_count; count *= 10) {
+        bench_map_tiny(count);
+    }
+    printf("\n");
+
+    printf("Group-by count (uint32_t keys and values, 8 per key), ns per operation\n");
+    for (size_t count = 1000; count <= max_count; count *= 10) {
+        bench_map_group_by(OK_MAP_OPTION_NONE, count);
+    }
+    printf("\n");
+
+    printf("Map resize (uint32_t keys and values), ns per entry\n");
+    for (size_t count = 1000; count <= max_count; count *= 10) {
+        bench_map_resize("linear probing", OK_MAP_OPTION_NONE, count);
+        bench_map_resize("robin hood", OK_MAP_OPTION_ROBIN_HOOD, count);
+        bench_map_resize("group probing", OK_MAP_OPTION_GROUP_PROBING, count);
+    }
+    printf("\n");
+
+    printf("Map build (uint32_t keys and values), ns per entry\n");
+    for (size_t count = 1000; count <= max_count; count *= 10) {
+        bench_map_build("linear probing", OK_MAP_OPTION_NONE, count);
+        bench_map_build("robin hood", OK_MAP_OPTION_ROBIN_HOOD, count);
+    }
+    printf("\n");
+
+    printf("Map put latency (uint32_t keys and values), ns per operation\n");
+    bench_map_put_latency("linear probing", OK_MAP_OPTION_NONE, max_count);
+    bench_map_put_latency("incremental", OK_MAP_OPTION_INCREMENTAL_RESIZE, max_count);
+    printf("\n");
+
+    printf("Frozen map (uint32_t keys and values), ns per operation\n");
+    for (size_t count = 1000; count <= max_count; count *= 10) {
+        bench_map_frozen(count);
+    }
+    printf("\n");
+
+    printf("Map scan (uint32_t keys and values, 100 buckets per step), ns per entry\n");
+    for (size_t count = 1000; count <= max_count; count *= 10) {
+        bench_map_scan("linear probing", OK_MAP_OPTION_NONE, count);
+        bench_map_scan("robin hood", OK_MAP_OPTION_ROBIN_HOOD, count);
+        bench_map_scan("group probing", OK_MAP_OPTION_GROUP_PROBING, count);
+    }
+    printf("\n");
+
+    printf("Map file (uint32_t keys and values)\n");
+    for (size_t count = 1000; count <= max_count; count *= 10) {
+        bench_map_file(count);
+    }
+    printf("\n");
+
+    printf("LRU cache (uint32_t keys and values), ns per operation\n");
+    for (size_t count = 1000; count <= max_count; count *= 10) {
+        bench_lru(count);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    size_t max_count = 4000000;
+    if (argc > 1) {
+        max_count = (size_t)strtoul(argv[1], NULL, 10);
+    }
+
+    bench_hashes();
+    bench_maps(max_count);
+    bench_cmap();
+    bench_agg();
+
+    return 0;
+}
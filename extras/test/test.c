@@ -75,6 +75,14 @@ static ok_hash_t bad_hash(int v) {
     return 0;
 }
 
+static ok_hash_t mod5_hash(int v) {
+    return ok_int32_hash(v % 5);
+}
+
+static ok_hash_t mod97_hash(int v) {
+    return ok_int32_hash(v % 97);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 // MARK: Test vec
@@ -415,6 +423,1138 @@ static void test_vec(void) {
 
 // MARK: Test map
 
+static void test_map_with_options(unsigned int options) {
+    struct int_int_map_s ok_map_of(int, int);
+    struct int_int_map_s map;
+    struct int_int_map_s *map_ptr = &map;
+    const int count = 10000;
+
+    bool success = ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0,
+                                                   options);
+    ok_assert(success, "ok_map_init_custom_with_options");
+
+    // Put / get
+    for (int i = 0; i < count; i++) {
+        ok_map_put(&map, i, i * 2);
+    }
+    size_t found = 0;
+    for (int i = 0; i < count; i++) {
+        if (ok_map_get(&map, i) == i * 2) {
+            found++;
+        }
+    }
+    ok_assert(ok_map_count(&map) == (size_t)count && found == (size_t)count,
+              "options: ok_map_put / ok_map_get");
+
+    // Batched lookups, including keys that don't exist
+    int batch_keys[100];
+    int batch_values[100];
+    int *batch_value_ptrs[100];
+    uint8_t batch_bitmap[13];
+    for (int i = 0; i < 100; i++) {
+        batch_keys[i] = count - 50 + i;
+    }
+    ok_map_get_many(&map, batch_keys, 100, batch_values);
+    ok_map_get_ptr_many(&map, batch_keys, 100, batch_value_ptrs);
+    memset(batch_bitmap, 0xff, sizeof(batch_bitmap));
+    ok_map_contains_many(&map, batch_keys, 100, batch_bitmap);
+    found = 0;
+    for (int i = 0; i < 100; i++) {
+        bool exists = batch_keys[i] < count;
+        bool bit = (batch_bitmap[i / 8] >> (i % 8)) & 1;
+        if (batch_values[i] == (exists ? batch_keys[i] * 2 : 0) && bit == exists &&
+            (exists ? *batch_value_ptrs[i] == batch_keys[i] * 2 : batch_value_ptrs[i] == NULL)) {
+            found++;
+        }
+    }
+    ok_assert(found == 100, "options: ok_map_get_many / ok_map_contains_many");
+
+    // Precomputed hashes
+    ok_hash_t hash_count = ok_map_hash(&map, count);
+    ok_hash_t hash_zero = ok_map_hash(&map, 0);
+    ok_assert(ok_map_put_hashed(&map, count, hash_count, 7) &&
+              ok_map_get_hashed(&map, count, hash_count) == 7 &&
+              *ok_map_get_ptr_hashed(&map, count, hash_count) == 7 &&
+              ok_map_get(&map, count) == 7 &&
+              ok_map_get_hashed(&map, 0, hash_zero) == 0 &&
+              ok_map_contains_hashed(&map, 0, hash_zero) &&
+              ok_map_remove_hashed(&map, count, hash_count) &&
+              !ok_map_contains_hashed(&map, count, hash_count) &&
+              ok_map_count(&map) == (size_t)count, "options: ok_map_*_hashed");
+    *ok_map_put_and_get_ptr_hashed(&map, count, hash_count) = 8;
+    ok_assert(ok_map_get(&map, count) == 8 && ok_map_remove(&map, count),
+              "options: ok_map_put_and_get_ptr_hashed");
+
+    // Reentrant functions
+    int r_key = 10;
+    int r_value = -1;
+    int *r_value_ptr = NULL;
+    int r_missing_key = count;
+    ok_assert(ok_map_get_r(&map, &r_key, &r_value) && r_value == 20 &&
+              ok_map_get_ptr_r(&map, &r_key, &r_value_ptr) && *r_value_ptr == 20 &&
+              ok_map_contains_r(&map, &r_key) && !ok_map_contains_r(&map, &r_missing_key) &&
+              !ok_map_get_r(&map, &r_missing_key, &r_value) && r_value == 0 &&
+              !ok_map_get_ptr_r(&map, &r_missing_key, &r_value_ptr) && r_value_ptr == NULL,
+              "options: ok_map_get_r / ok_map_get_ptr_r / ok_map_contains_r");
+    found = 0;
+    ok_map_foreach_r(&map, &r_key, &r_value) {
+        if (r_value == r_key * 2) {
+            found++;
+        }
+    }
+    ok_assert(found == (size_t)count, "options: ok_map_foreach_r");
+
+    // Put all
+    struct int_int_map_s map_copy;
+    ok_map_init_custom(&map_copy, ok_int32_hash, ok_32bit_equals);
+    ok_map_put_all(&map_copy, &map);
+    found = 0;
+    for (int i = 0; i < count; i++) {
+        if (ok_map_get(&map_copy, i) == i * 2) {
+            found++;
+        }
+    }
+    ok_assert(ok_map_count(&map_copy) == (size_t)count && found == (size_t)count,
+              "options: ok_map_put_all");
+    ok_map_deinit(&map_copy);
+
+    // Remove odd keys
+    for (int i = 1; i < count; i += 2) {
+        ok_map_remove(&map, i);
+    }
+    found = 0;
+    for (int i = 0; i < count; i++) {
+        if (ok_map_contains(&map, i) == (i % 2 == 0)) {
+            found++;
+        }
+    }
+    ok_assert(ok_map_count(&map) == (size_t)count / 2 && found == (size_t)count,
+              "options: ok_map_remove / ok_map_contains");
+
+    // Put odd keys again, overwrite even keys
+    for (int i = 0; i < count; i++) {
+        ok_map_put(&map, i, i * 3);
+    }
+    found = 0;
+    ok_map_foreach(&map, int key, int value) {
+        if (value == key * 3) {
+            found++;
+        }
+    }
+    ok_assert(ok_map_count(&map) == (size_t)count && found == (size_t)count,
+              "options: ok_map_put after ok_map_remove / ok_map_foreach");
+
+    // Remove all
+    for (int i = 0; i < count; i++) {
+        ok_map_remove(&map, i);
+    }
+    found = 0;
+    ok_map_foreach(&map, int key, int value) {
+        (void)key;
+        (void)value;
+        found++;
+    }
+    ok_assert(ok_map_count(&map) == 0 && found == 0, "options: remove all");
+
+    // Sliding window of keys. The capacity should not grow.
+    const int window = 50;
+    for (int i = 0; i < window; i++) {
+        ok_map_put(&map, i, i);
+    }
+    size_t capacity = ok_map_capacity(map_ptr);
+    for (int i = window; i < count * 2; i++) {
+        ok_map_remove(&map, i - window);
+        ok_map_put(&map, i, i);
+    }
+    found = 0;
+    for (int i = count * 2 - window; i < count * 2; i++) {
+        if (ok_map_get(&map, i) == i) {
+            found++;
+        }
+    }
+    ok_assert(ok_map_count(&map) == (size_t)window && found == (size_t)window &&
+              ok_map_capacity(map_ptr) == capacity, "options: sliding window");
+    ok_map_deinit(&map);
+
+    // Bad hash function
+    ok_map_init_custom_with_options(&map, bad_hash, ok_32bit_equals, 0, options);
+    for (int i = 0; i < 1000; i++) {
+        ok_map_put(&map, i, i);
+    }
+    for (int i = 0; i < 1000; i += 3) {
+        ok_map_remove(&map, i);
+    }
+    found = 0;
+    for (int i = 0; i < 1000; i++) {
+        if (ok_map_contains(&map, i) == (i % 3 != 0) && (i % 3 == 0 || ok_map_get(&map, i) == i)) {
+            found++;
+        }
+    }
+    ok_assert(found == 1000, "options: bad hash function");
+
+    // Freeze with duplicate hashes
+    bool frozen = ok_map_freeze(&map);
+    found = 0;
+    for (int i = 0; i < 1000; i++) {
+        if (ok_map_contains(&map, i) == (i % 3 != 0) && (i % 3 == 0 || ok_map_get(&map, i) == i)) {
+            found++;
+        }
+    }
+    ok_assert(frozen && found == 1000 && ok_map_capacity(map_ptr) == ok_map_count(&map),
+              "options: freeze with bad hash function");
+    ok_map_deinit(&map);
+
+    // Freeze with several duplicated hashes
+    ok_hash_t (*duplicate_hash_funcs[])(int) = { mod5_hash, mod97_hash };
+    for (size_t f = 0; f < 2; f++) {
+        const int n = (f == 0 ? 10 : 1000);
+        ok_map_init_custom_with_options(&map, duplicate_hash_funcs[f], ok_32bit_equals, 0,
+                                        options);
+        for (int i = 0; i < n; i++) {
+            ok_map_put(&map, i, i + 1);
+        }
+        frozen = ok_map_freeze(&map);
+        found = 0;
+        for (int i = 0; i < n; i++) {
+            found += (ok_map_get(&map, i) == i + 1);
+        }
+        ok_assert(frozen && found == (size_t)n && ok_map_count(&map) == (size_t)n &&
+                  !ok_map_contains(&map, n), "options: freeze with several duplicated hashes");
+        ok_map_deinit(&map);
+    }
+
+    // Freeze small maps
+    found = 0;
+    for (int n = 1; n <= 10; n++) {
+        ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0, options);
+        for (int i = 0; i < n; i++) {
+            ok_map_put(&map, i, i + 1);
+        }
+        ok_map_freeze(&map);
+        bool all_found = !ok_map_contains(&map, n);
+        for (int i = 0; i < n; i++) {
+            all_found = all_found && ok_map_get(&map, i) == i + 1;
+        }
+        found += all_found;
+        ok_map_deinit(&map);
+    }
+    ok_assert(found == 10, "options: freeze small maps");
+
+    // Freeze
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0, options);
+    ok_assert(ok_map_freeze(&map) && ok_map_count(&map) == 0 && !ok_map_contains(&map, 0),
+              "options: freeze empty map");
+    ok_map_deinit(&map);
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0, options);
+    for (int i = 0; i < count; i++) {
+        ok_map_put(&map, i * 7, i);
+    }
+    frozen = ok_map_freeze(&map) && ok_map_freeze(&map);
+    found = 0;
+    for (int i = 0; i < count * 7; i++) {
+        int *value_ptr = ok_map_get_ptr(&map, i);
+        if ((i % 7 == 0) ? (value_ptr && *value_ptr == i / 7) : (value_ptr == NULL)) {
+            found++;
+        }
+    }
+    ok_assert(frozen && found == (size_t)count * 7 && ok_map_count(&map) == (size_t)count &&
+              ok_map_capacity(map_ptr) <= (size_t)count + (size_t)count / 50, "options: freeze");
+    int frozen_keys[3] = { 7, 8, 14 };
+    int frozen_values[3];
+    ok_map_get_many(&map, frozen_keys, 3, frozen_values);
+    size_t frozen_sum = 0;
+    ok_map_foreach(&map, int key, int value) {
+        frozen_sum += (size_t)(key == value * 7);
+    }
+    ok_assert(frozen_values[0] == 1 && frozen_values[1] == 0 && frozen_values[2] == 2 &&
+              frozen_sum == (size_t)count, "options: frozen map lookup");
+    ok_assert(!ok_map_put(&map, 1, 1) && !ok_map_remove(&map, 7) &&
+              ok_map_put_and_get_ptr(&map, 1) == NULL && ok_map_count(&map) == (size_t)count,
+              "options: frozen map is read-only");
+    ok_map_init_custom_with_options(&map_copy, ok_int32_hash, ok_32bit_equals, 0, options);
+    ok_assert(ok_map_put_all(&map_copy, &map) && ok_map_count(&map_copy) == (size_t)count &&
+              ok_map_get(&map_copy, 14) == 2, "options: copy frozen map");
+    ok_map_deinit(&map_copy);
+    ok_map_deinit(&map);
+
+    // Iterate with pointers, modifying values in place
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0, options);
+    for (int i = 0; i < count; i++) {
+        ok_map_put(&map, i, i);
+    }
+    const int *key_ptr;
+    int *value_ptr;
+    ok_map_foreach_ptr(&map, key_ptr, value_ptr) {
+        *value_ptr += *key_ptr;
+    }
+    found = 0;
+    ok_map_foreach_ptr(&map, key_ptr, value_ptr) {
+        if (*value_ptr == *key_ptr * 2 && ok_map_get(&map, *key_ptr) == *value_ptr) {
+            found++;
+        }
+    }
+    ok_assert(found == (size_t)count, "options: ok_map_foreach_ptr");
+    ok_map_deinit(&map);
+
+    // Save and open
+    const char *map_file_path = "ok_map_test.bin";
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0, options);
+    for (int i = 0; i < count; i++) {
+        ok_map_put(&map, i, i * 3);
+    }
+    bool saved = ok_map_save(&map, map_file_path);
+    ok_map_deinit(&map);
+    success = saved && ok_map_init_custom_from_file(&map, ok_int32_hash, ok_32bit_equals,
+                                                    map_file_path);
+    found = 0;
+    for (int i = 0; i < count * 2; i++) {
+        if (ok_map_get(&map, i) == (i < count ? i * 3 : 0) &&
+            ok_map_contains(&map, i) == (i < count)) {
+            found++;
+        }
+    }
+    ok_assert(success && found == (size_t)count * 2 && ok_map_count(&map) == (size_t)count,
+              "options: ok_map_save / ok_map_init_from_file");
+
+    // Modifications (including resizing) are not written to the file
+    for (int i = count; i < count * 2; i++) {
+        ok_map_put(&map, i, i * 3);
+    }
+    ok_map_remove(&map, 0);
+    found = 0;
+    for (int i = 1; i < count * 2; i++) {
+        if (ok_map_get(&map, i) == i * 3) {
+            found++;
+        }
+    }
+    ok_assert(found == (size_t)count * 2 - 1 && ok_map_count(&map) == (size_t)count * 2 - 1,
+              "options: modify opened map");
+    ok_map_deinit(&map);
+    success = ok_map_init_custom_from_file(&map, ok_int32_hash, ok_32bit_equals, map_file_path);
+    ok_assert(success && ok_map_count(&map) == (size_t)count && ok_map_get(&map, 1) == 3 &&
+              ok_map_contains(&map, 0) && !ok_map_contains(&map, count),
+              "options: opened file is unchanged");
+
+    // Save an opened map to the file it was opened from
+    saved = ok_map_save(&map, map_file_path);
+    found = 0;
+    for (int i = 0; i < count; i++) {
+        found += (ok_map_get(&map, i) == i * 3);
+    }
+    ok_map_deinit(&map);
+    success = saved && ok_map_init_custom_from_file(&map, ok_int32_hash, ok_32bit_equals,
+                                                    map_file_path);
+    for (int i = 0; i < count; i++) {
+        found += (ok_map_get(&map, i) == i * 3);
+    }
+    ok_assert(success && found == (size_t)count * 2 && ok_map_count(&map) == (size_t)count,
+              "options: save opened map to its own file");
+
+    // Frozen map
+    ok_map_freeze(&map);
+    saved = ok_map_save(&map, map_file_path);
+    ok_map_deinit(&map);
+    success = saved && ok_map_init_custom_from_file(&map, ok_int32_hash, ok_32bit_equals,
+                                                    map_file_path);
+    found = 0;
+    for (int i = 0; i < count * 2; i++) {
+        if (ok_map_get(&map, i) == (i < count ? i * 3 : 0)) {
+            found++;
+        }
+    }
+    ok_assert(success && found == (size_t)count * 2 && !ok_map_put(&map, 0, 0),
+              "options: save and open frozen map");
+    ok_map_deinit(&map);
+
+    // Errors
+    struct int_double_map_s ok_map_of(int, double) double_map;
+    ok_assert(!ok_map_init_custom_from_file(&double_map, ok_int32_hash, ok_32bit_equals,
+                                            map_file_path) &&
+              !ok_map_init_custom_from_file(&map, ok_int32_hash, ok_32bit_equals,
+                                            "ok_map_test_missing.bin"),
+              "options: ok_map_init_from_file errors");
+    remove(map_file_path);
+}
+
+typedef struct ok_map_of(int, int) int_int_map_t;
+
+// Checks that the map iterates the expected keys in order, with values of key + 1.
+static bool map_order_equals(int_int_map_t *map, const int *keys, size_t count) {
+    size_t i = 0;
+    bool success = (ok_map_count(map) == count);
+    ok_map_foreach(map, int key, int value) {
+        success = success && i < count && key == keys[i] && value == key + 1;
+        i++;
+    }
+    return success && i == count;
+}
+
+static void test_map_insertion_order(void) {
+    // Enough keys for 8-, 16-, and 32-bit index slots
+    const size_t count = 100000;
+    int *keys = (int *)malloc(count * 2 * sizeof(int));
+    int_int_map_t map;
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0,
+                                    OK_MAP_OPTION_INSERTION_ORDER | OK_MAP_OPTION_ROBIN_HOOD);
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = (int)((i * 7919) % count);
+        ok_map_put(&map, keys[i], keys[i] + 1);
+    }
+    ok_assert(map_order_equals(&map, keys, count), "insertion order: put");
+
+    // Remove every third key, put existing keys again, then put new keys
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i % 3 == 0) {
+            ok_map_remove(&map, keys[i]);
+        } else {
+            keys[n++] = keys[i];
+        }
+    }
+    for (size_t i = 0; i < n; i += 2) {
+        ok_map_put(&map, keys[i], keys[i] + 1);
+    }
+    ok_assert(map_order_equals(&map, keys, n), "insertion order: remove");
+    for (size_t i = 0; i < count; i++) {
+        keys[n] = (int)(count + i);
+        ok_map_put(&map, keys[n], keys[n] + 1);
+        n++;
+    }
+    ok_assert(map_order_equals(&map, keys, n), "insertion order: put after remove");
+
+    // Remove the last keys, then put them again
+    for (size_t i = n - 10; i < n; i++) {
+        ok_map_remove(&map, keys[i]);
+    }
+    ok_assert(map_order_equals(&map, keys, n - 10), "insertion order: remove last");
+    for (size_t i = n - 10; i < n; i++) {
+        ok_map_put(&map, keys[i], keys[i] + 1);
+    }
+    ok_assert(map_order_equals(&map, keys, n), "insertion order: put last");
+
+    // Save, open, and modify
+    const char *map_file_path = "ok_map_test.bin";
+    bool success = ok_map_save(&map, map_file_path);
+    ok_map_deinit(&map);
+    success = success && ok_map_init_custom_from_file(&map, ok_int32_hash, ok_32bit_equals,
+                                                      map_file_path);
+    ok_assert(success && map_order_equals(&map, keys, n), "insertion order: open");
+    ok_map_remove(&map, keys[0]);
+    keys[n] = -1;
+    ok_map_put(&map, -1, 0);
+    success = map_order_equals(&map, keys + 1, n) && ok_map_get(&map, 1000) == 1001;
+    ok_assert(success, "insertion order: modify opened map");
+    ok_map_deinit(&map);
+    remove(map_file_path);
+    free(keys);
+}
+
+typedef struct {
+    double d[16];
+} big_value_t;
+
+static void test_map_split_values(unsigned int options) {
+    struct ok_map_of(int8_t, big_value_t) map;
+    const int count = 100;
+    ok_map_init_custom_with_options(&map, ok_int8_hash, ok_8bit_equals, 0,
+                                    options | OK_MAP_OPTION_SPLIT_VALUES);
+    for (int i = 0; i < count; i++) {
+        big_value_t value;
+        for (int j = 0; j < 16; j++) {
+            value.d[j] = i * 16 + j;
+        }
+        ok_map_put(&map, (int8_t)i, value);
+    }
+    for (int i = 0; i < count; i += 3) {
+        ok_map_remove(&map, (int8_t)i);
+    }
+    int8_t *key_ptr;
+    big_value_t *value_ptr;
+    ok_map_foreach_ptr(&map, key_ptr, value_ptr) {
+        value_ptr->d[15] = -(*key_ptr);
+    }
+    bool success = true;
+    for (int i = 0; i < count; i++) {
+        big_value_t *value = ok_map_get_ptr(&map, (int8_t)i);
+        if (i % 3 == 0) {
+            success = success && value == NULL;
+        } else {
+            success = success && value && value->d[0] == i * 16 && value->d[14] == i * 16 + 14 &&
+                      value->d[15] == -i;
+        }
+    }
+    ok_assert(success && ok_map_count(&map) == (size_t)(count - (count + 2) / 3),
+              "split values: large values");
+    ok_map_deinit(&map);
+
+    // Get and replace values while the map grows (with incremental resize, while entries are
+    // still in the old map)
+    struct ok_map_of(int, big_value_t) grow_map;
+    ok_map_init_custom_with_options(&grow_map, ok_int32_hash, ok_32bit_equals, 0,
+                                    options | OK_MAP_OPTION_SPLIT_VALUES);
+    success = true;
+    for (int i = 0; i < 500; i++) {
+        big_value_t value;
+        for (int j = 0; j < 16; j++) {
+            value.d[j] = i;
+        }
+        ok_map_put(&grow_map, i, value);
+        value.d[15] = -i;
+        ok_map_put(&grow_map, i / 2, value);
+        for (int j = 0; j <= i; j += 7) {
+            big_value_t *value_ptr = ok_map_get_ptr(&grow_map, j);
+            success = success && value_ptr && value_ptr->d[0] >= j && value_ptr->d[14] >= j &&
+                      value_ptr->d[15] == (j <= i / 2 ? -value_ptr->d[0] : j);
+        }
+    }
+    for (int i = 0; i < 500; i++) {
+        big_value_t *value_ptr = ok_map_get_ptr(&grow_map, i);
+        success = success && value_ptr && value_ptr->d[14] == (i < 250 ? i * 2 + 1 : i) &&
+                  value_ptr->d[15] == (i < 250 ? -(i * 2 + 1) : i);
+    }
+    ok_assert(success && ok_map_count(&grow_map) == 500, "split values: grow");
+    ok_map_deinit(&grow_map);
+}
+
+// Maps with up to OK_MAP_SMALL_CAPACITY (8) entries are small, and grow to a hashed map.
+static void test_map_small(unsigned int options) {
+    int_int_map_t map;
+    int_int_map_t *map_ptr = &map;
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0, options);
+    for (int i = 0; i < 8; i++) {
+        ok_map_put(&map, i, i + 1);
+    }
+    ok_map_put(&map, 7, 8);
+    bool success = (ok_map_count(&map) == 8 && ok_map_capacity(map_ptr) == 8);
+    for (int i = 0; i < 8; i++) {
+        success = success && ok_map_get(&map, i) == i + 1;
+    }
+    ok_assert(success && !ok_map_contains(&map, 8), "small map: put / get");
+
+    // Remove the first, a middle, and the last entry
+    ok_map_remove(&map, 0);
+    ok_map_remove(&map, 4);
+    ok_map_remove(&map, 7);
+    success = (ok_map_count(&map) == 5 && !ok_map_remove(&map, 4));
+    for (int i = 0; i < 8; i++) {
+        success = success && ok_map_contains(&map, i) == (i != 0 && i != 4 && i != 7);
+    }
+    int key_sum = 0;
+    ok_map_foreach(&map, int key, int value) {
+        success = success && value == key + 1;
+        key_sum += key;
+    }
+    ok_assert(success && key_sum == 1 + 2 + 3 + 5 + 6, "small map: remove");
+
+    // Save and open
+    const char *map_file_path = "ok_map_test.bin";
+    success = ok_map_save(&map, map_file_path);
+    ok_map_deinit(&map);
+    success = success && ok_map_init_custom_from_file(&map, ok_int32_hash, ok_32bit_equals,
+                                                      map_file_path);
+    remove(map_file_path);
+    success = success && ok_map_count(&map) == 5 && ok_map_get(&map, 6) == 7 &&
+              !ok_map_contains(&map, 7);
+    ok_assert(success, "small map: save / open");
+
+    // Grow past the small capacity
+    for (int i = 0; i < 100; i++) {
+        ok_map_put(&map, i, i + 1);
+    }
+    success = (ok_map_count(&map) == 100 && ok_map_capacity(map_ptr) > 100);
+    for (int i = 0; i < 100; i++) {
+        success = success && ok_map_get(&map, i) == i + 1;
+    }
+    ok_assert(success, "small map: grow");
+    ok_map_deinit(&map);
+
+    // Freeze
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0, options);
+    for (int i = 0; i < 6; i++) {
+        ok_map_put(&map, i * 10, i);
+    }
+    success = ok_map_freeze(&map) && ok_map_count(&map) == 6 && !ok_map_contains(&map, 1);
+    for (int i = 0; i < 6; i++) {
+        success = success && ok_map_get(&map, i * 10) == i;
+    }
+    ok_assert(success, "small map: freeze");
+    ok_map_deinit(&map);
+}
+
+static void test_map_capacity(unsigned int options) {
+    int_int_map_t map;
+    int_int_map_t *map_ptr = &map;
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0, options);
+
+    // Maps with a probing option are never small
+    const bool small = !(options & (OK_MAP_OPTION_GROUP_PROBING | OK_MAP_OPTION_ROBIN_HOOD |
+                                    OK_MAP_OPTION_INSERTION_ORDER));
+    const size_t min_capacity = (small ? 8 : 32);
+    bool success = ok_map_capacity(map_ptr) == min_capacity;
+    for (int i = 0; i < 8; i++) {
+        success = success && ok_map_put(&map, i, i + 1);
+    }
+    success = success && ok_map_capacity(map_ptr) == min_capacity;
+    ok_map_clear(&map);
+    ok_assert(success, "map capacity: small maps");
+
+    // Reserve, then put without growing
+    success = ok_map_reserve(&map, 1000);
+    const size_t reserved_capacity = ok_map_capacity(map_ptr);
+    for (int i = 0; i < 1000; i++) {
+        success = success && ok_map_put(&map, i, i + 1);
+    }
+    success = success && reserved_capacity >= 1000 && ok_map_capacity(map_ptr) == reserved_capacity;
+    success = success && ok_map_reserve(&map, 10) && ok_map_capacity(map_ptr) == reserved_capacity;
+    ok_assert(success, "map capacity: reserve");
+
+    // Max load factor
+    success = (!ok_map_set_max_load_factor(&map, 0.0f) && !ok_map_set_max_load_factor(&map, 1.0f) &&
+               ok_map_set_max_load_factor(&map, 0.25f) &&
+               ok_map_capacity(map_ptr) >= 4000 && ok_map_count(&map) == 1000);
+    for (int i = 0; i < 1000; i++) {
+        success = success && ok_map_get(&map, i) == i + 1;
+    }
+    ok_assert(success, "map capacity: set max load factor");
+
+    // Shrink after removing
+    for (int i = 10; i < 1000; i++) {
+        ok_map_remove(&map, i);
+    }
+    success = ok_map_set_max_load_factor(&map, 0.5f) && ok_map_shrink_to_fit(&map) &&
+              ok_map_count(&map) == 10 && ok_map_capacity(map_ptr) == 32;
+    for (int i = 0; i < 1000; i++) {
+        success = success && ok_map_contains(&map, i) == (i < 10);
+    }
+    ok_map_remove(&map, 0);
+    ok_map_remove(&map, 1);
+    success = success && ok_map_shrink_to_fit(&map) && ok_map_count(&map) == 8 &&
+              ok_map_capacity(map_ptr) == min_capacity;
+    for (int i = 2; i < 10; i++) {
+        success = success && ok_map_get(&map, i) == i + 1;
+    }
+    ok_assert(success, "map capacity: shrink to fit");
+
+    // Save and open with a custom load factor, which is used when the map grows
+    const char *map_file_path = "ok_map_test.bin";
+    for (int i = 0; i < 100; i++) {
+        ok_map_put(&map, i, i + 1);
+    }
+    success = ok_map_save(&map, map_file_path);
+    ok_map_deinit(&map);
+    success = success && ok_map_init_custom_from_file(&map, ok_int32_hash, ok_32bit_equals,
+                                                      map_file_path);
+    remove(map_file_path);
+    for (int i = 100; i < 1100; i++) {
+        ok_map_put(&map, i, i + 1);
+    }
+    // The default load factor would grow to 2048
+    success = success && ok_map_count(&map) == 1100 && ok_map_capacity(map_ptr) == 4096;
+    ok_assert(success, "map capacity: save / open");
+
+    // Clear keeps the buckets
+    const size_t capacity = ok_map_capacity(map_ptr);
+    success = ok_map_clear(&map) && ok_map_count(&map) == 0 &&
+              ok_map_capacity(map_ptr) == capacity && !ok_map_contains(&map, 1);
+    ok_map_foreach(&map, int key, int value) {
+        (void)key;
+        (void)value;
+        success = false;
+    }
+    for (int i = 0; i < 1000; i++) {
+        success = success && ok_map_put(&map, i * 3, i);
+    }
+    success = success && ok_map_count(&map) == 1000 && ok_map_capacity(map_ptr) == capacity;
+    for (int i = 0; i < 1000; i++) {
+        success = success && ok_map_get(&map, i * 3) == i && !ok_map_contains(&map, i * 3 + 1);
+    }
+    ok_assert(success, "map capacity: clear");
+
+    // Clear, then release the buckets
+    success = ok_map_clear(&map) && ok_map_shrink_to_fit(&map) && ok_map_count(&map) == 0 &&
+              ok_map_capacity(map_ptr) == min_capacity;
+    success = success && ok_map_put(&map, 5, 6) && ok_map_get(&map, 5) == 6;
+    ok_assert(success, "map capacity: clear and shrink");
+
+    // Frozen maps can't change
+    success = ok_map_freeze(&map) && !ok_map_reserve(&map, 100) && !ok_map_clear(&map) &&
+              !ok_map_set_max_load_factor(&map, 0.5f) && ok_map_get(&map, 5) == 6;
+    ok_assert(success, "map capacity: frozen");
+    ok_map_deinit(&map);
+}
+
+static void test_map_entry_init(void *value, const void *key, void *context) {
+    big_value_t *big_value = (big_value_t *)value;
+    int *init_count = (int *)context;
+    for (int j = 0; j < 16; j++) {
+        big_value->d[j] = *(const int *)key;
+    }
+    (*init_count)++;
+}
+
+static void test_map_entry(unsigned int options) {
+    // Count occurrences, as a group-by would
+    int_int_map_t map;
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0, options);
+    int inserted_count = 0;
+    bool success = true;
+    for (int i = 0; i < 3000; i++) {
+        bool inserted = false;
+        int *count = ok_map_entry(&map, i % 1000, &inserted);
+        if (count) {
+            success = success && inserted == (i < 1000) && *count == i / 1000;
+            (*count)++;
+            inserted_count += inserted;
+        } else {
+            success = false;
+        }
+    }
+    for (int i = 0; i < 1000; i++) {
+        success = success && ok_map_get(&map, i) == 3;
+    }
+    success = success && ok_map_count(&map) == 1000 && inserted_count == 1000;
+    ok_assert(success, "map entry: count");
+
+    // A removed key is inserted again, with a zeroed value
+    ok_map_remove(&map, 5);
+    bool inserted = false;
+    int *count = ok_map_entry(&map, 5, &inserted);
+    success = count && inserted && *count == 0 && ok_map_entry(&map, 6, NULL) != NULL;
+    ok_assert(success, "map entry: removed key");
+
+    ok_map_freeze(&map);
+    success = ok_map_entry(&map, 5000, &inserted) == NULL && !inserted &&
+              ok_map_entry(&map, 6, &inserted) == NULL && ok_map_get(&map, 6) == 3;
+    ok_assert(success, "map entry: frozen");
+    ok_map_deinit(&map);
+
+    // Init function
+    struct ok_map_of(int, big_value_t) big_map;
+    ok_map_init_custom_with_options(&big_map, ok_int32_hash, ok_32bit_equals, 0, options);
+    int init_count = 0;
+    success = true;
+    for (int i = 0; i < 2000; i++) {
+        big_value_t *value = ok_map_entry_with_init(&big_map, i / 2, &inserted,
+                                                    test_map_entry_init, &init_count);
+        success = success && value && inserted == (i % 2 == 0) && value->d[15] == i / 2;
+        if (value) {
+            value->d[0] = -(i / 2);
+        }
+        // Lookups during an incremental resize
+        big_value_t *first_value = ok_map_get_ptr(&big_map, 0);
+        success = success && first_value && first_value->d[0] == 0 && first_value->d[15] == 0;
+    }
+    for (int i = 0; i < 1000; i++) {
+        big_value_t *value = ok_map_get_ptr(&big_map, i);
+        success = success && value && value->d[0] == -i && value->d[15] == i;
+    }
+    ok_assert(success && init_count == 1000, "map entry: init");
+    ok_map_deinit(&big_map);
+}
+
+// With OK_LIB_USE_THREADS, the entries are moved on several threads.
+static void test_map_reserve_parallel(unsigned int options) {
+    int_int_map_t map;
+    int_int_map_t *map_ptr = &map;
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0, options);
+    for (int i = 0; i < 20000; i++) {
+        ok_map_put(&map, i, i + 1);
+    }
+    for (int i = 0; i < 20000; i += 7) {
+        ok_map_remove(&map, i);
+    }
+    bool success = (ok_map_reserve_parallel(&map, 200000, 4) &&
+                    ok_map_count(&map) == 20000 - 2858 && ok_map_capacity(map_ptr) >= 200000);
+    for (int i = 0; i < 20000; i++) {
+        success = success && ok_map_get(&map, i) == (i % 7 == 0 ? 0 : i + 1);
+    }
+    const size_t capacity = ok_map_capacity(map_ptr);
+    for (int i = 20000; i < 200000; i++) {
+        ok_map_put(&map, i, i + 1);
+    }
+    success = success && ok_map_capacity(map_ptr) == capacity;
+    for (int i = 20000; i < 200000; i++) {
+        success = success && ok_map_get(&map, i) == i + 1;
+    }
+    ok_assert(success, "map reserve parallel");
+    ok_map_deinit(&map);
+
+    // One cluster: entries past the end of the first range are deferred
+    ok_map_init_custom_with_options(&map, bad_hash, ok_32bit_equals, 0, options);
+    for (int i = 0; i < 1000; i++) {
+        ok_map_put(&map, i, i + 1);
+    }
+    success = ok_map_reserve_parallel(&map, 3000, 8) && ok_map_count(&map) == 1000;
+    for (int i = 0; i < 1000; i++) {
+        success = success && ok_map_get(&map, i) == i + 1;
+    }
+    success = success && !ok_map_contains(&map, 1000);
+    ok_assert(success, "map reserve parallel: one cluster");
+    ok_map_deinit(&map);
+}
+
+// May be called from several threads, so the context is read-only
+static void test_map_build_sum(void *value, const void *new_value, void *context) {
+    *(int *)value += *(const int *)new_value * *(const int *)context;
+}
+
+// Keys below 100 have home buckets just before 65536, where a range of the map ends
+static ok_hash_t test_map_build_clustered_hash(int key) {
+    return (key < 100 ? (ok_hash_t)65530 : ok_int32_hash(key));
+}
+
+typedef struct {
+    int k;
+    int v;
+} int_pair_t;
+
+// 100000 keys, so the map is built on several threads with OK_LIB_USE_THREADS. Keys below 30000
+// occur twice.
+static void test_map_build(unsigned int options) {
+    const int count = 100000;
+    const int unique_count = 70000;
+    int *keys = (int *)malloc((size_t)count * sizeof(int));
+    int *values = (int *)malloc((size_t)count * sizeof(int));
+    ok_hash_t *hashes = (ok_hash_t *)malloc((size_t)count * sizeof(ok_hash_t));
+    if (!keys || !values || !hashes) {
+        ok_assert(false, "map build: out of memory");
+        free(keys);
+        free(values);
+        free(hashes);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        keys[i] = i % unique_count;
+        values[i] = i;
+    }
+
+    int_int_map_t map;
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0, options);
+    ok_map_hash_many(&map, keys, (size_t)count, hashes);
+    bool success = (ok_map_build(&map, keys, hashes, values, (size_t)count, OK_MAP_BUILD_FIRST) &&
+                    ok_map_count(&map) == (size_t)unique_count);
+    for (int i = 0; i < unique_count; i++) {
+        success = success && ok_map_get(&map, i) == i;
+    }
+    ok_assert(success, "map build: first");
+
+    // Into a map that isn't empty. Keys 0 to 999 again, with values 70000 to 70999.
+    ok_map_put(&map, -1, 5);
+    success = (ok_map_build(&map, keys + unique_count, hashes + unique_count,
+                            values + unique_count, 1000, OK_MAP_BUILD_FIRST) &&
+               ok_map_get(&map, 999) == 999 &&
+               ok_map_build(&map, keys + unique_count, hashes + unique_count,
+                            values + unique_count, 1000, OK_MAP_BUILD_LAST) &&
+               ok_map_get(&map, 999) == 70999 && ok_map_get(&map, 1000) == 1000 &&
+               ok_map_get(&map, -1) == 5 && ok_map_count(&map) == (size_t)unique_count + 1);
+    ok_assert(success, "map build: existing keys");
+    ok_map_deinit(&map);
+
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0, options);
+    success = (ok_map_build(&map, keys, hashes, values, (size_t)count, OK_MAP_BUILD_LAST) &&
+               ok_map_count(&map) == (size_t)unique_count);
+    for (int i = 0; i < unique_count; i++) {
+        success = success &&
+                  ok_map_get(&map, i) == (i < count - unique_count ? i + unique_count : i);
+    }
+    ok_assert(success, "map build: last");
+    ok_map_deinit(&map);
+
+    int scale = 2;
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0, options);
+    success = (ok_map_build_with_combine(&map, keys, hashes, values, (size_t)count,
+                                         OK_MAP_BUILD_COMBINE, test_map_build_sum, &scale) &&
+               ok_map_count(&map) == (size_t)unique_count);
+    for (int i = 0; i < unique_count; i++) {
+        success = success && ok_map_get(&map, i) ==
+                  (i < count - unique_count ? i + (i + unique_count) * 2 : i);
+    }
+    ok_assert(success, "map build: combine");
+
+    success = ok_map_freeze(&map) &&
+              !ok_map_build(&map, keys, hashes, values, (size_t)count, OK_MAP_BUILD_LAST);
+    ok_assert(success, "map build: frozen");
+    ok_map_deinit(&map);
+
+    // Entries past the end of a range are deferred, in order
+    ok_map_init_custom_with_options(&map, test_map_build_clustered_hash, ok_32bit_equals, 0,
+                                    options);
+    ok_map_hash_many(&map, keys, (size_t)count, hashes);
+    success = (ok_map_build(&map, keys, hashes, values, (size_t)count, OK_MAP_BUILD_LAST) &&
+               ok_map_count(&map) == (size_t)unique_count);
+    for (int i = 0; i < unique_count; i++) {
+        success = success &&
+                  ok_map_get(&map, i) == (i < count - unique_count ? i + unique_count : i);
+    }
+    ok_assert(success, "map build: clustered");
+    ok_map_deinit(&map);
+
+    // Pairs in a vector
+    typedef struct ok_vec_of(int_pair_t) int_pair_vec_t;
+    int_pair_vec_t vec;
+    ok_vec_init(&vec);
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0, options);
+    for (int i = 0; i < 1000; i++) {
+        int_pair_t pair = { i % 100, i };
+        ok_vec_push(&vec, pair);
+        hashes[i] = ok_map_hash(&map, pair.k);
+    }
+    success = ok_map_build_pairs(&map, vec.values, hashes, vec.count, OK_MAP_BUILD_LAST) &&
+              ok_map_count(&map) == 100;
+    for (int i = 0; i < 100; i++) {
+        success = success && ok_map_get(&map, i) == 900 + i;
+    }
+    ok_assert(success, "map build: pairs");
+    ok_map_deinit(&map);
+    ok_vec_deinit(&vec);
+
+    free(keys);
+    free(values);
+    free(hashes);
+}
+
+static void test_map_merge_add(void *value, const void *new_value, void *context) {
+    (void)context;
+    *(int *)value += *(const int *)new_value;
+}
+
+static void test_map_merge(unsigned int options) {
+    // Keys 0 to 999 with values 0 to 999, merged with keys 500 to 1999 with value 1
+    int_int_map_t map;
+    int_int_map_t from_map;
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0, options);
+    ok_map_init_custom_with_options(&from_map, ok_int32_hash, ok_32bit_equals, 0, options);
+    for (int i = 0; i < 1000; i++) {
+        ok_map_put(&map, i, i);
+    }
+    for (int i = 500; i < 2000; i++) {
+        ok_map_put(&from_map, i, 1);
+    }
+    bool success = (ok_map_merge(&map, &from_map, test_map_merge_add, NULL) &&
+                    ok_map_count(&map) == 2000 && ok_map_count(&from_map) == 1500);
+    for (int i = 0; i < 2000; i++) {
+        success = success && ok_map_get(&map, i) == (i < 500 ? i : (i < 1000 ? i + 1 : 1));
+    }
+    ok_assert(success, "map merge: combine");
+
+    success = ok_map_merge(&map, &from_map, NULL, NULL) && ok_map_count(&map) == 2000;
+    for (int i = 0; i < 2000; i++) {
+        success = success && ok_map_get(&map, i) == (i < 500 ? i : 1);
+    }
+    ok_assert(success, "map merge: replace");
+    ok_map_deinit(&map);
+
+    // Into a map that hasn't allocated memory
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0, options);
+    success = (ok_map_merge(&map, &from_map, test_map_merge_add, NULL) &&
+               ok_map_count(&map) == 1500 && ok_map_get(&map, 1999) == 1);
+    ok_assert(success, "map merge: empty");
+    ok_map_deinit(&map);
+
+    // Maps with different hash functions can't be merged
+    ok_map_init_custom_with_options(&map, bad_hash, ok_32bit_equals, 0, options);
+    success = !ok_map_merge(&map, &from_map, test_map_merge_add, NULL) && ok_map_count(&map) == 0;
+    ok_assert(success, "map merge: different hash functions");
+    ok_map_deinit(&map);
+    ok_map_deinit(&from_map);
+}
+
+// Counts visits of keys 0 to 999, with value key * 2. Other keys are ignored.
+typedef struct {
+    int counts[1000];
+    int errors;
+} test_map_scan_context;
+
+static void test_map_scan_visit(const void *key, void *value, void *context) {
+    test_map_scan_context *c = (test_map_scan_context *)context;
+    int k = *(const int *)key;
+    if (k >= 0 && k < 1000) {
+        c->counts[k]++;
+        if (*(int *)value != k * 2) {
+            c->errors++;
+        }
+    }
+}
+
+typedef struct ok_vec_of(int) test_int_vec_t;
+
+static void test_map_scan_find_odd(const void *key, void *value, void *context) {
+    (void)value;
+    if (*(const int *)key % 2 == 1) {
+        ok_vec_push((test_int_vec_t *)context, *(const int *)key);
+    }
+}
+
+static void test_map_scan(unsigned int options) {
+    test_map_scan_context *context = (test_map_scan_context *)malloc(sizeof(*context));
+    if (!context) {
+        ok_assert(false, "map scan: out of memory");
+        return;
+    }
+    int_int_map_t map;
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0, options);
+    memset(context, 0, sizeof(*context));
+    bool success = (ok_map_scan(&map, 0, 10, test_map_scan_visit, context) == 0);
+
+    // Small map: visited in one call (maps with a probing option are never small)
+    const bool small = !(options & (OK_MAP_OPTION_GROUP_PROBING | OK_MAP_OPTION_ROBIN_HOOD |
+                                    OK_MAP_OPTION_INSERTION_ORDER));
+    for (int i = 0; i < 5; i++) {
+        ok_map_put(&map, i, i * 2);
+    }
+    size_t cursor = 0;
+    do {
+        cursor = ok_map_scan(&map, cursor, 1, test_map_scan_visit, context);
+    } while (cursor != 0 && !small);
+    for (int i = 0; i < 5; i++) {
+        success = success && context->counts[i] == 1;
+    }
+    ok_assert(success && context->errors == 0, "map scan: small");
+
+    // No modification: each key is visited once
+    for (int i = 0; i < 1000; i++) {
+        ok_map_put(&map, i, i * 2);
+    }
+    memset(context, 0, sizeof(*context));
+    cursor = 0;
+    int steps = 0;
+    do {
+        cursor = ok_map_scan(&map, cursor, 7, test_map_scan_visit, context);
+        steps++;
+    } while (cursor != 0 && steps < 100000);
+    success = (steps > 1 && context->errors == 0);
+    for (int i = 0; i < 1000; i++) {
+        success = success && context->counts[i] == 1;
+    }
+    ok_assert(success, "map scan");
+
+    // Puts and removes between calls for 100 steps, so the map grows, and then shrinks. Keys 0 to
+    // 999 are in the map for the whole scan.
+    memset(context, 0, sizeof(*context));
+    cursor = 0;
+    steps = 0;
+    int next_key = 10000;
+    do {
+        cursor = ok_map_scan(&map, cursor, 3, test_map_scan_visit, context);
+        steps++;
+        if (steps < 100) {
+            for (int i = 0; i < 50; i++) {
+                ok_map_put(&map, next_key++, 0);
+            }
+            for (int i = 0; i < 20; i++) {
+                ok_map_remove(&map, next_key - 1000 + i);
+            }
+        } else if (steps == 100) {
+            for (int key = 10000; key < next_key; key++) {
+                ok_map_remove(&map, key);
+            }
+            ok_map_shrink_to_fit(&map);
+        }
+    } while (cursor != 0 && steps < 100000);
+    success = (cursor == 0 && context->errors == 0);
+    for (int i = 0; i < 1000; i++) {
+        success = success && context->counts[i] >= 1;
+    }
+    ok_assert(success, "map scan: modified during scan");
+
+    // Sweep: remove the odd keys, a few at a time
+    for (int key = 10000; key < next_key; key++) {
+        ok_map_remove(&map, key);
+    }
+    test_int_vec_t odd_keys;
+    ok_vec_init(&odd_keys);
+    cursor = 0;
+    steps = 0;
+    do {
+        cursor = ok_map_scan(&map, cursor, 5, test_map_scan_find_odd, &odd_keys);
+        steps++;
+        ok_vec_foreach(&odd_keys, int key) {
+            ok_map_remove(&map, key);
+        }
+        ok_vec_clear(&odd_keys);
+    } while (cursor != 0 && steps < 100000);
+    success = (ok_map_count(&map) == 500);
+    for (int i = 0; i < 1000; i++) {
+        success = success && ok_map_contains(&map, i) == (i % 2 == 0);
+    }
+    ok_assert(success, "map scan: remove between calls");
+    ok_vec_deinit(&odd_keys);
+
+    // Frozen
+    for (int i = 1; i < 1000; i += 2) {
+        ok_map_put(&map, i, i * 2);
+    }
+    memset(context, 0, sizeof(*context));
+    cursor = 0;
+    success = ok_map_freeze(&map);
+    do {
+        cursor = ok_map_scan(&map, cursor, 10, test_map_scan_visit, context);
+    } while (cursor != 0);
+    for (int i = 0; i < 1000; i++) {
+        success = success && context->counts[i] == 1;
+    }
+    ok_assert(success && context->errors == 0, "map scan: frozen");
+    ok_map_deinit(&map);
+    free(context);
+}
+
+typedef struct ok_map_of(const char *, int) str_int_map_t;
+
+static str_int_map_t static_map = OK_MAP_INIT_CUSTOM(ok_const_str_hash, ok_str_equals);
+
+// Maps initialized statically, or without a capacity, allocate memory on the first put.
+static void test_map_lazy(void) {
+    bool success = (static_map.m == NULL && ok_map_count(&static_map) == 0 &&
+                    ok_map_get(&static_map, "dave") == 0 &&
+                    ok_map_get_ptr(&static_map, "dave") == NULL &&
+                    !ok_map_contains(&static_map, "dave") && !ok_map_remove(&static_map, "dave"));
+    ok_map_foreach(&static_map, const char *key, int value) {
+        (void)key;
+        (void)value;
+        success = false;
+    }
+    const char *keys[] = { "dave", "mary" };
+    int values[2] = { 1, 1 };
+    ok_map_get_many(&static_map, keys, 2, values);
+    ok_assert(success && static_map.m == NULL && values[0] == 0 && values[1] == 0,
+              "lazy map: read before put");
+    ok_map_put(&static_map, "dave", 10);
+    *ok_map_put_and_get_ptr(&static_map, "mary") = 20;
+    ok_assert(static_map.m != NULL && ok_map_count(&static_map) == 2 &&
+              ok_map_get(&static_map, "dave") == 10 && ok_map_get(&static_map, "mary") == 20,
+              "lazy map: put");
+    ok_map_deinit(&static_map);
+
+    int_int_map_t map;
+    int_int_map_t empty_map;
+    ok_map_init_custom_with_options(&map, ok_int32_hash, ok_32bit_equals, 0,
+                                    OK_MAP_OPTION_GROUP_PROBING);
+    ok_map_init_custom(&empty_map, ok_int32_hash, ok_32bit_equals);
+    success = (map.m == NULL && ok_map_put_all(&map, &empty_map) && ok_map_count(&map) == 0);
+    for (int i = 0; i < 100; i++) {
+        ok_map_put(&map, i, i + 1);
+    }
+    success = success && ok_map_count(&map) == 100 && ok_map_get(&map, 99) == 100 &&
+              empty_map.m == NULL && ok_map_put_all(&empty_map, &map) &&
+              ok_map_count(&empty_map) == 100;
+    ok_assert(success, "lazy map: put_all");
+    ok_map_deinit(&map);
+    ok_map_deinit(&empty_map);
+
+    // Freeze, save, and open an empty map
+    const char *map_file_path = "ok_map_test.bin";
+    ok_map_init_custom(&empty_map, ok_int32_hash, ok_32bit_equals);
+    success = ok_map_freeze(&empty_map) && ok_map_count(&empty_map) == 0 &&
+              !ok_map_put(&empty_map, 1, 2) && ok_map_save(&empty_map, map_file_path);
+    ok_map_deinit(&empty_map);
+    success = success && ok_map_init_custom_from_file(&map, ok_int32_hash, ok_32bit_equals,
+                                                      map_file_path);
+    remove(map_file_path);
+    ok_assert(success && ok_map_count(&map) == 0 && !ok_map_contains(&map, 1),
+              "lazy map: freeze / save");
+    ok_map_deinit(&map);
+}
+
 static void test_map(void) {
     // str-to-str map
 
@@ -654,6 +1794,432 @@ static void test_map(void) {
         free(value);
     }
     ok_map_deinit(&bad_map);
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+
+    // Foreach with pointers, with large values
+
+    typedef struct {
+        int id;
+        char data[252];
+    } large_value_t;
+    struct large_map_s ok_map_of(int, large_value_t) large_map;
+    ok_map_init_custom(&large_map, ok_int32_hash, ok_32bit_equals);
+    for (int i = 0; i < 100; i++) {
+        large_value_t *large_value = ok_map_put_and_get_ptr(&large_map, i);
+        large_value->id = i;
+        memset(large_value->data, 0, sizeof(large_value->data));
+    }
+    const int *large_key;
+    large_value_t *large_value;
+    ok_map_foreach_ptr(&large_map, large_key, large_value) {
+        if (*large_key % 2 == 0) {
+            continue;
+        }
+        large_value->data[0] = 1;
+    }
+    count = 0;
+    ok_map_foreach_ptr(&large_map, large_key, large_value) {
+        if (large_value->id == *large_key && large_value->data[0] == (*large_key % 2)) {
+            count++;
+        }
+    }
+    size_t break_count = 0;
+    ok_map_foreach_ptr(&large_map, large_key, large_value) {
+        if (++break_count == 10) {
+            break;
+        }
+    }
+    ok_assert(count == 100 && break_count == 10 &&
+              ok_map_get_ptr(&large_map, 51)->data[0] == 1, "ok_map_foreach_ptr large values");
+    ok_map_deinit(&large_map);
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+
+    // String view keys
+
+    struct strview_map_s ok_map_of(ok_strview_t, int);
+    struct strview_map_s strview_map;
+    ok_map_init_custom(&strview_map, ok_strview_hash, ok_strview_equals);
+    const char *words = "apple banana cherry";
+    ok_map_put(&strview_map, ok_strview(words, 5), 1);
+    ok_map_put(&strview_map, ok_strview(words + 6, 6), 2);
+    ok_map_put(&strview_map, ok_strview(words + 13, 6), 3);
+    ok_map_put(&strview_map, ok_strview("a\0b", 3), 4);
+    ok_map_put(&strview_map, ok_strview("a\0c", 3), 5);
+
+    // Look up with views into a different buffer, without NUL terminators
+    const char *request = "GET /cherry/banana/apple/app HTTP/1.1";
+    ok_assert(ok_map_count(&strview_map) == 5 &&
+              ok_map_get(&strview_map, ok_strview(request + 5, 6)) == 3 &&
+              ok_map_get(&strview_map, ok_strview(request + 12, 6)) == 2 &&
+              ok_map_get(&strview_map, ok_strview(request + 19, 5)) == 1 &&
+              !ok_map_contains(&strview_map, ok_strview(request + 25, 3)) &&
+              !ok_map_contains(&strview_map, ok_strview(request + 19, 4)) &&
+              ok_map_get(&strview_map, ok_strview_from_str("banana")) == 2,
+              "ok_strview keys");
+    ok_assert(ok_map_get(&strview_map, ok_strview("a\0b", 3)) == 4 &&
+              ok_map_get(&strview_map, ok_strview("a\0c", 3)) == 5 &&
+              !ok_map_contains(&strview_map, ok_strview("a", 1)) &&
+              ok_strview_hash(ok_strview("apple", 5)) == ok_const_str_hash("apple"),
+              "ok_strview keys with NUL characters");
+    ok_map_deinit(&strview_map);
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////
+
+    // Options
+
+    test_map_with_options(OK_MAP_OPTION_NONE);
+    test_map_with_options(OK_MAP_OPTION_GROUP_PROBING);
+    test_map_with_options(OK_MAP_OPTION_INCREMENTAL_RESIZE);
+    test_map_with_options(OK_MAP_OPTION_INCREMENTAL_RESIZE | OK_MAP_OPTION_GROUP_PROBING);
+    test_map_with_options(OK_MAP_OPTION_ROBIN_HOOD);
+    test_map_with_options(OK_MAP_OPTION_ROBIN_HOOD | OK_MAP_OPTION_INCREMENTAL_RESIZE);
+    test_map_with_options(OK_MAP_OPTION_INSERTION_ORDER);
+    test_map_with_options(OK_MAP_OPTION_SPLIT_VALUES);
+    test_map_with_options(OK_MAP_OPTION_ROBIN_HOOD | OK_MAP_OPTION_SPLIT_VALUES);
+    test_map_with_options(OK_MAP_OPTION_INCREMENTAL_RESIZE | OK_MAP_OPTION_GROUP_PROBING |
+                          OK_MAP_OPTION_SPLIT_VALUES);
+    test_map_insertion_order();
+    test_map_split_values(OK_MAP_OPTION_NONE);
+    test_map_split_values(OK_MAP_OPTION_ROBIN_HOOD);
+    test_map_split_values(OK_MAP_OPTION_INCREMENTAL_RESIZE);
+    test_map_small(OK_MAP_OPTION_NONE);
+    test_map_lazy();
+    test_map_small(OK_MAP_OPTION_INCREMENTAL_RESIZE);
+    test_map_small(OK_MAP_OPTION_INCREMENTAL_RESIZE | OK_MAP_OPTION_SPLIT_VALUES);
+    test_map_capacity(OK_MAP_OPTION_NONE);
+    test_map_capacity(OK_MAP_OPTION_GROUP_PROBING | OK_MAP_OPTION_INCREMENTAL_RESIZE);
+    test_map_capacity(OK_MAP_OPTION_ROBIN_HOOD | OK_MAP_OPTION_SPLIT_VALUES);
+    test_map_capacity(OK_MAP_OPTION_INSERTION_ORDER);
+    test_map_entry(OK_MAP_OPTION_NONE);
+    test_map_entry(OK_MAP_OPTION_INCREMENTAL_RESIZE | OK_MAP_OPTION_SPLIT_VALUES);
+    test_map_entry(OK_MAP_OPTION_GROUP_PROBING | OK_MAP_OPTION_INCREMENTAL_RESIZE);
+    test_map_entry(OK_MAP_OPTION_ROBIN_HOOD);
+    test_map_entry(OK_MAP_OPTION_INSERTION_ORDER);
+    test_map_reserve_parallel(OK_MAP_OPTION_NONE);
+    test_map_reserve_parallel(OK_MAP_OPTION_ROBIN_HOOD);
+    test_map_reserve_parallel(OK_MAP_OPTION_SPLIT_VALUES);
+    test_map_reserve_parallel(OK_MAP_OPTION_INCREMENTAL_RESIZE | OK_MAP_OPTION_GROUP_PROBING);
+    test_map_reserve_parallel(OK_MAP_OPTION_INSERTION_ORDER);
+    test_map_build(OK_MAP_OPTION_NONE);
+    test_map_build(OK_MAP_OPTION_ROBIN_HOOD | OK_MAP_OPTION_SPLIT_VALUES);
+    test_map_build(OK_MAP_OPTION_GROUP_PROBING | OK_MAP_OPTION_INCREMENTAL_RESIZE);
+    test_map_build(OK_MAP_OPTION_INSERTION_ORDER);
+    test_map_merge(OK_MAP_OPTION_NONE);
+    test_map_merge(OK_MAP_OPTION_ROBIN_HOOD | OK_MAP_OPTION_SPLIT_VALUES);
+    test_map_merge(OK_MAP_OPTION_GROUP_PROBING | OK_MAP_OPTION_INCREMENTAL_RESIZE);
+    test_map_merge(OK_MAP_OPTION_INSERTION_ORDER);
+    test_map_scan(OK_MAP_OPTION_NONE);
+    test_map_scan(OK_MAP_OPTION_ROBIN_HOOD);
+    test_map_scan(OK_MAP_OPTION_GROUP_PROBING);
+    test_map_scan(OK_MAP_OPTION_INCREMENTAL_RESIZE | OK_MAP_OPTION_SPLIT_VALUES);
+    test_map_scan(OK_MAP_OPTION_INCREMENTAL_RESIZE | OK_MAP_OPTION_GROUP_PROBING);
+    test_map_scan(OK_MAP_OPTION_INSERTION_ORDER);
+
+    // Hash functions use the full width of ok_hash_t (the top byte is used by group probing)
+    const int hash_shift = (int)sizeof(ok_hash_t) * 8 - 8;
+    int top_byte_count = 0;
+    for (int i = 0; i < 100; i++) {
+        char str_key[16];
+        snprintf(str_key, sizeof(str_key), "key%i", i);
+        if ((ok_uint32_hash((uint32_t)i) >> hash_shift) != 0 &&
+            (ok_uint64_hash((uint64_t)i << 40) >> hash_shift) != 0 &&
+            (ok_const_str_hash(str_key) >> hash_shift) != 0) {
+            top_byte_count++;
+        }
+    }
+    ok_assert(top_byte_count > 90, "hash width");
+
+    // Byte hash: every length (and every tail handling path) gives a different hash
+    uint8_t hash_bytes[100];
+    ok_hash_t hashes[101];
+    for (int i = 0; i < 100; i++) {
+        hash_bytes[i] = (uint8_t)i;
+    }
+    int unique_hash_count = 0;
+    for (int i = 0; i <= 100; i++) {
+        hashes[i] = ok_hash_bytes(hash_bytes, (size_t)i);
+        bool unique = true;
+        for (int j = 0; j < i; j++) {
+            unique = unique && hashes[j] != hashes[i];
+        }
+        if (unique) {
+            unique_hash_count++;
+        }
+    }
+    ok_assert(unique_hash_count == 101, "ok_hash_bytes lengths");
+    ok_assert(ok_hash_bytes(hash_bytes, 50) == ok_hash_bytes_seeded(hash_bytes, 50, 0) &&
+              ok_hash_bytes(hash_bytes, 50) != ok_hash_bytes_seeded(hash_bytes, 50, 1) &&
+              ok_const_str_hash("hello") == ok_hash_bytes("hello", 5) &&
+              ok_const_str_hash("") == ok_hash_bytes(NULL, 0), "ok_hash_bytes_seeded");
+
+    // Robin Hood probing allows a higher load factor
+    struct int_int_map_s ok_map_of(int, int) robin_hood_map;
+    struct int_int_map_s *robin_hood_map_ptr = &robin_hood_map;
+    ok_map_init_custom_with_options(&robin_hood_map, ok_int32_hash, ok_32bit_equals, 32,
+                                    OK_MAP_OPTION_ROBIN_HOOD);
+    for (int i = 0; i < 28; i++) {
+        ok_map_put(&robin_hood_map, i, i);
+    }
+    size_t robin_hood_found = 0;
+    for (int i = 0; i < 28; i++) {
+        if (ok_map_get(&robin_hood_map, i) == i && !ok_map_contains(&robin_hood_map, i + 28)) {
+            robin_hood_found++;
+        }
+    }
+    ok_assert(robin_hood_found == 28 && ok_map_capacity(robin_hood_map_ptr) == 32,
+              "robin hood load factor");
+    ok_map_deinit(&robin_hood_map);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// MARK: Test set
+
+typedef struct ok_set_of(int) int_set_t;
+
+static void int_set_init(int_set_t *set, unsigned int options, int start, int end, int step) {
+    ok_set_init_custom_with_options(set, ok_int32_hash, ok_32bit_equals, 0, options);
+    for (int i = start; i < end; i += step) {
+        ok_set_add(set, i);
+    }
+}
+
+typedef enum {
+    INT_SET_UNION,
+    INT_SET_INTERSECT,
+    INT_SET_DIFFERENCE,
+} int_set_op_t;
+
+// Checks the result of a set operation on {0, 2, 4, ... < limit} and {0, 3, 6, ... < other_limit}.
+static bool int_set_check(int_set_t *set, int_set_op_t op, int limit, int other_limit) {
+    size_t expected_count = 0;
+    bool success = true;
+    for (int i = 0; i < 3000; i++) {
+        bool a = (i % 2 == 0 && i < limit);
+        bool b = (i % 3 == 0 && i < other_limit);
+        bool expected = (op == INT_SET_UNION ? (a || b) :
+                         op == INT_SET_INTERSECT ? (a && b) : (a && !b));
+        expected_count += expected;
+        success = success && ok_set_contains(set, i) == expected;
+    }
+    return success && ok_set_count(set) == expected_count;
+}
+
+static void test_set_with_options(unsigned int options) {
+    int_set_t set;
+    int_set_t other_set;
+
+    // Iterate the smaller set (set), and the larger set (other_set)
+    for (int smaller = 0; smaller <= 1; smaller++) {
+        const int limit = smaller ? 1000 : 3000;
+        const int other_limit = smaller ? 3000 : 1000;
+        int_set_init(&set, options, 0, limit, 2);
+        int_set_init(&other_set, options, 0, other_limit, 3);
+        bool success = ok_set_intersect(&set, &other_set);
+        ok_assert(success && int_set_check(&set, INT_SET_INTERSECT, limit, other_limit),
+                  "set: ok_set_intersect");
+        ok_set_deinit(&set);
+
+        int_set_init(&set, options, 0, limit, 2);
+        success = ok_set_difference(&set, &other_set);
+        ok_assert(success && int_set_check(&set, INT_SET_DIFFERENCE, limit, other_limit),
+                  "set: ok_set_difference");
+        ok_set_deinit(&set);
+
+        int_set_init(&set, options, 0, limit, 2);
+        success = ok_set_union(&set, &other_set);
+        ok_assert(success && int_set_check(&set, INT_SET_UNION, limit, other_limit),
+                  "set: ok_set_union");
+        ok_set_deinit(&set);
+        ok_set_deinit(&other_set);
+    }
+
+    // Same set, and empty result
+    int_set_init(&set, options, 0, 1000, 1);
+    ok_assert(ok_set_intersect(&set, &set) && ok_set_count(&set) == 1000 &&
+              ok_set_difference(&set, &set) && ok_set_count(&set) == 0,
+              "set: ok_set_intersect / ok_set_difference with itself");
+    ok_set_deinit(&set);
+}
+
+static void test_set(void) {
+    typedef struct ok_set_of(const char *) str_set_t;
+    str_set_t str_set;
+    bool success = ok_set_init(&str_set);
+    ok_assert(success, "ok_set_init");
+
+    ok_set_add(&str_set, "dave");
+    ok_set_add(&str_set, "mary");
+    ok_set_add(&str_set, "dave");
+    ok_assert(ok_set_count(&str_set) == 2 && ok_set_contains(&str_set, "mary") &&
+              !ok_set_contains(&str_set, "steve"), "ok_set_add / ok_set_contains");
+    size_t count = 0;
+    ok_set_foreach(&str_set, const char *name) {
+        if (strcmp(name, "dave") == 0 || strcmp(name, "mary") == 0) {
+            count++;
+        }
+    }
+    ok_assert(count == 2, "ok_set_foreach");
+    ok_assert(ok_set_remove(&str_set, "dave") && !ok_set_remove(&str_set, "dave") &&
+              ok_set_count(&str_set) == 1, "ok_set_remove");
+    ok_set_deinit(&str_set);
+
+    // Sets that haven't allocated memory
+    static str_set_t static_set = OK_SET_INIT_CUSTOM(ok_const_str_hash, ok_str_equals);
+    ok_set_init(&str_set);
+    success = (ok_set_intersect(&static_set, &str_set) &&
+               ok_set_difference(&static_set, &str_set) && ok_set_count(&static_set) == 0 && !ok_set_contains(&static_set, "dave"));
+    ok_set_add(&str_set, "dave");
+    ok_set_add(&str_set, "mary");
+    success = success && ok_set_difference(&str_set, &static_set) && ok_set_count(&str_set) == 2;
+    success = success && ok_set_union(&static_set, &str_set) && ok_set_count(&static_set) == 2;
+    ok_set_deinit(&str_set);
+    ok_set_init(&str_set);
+    success = success && ok_set_intersect(&static_set, &str_set) && ok_set_count(&static_set) == 0;
+    ok_assert(success && str_set.m == NULL, "lazy set");
+    ok_set_deinit(&str_set);
+    ok_set_deinit(&static_set);
+
+    // No value storage
+    int_set_t int_set;
+    ok_assert(sizeof(int_set.entry) == sizeof(struct { ok_hash_t hash; int k; }),
+              "set bucket size");
+
+    test_set_with_options(OK_MAP_OPTION_NONE);
+    test_set_with_options(OK_MAP_OPTION_GROUP_PROBING);
+    test_set_with_options(OK_MAP_OPTION_INCREMENTAL_RESIZE);
+    test_set_with_options(OK_MAP_OPTION_ROBIN_HOOD);
+    test_set_with_options(OK_MAP_OPTION_INSERTION_ORDER);
+    test_set_with_options(OK_MAP_OPTION_SPLIT_VALUES);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// MARK: Test LRU cache
+
+typedef struct ok_lru_of(int, int) int_lru_t;
+
+static void lru_count_evictions(void *context, void *key, void *value) {
+    (void)key;
+    (void)value;
+    (*(size_t *)context)++;
+}
+
+// Compares the cache to a list of keys, from most to least recently used, with values of key * 10.
+static bool lru_equals_model(int_lru_t *lru, const int *model_keys, size_t model_count) {
+    size_t i = 0;
+    bool success = (ok_lru_count(lru) == model_count);
+    ok_lru_foreach(lru, int key, int value) {
+        success = success && i < model_count && key == model_keys[i] && value == key * 10;
+        i++;
+    }
+    return success && i == model_count;
+}
+
+// Random puts, gets, and removes, checked against a simple list. With a bad hash function, all keys
+// are in one cluster, so removes and evictions move many entries.
+static void test_lru_with_hash(ok_hash_t (*hash_func)(int), size_t capacity) {
+    enum { max_capacity = 50, op_count = 20000 };
+    const size_t key_range = capacity * 3;
+    int model_keys[max_capacity];
+    size_t model_count = 0;
+    size_t evictions = 0;
+    size_t model_evictions = 0;
+    int_lru_t lru;
+    ok_lru_init_custom(&lru, hash_func, ok_32bit_equals, capacity);
+    ok_lru_set_evict_func(&lru, lru_count_evictions, &evictions);
+    uint32_t random = 1;
+    bool success = true;
+    for (int op = 0; op < op_count && success; op++) {
+        random = random * 1103515245 + 12345;
+        int key = (int)((random >> 8) % key_range);
+        int action = (int)((random >> 24) % 4);
+        size_t found = model_count;
+        for (size_t i = 0; i < model_count; i++) {
+            if (model_keys[i] == key) {
+                found = i;
+                break;
+            }
+        }
+        if (action == 0) {
+            success = (ok_lru_remove(&lru, key) == (found < model_count));
+            if (found < model_count) {
+                memmove(model_keys + found, model_keys + found + 1,
+                        (model_count - found - 1) * sizeof(int));
+                model_count--;
+            }
+            continue;
+        } else if (action == 1) {
+            success = (ok_lru_get(&lru, key) == (found < model_count ? key * 10 : 0));
+            if (found == model_count) {
+                continue;
+            }
+        } else {
+            ok_lru_put(&lru, key, key * 10);
+            if (found == model_count) {
+                if (model_count == capacity) {
+                    model_evictions++;
+                    model_count--;
+                }
+                found = model_count++;
+            }
+        }
+        // Move to front
+        memmove(model_keys + 1, model_keys, found * sizeof(int));
+        model_keys[0] = key;
+        if (op % 1000 == 0) {
+            success = success && lru_equals_model(&lru, model_keys, model_count);
+        }
+    }
+    ok_assert(success && lru_equals_model(&lru, model_keys, model_count) &&
+              evictions == model_evictions && evictions > 0, "lru: random operations");
+    ok_lru_deinit(&lru);
+}
+
+static void test_lru(void) {
+    typedef struct ok_lru_of(const char *, int) str_lru_t;
+    str_lru_t lru;
+    size_t evictions = 0;
+    bool success = ok_lru_init(&lru, 3);
+    ok_assert(success && ok_lru_capacity(&lru) == 3, "ok_lru_init");
+    ok_lru_set_evict_func(&lru, lru_count_evictions, &evictions);
+
+    ok_lru_put(&lru, "a", 1);
+    ok_lru_put(&lru, "b", 2);
+    ok_lru_put(&lru, "c", 3);
+    ok_assert(ok_lru_count(&lru) == 3 && ok_lru_get(&lru, "a") == 1, "ok_lru_put / ok_lru_get");
+    ok_lru_put(&lru, "d", 4);
+    ok_assert(ok_lru_count(&lru) == 3 && evictions == 1 && !ok_lru_contains(&lru, "b") &&
+              ok_lru_contains(&lru, "a"), "lru: least recently used key is evicted");
+    *ok_lru_get_ptr(&lru, "c") = 30;
+    ok_assert(ok_lru_get_ptr(&lru, "b") == NULL && ok_lru_get(&lru, "b") == 0 &&
+              ok_lru_hits(&lru) == 2 && ok_lru_misses(&lru) == 2, "ok_lru_hits / ok_lru_misses");
+
+    const char *expected_keys[] = { "c", "d", "a" };
+    size_t i = 0;
+    ok_lru_foreach(&lru, const char *key, int value) {
+        success = success && strcmp(key, expected_keys[i]) == 0 && value == ok_lru_get(&lru, key);
+        i++;
+        break;
+    }
+    ok_assert(success && i == 1, "ok_lru_foreach with break");
+    i = 0;
+    ok_lru_foreach(&lru, const char *key, int value) {
+        (void)value;
+        success = success && strcmp(key, expected_keys[i]) == 0;
+        i++;
+    }
+    ok_assert(success && i == 3, "ok_lru_foreach order");
+
+    ok_assert(ok_lru_remove(&lru, "d") && !ok_lru_remove(&lru, "d") && ok_lru_count(&lru) == 2 &&
+              evictions == 1, "ok_lru_remove");
+    ok_lru_deinit(&lru);
+
+    test_lru_with_hash(ok_int32_hash, 50);
+    test_lru_with_hash(bad_hash, 50);
+    test_lru_with_hash(ok_int32_hash, 4); // Small map
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -923,6 +2489,409 @@ static void test_queue(void) {
     test_queue_multithreaded();
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// MARK: Test concurrent map
+
+// The number of buckets allocated by a concurrent map, including replaced tables not freed yet.
+static size_t test_cmap_bucket_count(const struct _ok_cmap *map) {
+    size_t bucket_count = 0;
+    for (size_t i = 0; i <= map->segment_mask; i++) {
+        const struct _ok_cmap_segment *segment = map->segments + i;
+        const struct _ok_cmap_table *tables[3] = { atomic_load(&segment->table), segment->retired,
+                                                   segment->expired };
+        for (size_t j = 0; j < 3; j++) {
+            for (const struct _ok_cmap_table *table = tables[j]; table;
+                 table = table->next_retired) {
+                bucket_count += table->capacity_mask + 1;
+            }
+        }
+    }
+    return bucket_count;
+}
+
+#if !defined(__EMSCRIPTEN__)
+
+#define CMAP_THREAD_COUNT 4
+#define CMAP_VALUE_COUNT 20000
+
+typedef struct ok_cmap_of(int, int) cmap_int_t;
+
+typedef struct {
+    pthread_t thread;
+    cmap_int_t *map;
+    int first_key;
+    int errors;
+} cmap_thread_context;
+
+static void cmap_add(void *value, bool exists, void *context) {
+    (void)exists;
+    *(int *)value += *(int *)context;
+}
+
+static THREAD_RETURN_VALUE cmap_writer_thread_entry(void *context) {
+    cmap_thread_context *c = context;
+    int one = 1;
+    for (int i = 0; i < CMAP_VALUE_COUNT; i++) {
+        int key = c->first_key + i;
+        int value = key * 2;
+        int shared_key = i % 100;
+        ok_cmap_put(c->map, &key, &value);
+        ok_cmap_update(c->map, &shared_key, cmap_add, &one);
+    }
+    return 0;
+}
+
+static THREAD_RETURN_VALUE cmap_reader_thread_entry(void *context) {
+    cmap_thread_context *c = context;
+    for (int i = 0; i < CMAP_VALUE_COUNT; i++) {
+        // Keys are either missing, or have the value that was put
+        int key = c->first_key + i;
+        int value = -1;
+        if (ok_cmap_get(c->map, &key, &value) ? (value != key * 2) : (value != 0)) {
+            c->errors++;
+        }
+    }
+    return 0;
+}
+
+// Each writer keeps 500 of its keys in the map, removing the oldest key and putting a new one
+static THREAD_RETURN_VALUE cmap_churn_writer_thread_entry(void *context) {
+    cmap_thread_context *c = context;
+    for (int i = 0; i < CMAP_VALUE_COUNT * 2; i++) {
+        int key = c->first_key + i;
+        int value = key * 2;
+        ok_cmap_put(c->map, &key, &value);
+        if (i >= 500) {
+            key -= 500;
+            ok_cmap_remove(c->map, &key);
+        }
+    }
+    return 0;
+}
+
+static THREAD_RETURN_VALUE cmap_churn_reader_thread_entry(void *context) {
+    cmap_thread_context *c = context;
+    for (int i = 0; i < CMAP_VALUE_COUNT * 2; i++) {
+        // Keys 0 to 99 never change. The churned keys are either missing or have the value put.
+        int key = (i % 2 == 0 ? (i / 2) % 100 : c->first_key + i);
+        int value = -1;
+        bool found = ok_cmap_get(c->map, &key, &value);
+        if ((key < 100 && !found) || (found ? (value != key * 2) : (value != 0))) {
+            c->errors++;
+        }
+    }
+    return 0;
+}
+
+// Tables replaced while other threads read are freed, so memory stays bounded
+static void test_cmap_churn_multithreaded(void) {
+    cmap_thread_context writer_contexts[CMAP_THREAD_COUNT];
+    cmap_thread_context reader_contexts[CMAP_THREAD_COUNT];
+    cmap_int_t map;
+    ok_cmap_init_custom(&map, ok_int32_hash, ok_32bit_equals);
+    for (int key = 0; key < 100; key++) {
+        int value = key * 2;
+        ok_cmap_put(&map, &key, &value);
+    }
+    for (int i = 0; i < CMAP_THREAD_COUNT; i++) {
+        writer_contexts[i].map = &map;
+        writer_contexts[i].first_key = 1000 + i * CMAP_VALUE_COUNT * 2;
+        pthread_create(&writer_contexts[i].thread, NULL, cmap_churn_writer_thread_entry,
+                       &writer_contexts[i]);
+        reader_contexts[i].map = &map;
+        reader_contexts[i].first_key = writer_contexts[i].first_key;
+        reader_contexts[i].errors = 0;
+        pthread_create(&reader_contexts[i].thread, NULL, cmap_churn_reader_thread_entry,
+                       &reader_contexts[i]);
+    }
+    int errors = 0;
+    for (int i = 0; i < CMAP_THREAD_COUNT; i++) {
+        pthread_join(writer_contexts[i].thread, NULL);
+        pthread_join(reader_contexts[i].thread, NULL);
+        errors += reader_contexts[i].errors;
+    }
+    ok_assert(errors == 0 && ok_cmap_count(&map) == 100 + CMAP_THREAD_COUNT * 500 &&
+              test_cmap_bucket_count(map.m) <= 16 * ok_cmap_count(&map),
+              "cmap: churn with concurrent reads");
+    ok_cmap_deinit(&map);
+}
+
+static void test_cmap_multithreaded(void) {
+    cmap_thread_context writer_contexts[CMAP_THREAD_COUNT];
+    cmap_thread_context reader_contexts[CMAP_THREAD_COUNT];
+    cmap_int_t map;
+    ok_cmap_init_custom(&map, ok_int32_hash, ok_32bit_equals);
+
+    for (int i = 0; i < CMAP_THREAD_COUNT; i++) {
+        writer_contexts[i].map = &map;
+        writer_contexts[i].first_key = 1000 + i * CMAP_VALUE_COUNT;
+        pthread_create(&writer_contexts[i].thread, NULL, cmap_writer_thread_entry,
+                       &writer_contexts[i]);
+        reader_contexts[i].map = &map;
+        reader_contexts[i].first_key = 1000 + i * CMAP_VALUE_COUNT;
+        reader_contexts[i].errors = 0;
+        pthread_create(&reader_contexts[i].thread, NULL, cmap_reader_thread_entry,
+                       &reader_contexts[i]);
+    }
+    int errors = 0;
+    for (int i = 0; i < CMAP_THREAD_COUNT; i++) {
+        pthread_join(writer_contexts[i].thread, NULL);
+        pthread_join(reader_contexts[i].thread, NULL);
+        errors += reader_contexts[i].errors;
+    }
+    ok_assert(errors == 0, "cmap: concurrent reads");
+
+    size_t found = 0;
+    for (int key = 1000; key < 1000 + CMAP_THREAD_COUNT * CMAP_VALUE_COUNT; key++) {
+        int value;
+        if (ok_cmap_get(&map, &key, &value) && value == key * 2) {
+            found++;
+        }
+    }
+    int shared_total = 0;
+    for (int key = 0; key < 100; key++) {
+        int value = 0;
+        ok_cmap_get(&map, &key, &value);
+        shared_total += value;
+    }
+    ok_assert(found == CMAP_THREAD_COUNT * CMAP_VALUE_COUNT &&
+              shared_total == CMAP_THREAD_COUNT * CMAP_VALUE_COUNT &&
+              ok_cmap_count(&map) == CMAP_THREAD_COUNT * CMAP_VALUE_COUNT + 100,
+              "cmap: concurrent writes");
+    ok_cmap_deinit(&map);
+
+    test_cmap_churn_multithreaded();
+}
+
+#else
+
+static void test_cmap_multithreaded(void) {
+    // Emscripten: Do nothing
+}
+
+#endif // __EMSCRIPTEN__
+
+static void test_cmap(void) {
+    struct cmap_str_int_s ok_cmap_of(const char *, int);
+    struct cmap_str_int_s map;
+    bool success = ok_cmap_init_custom_with_segment_count(&map, ok_const_str_hash, ok_str_equals,
+                                                          4);
+    ok_assert(success, "ok_cmap_init");
+
+    const char *keys[] = { "dave", "mary", "lucy" };
+    int values[] = { 1, 2, 3 };
+    for (int i = 0; i < 3; i++) {
+        ok_cmap_put(&map, &keys[i], &values[i]);
+    }
+    int value = -1;
+    const char *missing_key = "cyrus";
+    ok_assert(ok_cmap_count(&map) == 3 && ok_cmap_get(&map, &keys[1], &value) && value == 2 &&
+              ok_cmap_contains(&map, &keys[2]) && !ok_cmap_contains(&map, &missing_key) &&
+              !ok_cmap_get(&map, &missing_key, &value) && value == 0,
+              "ok_cmap_put / ok_cmap_get");
+
+    // Get or insert
+    bool inserted = true;
+    value = 10;
+    success = ok_cmap_get_or_insert(&map, &keys[0], &value, &inserted);
+    ok_assert(success && !inserted && value == 1, "ok_cmap_get_or_insert (existing)");
+    value = 4;
+    success = ok_cmap_get_or_insert(&map, &missing_key, &value, &inserted);
+    ok_assert(success && inserted && value == 4 && ok_cmap_count(&map) == 4,
+              "ok_cmap_get_or_insert (inserted)");
+
+    // Remove
+    ok_assert(ok_cmap_remove(&map, &missing_key) && !ok_cmap_remove(&map, &missing_key) &&
+              !ok_cmap_contains(&map, &missing_key) && ok_cmap_count(&map) == 3,
+              "ok_cmap_remove");
+    ok_cmap_deinit(&map);
+
+    // Many keys, with resizing, removing, and re-inserting
+    typedef struct ok_cmap_of(int, int) cmap_int_int_t;
+    cmap_int_int_t int_map;
+    ok_cmap_init_custom(&int_map, ok_int32_hash, ok_32bit_equals);
+    for (int i = 0; i < 10000; i++) {
+        int v = i * 2;
+        ok_cmap_put(&int_map, &i, &v);
+    }
+    for (int i = 0; i < 10000; i += 2) {
+        ok_cmap_remove(&int_map, &i);
+    }
+    for (int round = 0; round < 4; round++) {
+        for (int i = 0; i < 10000; i += 2) {
+            int v = i * 2;
+            ok_cmap_put(&int_map, &i, &v);
+            ok_cmap_remove(&int_map, &i);
+        }
+    }
+    size_t found = 0;
+    for (int i = 0; i < 10000; i++) {
+        int v;
+        if (ok_cmap_get(&int_map, &i, &v) == (i % 2 == 1) && v == (i % 2 == 1 ? i * 2 : 0)) {
+            found++;
+        }
+    }
+    ok_cmap_free_retired(&int_map);
+    ok_assert(found == 10000 && ok_cmap_count(&int_map) == 5000, "ok_cmap resize");
+    ok_cmap_deinit(&int_map);
+
+    // Churn: remove a key and put a new one, at a constant count. Tombstones are reused, and
+    // replaced tables are freed, so memory stays bounded.
+    ok_cmap_init_custom(&int_map, ok_int32_hash, ok_32bit_equals);
+    for (int i = 0; i < 1000; i++) {
+        ok_cmap_put(&int_map, &i, &i);
+    }
+    const size_t bucket_count = test_cmap_bucket_count(int_map.m);
+    size_t max_bucket_count = bucket_count;
+    success = true;
+    for (int i = 1000; i < 200000; i++) {
+        int old_key = i - 1000;
+        success = success && ok_cmap_remove(&int_map, &old_key) && ok_cmap_put(&int_map, &i, &i);
+        size_t churn_bucket_count = test_cmap_bucket_count(int_map.m);
+        max_bucket_count = (churn_bucket_count > max_bucket_count ? churn_bucket_count :
+                            max_bucket_count);
+    }
+    for (int i = 198000; i < 200000; i++) {
+        int v = -1;
+        success = success && ok_cmap_get(&int_map, &i, &v) == (i >= 199000) &&
+                  v == (i >= 199000 ? i : 0);
+    }
+    ok_assert(success && ok_cmap_count(&int_map) == 1000 && max_bucket_count <= bucket_count * 8,
+              "ok_cmap churn");
+    ok_cmap_deinit(&int_map);
+
+    test_cmap_multithreaded();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// MARK: Test aggregator
+
+#if !defined(__EMSCRIPTEN__)
+
+#define AGG_THREAD_COUNT 4
+#define AGG_VALUE_COUNT 20000
+
+typedef struct ok_agg_of(int, int) agg_int_t;
+
+typedef struct {
+    pthread_t thread;
+    agg_int_t *agg;
+    size_t worker;
+    int errors;
+} agg_thread_context;
+
+static THREAD_RETURN_VALUE agg_worker_thread_entry(void *context) {
+    agg_thread_context *c = context;
+    for (int i = 0; i < AGG_VALUE_COUNT; i++) {
+        int key = i % 1000;
+        int *count = ok_agg_entry(c->agg, c->worker, &key, NULL);
+        if (count) {
+            (*count)++;
+        } else {
+            c->errors++;
+        }
+    }
+    return 0;
+}
+
+static void test_agg_multithreaded(void) {
+    agg_thread_context contexts[AGG_THREAD_COUNT];
+    agg_int_t agg;
+    ok_agg_init_custom(&agg, ok_int32_hash, ok_32bit_equals, AGG_THREAD_COUNT);
+
+    for (int i = 0; i < AGG_THREAD_COUNT; i++) {
+        contexts[i].agg = &agg;
+        contexts[i].worker = (size_t)i;
+        contexts[i].errors = 0;
+        pthread_create(&contexts[i].thread, NULL, agg_worker_thread_entry, &contexts[i]);
+    }
+    int errors = 0;
+    for (int i = 0; i < AGG_THREAD_COUNT; i++) {
+        pthread_join(contexts[i].thread, NULL);
+        errors += contexts[i].errors;
+    }
+    bool success = (errors == 0 && ok_agg_merge(&agg, test_map_merge_add, NULL) &&
+                    ok_agg_count(&agg) == 1000);
+    for (int key = 0; key < 1000; key++) {
+        int value = 0;
+        success = success && ok_agg_get(&agg, &key, &value) &&
+                  value == AGG_THREAD_COUNT * AGG_VALUE_COUNT / 1000;
+    }
+    ok_assert(success, "agg: concurrent workers");
+    ok_agg_deinit(&agg);
+}
+
+#else
+
+static void test_agg_multithreaded(void) {
+    // Emscripten: Do nothing
+}
+
+#endif // __EMSCRIPTEN__
+
+static void agg_increment(void *value, bool exists, void *context) {
+    (void)exists;
+    (void)context;
+    (*(int *)value)++;
+}
+
+static void test_agg(void) {
+    typedef struct ok_agg_of(int, int) agg_int_int_t;
+    agg_int_int_t agg;
+    bool success = ok_agg_init_custom_with_shard_count(&agg, ok_int32_hash, ok_32bit_equals, 3, 4);
+
+    // Worker `w` counts keys `w` to 999
+    for (size_t w = 0; w < 3; w++) {
+        for (int key = (int)w; key < 1000; key++) {
+            success = success && ok_agg_update(&agg, w, &key, agg_increment, NULL);
+        }
+    }
+    int key = 5;
+    success = (success && !ok_agg_update(&agg, 3, &key, agg_increment, NULL) &&
+               ok_agg_entry(&agg, 3, &key, NULL) == NULL &&
+               ok_agg_count(&agg) == 1000 + 999 + 998);
+    ok_assert(success, "ok_agg_update");
+
+    success = ok_agg_merge(&agg, test_map_merge_add, NULL) && ok_agg_count(&agg) == 1000;
+    for (key = 0; key < 1000; key++) {
+        int value = 0;
+        success = success && ok_agg_get(&agg, &key, &value) && value == (key < 3 ? key + 1 : 3);
+    }
+    int value = -1;
+    key = 1000;
+    success = success && !ok_agg_get(&agg, &key, &value) && value == 0;
+    ok_assert(success, "ok_agg_merge");
+
+    int sum = 0;
+    size_t count = 0;
+    ok_agg_foreach_r(&agg, &key, &value) {
+        sum += value;
+        count++;
+    }
+    ok_assert(count == 1000 && sum == 1000 + 999 + 998, "ok_agg_foreach_r");
+
+    // Workers can continue after a merge
+    bool inserted = false;
+    key = 2000;
+    int *value_ptr = ok_agg_entry(&agg, 2, &key, &inserted);
+    success = (value_ptr != NULL && inserted);
+    if (value_ptr) {
+        *value_ptr = 7;
+    }
+    key = 0;
+    success = (success && ok_agg_update(&agg, 1, &key, agg_increment, NULL) &&
+               ok_agg_merge(&agg, test_map_merge_add, NULL) && ok_agg_count(&agg) == 1001 &&
+               ok_agg_get(&agg, &key, &value) && value == 2);
+    key = 2000;
+    success = success && ok_agg_get(&agg, &key, &value) && value == 7;
+    ok_assert(success, "ok_agg_merge again");
+    ok_agg_deinit(&agg);
+
+    test_agg_multithreaded();
+}
+
 int main(void) {
     //ok_static_assert(2 + 2 == 5, "2+2 is not 5");
     ok_static_assert(true, "Identifier `true` must be true");
@@ -931,7 +2900,11 @@ int main(void) {
 
     test_vec();
     test_map();
+    test_set();
+    test_lru();
     test_queue();
+    test_cmap();
+    test_agg();
 
     ok_tests_finish();
 
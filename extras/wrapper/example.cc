@@ -31,6 +31,9 @@ int main() {
     *p = "fries";
     std::cout << "john: no, wait, " << map.get("john") << "!" << std::endl;
 
+    // get_r() returns a copy, and may be called from several reader threads at once
+    std::cout << "mary: " << map.get_r("mary") << "." << std::endl;
+
     // Examples when key doesn't exist
     std::cout << "Map size: " << map.size() << std::endl;
     map.get("cyrus"); // Returns NULL
@@ -39,7 +42,12 @@ int main() {
     std::cout << "Map size after map[\"cyrus\"]: " << map.size() << std::endl;
     map["cyrus"] = "(who knows)"; // Define the value so we don't crash
 
-    // Iterator
+    // Iterator. Values can be changed in place
+    for (auto& pair : map) {
+        if (strcmp(pair.key, "sue") == 0) {
+            pair.value = "green beans";
+        }
+    }
     for (auto& pair : map) {
         std::cout << "> " << pair.key << " wants " << pair.value << "." << std::endl;
     }
@@ -10,7 +10,9 @@
 #ifndef OK_MAP_H
 #define OK_MAP_H
 
+#include <new>
 #include <string>
+#include <type_traits>
 
 #define OK_LIB_DECLARE
 #include "ok_lib.h"
@@ -49,8 +51,25 @@ namespace ok {
             return ok_map_get(&map_, key);
         }
 
+        /**
+         Gets a copy of the value for the specified key, or a zero value if the key doesn't exist.
+         Unlike get(), safe to call from multiple threads at once, as long as no thread modifies
+         the map.
+         */
+        inline value_type get_r(const key_type& key) const {
+            value_type value;
+            ok_map_get_r(&map_, &key, &value);
+            return value;
+        }
+
+        /**
+         Gets a pointer to the value for the specified key, or `NULL` if the key doesn't exist.
+         Safe to call from multiple threads at once, as long as no thread modifies the map.
+         */
         inline value_type* get_ptr(const key_type& key) const {
-            return ok_map_get_ptr(&map_, key);
+            value_type* value_ptr;
+            ok_map_get_ptr_r(&map_, &key, &value_ptr);
+            return value_ptr;
         }
 
         /**
@@ -65,6 +84,14 @@ namespace ok {
             return ok_map_remove(&map_, key);
         }
 
+        /**
+         Makes the map read-only and compact. See `ok_map_freeze`. After freezing, `put` and
+         `erase` return `false`, and `operator[]` must not be used with a key that doesn't exist.
+         */
+        inline bool freeze() {
+            return ok_map_freeze(&map_);
+        }
+
     private:
         class iterator;
 
@@ -79,9 +106,13 @@ namespace ok {
             return iterator(&map_);
         }
 
+        /**
+         A key and value in the map, referencing the map's buckets. The value can be modified in
+         place during iteration.
+         */
         struct pair {
-            key_type key;
-            value_type value;
+            const key_type& key;
+            value_type& value;
         };
 
     private:
@@ -90,10 +121,15 @@ namespace ok {
 
         class iterator {
         public:
-            iterator(const map_t* map, void*iter = NULL) : map_(map), iter_(iter) { }
+            iterator(const map_t* map, void* iter = NULL) : map_(map), iter_(iter) {
+                set_pair();
+            }
+            iterator(const iterator& other) : map_(other.map_), iter_(other.iter_) {
+                set_pair();
+            }
             iterator& operator++() {
-                iter_ = _ok_map_next(map_->m, iter_, &pair_.key, sizeof(pair_.key),
-                                     &pair_.value, sizeof(pair_.value));
+                iter_ = _ok_map_next(map_->m, iter_, NULL, 0, NULL, 0);
+                set_pair();
                 return *this;
             }
             iterator operator++(int) {
@@ -101,14 +137,29 @@ namespace ok {
                 ++(*this);
                 return result;
             }
-            pair& operator*() { return pair_; }
-            pair* operator->() { return &pair_; }
+            pair& operator*() { return *pair_; }
+            pair* operator->() { return pair_; }
             bool operator==(const iterator& rhs) { return iter_ == rhs.iter_; }
             bool operator!=(const iterator& rhs) { return iter_ != rhs.iter_; }
         private:
+            // The pair has reference members, so it is constructed again for each bucket.
+            void set_pair() {
+                if (iter_) {
+                    pair_ = new (&pair_storage_) pair {
+                        *static_cast<key_type*>(static_cast<void*>(
+                            _ok_map_iterator_key(map_->m, iter_))),
+                        *static_cast<value_type*>(static_cast<void*>(
+                            _ok_map_iterator_value(map_->m, iter_)))
+                    };
+                } else {
+                    pair_ = NULL;
+                }
+            }
+
             const map_t* const map_;
             void* iter_;
-            pair pair_;
+            pair* pair_;
+            typename std::aligned_storage<sizeof(pair), alignof(pair)>::type pair_storage_;
         };
     };
 
@@ -143,6 +194,8 @@ namespace ok {
 
     template <> ok_hash_t hash_func(const std::string key) { return ok_const_str_hash(key.c_str()); }
 
+    template <> ok_hash_t hash_func(ok_strview_t key) { return ok_strview_hash(key); }
+
     // MARK: Equals
 
     template <typename T> bool equals_func(const void* v1, const void* v2) {
@@ -156,6 +209,10 @@ namespace ok {
         return strcmp(str1, str2) == 0;
     }
 
+    template<> bool equals_func<ok_strview_t>(const void* v1, const void* v2) {
+        return ok_strview_equals(v1, v2);
+    }
+
 #ifdef __GNUC__
 #pragma GCC diagnostic pop
 #endif
@@ -42,6 +42,16 @@
  | #define OK_LIB_USE_STDATOMIC  | Force usage of <stdatomic.h>. If not defined, `ok_lib` checks   |
  |                               | the compiler version to determine whether to use it.            |
  |-------------------------------|-----------------------------------------------------------------|
+ | #define OK_LIB_USE_64BIT_HASH | Use a 64-bit #ok_hash_t, so maps can have more than 2^31        |
+ |                               | buckets, with fewer hash collisions. Each bucket is 4 bytes     |
+ |                               | larger (or more, depending on alignment). All files that        |
+ |                               | include ok_lib.h must use the same setting.                     |
+ |-------------------------------|-----------------------------------------------------------------|
+ | #define OK_LIB_USE_THREADS    | Resize large maps on several threads (pthreads, or Windows      |
+ |                               | threads). See #ok_map_reserve_parallel(). Also used by          |
+ |                               | #ok_map_build() and #ok_agg_merge(). Only needed in the file    |
+ |                               | that defines the functions.                                     |
+ |-------------------------------|-----------------------------------------------------------------|
 
  */
 
@@ -458,8 +468,34 @@
     OK_MUTABLE value_type *v_ptr; \
     struct _ok_map *m; \
     ok_hash_t (*key_hash_func)(key_type); \
+    bool (*key_equals_func)(const void *key1, const void *key2); \
+    unsigned int map_options; \
 }
 
+/**
+ A macro to initialize a map statically. The map doesn't allocate memory until the first put.
+
+     typedef struct ok_map_of(const char *, int) my_map_t;
+     my_map_t map = OK_MAP_INIT_CUSTOM(ok_const_str_hash, ok_str_equals);
+
+ When finished using the map, the #ok_map_deinit() function must be called.
+
+ @param hash_func   The function to calculate the hash of the key.
+ @param equals_func The function to determine if two keys are equal.
+ */
+#define OK_MAP_INIT_CUSTOM(hash_func, equals_func) \
+    OK_MAP_INIT_CUSTOM_WITH_OPTIONS(hash_func, equals_func, OK_MAP_OPTION_NONE)
+
+/**
+ A macro to initialize a map statically, with options. See #OK_MAP_INIT_CUSTOM().
+
+ @param hash_func   The function to calculate the hash of the key.
+ @param equals_func The function to determine if two keys are equal.
+ @param options     The map options, like #OK_MAP_OPTION_GROUP_PROBING, or #OK_MAP_OPTION_NONE.
+ */
+#define OK_MAP_INIT_CUSTOM_WITH_OPTIONS(hash_func, equals_func, options) \
+    { { 0 }, NULL, NULL, (hash_func), (equals_func), (options) }
+
 /**
  Inits a map, automatically chooising hash and equals functions if possible. If not possible,
  a compile-time error occurs.
@@ -469,6 +505,9 @@
  
  To init a map with a custom key, use #ok_map_init_custom() instead.
 
+ The map doesn't allocate memory until the first put. Until then, lookups and iteration don't
+ access any memory other than the map struct.
+
  When finished using the map, the #ok_map_deinit() function must be called.
 
  @param map Pointer to the map.
@@ -507,8 +546,9 @@
  When finished using the map, the #ok_map_deinit() function must be called.
 
  @param map      Pointer to the map.
- @param capacity The initial capacity. If 0, the default capacity is used. The actual capacity will
-                 be a power-of-two integer greater than or equal to the requested capacity.
+ @param capacity The initial capacity. If 0, the default capacity is used, and memory isn't
+                 allocated until the first put. The actual capacity will be a power-of-two integer
+                 greater than or equal to the requested capacity.
 
  @return bool `true` if success, `false` otherwise (out of memory error).
  */
@@ -527,18 +567,124 @@
  @param equals_func The function to determine if two keys are equal. The signature of the function
                     is `bool equals_func(void *, void *)`, where the parameters are pointers to the
                     key. For example, see #ok_str_equals().
- @param capacity    The initial capacity. If 0, the default capacity is used. The actual capacity
-                    may be a power-of-two integer greater than or equal to the requested capacity.
+ @param capacity    The initial capacity. If 0, the default capacity is used, and memory isn't
+                    allocated until the first put. The actual capacity may be a power-of-two
+                    integer greater than or equal to the requested capacity.
+
+ @return bool `true` if success, `false` otherwise (out of memory error).
+ */
+#define ok_map_init_custom_with_capacity(map, hash_func, equals_func, capacity) \
+    ok_map_init_custom_with_options(map, hash_func, equals_func, capacity, OK_MAP_OPTION_NONE)
+
+/**
+ Map option: the default layout. Buckets are probed one at a time (linear probing).
+
+ Maps with at most 8 entries are small maps: the buckets are allocated with the map, and a lookup
+ scans them, comparing the stored hashes before comparing keys. A small map is copied to the
+ probed layout when it grows past 8 entries. #OK_MAP_OPTION_GROUP_PROBING,
+ #OK_MAP_OPTION_ROBIN_HOOD, and #OK_MAP_OPTION_INSERTION_ORDER maps are never small.
+ */
+#define OK_MAP_OPTION_NONE 0u
+
+/**
+ Map option: group probing. A separate array of control bytes (an occupied/empty/deleted marker
+ and 7 bits of the hash for each bucket) is probed 16 buckets at a time, using SSE2 or NEON if
+ available. Most lookups touch one cache line of control bytes and one bucket.
+
+ This option uses one extra byte per bucket. It is usually faster than the default layout for
+ lookups of keys that are not in the map, and for maps with large buckets or expensive key
+ comparisons. For small buckets, the default layout may be faster for keys that are in the map.
+
+ Maps with this option are never small maps (see #OK_MAP_OPTION_NONE), so even a map with a few
+ entries has at least 32 buckets and its control bytes.
+ */
+#define OK_MAP_OPTION_GROUP_PROBING (1u << 0)
+
+/**
+ Map option: incremental resize. When the map grows, the old buckets are kept, and are moved to the
+ new buckets a few at a time by each subsequent put or remove. This avoids the latency spike of
+ moving every entry at once, at the cost of lookups checking both sets of buckets while a resize is
+ in progress.
+
+ Lookups (like #ok_map_get()) never move buckets, so they do not modify the map.
+ */
+#define OK_MAP_OPTION_INCREMENTAL_RESIZE (1u << 1)
+
+/**
+ Map option: Robin Hood probing. Entries in a probe sequence are kept ordered by their distance
+ from their home bucket, so a lookup for a key that is not in the map stops as soon as it reaches
+ an entry closer to its home than the key would be. Probe lengths stay short even at high load, so
+ the default max load factor is 0.9 instead of 0.75.
+
+ Puts may move existing entries. This option is ignored if #OK_MAP_OPTION_GROUP_PROBING is set.
+ Maps with this option are never small maps (see #OK_MAP_OPTION_NONE), so even a map with a few
+ entries has at least 32 buckets.
+ */
+#define OK_MAP_OPTION_ROBIN_HOOD (1u << 2)
+
+/**
+ Map option: insertion order. The entries are kept in a dense array, in the order their keys were
+ first put, and a separate index table of 8-, 16-, 32-, or 64-bit slots (the smallest that fits)
+ points into it, like CPython's dict. Iteration (like #ok_map_foreach()) is a linear walk over the
+ dense array, in insertion order.
+
+ Putting an existing key keeps its position. Removing a key leaves a hole that is reclaimed when the
+ map is resized. Resizing removes the holes, reallocates the dense array, and rebuilds the index;
+ the entries are not rehashed into a new bucket array. The dense array only has room for the max
+ load, so memory use is much lower for large values. Lookups read an index slot and then the entry,
+ so for small entries they may be slower than the default layout.
+
+ This option can't be combined with other options, which are ignored. Freezing the map with
+ #ok_map_freeze() discards the insertion order.
+ */
+#define OK_MAP_OPTION_INSERTION_ORDER (1u << 3)
+
+/**
+ Map option: split values. The buckets only contain the hash and the key, and the values are in a
+ separate array, parallel to the buckets. Probing touches the same number of cache lines regardless
+ of the size of the value type, so use this option for maps with large values.
+
+ Accessing a value is one more memory access (and a division by the bucket size). This option can
+ be combined with the other options, except #OK_MAP_OPTION_INSERTION_ORDER, which already stores
+ the entries outside of the probed array. It is ignored for sets.
+ */
+#define OK_MAP_OPTION_SPLIT_VALUES (1u << 4)
+
+/**
+ Inits a map with the specified initial capacity and options, automatically choosing hash and
+ equals functions if possible. If not possible, a compile-time error occurs.
+
+ When finished using the map, the #ok_map_deinit() function must be called.
+
+ @param map      Pointer to the map.
+ @param capacity The initial capacity. If 0, the default capacity is used.
+ @param options  The map options, like #OK_MAP_OPTION_GROUP_PROBING, or #OK_MAP_OPTION_NONE.
+
+ @return bool `true` if success, `false` otherwise (out of memory error).
+ */
+#define ok_map_init_with_options(map, capacity, options) \
+    ok_map_init_custom_with_options(map, ok_default_hash((map)->entry.k), \
+                                    ok_default_equals((map)->entry.k), capacity, options)
+
+/**
+ Inits a map with the specified initial capacity and options.
+
+ When finished using the map, the #ok_map_deinit() function must be called.
+
+ @param map         Pointer to the map.
+ @param hash_func   The function to calculate the hash of the key.
+ @param equals_func The function to determine if two keys are equal.
+ @param capacity    The initial capacity. If 0, the default capacity is used.
+ @param options     The map options, like #OK_MAP_OPTION_GROUP_PROBING, or #OK_MAP_OPTION_NONE.
 
  @return bool `true` if success, `false` otherwise (out of memory error).
  */
-#define ok_map_init_custom_with_capacity(map, hash_func, equals_func, capacity) ( \
+#define ok_map_init_custom_with_options(map, hash_func, equals_func, capacity, options) ( \
     memset((map), 0, sizeof(*(map))), \
     (map)->key_hash_func = hash_func, \
-    (((map)->m = _ok_map_create(capacity, equals_func, \
-                                OK_OFFSETOF(&(map)->entry, &(map)->entry.k), \
-                                OK_OFFSETOF(&(map)->entry, &(map)->entry.v), \
-                                sizeof((map)->entry))) != NULL) \
+    (map)->key_equals_func = equals_func, \
+    (map)->map_options = (options), \
+    _ok_map_alloc_if(map, (capacity) != 0, capacity) \
 )
 
 /**
@@ -560,14 +706,93 @@
     _ok_map_count((map)->m)
 
 /**
- Gets the capacity of a hash map. The capacity never shrinks.
+ Gets the capacity of a hash map. The capacity only shrinks when #ok_map_shrink_to_fit() releases
+ memory. #ok_map_clear() removes the entries but keeps the capacity (it only releases the old
+ buckets of an incremental resize).
 
- @param map Pointer to the map. If `NULL`, the default capacity is returned.
+ @param map Pointer to the map. If `NULL`, or if the map hasn't allocated memory yet, the default
+            capacity is returned.
 
  @return size_t The capacity.
  */
 #define ok_map_capacity(map) \
-    _ok_map_capacity((map) ? (map)->m : NULL)
+    ((map) ? _ok_map_capacity((map)->m, (map)->map_options) : _ok_map_capacity(NULL, 0))
+
+/**
+ Sets the max load factor: the fraction of buckets that can be used before the map grows. A lower
+ load factor uses more memory and makes probing faster. The default is 0.75 (0.9 for
+ #OK_MAP_OPTION_ROBIN_HOOD).
+
+ If the map has more entries than the new max load factor allows, it is resized.
+
+ @param map             Pointer to the map.
+ @param max_load_factor The max load factor, from 0.1 to 0.95.
+
+ @return bool `true` if success, `false` if the load factor is out of range, the map is frozen, or
+ out of memory. On failure, the map is unchanged.
+ */
+#define ok_map_set_max_load_factor(map, max_load_factor) ( \
+    _ok_map_alloc(map, 0) ? \
+    _ok_map_set_max_load_factor(&(map)->m, (max_load_factor)) : false \
+)
+
+/**
+ Resizes the map, if needed, so that it can hold a number of entries without growing. Use this
+ before putting many keys into the map.
+
+ @param map   Pointer to the map.
+ @param count The total number of entries the map should hold.
+
+ @return bool `true` if success, `false` if the map is frozen or out of memory.
+ */
+#define ok_map_reserve(map, count) ( \
+    _ok_map_alloc(map, 0) ? \
+    _ok_map_reserve(&(map)->m, (count), 0) : false \
+)
+
+/**
+ Resizes the map, if needed, so that it can hold a number of entries without growing, moving the
+ existing entries on several threads. See #ok_map_reserve().
+
+ Threads are only used if `OK_LIB_USE_THREADS` is defined where the functions are defined, and only
+ for maps without #OK_MAP_OPTION_GROUP_PROBING or #OK_MAP_OPTION_INSERTION_ORDER. Otherwise, this
+ is the same as #ok_map_reserve(). (With `OK_LIB_USE_THREADS`, a map that grows on its own to at
+ least 2^20 buckets also uses threads, up to 8.)
+
+ @param map          Pointer to the map.
+ @param count        The total number of entries the map should hold.
+ @param thread_count The number of threads, including the calling thread.
+
+ @return bool `true` if success, `false` if the map is frozen or out of memory.
+ */
+#define ok_map_reserve_parallel(map, count, thread_count) ( \
+    _ok_map_alloc(map, 0) ? \
+    _ok_map_reserve(&(map)->m, (count), (thread_count)) : false \
+)
+
+/**
+ Resizes the map to the smallest capacity that holds its entries, releasing unused buckets. Maps
+ with at most 8 entries become small maps, unless an option prevents it (see #OK_MAP_OPTION_NONE).
+ Deleted buckets are also reclaimed.
+
+ @param map Pointer to the map.
+
+ @return bool `true` if success, `false` otherwise (out of memory). On failure, the map is
+ unchanged.
+ */
+#define ok_map_shrink_to_fit(map) \
+    _ok_map_shrink_to_fit(&(map)->m)
+
+/**
+ Removes all entries from the map. The buckets are kept, so the map can be filled again without
+ growing. To also release the buckets, call #ok_map_shrink_to_fit() afterward.
+
+ @param map Pointer to the map.
+
+ @return bool `true` if success, `false` if the map is frozen.
+ */
+#define ok_map_clear(map) \
+    _ok_map_clear((map)->m)
 
 /**
  Puts a key-value pair into the map. If the key already exists in the map, it is replaced with
@@ -582,6 +807,7 @@
 #define ok_map_put(map, key, value) ( \
     (map)->entry.k = (key), \
     (map)->entry.v = (value), \
+    _ok_map_alloc(map, 0) && \
     _ok_map_put(&(map)->m, &(map)->entry.k, sizeof((map)->entry.k), \
                 (map)->key_hash_func((map)->entry.k), \
                 &(map)->entry.v, sizeof((map)->entry.v)) \
@@ -607,9 +833,66 @@
  */
 #define ok_map_put_and_get_ptr(map, key) ( \
     (map)->entry.k = (key), \
-    _ok_map_put_and_get_ptr(&(map)->m, &(map)->entry.k, sizeof((map)->entry.k), \
-                            (map)->key_hash_func((map)->entry.k), \
-                            (void **)&(map)->v_ptr, sizeof((map)->entry.v)), \
+    (map)->v_ptr = NULL, \
+    _ok_map_alloc(map, 0) && \
+    (_ok_map_put_and_get_ptr(&(map)->m, &(map)->entry.k, sizeof((map)->entry.k), \
+                             (map)->key_hash_func((map)->entry.k), \
+                             (void **)&(map)->v_ptr, sizeof((map)->entry.v)), true), \
+    (map)->v_ptr \
+)
+
+/**
+ Gets a pointer to the value associated with a key, creating a new mapping if the key does not exist
+ in the map. The key is hashed and probed once.
+
+ Unlike #ok_map_put_and_get_ptr(), the value of a new mapping is zeroed, and `inserted` is set to
+ whether the key was put.
+
+ Example:
+
+ *    bool inserted;
+ *    int *count = ok_map_entry(map, word, &inserted);
+ *    if (count) {
+ *        (*count)++;
+ *    }
+
+ The returned pointer should be considered temporary. It may be invalid, and should not be used,
+ after any modification to the map (like a call to #ok_map_put() or #ok_map_remove().)
+
+ @param map      Pointer to the map.
+ @param key      The key.
+ @param inserted Pointer to a `bool` that is set to `true` if the key was put, or `false` if it
+                 already existed. May be `NULL`.
+
+ @return A pointer to the value, or `NULL` for out-of-memory error, or if the map is frozen.
+ */
+#define ok_map_entry(map, key, inserted) \
+    ok_map_entry_with_init(map, key, inserted, NULL, NULL)
+
+/**
+ Gets a pointer to the value associated with a key, creating a new mapping if the key does not exist
+ in the map. See #ok_map_entry().
+
+ The value of a new mapping is zeroed, and then `init_func` is called with a pointer to the value,
+ a pointer to the key in the map, and the `context`.
+
+ @param map       Pointer to the map.
+ @param key       The key.
+ @param inserted  Pointer to a `bool` that is set to `true` if the key was put, or `false` if it
+                  already existed. May be `NULL`.
+ @param init_func The function to initialize the value of a new mapping, or `NULL`.
+ @param context   The context passed to `init_func`.
+
+ @return A pointer to the value, or `NULL` for out-of-memory error, or if the map is frozen.
+ */
+#define ok_map_entry_with_init(map, key, inserted, init_func, context) ( \
+    (map)->entry.k = (key), \
+    (map)->v_ptr = NULL, \
+    _ok_map_alloc(map, 0) && \
+    (_ok_map_entry(&(map)->m, &(map)->entry.k, sizeof((map)->entry.k), \
+                   (map)->key_hash_func((map)->entry.k), \
+                   (void **)&(map)->v_ptr, sizeof((map)->entry.v), (inserted), \
+                   (init_func), (context)), true), \
     (map)->v_ptr \
 )
 
@@ -626,11 +909,183 @@
 #define ok_map_put_all(map, from_map) (\
     ((sizeof((map)->entry) == sizeof((from_map)->entry) && \
     (map)->key_hash_func == (from_map)->key_hash_func) ? \
-    _ok_map_put_all(&(map)->m, (from_map)->m, sizeof((map)->entry.k), \
-                    sizeof((map)->entry.v)) : \
+    (_ok_map_alloc(map, 0) ? \
+     _ok_map_put_all(&(map)->m, (from_map)->m, sizeof((map)->entry.k), \
+                     sizeof((map)->entry.v)) : false) : \
     false) \
 )
 
+/**
+ Merges the mappings of one map into another, combining the values of keys that are in both maps.
+ The maps must have the same types, hash functions, and equals functions.
+
+ The hashes stored in `from_map` are reused, so keys are not hashed again, and the map is resized
+ at most once. This is the reduce step of a parallel group-by: each thread aggregates into its own
+ map, and then the maps are merged. See also #ok_agg_of().
+
+ For keys not in the map, the value is copied. For keys in both maps, `combine_func` is called
+ with a pointer to the value in the map, a pointer to the value in `from_map`, and the `context`.
+ If `combine_func` is `NULL`, the value in `from_map` replaces the value in the map, like
+ #ok_map_put_all().
+
+ Example:
+
+     static void add_counts(void *value, const void *new_value, void *context) {
+         *(int *)value += *(const int *)new_value;
+     }
+     ...
+     ok_map_merge(&totals, &thread_counts, add_counts, NULL);
+
+ @param map          Pointer to the map.
+ @param from_map     Pointer to the map to merge mappings from. It isn't modified.
+ @param combine_func The function that combines a value from `from_map` into a value in the map,
+                     declared as `void combine_func(void *value, const void *new_value,
+                     void *context)`, or `NULL`.
+ @param context      The context passed to `combine_func`.
+
+ @return `true` if success, `false` if the maps have different hash functions, the map is
+ frozen, or out of memory. If `false`, some of the mappings may have been merged.
+ */
+#define ok_map_merge(map, from_map, combine_func, context) ( \
+    (sizeof((map)->entry) == sizeof((from_map)->entry) && \
+     (map)->key_hash_func == (from_map)->key_hash_func) ? \
+    (_ok_map_alloc(map, 0) ? \
+     _ok_map_merge(&(map)->m, (from_map)->m, sizeof((map)->entry.k), sizeof((map)->entry.v), \
+                   (combine_func), (context)) : false) : \
+    false \
+)
+
+/// Duplicate keys in #ok_map_build(): the first value is kept.
+#define OK_MAP_BUILD_FIRST 0u
+
+/// Duplicate keys in #ok_map_build(): the last value is kept.
+#define OK_MAP_BUILD_LAST 1u
+
+/// Duplicate keys in #ok_map_build(): values are combined. See #ok_map_build_with_combine().
+#define OK_MAP_BUILD_COMBINE 2u
+
+/**
+ Computes the hash of each key in an array, using the map's hash function, for #ok_map_build().
+
+ This only reads the map's hash function, so several threads can hash parts of a large array at the
+ same time, like `ok_map_hash_many(map, keys + start, n, hashes + start)`.
+
+ This is a statement, not an expression.
+
+ @param map    Pointer to the map.
+ @param keys   Pointer to an array of keys.
+ @param count  The number of keys.
+ @param hashes Pointer to an array of at least `count` hashes.
+ */
+#define ok_map_hash_many(map, keys, count, hashes) do { \
+    ok_static_assert(sizeof(*(keys)) == sizeof((map)->entry.k), "Incompatible types"); \
+    const size_t _ok_count = (count); \
+    for (size_t _ok_i = 0; _ok_i < _ok_count; _ok_i++) { \
+        (hashes)[_ok_i] = (map)->key_hash_func((keys)[_ok_i]); \
+    } \
+} while (0)
+
+/**
+ Puts an array of keys and an array of values into the map, using precomputed hashes (from
+ #ok_map_hash_many()). For a large number of keys, this is faster than calling #ok_map_put() in a
+ loop: the map is resized once, for `count` entries.
+
+ If `OK_LIB_USE_THREADS` is defined where the functions are defined, and the map is empty, the map
+ is built on several threads for large arrays (2^16 keys or more). The map is split into ranges of
+ buckets, and each thread puts the keys whose home bucket is in its range. Maps with
+ #OK_MAP_OPTION_GROUP_PROBING or #OK_MAP_OPTION_INSERTION_ORDER are built on one thread.
+
+ Keys that occur more than once, or that are already in the map, are handled by the policy: the
+ first value is kept (#OK_MAP_BUILD_FIRST), or the last value is kept (#OK_MAP_BUILD_LAST).
+
+ Example:
+
+ *    ok_hash_t *hashes = malloc(count * sizeof(ok_hash_t));
+ *    ok_map_hash_many(&map, keys, count, hashes);
+ *    bool success = ok_map_build(&map, keys, hashes, values, count, OK_MAP_BUILD_LAST);
+ *    free(hashes);
+
+ @param map    Pointer to the map.
+ @param keys   Pointer to an array of keys.
+ @param hashes Pointer to an array of the hashes of the keys.
+ @param values Pointer to an array of values.
+ @param count  The number of keys and values.
+ @param policy The duplicate-key policy, #OK_MAP_BUILD_FIRST or #OK_MAP_BUILD_LAST.
+
+ @return bool `true` if success, `false` if the types don't match, the map is frozen, or out of
+ memory. If `false`, some of the keys may have been put.
+ */
+#define ok_map_build(map, keys, hashes, values, count, policy) \
+    ok_map_build_with_combine(map, keys, hashes, values, count, policy, NULL, NULL)
+
+/**
+ Puts an array of keys and an array of values into the map, combining the values of duplicate
+ keys. See #ok_map_build().
+
+ The first value of a key is copied. For each later value of the key (including when the key is
+ already in the map), `combine_func` is called with a pointer to the value in the map, a pointer to
+ the new value, and the `context`. For one key, the values are combined in array order. With
+ `OK_LIB_USE_THREADS`, `combine_func` may be called from several threads at once (for different
+ keys).
+
+ @param map          Pointer to the map.
+ @param keys         Pointer to an array of keys.
+ @param hashes       Pointer to an array of the hashes of the keys.
+ @param values       Pointer to an array of values.
+ @param count        The number of keys and values.
+ @param policy       The duplicate-key policy. If #OK_MAP_BUILD_COMBINE, `combine_func` is used.
+ @param combine_func The function that combines a new value into a value in the map.
+ @param context      The context passed to `combine_func`.
+
+ @return bool `true` if success, `false` if the types don't match, the map is frozen, or out of
+ memory.
+ */
+#define ok_map_build_with_combine(map, keys, hashes, values, count, policy, combine_func, \
+                                  context) ( \
+    (sizeof(*(keys)) == sizeof((map)->entry.k) && sizeof(*(values)) == sizeof((map)->entry.v)) ? \
+    (_ok_map_alloc(map, 0) ? \
+     _ok_map_build(&(map)->m, (keys), sizeof(*(keys)), sizeof((map)->entry.k), (hashes), \
+                   (values), sizeof(*(values)), sizeof((map)->entry.v), (count), (policy), \
+                   (combine_func), (context)) : false) : \
+    false \
+)
+
+/**
+ Puts an array of key-value pairs into the map, like an #ok_vec of structs with members `k` and
+ `v`. See #ok_map_build().
+
+ Example:
+
+ *    typedef struct {
+ *        int k;
+ *        float v;
+ *    } pair_t;
+ *    typedef struct ok_vec_of(pair_t) pair_vec_t;
+ *    ...
+ *    for (size_t i = 0; i < vec.count; i++) {
+ *        hashes[i] = ok_map_hash(&map, vec.values[i].k);
+ *    }
+ *    bool success = ok_map_build_pairs(&map, vec.values, hashes, vec.count, OK_MAP_BUILD_LAST);
+
+ @param map    Pointer to the map.
+ @param pairs  Pointer to an array of structs with members `k` (the key) and `v` (the value).
+ @param hashes Pointer to an array of the hashes of the keys.
+ @param count  The number of pairs.
+ @param policy The duplicate-key policy, #OK_MAP_BUILD_FIRST or #OK_MAP_BUILD_LAST.
+
+ @return bool `true` if success, `false` if the types don't match, the map is frozen, or out of
+ memory.
+ */
+#define ok_map_build_pairs(map, pairs, hashes, count, policy) ( \
+    (sizeof((pairs)->k) == sizeof((map)->entry.k) && \
+     sizeof((pairs)->v) == sizeof((map)->entry.v)) ? \
+    (_ok_map_alloc(map, 0) ? \
+     _ok_map_build(&(map)->m, &(pairs)->k, sizeof(*(pairs)), sizeof((map)->entry.k), (hashes), \
+                   &(pairs)->v, sizeof(*(pairs)), sizeof((map)->entry.v), (count), (policy), \
+                   NULL, NULL) : false) : \
+    false \
+)
+
 /**
  Gets a value from the map. If the key doesn't exist in the map, returns a zeroed-out value
  (`0`, `0.0`, `{0}`, `NULL`, etc.).
@@ -679,810 +1134,5522 @@
 )
 
 /**
- Removes a key from the map.
-
- @param map Pointer to the map.
- @param key The key to remove.
+ Gets a value from the map, without using the map's internal scratch space. If the key doesn't
+ exist in the map, the value is set to zero.
 
- @return `true` if the key was in the map (thus removed), `false` otherwise.
- */
-#define ok_map_remove(map, key) ( \
-    (map)->entry.k = (key), \
-    _ok_map_remove((map)->m, &(map)->entry.k, (map)->key_hash_func((map)->entry.k)) \
-)
+ Unlike #ok_map_get(), this function doesn't modify the map, so multiple threads can call it (and
+ #ok_map_get_ptr_r(), #ok_map_contains_r(), #ok_map_foreach_r(), and #ok_map_get_many()) at the
+ same time without locks, as long as no thread modifies the map.
 
-/**
- Foreach macro that iterates over the keys and values in the map. The mappings are not returned in
- any particular order, and the order may change as the map is modified.
- 
- The map should not be modified during iteration. A call to #ok_map_put() or #ok_map_remove()
- during iteration could cause as crash.
- 
- The `break` and `continue` keywords are supported during iteration.
- 
  Example:
- 
-     ok_map_foreach(map, const char *key, char *value) {
-         printf("Name: %s  Phone: %s\n", key, value);
+
+     int value;
+     if (ok_map_get_r(&map, &key, &value)) {
+         ...
      }
 
  @param map       Pointer to the map.
- @param key_var   The key type and name.
- @param value_var The value type and name.
- */
-#define ok_map_foreach(map, key_var, value_var) \
-    for (size_t _keep = 1, _keep2 = 1, *_i = NULL; _keep && \
-        ((_i = (size_t *)_ok_map_next((map)->m, _i, (void *)&(map)->entry.k, \
-                                      sizeof((map)->entry.k), (void *)&(map)->entry.v, \
-                                      sizeof((map)->entry.v))) != NULL); \
-        _keep = 1 - _keep, _keep2 = 1 - _keep2) \
-    for (key_var = (map)->entry.k; _keep && _keep2; _keep2 = 1 - _keep2) \
-    for (value_var = (map)->entry.v; _keep; _keep = 1 - _keep)
-
-// MARK: Concurrent queue
+ @param key_ptr   Pointer to the key.
+ @param value_ptr Pointer to the value to set.
 
-/**
- The default capacity of a queue. This is the minimum capacity; queues can grow in size.
+ @return bool `true` if the key exists, `false` otherwise.
  */
-#define OK_QUEUE_DEFAULT_CAPACITY 16
+#define ok_map_get_r(map, key_ptr, value_ptr) ( \
+    (void)sizeof(char[(sizeof(*(key_ptr)) == sizeof((map)->entry.k) && \
+                       sizeof(*(value_ptr)) == sizeof((map)->entry.v)) ? 1 : -1]), \
+    _ok_map_get((map)->m, (key_ptr), (map)->key_hash_func(*(key_ptr)), \
+                (void *)(value_ptr), sizeof(*(value_ptr))) \
+)
 
 /**
- A macro to initialize a queue statically.
+ Gets a pointer to the value associated with a key, without using the map's internal scratch
+ space. See #ok_map_get_r() and #ok_map_get_ptr().
 
-     typedef struct ok_queue_of(int) my_queue_t;
-     my_queue_t queue = OK_QUEUE_INIT;
+ @param map           Pointer to the map.
+ @param key_ptr       Pointer to the key.
+ @param value_ptr_ptr Pointer to the value pointer to set. It is set to `NULL` if the key does
+                      not exist in the map.
 
- When finished using the queue, the #ok_queue_deinit() function must be called.
+ @return bool `true` if the key exists, `false` otherwise.
  */
-#define OK_QUEUE_INIT { { NULL, NULL, NULL, false, false, OK_QUEUE_DEFAULT_CAPACITY }, NULL }
+#define ok_map_get_ptr_r(map, key_ptr, value_ptr_ptr) ( \
+    (void)sizeof(char[(sizeof(*(key_ptr)) == sizeof((map)->entry.k) && \
+                       sizeof(**(value_ptr_ptr)) == sizeof((map)->entry.v)) ? 1 : -1]), \
+    _ok_map_get_ptr((map)->m, (key_ptr), (map)->key_hash_func(*(key_ptr)), \
+                    (void **)(value_ptr_ptr)) \
+)
 
 /**
- Declares a generic `ok_queue` struct or typedef.
-
- For example, a ok_queue with `int` values can be declared as a typedef:
-
-     typedef struct ok_queue_of(int) my_queue_t;
-
- or a struct:
+ Checks if a key exists in the map, without using the map's internal scratch space. See
+ #ok_map_get_r().
 
-     struct my_queue_s ok_queue_of(int);
+ @param map     Pointer to the map.
+ @param key_ptr Pointer to the key.
 
- @tparam value_type The value type.
+ @return bool `true` if the key exists, `false` otherwise.
+ */
+#define ok_map_contains_r(map, key_ptr) ( \
+    (void)sizeof(char[sizeof(*(key_ptr)) == sizeof((map)->entry.k) ? 1 : -1]), \
+    _ok_map_contains((map)->m, (key_ptr), (map)->key_hash_func(*(key_ptr))) \
+)
 
- @return Internal structure members in curly braces.
+/**
+ The number of keys that #ok_map_get_many(), #ok_map_get_ptr_many(), and #ok_map_contains_many()
+ hash and prefetch before probing.
  */
-#define ok_queue_of(value_type) { \
-    struct _ok_queue q; \
-    value_type *v; \
-}
+#define OK_MAP_BATCH_SIZE 16
 
 /**
- Inits a queue with the default minimum capacity.
+ Gets the values associated with an array of keys.
 
- To init a queue with a custom minimum capacity, use #ok_queue_init_with_capacity() instead.
+ For large maps, this is faster than calling #ok_map_get() in a loop: the keys are hashed, and
+ their buckets prefetched, in batches of #OK_MAP_BATCH_SIZE before any are probed, so the cache
+ misses of the lookups overlap instead of happening one after another.
 
- This function is not thread safe. If two threads attempt to init a queue at the same time, the
- result is undefined.
+ To look up the keys in a vector, use `ok_map_get_many(map, vec.values, vec.count, values)`.
 
- When finished using the queue, the #ok_queue_deinit() function must be called.
+ This is a statement, not an expression.
 
- @tparam queue Pointer to the queue.
+ @param map    Pointer to the map.
+ @param keys   Pointer to an array of keys.
+ @param count  The number of keys.
+ @param values Pointer to an array of at least `count` values. The value for a key that doesn't
+               exist in the map is set to zero.
  */
-#define ok_queue_init(queue) \
-    ok_queue_init_with_capacity(queue, OK_QUEUE_DEFAULT_CAPACITY)
+#define ok_map_get_many(map, keys, count, values) \
+    _ok_map_batch(map, keys, count, \
+                  ok_static_assert(sizeof(*(values)) == sizeof((map)->entry.v), \
+                                   "Incompatible types"); \
+                  _ok_map_get_many((map)->m, _ok_keys, sizeof(*(keys)), _ok_hashes, _ok_n, \
+                                   (void *)((values) + _ok_i), sizeof(*(values))))
 
 /**
- Inits a queue with a custom minimum capacity. The queue may grow in size larger than the specified
- capacity.
+ Gets pointers to the values associated with an array of keys. See #ok_map_get_many().
 
- This function is not thread safe. If two threads attempt to init a queue at the same time, the
- result is undefined.
+ The pointers should be considered temporary. They may be invalid, and should not be used, after
+ any modification to the map (like a call to #ok_map_put() or #ok_map_remove().)
 
- When finished using the queue, the #ok_queue_deinit() function must be called.
+ This is a statement, not an expression.
 
- @tparam queue Pointer to the queue.
- @tparam capacity The minimum number of values the queue can hold.
+ @param map        Pointer to the map.
+ @param keys       Pointer to an array of keys.
+ @param count      The number of keys.
+ @param value_ptrs Pointer to an array of at least `count` value pointers. The pointer for a key
+                   that doesn't exist in the map is set to `NULL`.
  */
-#define ok_queue_init_with_capacity(queue, capacity) \
-    _ok_queue_init(&(queue)->q, sizeof(*(queue)->v), capacity)
+#define ok_map_get_ptr_many(map, keys, count, value_ptrs) \
+    _ok_map_batch(map, keys, count, \
+                  ok_static_assert(sizeof(*(value_ptrs)) == sizeof((map)->v_ptr), \
+                                   "Incompatible types"); \
+                  _ok_map_get_ptr_many((map)->m, _ok_keys, sizeof(*(keys)), _ok_hashes, _ok_n, \
+                                       (void **)((value_ptrs) + _ok_i)))
 
 /**
- Deinits the queue. The queue may be used again by calling #ok_queue_init().
+ Checks if each key in an array of keys exists in the map. See #ok_map_get_many().
 
- @tparam queue Pointer to the queue.
+ This is a statement, not an expression.
+
+ @param map    Pointer to the map.
+ @param keys   Pointer to an array of keys.
+ @param count  The number of keys.
+ @param bitmap Pointer to an array of at least `(count + 7) / 8` bytes. On return, bit `i % 8` of
+               `bitmap[i / 8]` is set if `keys[i]` exists in the map, and cleared otherwise.
  */
-#define ok_queue_deinit(queue) \
-    ok_queue_deinit_with_deallocator(queue, NULL)
+#define ok_map_contains_many(map, keys, count, bitmap) \
+    _ok_map_batch(map, keys, count, \
+                  _ok_map_contains_many((map)->m, _ok_keys, sizeof(*(keys)), _ok_hashes, _ok_n, \
+                                        (uint8_t *)(bitmap), _ok_i))
 
 /**
- Deinits the queue and deallocates its remaining values. Each remaining value is
- removed from the queue and sent as a param to the deallocator function.
+ Removes a key from the map.
 
- The queue may be used again by calling #ok_queue_init().
+ @param map Pointer to the map.
+ @param key The key to remove.
 
- @tparam queue Pointer to the queue.
- @tparam deallocator The deallocator function, declared as `void (*deallocator)(void *)`.
+ @return `true` if the key was in the map (thus removed), `false` otherwise.
  */
-#define ok_queue_deinit_with_deallocator(queue, deallocator) \
-    _ok_queue_deinit(&(queue)->q, sizeof(*(queue)->v), (deallocator))
+#define ok_map_remove(map, key) ( \
+    (map)->entry.k = (key), \
+    _ok_map_remove((map)->m, &(map)->entry.k, (map)->key_hash_func((map)->entry.k)) \
+)
 
 /**
- Adds a value to the back of the queue.
+ Gets the hash of a key, using the map's hash function.
 
- @tparam queue Pointer to the queue.
- @tparam value The value to add. Must be an addressable rvalue.
+ The hash can be passed to the `_hashed` functions, like #ok_map_get_hashed(), of any map that uses
+ the same hash function, so that a key used with several maps (or to choose a shard) is only hashed
+ once.
+
+ @param map Pointer to the map.
+ @param key The key.
+
+ @return ok_hash_t The hash.
  */
-#define ok_queue_push(queue, value) do { \
-    ok_static_assert(ok_types_compatible(*(queue)->v, value), "Incompatible types"); \
-    _ok_queue_push(&(queue)->q, sizeof(*(queue)->v), &(value)); \
-} while (0)
+#define ok_map_hash(map, key) \
+    ((map)->key_hash_func(key))
 
 /**
- Attempts to remove a value from the front of the queue.
+ Puts a key-value pair into the map, using a precomputed hash. See #ok_map_put().
 
- @tparam queue Pointer to the queue.
- @tparam value_ptr The address to store the removed value.
- @return true on success, false if the queue is empty.
+ @param map   Pointer to the map.
+ @param key   The key.
+ @param hash  The hash of the key, from #ok_map_hash(). It must be the hash the map's hash function
+              returns for the key.
+ @param value The value.
+
+ @return `true` if the operation was successful, `false` otherwise (out of memory).
  */
-#define ok_queue_pop(queue, value_ptr) (\
-    sizeof(char[ok_types_compatible(*(queue)->v, *(value_ptr)) ? 1 : -1]) && /* Type check */ \
-    _ok_queue_pop(&(queue)->q, sizeof(*(queue)->v), (value_ptr)) \
+#define ok_map_put_hashed(map, key, hash, value) ( \
+    (map)->entry.k = (key), \
+    (map)->entry.v = (value), \
+    _ok_map_alloc(map, 0) && \
+    _ok_map_put(&(map)->m, &(map)->entry.k, sizeof((map)->entry.k), (hash), \
+                &(map)->entry.v, sizeof((map)->entry.v)) \
 )
 
-// MARK: Declarations: Hash functions
+/**
+ Gets a pointer to the value associated with a key, using a precomputed hash, creating a new
+ mapping if the key does not exist in the map. See #ok_map_put_and_get_ptr().
 
-/// The hash type, which is returned from hash functions.
-typedef uint32_t ok_hash_t;
+ @param map  Pointer to the map.
+ @param key  The key.
+ @param hash The hash of the key, from #ok_map_hash().
 
-/// Gets the default hash function for the specified key type. Uses _Generic, so it requires C11.
-#ifndef ok_default_hash
-#  if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
-#    define ok_default_hash(key) _Generic(key, \
-       uint8_t      : ok_uint8_hash, \
-       int8_t       : ok_int8_hash, \
-       uint16_t     : ok_uint16_hash, \
-       int16_t      : ok_int16_hash, \
-       uint32_t     : ok_uint32_hash, \
-       int32_t      : ok_int32_hash, \
-       uint64_t     : ok_uint64_hash, \
-       int64_t      : ok_int64_hash, \
-       float        : ok_float_hash, \
-       double       : ok_double_hash, \
-       char *       : ok_str_hash, \
-       const char * : ok_const_str_hash, \
-       void *       : ok_ptr_hash, \
-       const void * : ok_const_ptr_hash)
-#  else
-// Force compile error if type is not 'char *`
-#    define ok_default_hash(key) (ok_static_assert(sizeof(_ok_is_char(*key)) == sizeof(bool) && \
-                                                   sizeof(*key) == sizeof(char), \
-                                                   "Only works with `char *` type"), \
-                                                   ok_const_str_hash)
-#  endif
-#endif
+ @return A pointer to the value, or `NULL` for out-of-memory error.
+ */
+#define ok_map_put_and_get_ptr_hashed(map, key, hash) ( \
+    (map)->entry.k = (key), \
+    (map)->v_ptr = NULL, \
+    _ok_map_alloc(map, 0) && \
+    (_ok_map_put_and_get_ptr(&(map)->m, &(map)->entry.k, sizeof((map)->entry.k), (hash), \
+                             (void **)&(map)->v_ptr, sizeof((map)->entry.v)), true), \
+    (map)->v_ptr \
+)
 
-static inline bool _ok_is_char(char);
+/**
+ Gets a value from the map, using a precomputed hash. See #ok_map_get().
 
-/// Gets the hash for a uint8_t.
-OK_LIB_API ok_hash_t ok_uint8_hash(uint8_t key);
+ @param map  Pointer to the map.
+ @param key  The key.
+ @param hash The hash of the key, from #ok_map_hash().
 
-/// Gets the hash for a int8_t.
-OK_LIB_API ok_hash_t ok_int8_hash(int8_t key);
+ @return The value, or zero if the key doesn't exist in the map.
+ */
+#define ok_map_get_hashed(map, key, hash) ( \
+    (map)->entry.k = (key), \
+    _ok_map_get((map)->m, &(map)->entry.k, (hash), \
+                (void *)&(map)->entry.v, sizeof((map)->entry.v)), \
+    (map)->entry.v \
+)
 
-/// Gets the hash for a uint16_t.
-OK_LIB_API ok_hash_t ok_uint16_hash(uint16_t key);
+/**
+ Gets a pointer to the value associated with a key, using a precomputed hash. See
+ #ok_map_get_ptr().
 
-/// Gets the hash for a int16_t.
-OK_LIB_API ok_hash_t ok_int16_hash(int16_t key);
+ @param map  Pointer to the map.
+ @param key  The key.
+ @param hash The hash of the key, from #ok_map_hash().
 
-/// Gets the hash for a uint32_t.
-OK_LIB_API ok_hash_t ok_uint32_hash(uint32_t key);
+ @return A pointer to the value, or `NULL` if the key does not exist in the map.
+ */
+#define ok_map_get_ptr_hashed(map, key, hash) ( \
+    (map)->entry.k = (key), \
+    _ok_map_get_ptr((map)->m, &(map)->entry.k, (hash), (void **)&(map)->v_ptr), \
+    (map)->v_ptr \
+)
 
-/// Gets the hash for a int32_t.
-OK_LIB_API ok_hash_t ok_int32_hash(int32_t key);
+/**
+ Checks if a key exists in the map, using a precomputed hash. See #ok_map_contains().
 
-/// Gets the hash for a uint64_t.
-OK_LIB_API ok_hash_t ok_uint64_hash(uint64_t key);
+ @param map  Pointer to the map.
+ @param key  The key.
+ @param hash The hash of the key, from #ok_map_hash().
 
-/// Gets the hash for a int64_t.
-OK_LIB_API ok_hash_t ok_int64_hash(int64_t key);
+ @return bool `true` if the key exists, `false` otherwise.
+ */
+#define ok_map_contains_hashed(map, key, hash) ( \
+    (map)->entry.k = (key), \
+    _ok_map_contains((map)->m, &(map)->entry.k, (hash)) \
+)
 
-/// Gets the hash for a float.
-OK_LIB_API ok_hash_t ok_float_hash(float key);
+/**
+ Removes a key from the map, using a precomputed hash. See #ok_map_remove().
 
-/// Gets the hash for a double.
-OK_LIB_API ok_hash_t ok_double_hash(double key);
+ @param map  Pointer to the map.
+ @param key  The key to remove.
+ @param hash The hash of the key, from #ok_map_hash().
 
-/// Gets the hash for a string.
-OK_LIB_API ok_hash_t ok_str_hash(char *key);
+ @return `true` if the key was in the map (thus removed), `false` otherwise.
+ */
+#define ok_map_remove_hashed(map, key, hash) ( \
+    (map)->entry.k = (key), \
+    _ok_map_remove((map)->m, &(map)->entry.k, (hash)) \
+)
 
-/// Gets the hash for a string.
-OK_LIB_API ok_hash_t ok_const_str_hash(const char *key);
+/**
+ Foreach macro that iterates over the keys and values in the map. The mappings are not returned in
+ any particular order, and the order may change as the map is modified.
+ 
+ The map should not be modified during iteration. A call to #ok_map_put() or #ok_map_remove()
+ during iteration could cause as crash.
+ 
+ The `break` and `continue` keywords are supported during iteration.
+ 
+ Example:
+ 
+     ok_map_foreach(map, const char *key, char *value) {
+         printf("Name: %s  Phone: %s\n", key, value);
+     }
 
-/// Combines two hashes into one.
-OK_LIB_API ok_hash_t ok_hash_combine(ok_hash_t hash_a, ok_hash_t hash_b);
+ @param map       Pointer to the map.
+ @param key_var   The key type and name.
+ @param value_var The value type and name.
+ */
+#define ok_map_foreach(map, key_var, value_var) \
+    for (size_t _keep = 1, _keep2 = 1, *_i = NULL; _keep && \
+        ((_i = (size_t *)_ok_map_next((map)->m, _i, (void *)&(map)->entry.k, \
+                                      sizeof((map)->entry.k), (void *)&(map)->entry.v, \
+                                      sizeof((map)->entry.v))) != NULL); \
+        _keep = 1 - _keep, _keep2 = 1 - _keep2) \
+    for (key_var = (map)->entry.k; _keep && _keep2; _keep2 = 1 - _keep2) \
+    for (value_var = (map)->entry.v; _keep; _keep = 1 - _keep)
 
-// MARK: Declarations: Equals functions
+/**
+ Iterates over all the keys and values in the map, copying them to variables owned by the caller
+ instead of the map's internal scratch space. See #ok_map_get_r().
 
-/// Gets the default equals function for the specified key type. Uses _Generic, so it requires C11.
-#ifndef ok_default_equals
-#  if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
-#    define ok_default_equals(key) _Generic(key, \
-       uint8_t      : ok_8bit_equals, \
-       int8_t       : ok_8bit_equals, \
-       uint16_t     : ok_16bit_equals, \
-       int16_t      : ok_16bit_equals, \
-       uint32_t     : ok_32bit_equals, \
-       int32_t      : ok_32bit_equals, \
-       uint64_t     : ok_64bit_equals, \
-       int64_t      : ok_64bit_equals, \
-       float        : ok_32bit_equals, \
-       double       : ok_64bit_equals, \
-       char *       : ok_str_equals, \
-       const char * : ok_str_equals)
-#  else
-#    define ok_default_equals(key) ok_str_equals
-#  endif
-#endif
+ Example:
 
-/// Checks if two 8-bit values are equal.
-OK_LIB_API bool ok_8bit_equals(const void *v1, const void *v2);
+     const char *key;
+     char *value;
+     ok_map_foreach_r(map, &key, &value) {
+         printf("%s: %s\n", key, value);
+     }
 
-/// Checks if two 16-bit values are equal.
-OK_LIB_API bool ok_16bit_equals(const void *v1, const void *v2);
+ @param map       Pointer to the map.
+ @param key_ptr   Pointer to the key to set for each mapping, or `NULL`.
+ @param value_ptr Pointer to the value to set for each mapping, or `NULL`.
+ */
+#define ok_map_foreach_r(map, key_ptr, value_ptr) \
+    for (void *_i = NULL; \
+         (_i = _ok_map_next((map)->m, _i, (void *)(key_ptr), sizeof((map)->entry.k), \
+                            (void *)(value_ptr), sizeof((map)->entry.v))) != NULL; )
 
-/// Checks if two 32-bit values are equal.
-OK_LIB_API bool ok_32bit_equals(const void *v1, const void *v2);
+/**
+ Iterates over all the keys and values in the map, setting pointers to the key and value in the
+ map's buckets. Nothing is copied, so this is faster than #ok_map_foreach() for large keys or
+ values, and values can be modified in place during iteration.
 
-/// Checks if two 64-bit values are equal.
-OK_LIB_API bool ok_64bit_equals(const void *v1, const void *v2);
+ The key must not be modified. Like #ok_map_foreach(), the map should not be modified during
+ iteration, and the pointers should not be used after any modification to the map. The `break`
+ and `continue` keywords are supported.
 
-/// Checks if two strings are equal.
-OK_LIB_API bool ok_str_equals(const void *a, const void *b);
+ Example:
 
-// MARK: Declarations: Private functions
+     const int *key;
+     struct big_struct *value;
+     ok_map_foreach_ptr(&map, key, value) {
+         value->count++;
+     }
 
-// @cond private
+ @param map       Pointer to the map.
+ @param key_ptr   The key pointer variable to set for each mapping.
+ @param value_ptr The value pointer variable to set for each mapping.
+ */
+#define ok_map_foreach_ptr(map, key_ptr, value_ptr) \
+    for (void *_i = NULL; \
+         sizeof(char[(sizeof(*(key_ptr)) == sizeof((map)->entry.k) && \
+                      sizeof(*(value_ptr)) == sizeof((map)->entry.v)) ? 1 : -1]) && \
+         (_i = _ok_map_next((map)->m, _i, NULL, 0, NULL, 0)) != NULL && \
+         ((key_ptr) = _ok_ptr_cast(key_ptr, _ok_map_iterator_key((map)->m, _i)), \
+          (value_ptr) = _ok_ptr_cast(value_ptr, _ok_map_iterator_value((map)->m, _i)), true); )
 
-#define OK_PTR_INC(ptr, offset) ((uint8_t *)(ptr) + (offset))
-#define OK_OFFSETOF(base_ptr, ptr) ((size_t)((uint8_t *)(ptr) - (uint8_t *)(base_ptr)))
+/**
+ Scans a part of the map, like Redis's `SCAN` command. Unlike #ok_map_foreach(), the map may be
+ modified between calls, so a large map can be scanned in small steps, with other work (including
+ puts, removes, and resizes) in between.
 
-struct _ok_map;
-struct _ok_queue_block;
-struct _ok_queue;
+ Start with a cursor of 0. Each call visits `count` buckets and returns the cursor for the next
+ call. The scan is finished when the returned cursor is 0.
 
-OK_LIB_API bool _ok_vec_realloc(void **values, size_t min_capacity, size_t element_size,
-                                size_t *capacity);
+ Every mapping that is in the map for the whole scan is visited at least once. A mapping may be
+ visited more than once if the map shrinks during the scan. Mappings that are put or removed
+ during the scan may or may not be visited. If the map is frozen during a scan, start again with a
+ cursor of 0.
 
-OK_LIB_API struct _ok_map *_ok_map_create(size_t initial_capacity,
-                                          bool (*key_equals_func)(const void *key1,
-                                                                  const void *key2),
-                                          size_t key_offset, size_t value_offset,
-                                          size_t bucket_stride);
+ The cursor is a bucket index incremented in reverse-binary order (the highest bit first), so the
+ buckets already visited are still visited after the capacity changes. Each call visits the
+ mappings whose home bucket is the cursor's bucket. During an incremental resize, the buckets of
+ the old map are visited too. Because the buckets are visited out of order, a full scan is slower
+ than #ok_map_foreach(), especially with #OK_MAP_OPTION_GROUP_PROBING (a group of buckets is
+ checked for each bucket).
 
-OK_LIB_API void _ok_map_free(struct _ok_map *map);
+ The `scan_func` must not modify the map. To remove mappings, collect their keys, and remove them
+ after the call.
 
-OK_LIB_API size_t _ok_map_count(const struct _ok_map *map);
+ Example:
 
-OK_LIB_API size_t _ok_map_capacity(const struct _ok_map *map);
+     static void find_expired(const void *key, void *value, void *context) {
+         if (((const struct session *)value)->expire_time < now) {
+             ok_vec_push((my_key_vec_t *)context, *(const uint64_t *)key);
+         }
+     }
+     ...
+     // One step of a sweep. `cursor` is kept between steps.
+     cursor = ok_map_scan(&map, cursor, 100, find_expired, &expired_keys);
+     ok_vec_foreach(&expired_keys, uint64_t key) {
+         ok_map_remove(&map, key);
+     }
+     ok_vec_clear(&expired_keys);
 
-OK_LIB_API bool _ok_map_contains(const struct _ok_map *map, const void *key,
-                                  ok_hash_t key_hash);
+ @param map       Pointer to the map.
+ @param cursor    The cursor returned by the previous call, or 0 to start a scan.
+ @param count     The number of buckets to visit. Small maps (see #OK_MAP_OPTION_NONE) are
+                  visited in one call.
+ @param scan_func The function called for each mapping, declared as
+                  `void scan_func(const void *key, void *value, void *context)`. The value can be
+                  modified in place.
+ @param context   The context passed to `scan_func`.
+
+ @return size_t The cursor for the next call, or 0 if the scan is finished.
+ */
+#define ok_map_scan(map, cursor, count, scan_func, context) \
+    _ok_map_scan((map)->m, (cursor), (count), (scan_func), (context))
 
-OK_LIB_API bool _ok_map_put(struct _ok_map **map, const void *key,
-                            size_t key_size, ok_hash_t key_hash,
-                            const void *value, size_t value_size);
+/**
+ Freezes the map, making it read-only and compact. Use this for maps that are built once and then
+ only read, like lookup tables.
 
-OK_LIB_API void _ok_map_put_and_get_ptr(struct _ok_map **map, const void *key,
-                                        size_t key_size, ok_hash_t key_hash,
-                                        void **value_ptr, size_t value_size);
+ A frozen map uses a perfect hash: a lookup examines exactly one bucket, and there is one bucket
+ per key, plus one empty bucket per 100 keys. The only other memory used is about one byte per
+ key. Keys whose hash is equal to the hash of another key are the exception; they are stored in a
+ separate sorted list, and a lookup of one of them uses a binary search.
 
-OK_LIB_API bool _ok_map_put_all(struct _ok_map **map,
-                                const struct _ok_map *from_map,
-                                size_t key_size, size_t value_size);
+ After freezing, #ok_map_put(), #ok_map_put_and_get_ptr(), #ok_map_entry(), and #ok_map_remove()
+ fail, returning `false` or `NULL`. All lookup functions work as usual, and #ok_map_put_all() can
+ copy a frozen map into a map that is not frozen. Since a frozen map is never modified, multiple
+ threads can call the reentrant functions, like #ok_map_get_r(), at the same time without locks.
 
-OK_LIB_API void _ok_map_get(const struct _ok_map *map, const void *key,
-                            ok_hash_t key_hash, void *value, size_t value_size);
+ Freezing takes time proportional to the number of keys. A map can't be unfrozen.
 
-OK_LIB_API void _ok_map_get_ptr(const struct _ok_map *map, const void *key,
-                                ok_hash_t key_hash, void **value_ptr);
+ @param map Pointer to the map.
 
-OK_LIB_API bool _ok_map_remove(struct _ok_map *map, const void *key,
-                               ok_hash_t key_hash);
+ @return bool `true` if success, `false` otherwise (out of memory error). On failure, the map is
+ unchanged.
+ */
+#define ok_map_freeze(map) \
+    (_ok_map_alloc(map, 0) ? _ok_map_freeze((map)->m) : false)
 
-OK_LIB_API void *_ok_map_next(const struct _ok_map *map, void *iterator, void *key,
-                              size_t key_size, void *value, size_t value_size);
+/**
+ Saves the map to a file, so that it can be opened later with #ok_map_init_from_file().
 
-OK_LIB_API struct _ok_queue_block *_ok_queue_new_block(const struct _ok_queue *queue,
-                                                       size_t value_size);
+ The file contains the buckets exactly as they are in memory, so the keys and values must be
+ plain-old-data: they must not contain pointers (including `const char *` keys and #ok_strview_t
+ keys). The file can only be opened by a program that uses the same key and value types, the same
+ hash function, the same #OK_LIB_USE_64BIT_HASH setting, and the same CPU architecture.
 
-OK_LIB_API void _ok_queue_free_block(struct _ok_queue_block *block);
+ If the map is in the middle of an incremental resize, the resize is finished first.
 
-OK_LIB_API struct _ok_queue_block *_ok_queue_get_free_block(struct _ok_queue *queue,
-                                                            size_t value_size);
+ The map is written to a temporary file (the path with ".tmp" appended), which then replaces the
+ file at `path`. Maps already opened from `path` keep reading the old file, so a map can be saved
+ back to the file it was opened from. On Windows, replacing a file that is still open fails.
 
-OK_LIB_API void _ok_queue_release_free_block(struct _ok_queue *queue,
-                                             struct _ok_queue_block *block);
+ @param map  Pointer to the map.
+ @param path The file path.
 
-OK_LIB_API void _ok_queue_set_value(void *values, size_t value_size, size_t index, void *value);
+ @return bool `true` if success, `false` otherwise (out of memory or I/O error).
+ */
+#define ok_map_save(map, path) \
+    (_ok_map_alloc(map, 0) ? _ok_map_save((map)->m, (path)) : false)
 
-OK_LIB_API void _ok_queue_get_value(void *values, size_t value_size, size_t index, void *value);
+/**
+ Inits a map from a file created with #ok_map_save(), automatically choosing hash and equals
+ functions if possible. See #ok_map_init_custom_from_file().
 
-OK_LIB_API bool _ok_queue_pop(struct _ok_queue *queue, size_t value_size, void *value);
+ @param map  Pointer to the map.
+ @param path The file path.
 
-OK_LIB_API void _ok_queue_push(struct _ok_queue *queue, size_t value_size, void *value);
+ @return bool `true` if success, `false` otherwise.
+ */
+#define ok_map_init_from_file(map, path) \
+    ok_map_init_custom_from_file(map, ok_default_hash((map)->entry.k), \
+                                 ok_default_equals((map)->entry.k), path)
 
-OK_LIB_API void _ok_queue_init(struct _ok_queue *queue, size_t value_size, size_t capacity);
+/**
+ Inits a map from a file created with #ok_map_save().
 
-OK_LIB_API void _ok_queue_deinit(struct _ok_queue *queue, size_t value_size,
-                                 void (*deallocator)(void *));
+ The file is memory-mapped (where supported) instead of read, so the map can be used immediately,
+ pages are loaded from disk as they are used, and multiple processes that open the same file share
+ the same memory. The mapping is private: the map can be modified as usual, but modifications are
+ not written to the file.
 
-// MARK: Implementation: Hash functions
+ Initialization fails if the file was saved by a map with a different bucket layout (key type or
+ value type), a different hash width, or a different version of the ok_lib hash functions. The
+ hash function itself can't be checked, so it must be the same function used for the saved map.
 
-#ifdef OK_LIB_DEFINE
+ When finished using the map, the #ok_map_deinit() function must be called.
 
-#if defined(__GNUC__)
-#  pragma GCC diagnostic push
-#  pragma GCC diagnostic ignored "-Wunused-function"
-#elif defined (_MSC_VER)
-#  pragma warning(push)
-#  pragma warning(disable:4505)
-#endif
+ @param map         Pointer to the map.
+ @param hash_func   The function to calculate the hash of the key.
+ @param equals_func The function to determine if two keys are equal.
+ @param path        The file path.
 
-// Hash functions from Wang http://www.cris.com/~Ttwang/tech/inthash.htm
-// and Jenkins http://www.burtleburtle.net/bob/hash/doobs.html
+ @return bool `true` if success, `false` otherwise (the file could not be opened, or is invalid).
+ */
+#define ok_map_init_custom_from_file(map, hash_func, equals_func, path) ( \
+    memset((map), 0, sizeof(*(map))), \
+    (map)->key_hash_func = hash_func, \
+    (map)->key_equals_func = equals_func, \
+    (((map)->m = _ok_map_open((path), equals_func, \
+                              OK_OFFSETOF(&(map)->entry, &(map)->entry.k), \
+                              OK_OFFSETOF(&(map)->entry, &(map)->entry.v), \
+                              sizeof((map)->entry))) != NULL) \
+)
 
-OK_LIB_API ok_hash_t ok_uint8_hash(uint8_t key) {
-    return ok_uint32_hash(key);
-}
+// MARK: Set
 
-OK_LIB_API ok_hash_t ok_int8_hash(int8_t key) {
-    return ok_uint32_hash((uint32_t)key);
+/**
+ Declares a generic `ok_set` struct or typedef. A set is a map without values: it uses the same
+ hash table as `ok_map`, but the buckets only contain the hash and the key.
+
+ For example, a set of strings can be declared as a typedef:
+
+     typedef struct ok_set_of(const char *) my_set_t;
+
+ @tparam key_type The key type.
+
+ @return Internal structure members in curly braces.
+ */
+#define ok_set_of(key_type) { \
+    /* The hash member must be first. See ok_map_of. */ \
+    OK_MUTABLE struct { \
+        ok_hash_t hash; \
+        key_type k; \
+    } entry; \
+    struct _ok_map *m; \
+    ok_hash_t (*key_hash_func)(key_type); \
+    bool (*key_equals_func)(const void *key1, const void *key2); \
+    unsigned int map_options; \
+}
+
+/**
+ A macro to initialize a set statically. The set doesn't allocate memory until the first add. See
+ #OK_MAP_INIT_CUSTOM().
+
+ @param hash_func   The function to calculate the hash of the key.
+ @param equals_func The function to determine if two keys are equal.
+ */
+#define OK_SET_INIT_CUSTOM(hash_func, equals_func) \
+    { { 0 }, NULL, (hash_func), (equals_func), OK_MAP_OPTION_NONE }
+
+/**
+ Inits a set, automatically choosing hash and equals functions if possible. If not possible, a
+ compile-time error occurs. See #ok_map_init().
+
+ When finished using the set, the #ok_set_deinit() function must be called.
+
+ @param set Pointer to the set.
+
+ @return bool `true` if success, `false` otherwise (out of memory error).
+ */
+#define ok_set_init(set) \
+    ok_set_init_custom(set, ok_default_hash((set)->entry.k), ok_default_equals((set)->entry.k))
+
+/**
+ Inits a set. See #ok_map_init_custom().
+
+ When finished using the set, the #ok_set_deinit() function must be called.
+
+ @param set         Pointer to the set.
+ @param hash_func   The function to calculate the hash of the key.
+ @param equals_func The function to determine if two keys are equal.
+
+ @return bool `true` if success, `false` otherwise (out of memory error).
+ */
+#define ok_set_init_custom(set, hash_func, equals_func) \
+    ok_set_init_custom_with_options(set, hash_func, equals_func, 0, OK_MAP_OPTION_NONE)
+
+/**
+ Inits a set with the specified initial capacity and options. See
+ #ok_map_init_custom_with_options().
+
+ When finished using the set, the #ok_set_deinit() function must be called.
+
+ @param set         Pointer to the set.
+ @param hash_func   The function to calculate the hash of the key.
+ @param equals_func The function to determine if two keys are equal.
+ @param capacity    The initial capacity. If 0, the default capacity is used.
+ @param options     The map options, like #OK_MAP_OPTION_GROUP_PROBING, or #OK_MAP_OPTION_NONE.
+
+ @return bool `true` if success, `false` otherwise (out of memory error).
+ */
+#define ok_set_init_custom_with_options(set, hash_func, equals_func, capacity, options) ( \
+    memset((set), 0, sizeof(*(set))), \
+    (set)->key_hash_func = hash_func, \
+    (set)->key_equals_func = equals_func, \
+    (set)->map_options = (options), \
+    _ok_set_alloc_if(set, (capacity) != 0, capacity) \
+)
+
+/**
+ Deinits the set. The set may be used again by calling #ok_set_init().
+
+ @param set Pointer to the set.
+ */
+#define ok_set_deinit(set) \
+    _ok_map_free((set)->m)
+
+/**
+ Gets the number of keys in the set.
+
+ @param set Pointer to the set.
+
+ @return size_t The number of keys in the set.
+ */
+#define ok_set_count(set) \
+    _ok_map_count((set)->m)
+
+/**
+ Adds a key to the set. If the key already exists in the set, the set is unchanged.
+
+ @param set Pointer to the set.
+ @param key The key.
+
+ @return `true` if the operation was successful, `false` otherwise (out of memory).
+ */
+#define ok_set_add(set, key) ( \
+    (set)->entry.k = (key), \
+    _ok_set_alloc(set, 0) && \
+    _ok_map_put(&(set)->m, &(set)->entry.k, sizeof((set)->entry.k), \
+                (set)->key_hash_func((set)->entry.k), &(set)->entry.k, 0) \
+)
+
+/**
+ Checks if a key exists in the set.
+
+ @param set Pointer to the set.
+ @param key The key.
+
+ @return bool `true` if the key exists, `false` otherwise.
+ */
+#define ok_set_contains(set, key) ( \
+    (set)->entry.k = (key), \
+    _ok_map_contains((set)->m, &(set)->entry.k, (set)->key_hash_func((set)->entry.k)) \
+)
+
+/**
+ Removes a key from the set.
+
+ @param set Pointer to the set.
+ @param key The key to remove.
+
+ @return `true` if the key was in the set (thus removed), `false` otherwise.
+ */
+#define ok_set_remove(set, key) ( \
+    (set)->entry.k = (key), \
+    _ok_map_remove((set)->m, &(set)->entry.k, (set)->key_hash_func((set)->entry.k)) \
+)
+
+/**
+ Adds all the keys of another set to the set. The stored hashes are used, so no keys are hashed.
+
+ @param set       Pointer to the set.
+ @param other_set Pointer to the other set, which must have the same key type, hash function, and
+                  equals function.
+
+ @return `true` if the operation was successful, `false` otherwise (out of memory).
+ */
+#define ok_set_union(set, other_set) ( \
+    (sizeof((set)->entry) == sizeof((other_set)->entry) && \
+     (set)->key_hash_func == (other_set)->key_hash_func) ? \
+    (_ok_set_alloc(set, 0) ? \
+     _ok_map_put_all(&(set)->m, (other_set)->m, sizeof((set)->entry.k), 0) : false) : \
+    false \
+)
+
+/**
+ Removes the keys from the set that are not in another set.
+
+ The smaller of the two sets is iterated, and the larger is probed using the stored hashes, so no
+ keys are hashed.
+
+ @param set       Pointer to the set.
+ @param other_set Pointer to the other set, which must have the same key type, hash function, and
+                  equals function.
+
+ @return `true` if the operation was successful, `false` otherwise (out of memory).
+ */
+#define ok_set_intersect(set, other_set) ( \
+    (sizeof((set)->entry) == sizeof((other_set)->entry) && \
+     (set)->key_hash_func == (other_set)->key_hash_func) ? \
+    _ok_map_intersect(&(set)->m, (other_set)->m) : \
+    false \
+)
+
+/**
+ Removes the keys from the set that are in another set.
+
+ The smaller of the two sets is iterated, and the larger is probed using the stored hashes, so no
+ keys are hashed.
+
+ @param set       Pointer to the set.
+ @param other_set Pointer to the other set, which must have the same key type, hash function, and
+                  equals function.
+
+ @return `true` if the operation was successful, `false` otherwise.
+ */
+#define ok_set_difference(set, other_set) ( \
+    (sizeof((set)->entry) == sizeof((other_set)->entry) && \
+     (set)->key_hash_func == (other_set)->key_hash_func) ? \
+    _ok_map_difference((set)->m, (other_set)->m) : \
+    false \
+)
+
+/**
+ Foreach macro that iterates over the keys in the set. The keys are not returned in any particular
+ order. The set should not be modified during iteration. See #ok_map_foreach().
+
+ Example:
+
+     ok_set_foreach(&set, const char *name) {
+         printf("Name: %s\n", name);
+     }
+
+ @param set     Pointer to the set.
+ @param key_var The key type and name.
+ */
+#define ok_set_foreach(set, key_var) \
+    for (size_t _keep = 1, *_i = NULL; _keep && \
+        ((_i = (size_t *)_ok_map_next((set)->m, _i, (void *)&(set)->entry.k, \
+                                      sizeof((set)->entry.k), NULL, 0)) != NULL); \
+        _keep = 1 - _keep) \
+    for (key_var = (set)->entry.k; _keep; _keep = 1 - _keep)
+
+// MARK: LRU cache
+
+/**
+ Declares a generic `ok_lru` struct or typedef: a cache with a fixed capacity, which evicts the
+ least recently used entry when a new key is put into a full cache.
+
+ The cache is a hash table (like `ok_map`) whose buckets also contain the links of the recency list,
+ so gets, puts, and evictions are O(1), and each access probes the table once.
+
+ For example, a cache of string keys with `int` values can be declared as a typedef:
+
+     typedef struct ok_lru_of(const char *, int) my_cache_t;
+
+ @tparam key_type   The key type.
+ @tparam value_type The value type.
+
+ @return Internal structure members in curly braces.
+ */
+#define ok_lru_of(key_type, value_type) { \
+    /* The hash member must be first. See ok_map_of. The links are the bucket indexes of the
+    previous (more recent) and next (less recent) entries. */ \
+    OK_MUTABLE struct { \
+        ok_hash_t hash; \
+        key_type k; \
+        value_type v; \
+        size_t links[2]; \
+    } entry; \
+    OK_MUTABLE value_type *v_ptr; \
+    struct _ok_lru *cache; \
+    ok_hash_t (*key_hash_func)(key_type); \
+}
+
+/**
+ Inits a cache, automatically choosing hash and equals functions if possible. If not possible, a
+ compile-time error occurs. See #ok_map_init().
+
+ When finished using the cache, the #ok_lru_deinit() function must be called.
+
+ @param lru      Pointer to the cache.
+ @param capacity The maximum number of entries. Must be greater than 0.
+
+ @return bool `true` if success, `false` otherwise (out of memory error).
+ */
+#define ok_lru_init(lru, capacity) \
+    ok_lru_init_custom(lru, ok_default_hash((lru)->entry.k), ok_default_equals((lru)->entry.k), \
+                       capacity)
+
+/**
+ Inits a cache. See #ok_map_init_custom().
+
+ When finished using the cache, the #ok_lru_deinit() function must be called.
+
+ @param lru         Pointer to the cache.
+ @param hash_func   The function to calculate the hash of the key.
+ @param equals_func The function to determine if two keys are equal.
+ @param capacity    The maximum number of entries. Must be greater than 0.
+
+ @return bool `true` if success, `false` otherwise (out of memory error).
+ */
+#define ok_lru_init_custom(lru, hash_func, equals_func, capacity) ( \
+    memset((lru), 0, sizeof(*(lru))), \
+    (lru)->key_hash_func = hash_func, \
+    (((lru)->cache = _ok_lru_create(capacity, equals_func, \
+                                    OK_OFFSETOF(&(lru)->entry, &(lru)->entry.k), \
+                                    OK_OFFSETOF(&(lru)->entry, &(lru)->entry.v), \
+                                    OK_OFFSETOF(&(lru)->entry, &(lru)->entry.links), \
+                                    sizeof((lru)->entry))) != NULL) \
+)
+
+/**
+ Deinits the cache. The eviction function is not called for the remaining entries; to release
+ them, iterate with #ok_lru_foreach() first.
+
+ @param lru Pointer to the cache.
+ */
+#define ok_lru_deinit(lru) \
+    _ok_lru_free((lru)->cache)
+
+/**
+ Sets the function that is called when an entry is evicted to make room for a new key. It is not
+ called by #ok_lru_remove(), or when a put replaces the value of an existing key.
+
+ The function must not modify the cache.
+
+ @param lru        Pointer to the cache.
+ @param evict_func The function, with the signature `void evict_func(void *context, void *key,
+                   void *value)`, where the parameters are pointers to the evicted key and value.
+                   May be `NULL`.
+ @param context    The context passed to the function.
+ */
+#define ok_lru_set_evict_func(lru, evict_func, context) \
+    _ok_lru_set_evict_func((lru)->cache, evict_func, context)
+
+/**
+ Gets the number of entries in the cache.
+
+ @param lru Pointer to the cache.
+
+ @return size_t The number of entries in the cache.
+ */
+#define ok_lru_count(lru) \
+    _ok_lru_count((lru)->cache)
+
+/**
+ Gets the capacity of the cache, which is the maximum number of entries.
+
+ @param lru Pointer to the cache.
+
+ @return size_t The capacity.
+ */
+#define ok_lru_capacity(lru) \
+    _ok_lru_capacity((lru)->cache)
+
+/**
+ Puts a key-value pair into the cache, and makes it the most recently used entry. If the key
+ already exists in the cache, its value is replaced. Otherwise, if the cache is full, the least
+ recently used entry is evicted first.
+
+ @param lru   Pointer to the cache.
+ @param key   The key.
+ @param value The value.
+ */
+#define ok_lru_put(lru, key, value) ( \
+    (lru)->entry.k = (key), \
+    (lru)->entry.v = (value), \
+    _ok_lru_put((lru)->cache, &(lru)->entry.k, sizeof((lru)->entry.k), \
+                (lru)->key_hash_func((lru)->entry.k), \
+                &(lru)->entry.v, sizeof((lru)->entry.v)) \
+)
+
+/**
+ Gets a value from the cache, and makes it the most recently used entry. If the key doesn't exist
+ in the cache, returns a zeroed-out value. Counts a hit or a miss.
+
+ @param lru Pointer to the cache.
+ @param key The key.
+
+ @return The value, or zero if the key doesn't exist in the cache.
+ */
+#define ok_lru_get(lru, key) ( \
+    (lru)->entry.k = (key), \
+    _ok_lru_get((lru)->cache, &(lru)->entry.k, (lru)->key_hash_func((lru)->entry.k), \
+                (void *)&(lru)->entry.v, sizeof((lru)->entry.v)), \
+    (lru)->entry.v \
+)
+
+/**
+ Gets a pointer to the value associated with a key, and makes it the most recently used entry.
+ Counts a hit or a miss.
+
+ The returned pointer should be considered temporary. It may be invalid, and should not be used,
+ after a call to #ok_lru_put() or #ok_lru_remove().
+
+ @param lru Pointer to the cache.
+ @param key The key.
+
+ @return A pointer to the value, or `NULL` if the key does not exist in the cache.
+ */
+#define ok_lru_get_ptr(lru, key) ( \
+    (lru)->entry.k = (key), \
+    _ok_lru_get_ptr((lru)->cache, &(lru)->entry.k, (lru)->key_hash_func((lru)->entry.k), \
+                    (void **)&(lru)->v_ptr), \
+    (lru)->v_ptr \
+)
+
+/**
+ Checks if a key exists in the cache. The recency order and the hit and miss counts are not
+ changed.
+
+ @param lru Pointer to the cache.
+ @param key The key.
+
+ @return bool `true` if the key exists, `false` otherwise.
+ */
+#define ok_lru_contains(lru, key) ( \
+    (lru)->entry.k = (key), \
+    _ok_lru_contains((lru)->cache, &(lru)->entry.k, (lru)->key_hash_func((lru)->entry.k)) \
+)
+
+/**
+ Removes a key from the cache. The eviction function is not called.
+
+ @param lru Pointer to the cache.
+ @param key The key to remove.
+
+ @return `true` if the key was in the cache (thus removed), `false` otherwise.
+ */
+#define ok_lru_remove(lru, key) ( \
+    (lru)->entry.k = (key), \
+    _ok_lru_remove((lru)->cache, &(lru)->entry.k, (lru)->key_hash_func((lru)->entry.k)) \
+)
+
+/**
+ Gets the number of calls to #ok_lru_get() and #ok_lru_get_ptr() that found the key.
+
+ @param lru Pointer to the cache.
+
+ @return size_t The number of hits.
+ */
+#define ok_lru_hits(lru) \
+    _ok_lru_hits((lru)->cache)
+
+/**
+ Gets the number of calls to #ok_lru_get() and #ok_lru_get_ptr() that didn't find the key.
+
+ @param lru Pointer to the cache.
+
+ @return size_t The number of misses.
+ */
+#define ok_lru_misses(lru) \
+    _ok_lru_misses((lru)->cache)
+
+/**
+ Foreach macro that iterates over the keys and values in the cache, from the most recently used to
+ the least recently used. The recency order is not changed. The cache should not be modified
+ during iteration.
+
+ Example:
+
+     ok_lru_foreach(&cache, const char *key, int value) {
+         printf("%s: %i\n", key, value);
+     }
+
+ @param lru       Pointer to the cache.
+ @param key_var   The key type and name.
+ @param value_var The value type and name.
+ */
+#define ok_lru_foreach(lru, key_var, value_var) \
+    for (size_t _keep = 1, _keep2 = 1, *_i = NULL; _keep && \
+        ((_i = (size_t *)_ok_lru_next((lru)->cache, _i, (void *)&(lru)->entry.k, \
+                                      sizeof((lru)->entry.k), (void *)&(lru)->entry.v, \
+                                      sizeof((lru)->entry.v))) != NULL); \
+        _keep = 1 - _keep, _keep2 = 1 - _keep2) \
+    for (key_var = (lru)->entry.k; _keep && _keep2; _keep2 = 1 - _keep2) \
+    for (value_var = (lru)->entry.v; _keep; _keep = 1 - _keep)
+
+// MARK: Concurrent map
+
+/**
+ The default number of segments of a concurrent map.
+ */
+#define OK_CMAP_DEFAULT_SEGMENT_COUNT 64
+
+/**
+ Declares a generic `ok_cmap` struct or typedef: a hash map that can be used by multiple threads
+ at the same time.
+
+ For example, a concurrent map with `uint64_t` keys and `double` values can be declared as a
+ typedef:
+
+     typedef struct ok_cmap_of(uint64_t, double) my_cmap_t;
+
+ or a struct:
+
+     struct my_cmap_s ok_cmap_of(uint64_t, double);
+
+ The map is divided into segments, chosen by the key's hash. Reads (#ok_cmap_get(),
+ #ok_cmap_contains()) are lock-free. Writes lock one segment, and a segment is resized without
+ blocking readers or writers of other segments.
+
+ Unlike #ok_map_of(), keys and values are passed by pointer, and are copied to and from memory
+ owned by the caller. The map has no internal scratch space, so every function may be called
+ from any thread.
+
+ @tparam key_type   The key type.
+ @tparam value_type The value type.
+
+ @return Internal structure members in curly braces.
+ */
+#define ok_cmap_of(key_type, value_type) { \
+    struct { \
+        ok_hash_t hash; \
+        key_type k; \
+        value_type v; \
+    } entry; /* Only used for its layout. Never written. */ \
+    struct _ok_cmap *m; \
+    ok_hash_t (*key_hash_func)(key_type); \
+}
+
+/**
+ Inits a concurrent map, automatically choosing hash and equals functions if possible. If not
+ possible, a compile-time error occurs.
+
+ This function is not thread safe. When finished using the map, the #ok_cmap_deinit() function
+ must be called.
+
+ @param map Pointer to the map.
+
+ @return bool `true` if success, `false` otherwise (out of memory error).
+ */
+#define ok_cmap_init(map) \
+    ok_cmap_init_custom(map, ok_default_hash((map)->entry.k), ok_default_equals((map)->entry.k))
+
+/**
+ Inits a concurrent map with the specified hash and equals functions, and the default number of
+ segments. See #ok_map_init_custom().
+
+ @param map         Pointer to the map.
+ @param hash_func   The function to calculate the hash of the key.
+ @param equals_func The function to determine if two keys are equal.
+
+ @return bool `true` if success, `false` otherwise (out of memory error).
+ */
+#define ok_cmap_init_custom(map, hash_func, equals_func) \
+    ok_cmap_init_custom_with_segment_count(map, hash_func, equals_func, \
+                                           OK_CMAP_DEFAULT_SEGMENT_COUNT)
+
+/**
+ Inits a concurrent map with the specified hash and equals functions, and number of segments.
+
+ More segments allow more writers to work at the same time, at the cost of memory.
+
+ @param map           Pointer to the map.
+ @param hash_func     The function to calculate the hash of the key.
+ @param equals_func   The function to determine if two keys are equal.
+ @param segment_count The number of segments. Rounded up to a power of two, with a maximum of 128.
+
+ @return bool `true` if success, `false` otherwise (out of memory error).
+ */
+#define ok_cmap_init_custom_with_segment_count(map, hash_func, equals_func, segment_count) ( \
+    memset((map), 0, sizeof(*(map))), \
+    (map)->key_hash_func = hash_func, \
+    (((map)->m = _ok_cmap_create(segment_count, equals_func, \
+                                 OK_OFFSETOF(&(map)->entry, &(map)->entry.k), \
+                                 sizeof((map)->entry.k), \
+                                 OK_OFFSETOF(&(map)->entry, &(map)->entry.v), \
+                                 sizeof((map)->entry.v), sizeof((map)->entry))) != NULL) \
+)
+
+/**
+ Deinits the map. This function is not thread safe.
+
+ @param map Pointer to the map.
+ */
+#define ok_cmap_deinit(map) do { \
+    _ok_cmap_free((map)->m); \
+    (map)->m = NULL; \
+} while (0)
+
+/**
+ Gets the number of elements in the map. If other threads are modifying the map, the count is
+ approximate.
+
+ @param map Pointer to the map.
+
+ @return size_t The number of elements.
+ */
+#define ok_cmap_count(map) \
+    _ok_cmap_count((map)->m)
+
+/**
+ Puts a key-value pair into the map. If the key already exists in the map, its value is replaced.
+
+ @param map       Pointer to the map.
+ @param key_ptr   Pointer to the key.
+ @param value_ptr Pointer to the value.
+
+ @return `true` if the operation was successful, `false` otherwise (out of memory).
+ */
+#define ok_cmap_put(map, key_ptr, value_ptr) ( \
+    (void)sizeof(char[(sizeof(*(key_ptr)) == sizeof((map)->entry.k) && \
+                       sizeof(*(value_ptr)) == sizeof((map)->entry.v)) ? 1 : -1]), \
+    _ok_cmap_put((map)->m, (key_ptr), (map)->key_hash_func(*(key_ptr)), (value_ptr)) \
+)
+
+/**
+ Gets a value from the map. Lock-free. If the key doesn't exist in the map, the value is set to
+ zero.
+
+ @param map       Pointer to the map.
+ @param key_ptr   Pointer to the key.
+ @param value_ptr Pointer to the value to set.
+
+ @return bool `true` if the key exists, `false` otherwise.
+ */
+#define ok_cmap_get(map, key_ptr, value_ptr) ( \
+    (void)sizeof(char[(sizeof(*(key_ptr)) == sizeof((map)->entry.k) && \
+                       sizeof(*(value_ptr)) == sizeof((map)->entry.v)) ? 1 : -1]), \
+    _ok_cmap_get((map)->m, (key_ptr), (map)->key_hash_func(*(key_ptr)), (value_ptr)) \
+)
+
+/**
+ Checks if a key exists in the map. Lock-free.
+
+ @param map     Pointer to the map.
+ @param key_ptr Pointer to the key.
+
+ @return bool `true` if the key exists, `false` otherwise.
+ */
+#define ok_cmap_contains(map, key_ptr) ( \
+    (void)sizeof(char[sizeof(*(key_ptr)) == sizeof((map)->entry.k) ? 1 : -1]), \
+    _ok_cmap_get((map)->m, (key_ptr), (map)->key_hash_func(*(key_ptr)), NULL) \
+)
+
+/**
+ Atomically gets the value for a key, or inserts a value if the key doesn't exist.
+
+ @param map       Pointer to the map.
+ @param key_ptr   Pointer to the key.
+ @param value_ptr Pointer to the value. If the key exists, the value is set to the existing value.
+                  Otherwise, the value is inserted into the map.
+ @param inserted  Pointer to a bool that is set to `true` if the value was inserted, and `false`
+                  if the key already existed. May be `NULL`.
+
+ @return `true` if the operation was successful, `false` otherwise (out of memory).
+ */
+#define ok_cmap_get_or_insert(map, key_ptr, value_ptr, inserted) ( \
+    (void)sizeof(char[(sizeof(*(key_ptr)) == sizeof((map)->entry.k) && \
+                       sizeof(*(value_ptr)) == sizeof((map)->entry.v)) ? 1 : -1]), \
+    _ok_cmap_get_or_insert((map)->m, (key_ptr), (map)->key_hash_func(*(key_ptr)), \
+                           (value_ptr), (inserted)) \
+)
+
+/**
+ Atomically updates the value for a key, inserting it if it doesn't exist. The update function is
+ called with the segment locked, so it should be short, and must not use the map.
+
+ Example:
+
+     static void increment(void *value, bool exists, void *context) {
+         *(int *)value += *(int *)context;
+     }
+     ...
+     int amount = 1;
+     ok_cmap_update(&map, &key, increment, &amount);
+
+ @param map         Pointer to the map.
+ @param key_ptr     Pointer to the key.
+ @param update_func The function to update the value, declared as
+                    `void update_func(void *value, bool exists, void *context)`. If the key
+                    didn't exist, the value is zeroed before the function is called.
+ @param context     The context passed to the update function.
+
+ @return `true` if the operation was successful, `false` otherwise (out of memory).
+ */
+#define ok_cmap_update(map, key_ptr, update_func, context) ( \
+    (void)sizeof(char[sizeof(*(key_ptr)) == sizeof((map)->entry.k) ? 1 : -1]), \
+    _ok_cmap_update((map)->m, (key_ptr), (map)->key_hash_func(*(key_ptr)), \
+                    (update_func), (context)) \
+)
+
+/**
+ Removes a key from the map.
+
+ @param map     Pointer to the map.
+ @param key_ptr Pointer to the key to remove.
+
+ @return `true` if the key was in the map (thus removed), `false` otherwise.
+ */
+#define ok_cmap_remove(map, key_ptr) ( \
+    (void)sizeof(char[sizeof(*(key_ptr)) == sizeof((map)->entry.k) ? 1 : -1]), \
+    _ok_cmap_remove((map)->m, (key_ptr), (map)->key_hash_func(*(key_ptr))) \
+)
+
+/**
+ Frees the memory of tables that were replaced when the map was resized.
+
+ Because reads are lock-free, a replaced table may still be read by another thread. Replaced tables
+ are freed by a later write to the same segment, once every read that started before the table was
+ replaced has finished. This function frees them right away (for example, before measuring memory
+ use). It is not thread safe: no other thread may use the map while it is called.
+
+ @param map Pointer to the map.
+ */
+#define ok_cmap_free_retired(map) \
+    _ok_cmap_free_retired((map)->m)
+
+// MARK: Aggregator
+
+/**
+ The default number of shards of an aggregator.
+ */
+#define OK_AGG_DEFAULT_SHARD_COUNT 16
+
+/**
+ Declares a generic `ok_agg` struct or typedef: a set of maps for a parallel group-by, where
+ several worker threads aggregate values by key, and the results are merged.
+
+ For example, an aggregator that counts `uint32_t` keys can be declared as a typedef:
+
+     typedef struct ok_agg_of(uint32_t, size_t) my_agg_t;
+
+ or a struct:
+
+     struct my_agg_s ok_agg_of(uint32_t, size_t);
+
+ Each worker has its own maps, so workers update values without locking. A worker's maps are
+ shards, chosen by the upper bits of the key's hash (like the segments of an #ok_cmap_of()). When
+ the workers are finished, #ok_agg_merge() merges every worker's shard into worker 0's shard, using
+ #ok_map_merge(). Shards have different keys, so with `OK_LIB_USE_THREADS`, the shards are merged
+ on several threads at once.
+
+ Like #ok_cmap_of(), keys and values are passed by pointer.
+
+ Example:
+
+     static void increment(void *value, bool exists, void *context) {
+         (*(size_t *)value)++;
+     }
+     static void add(void *value, const void *new_value, void *context) {
+         *(size_t *)value += *(const size_t *)new_value;
+     }
+     ...
+     ok_agg_init(&agg, worker_count);
+     ...
+     // On the thread of worker `w`:
+     ok_agg_update(&agg, w, &key, increment, NULL);
+     ...
+     // After all workers are finished:
+     ok_agg_merge(&agg, add, NULL);
+     size_t count;
+     ok_agg_get(&agg, &key, &count);
+
+ @tparam key_type   The key type.
+ @tparam value_type The value type.
+
+ @return Internal structure members in curly braces.
+ */
+#define ok_agg_of(key_type, value_type) { \
+    struct { \
+        ok_hash_t hash; \
+        key_type k; \
+        value_type v; \
+    } entry; /* Only used for its layout. Never written. */ \
+    struct _ok_agg *a; \
+    ok_hash_t (*key_hash_func)(key_type); \
+}
+
+/**
+ Inits an aggregator, automatically choosing hash and equals functions if possible. If not
+ possible, a compile-time error occurs.
+
+ When finished using the aggregator, the #ok_agg_deinit() function must be called.
+
+ @param agg          Pointer to the aggregator.
+ @param worker_count The number of workers.
+
+ @return bool `true` if success, `false` otherwise (out of memory error).
+ */
+#define ok_agg_init(agg, worker_count) \
+    ok_agg_init_custom(agg, ok_default_hash((agg)->entry.k), ok_default_equals((agg)->entry.k), \
+                       worker_count)
+
+/**
+ Inits an aggregator with the specified hash and equals functions, and the default number of
+ shards. See #ok_map_init_custom().
+
+ @param agg          Pointer to the aggregator.
+ @param hash_func    The function to calculate the hash of the key.
+ @param equals_func  The function to determine if two keys are equal.
+ @param worker_count The number of workers.
+
+ @return bool `true` if success, `false` otherwise (out of memory error).
+ */
+#define ok_agg_init_custom(agg, hash_func, equals_func, worker_count) \
+    ok_agg_init_custom_with_shard_count(agg, hash_func, equals_func, worker_count, \
+                                        OK_AGG_DEFAULT_SHARD_COUNT)
+
+/**
+ Inits an aggregator with the specified hash and equals functions, and number of shards.
+
+ The shards are merged in parallel, so there should be at least as many shards as threads. The
+ maps of a worker are created as needed.
+
+ @param agg          Pointer to the aggregator.
+ @param hash_func    The function to calculate the hash of the key.
+ @param equals_func  The function to determine if two keys are equal.
+ @param worker_count The number of workers.
+ @param shard_count  The number of shards. Rounded up to a power of two, with a maximum of 128.
+
+ @return bool `true` if success, `false` otherwise (out of memory error).
+ */
+#define ok_agg_init_custom_with_shard_count(agg, hash_func, equals_func, worker_count, \
+                                            shard_count) ( \
+    memset((agg), 0, sizeof(*(agg))), \
+    (agg)->key_hash_func = hash_func, \
+    (((agg)->a = _ok_agg_create(worker_count, shard_count, equals_func, \
+                                OK_OFFSETOF(&(agg)->entry, &(agg)->entry.k), \
+                                sizeof((agg)->entry.k), \
+                                OK_OFFSETOF(&(agg)->entry, &(agg)->entry.v), \
+                                sizeof((agg)->entry.v), sizeof((agg)->entry))) != NULL) \
+)
+
+/**
+ Deinits the aggregator.
+
+ @param agg Pointer to the aggregator.
+ */
+#define ok_agg_deinit(agg) do { \
+    _ok_agg_free((agg)->a); \
+    (agg)->a = NULL; \
+} while (0)
+
+/**
+ Updates the value for a key in a worker's maps, inserting it if it doesn't exist.
+
+ Workers can be used on different threads at the same time, but one worker must not be used on
+ two threads at the same time.
+
+ @param agg         Pointer to the aggregator.
+ @param worker      The worker index, from 0 to `worker_count - 1`.
+ @param key_ptr     Pointer to the key.
+ @param update_func The function to update the value, declared as
+                    `void update_func(void *value, bool exists, void *context)`. If the key
+                    didn't exist, the value is zeroed before the function is called.
+ @param context     The context passed to the update function.
+
+ @return `true` if the operation was successful, `false` otherwise (out of memory, or the worker
+ index is out of range).
+ */
+#define ok_agg_update(agg, worker, key_ptr, update_func, context) ( \
+    (void)sizeof(char[sizeof(*(key_ptr)) == sizeof((agg)->entry.k) ? 1 : -1]), \
+    _ok_agg_update((agg)->a, (worker), (key_ptr), (agg)->key_hash_func(*(key_ptr)), \
+                   (update_func), (context)) \
+)
+
+/**
+ Gets a pointer to the value for a key in a worker's maps, inserting the key (with a zeroed
+ value) if it doesn't exist. This is faster than #ok_agg_update() for simple updates, like
+ counting. See #ok_agg_update() for thread safety.
+
+ The returned pointer should be considered temporary. It may be invalid after the next call to
+ #ok_agg_update() or #ok_agg_entry() for the same worker.
+
+ Example:
+
+     size_t *count = ok_agg_entry(&agg, w, &key, NULL);
+     if (count) {
+         (*count)++;
+     }
+
+ @param agg      Pointer to the aggregator.
+ @param worker   The worker index, from 0 to `worker_count - 1`.
+ @param key_ptr  Pointer to the key.
+ @param inserted Pointer to a `bool` that is set to `true` if the key was inserted, or `false` if
+                 it already existed. May be `NULL`.
+
+ @return A `void` pointer to the value, or `NULL` for out-of-memory error (or if the worker index
+ is out of range).
+ */
+#define ok_agg_entry(agg, worker, key_ptr, inserted) ( \
+    sizeof(char[sizeof(*(key_ptr)) == sizeof((agg)->entry.k) ? 1 : -1]) ? \
+    _ok_agg_entry((agg)->a, (worker), (key_ptr), (agg)->key_hash_func(*(key_ptr)), \
+                  (inserted)) : NULL \
+)
+
+/**
+ Merges the maps of every worker into the maps of worker 0, shard by shard. This function is not
+ thread safe: no worker may use the aggregator while it is called.
+
+ With `OK_LIB_USE_THREADS`, shards are merged on several threads, and `combine_func` may be called
+ from several threads at once (for different keys). For one key, the values are combined in
+ worker order.
+
+ After merging, the results are read with #ok_agg_get(), #ok_agg_count(), and
+ #ok_agg_foreach_r(). Workers may continue to update values, and the aggregator may be merged
+ again.
+
+ @param agg          Pointer to the aggregator.
+ @param combine_func The function that combines a value from another worker into a value of
+                     worker 0, declared as `void combine_func(void *value, const void *new_value,
+                     void *context)`. See #ok_map_merge().
+ @param context      The context passed to `combine_func`.
+
+ @return `true` if success, `false` otherwise (out of memory). If `false`, some of the values may
+ have been merged.
+ */
+#define ok_agg_merge(agg, combine_func, context) \
+    _ok_agg_merge((agg)->a, (combine_func), (context))
+
+/**
+ Gets the number of keys in the maps of all workers. After #ok_agg_merge(), this is the number of
+ keys in the result.
+
+ @param agg Pointer to the aggregator.
+
+ @return size_t The number of keys.
+ */
+#define ok_agg_count(agg) \
+    _ok_agg_count((agg)->a)
+
+/**
+ Gets a value from the maps of worker 0, which are the results after #ok_agg_merge(). If the key
+ doesn't exist, the value is set to zero.
+
+ @param agg       Pointer to the aggregator.
+ @param key_ptr   Pointer to the key.
+ @param value_ptr Pointer to the value to set.
+
+ @return bool `true` if the key exists, `false` otherwise.
+ */
+#define ok_agg_get(agg, key_ptr, value_ptr) ( \
+    (void)sizeof(char[(sizeof(*(key_ptr)) == sizeof((agg)->entry.k) && \
+                       sizeof(*(value_ptr)) == sizeof((agg)->entry.v)) ? 1 : -1]), \
+    _ok_agg_get((agg)->a, (key_ptr), (agg)->key_hash_func(*(key_ptr)), (value_ptr), \
+                sizeof((agg)->entry.v)) \
+)
+
+/**
+ Iterates over the keys and values in the maps of worker 0, which are the results after
+ #ok_agg_merge(), copying them to variables owned by the caller. See #ok_map_foreach_r().
+
+ Example:
+
+     uint32_t key;
+     size_t count;
+     ok_agg_foreach_r(&agg, &key, &count) {
+         printf("%u: %zu\n", key, count);
+     }
+
+ @param agg       Pointer to the aggregator.
+ @param key_ptr   Pointer to the key to set for each mapping, or `NULL`.
+ @param value_ptr Pointer to the value to set for each mapping, or `NULL`.
+ */
+#define ok_agg_foreach_r(agg, key_ptr, value_ptr) \
+    for (size_t _s = 0, *_i = NULL; \
+         (_i = (size_t *)_ok_agg_next((agg)->a, &_s, _i, (void *)(key_ptr), \
+                                      sizeof((agg)->entry.k), (void *)(value_ptr), \
+                                      sizeof((agg)->entry.v))) != NULL; )
+
+// MARK: Concurrent queue
+
+/**
+ The default capacity of a queue. This is the minimum capacity; queues can grow in size.
+ */
+#define OK_QUEUE_DEFAULT_CAPACITY 16
+
+/**
+ A macro to initialize a queue statically.
+
+     typedef struct ok_queue_of(int) my_queue_t;
+     my_queue_t queue = OK_QUEUE_INIT;
+
+ When finished using the queue, the #ok_queue_deinit() function must be called.
+ */
+#define OK_QUEUE_INIT { { NULL, NULL, NULL, false, false, OK_QUEUE_DEFAULT_CAPACITY }, NULL }
+
+/**
+ Declares a generic `ok_queue` struct or typedef.
+
+ For example, a ok_queue with `int` values can be declared as a typedef:
+
+     typedef struct ok_queue_of(int) my_queue_t;
+
+ or a struct:
+
+     struct my_queue_s ok_queue_of(int);
+
+ @tparam value_type The value type.
+
+ @return Internal structure members in curly braces.
+ */
+#define ok_queue_of(value_type) { \
+    struct _ok_queue q; \
+    value_type *v; \
+}
+
+/**
+ Inits a queue with the default minimum capacity.
+
+ To init a queue with a custom minimum capacity, use #ok_queue_init_with_capacity() instead.
+
+ This function is not thread safe. If two threads attempt to init a queue at the same time, the
+ result is undefined.
+
+ When finished using the queue, the #ok_queue_deinit() function must be called.
+
+ @tparam queue Pointer to the queue.
+ */
+#define ok_queue_init(queue) \
+    ok_queue_init_with_capacity(queue, OK_QUEUE_DEFAULT_CAPACITY)
+
+/**
+ Inits a queue with a custom minimum capacity. The queue may grow in size larger than the specified
+ capacity.
+
+ This function is not thread safe. If two threads attempt to init a queue at the same time, the
+ result is undefined.
+
+ When finished using the queue, the #ok_queue_deinit() function must be called.
+
+ @tparam queue Pointer to the queue.
+ @tparam capacity The minimum number of values the queue can hold.
+ */
+#define ok_queue_init_with_capacity(queue, capacity) \
+    _ok_queue_init(&(queue)->q, sizeof(*(queue)->v), capacity)
+
+/**
+ Deinits the queue. The queue may be used again by calling #ok_queue_init().
+
+ @tparam queue Pointer to the queue.
+ */
+#define ok_queue_deinit(queue) \
+    ok_queue_deinit_with_deallocator(queue, NULL)
+
+/**
+ Deinits the queue and deallocates its remaining values. Each remaining value is
+ removed from the queue and sent as a param to the deallocator function.
+
+ The queue may be used again by calling #ok_queue_init().
+
+ @tparam queue Pointer to the queue.
+ @tparam deallocator The deallocator function, declared as `void (*deallocator)(void *)`.
+ */
+#define ok_queue_deinit_with_deallocator(queue, deallocator) \
+    _ok_queue_deinit(&(queue)->q, sizeof(*(queue)->v), (deallocator))
+
+/**
+ Adds a value to the back of the queue.
+
+ @tparam queue Pointer to the queue.
+ @tparam value The value to add. Must be an addressable rvalue.
+ */
+#define ok_queue_push(queue, value) do { \
+    ok_static_assert(ok_types_compatible(*(queue)->v, value), "Incompatible types"); \
+    _ok_queue_push(&(queue)->q, sizeof(*(queue)->v), &(value)); \
+} while (0)
+
+/**
+ Attempts to remove a value from the front of the queue.
+
+ @tparam queue Pointer to the queue.
+ @tparam value_ptr The address to store the removed value.
+ @return true on success, false if the queue is empty.
+ */
+#define ok_queue_pop(queue, value_ptr) (\
+    sizeof(char[ok_types_compatible(*(queue)->v, *(value_ptr)) ? 1 : -1]) && /* Type check */ \
+    _ok_queue_pop(&(queue)->q, sizeof(*(queue)->v), (value_ptr)) \
+)
+
+// MARK: Declarations: Hash functions
+
+/// The hash type, which is returned from hash functions. 64-bit if `OK_LIB_USE_64BIT_HASH` is defined.
+#ifdef OK_LIB_USE_64BIT_HASH
+typedef uint64_t ok_hash_t;
+#else
+typedef uint32_t ok_hash_t;
+#endif
+
+/**
+ A string view: a pointer to characters and a length. The characters do not need to be
+ NUL-terminated, and may be part of a larger buffer.
+
+ String views can be used as map keys, which allows looking up a key directly from a slice of a
+ buffer without copying it. A map does not copy the characters, so the characters of the keys
+ in the map must remain valid while they are in the map.
+ */
+typedef struct {
+    const char *ptr;
+    size_t len;
+} ok_strview_t;
+
+/// Creates a string view from a pointer and a length.
+static inline ok_strview_t ok_strview(const char *ptr, size_t len) {
+    ok_strview_t view;
+    view.ptr = ptr;
+    view.len = len;
+    return view;
+}
+
+/// Creates a string view of a NUL-terminated string (not including the NUL terminator).
+static inline ok_strview_t ok_strview_from_str(const char *str) {
+    return ok_strview(str, strlen(str));
+}
+
+/// Gets the default hash function for the specified key type. Uses _Generic, so it requires C11.
+#ifndef ok_default_hash
+#  if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+#    define ok_default_hash(key) _Generic(key, \
+       uint8_t      : ok_uint8_hash, \
+       int8_t       : ok_int8_hash, \
+       uint16_t     : ok_uint16_hash, \
+       int16_t      : ok_int16_hash, \
+       uint32_t     : ok_uint32_hash, \
+       int32_t      : ok_int32_hash, \
+       uint64_t     : ok_uint64_hash, \
+       int64_t      : ok_int64_hash, \
+       float        : ok_float_hash, \
+       double       : ok_double_hash, \
+       char *       : ok_str_hash, \
+       const char * : ok_const_str_hash, \
+       void *       : ok_ptr_hash, \
+       const void * : ok_const_ptr_hash, \
+       ok_strview_t : ok_strview_hash)
+#  else
+// Force compile error if type is not 'char *`
+#    define ok_default_hash(key) (ok_static_assert(sizeof(_ok_is_char(*key)) == sizeof(bool) && \
+                                                   sizeof(*key) == sizeof(char), \
+                                                   "Only works with `char *` type"), \
+                                                   ok_const_str_hash)
+#  endif
+#endif
+
+static inline bool _ok_is_char(char);
+
+/// Gets the hash for a uint8_t.
+OK_LIB_API ok_hash_t ok_uint8_hash(uint8_t key);
+
+/// Gets the hash for a int8_t.
+OK_LIB_API ok_hash_t ok_int8_hash(int8_t key);
+
+/// Gets the hash for a uint16_t.
+OK_LIB_API ok_hash_t ok_uint16_hash(uint16_t key);
+
+/// Gets the hash for a int16_t.
+OK_LIB_API ok_hash_t ok_int16_hash(int16_t key);
+
+/// Gets the hash for a uint32_t.
+OK_LIB_API ok_hash_t ok_uint32_hash(uint32_t key);
+
+/// Gets the hash for a int32_t.
+OK_LIB_API ok_hash_t ok_int32_hash(int32_t key);
+
+/// Gets the hash for a uint64_t.
+OK_LIB_API ok_hash_t ok_uint64_hash(uint64_t key);
+
+/// Gets the hash for a int64_t.
+OK_LIB_API ok_hash_t ok_int64_hash(int64_t key);
+
+/// Gets the hash for a float.
+OK_LIB_API ok_hash_t ok_float_hash(float key);
+
+/// Gets the hash for a double.
+OK_LIB_API ok_hash_t ok_double_hash(double key);
+
+/// Gets the hash for a string.
+OK_LIB_API ok_hash_t ok_str_hash(char *key);
+
+/// Gets the hash for a string.
+OK_LIB_API ok_hash_t ok_const_str_hash(const char *key);
+
+/// Gets the hash for a string view. The hash is the same as #ok_const_str_hash() of the same string.
+OK_LIB_API ok_hash_t ok_strview_hash(ok_strview_t key);
+
+/**
+ Gets the hash for an array of bytes. The bytes are read 8 bytes at a time (48 bytes at a time for
+ large arrays) and mixed with 64-bit multiplies, like wyhash.
+
+ @param data   Pointer to the bytes. May be NULL if `length` is 0.
+ @param length The number of bytes.
+ */
+OK_LIB_API ok_hash_t ok_hash_bytes(const void *data, size_t length);
+
+/**
+ Gets the hash for an array of bytes, using a seed. Different seeds produce unrelated hashes, which
+ can be used to make hash flooding attacks harder, or to create independent hash functions.
+
+ @param data   Pointer to the bytes. May be NULL if `length` is 0.
+ @param length The number of bytes.
+ @param seed   The seed. The seed `0` produces the same hash as #ok_hash_bytes().
+ */
+OK_LIB_API ok_hash_t ok_hash_bytes_seeded(const void *data, size_t length, uint64_t seed);
+
+/// Combines two hashes into one.
+OK_LIB_API ok_hash_t ok_hash_combine(ok_hash_t hash_a, ok_hash_t hash_b);
+
+// MARK: Declarations: Equals functions
+
+/// Gets the default equals function for the specified key type. Uses _Generic, so it requires C11.
+#ifndef ok_default_equals
+#  if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L)
+#    define ok_default_equals(key) _Generic(key, \
+       uint8_t      : ok_8bit_equals, \
+       int8_t       : ok_8bit_equals, \
+       uint16_t     : ok_16bit_equals, \
+       int16_t      : ok_16bit_equals, \
+       uint32_t     : ok_32bit_equals, \
+       int32_t      : ok_32bit_equals, \
+       uint64_t     : ok_64bit_equals, \
+       int64_t      : ok_64bit_equals, \
+       float        : ok_32bit_equals, \
+       double       : ok_64bit_equals, \
+       char *       : ok_str_equals, \
+       const char * : ok_str_equals, \
+       ok_strview_t : ok_strview_equals)
+#  else
+#    define ok_default_equals(key) ok_str_equals
+#  endif
+#endif
+
+/// Checks if two 8-bit values are equal.
+OK_LIB_API bool ok_8bit_equals(const void *v1, const void *v2);
+
+/// Checks if two 16-bit values are equal.
+OK_LIB_API bool ok_16bit_equals(const void *v1, const void *v2);
+
+/// Checks if two 32-bit values are equal.
+OK_LIB_API bool ok_32bit_equals(const void *v1, const void *v2);
+
+/// Checks if two 64-bit values are equal.
+OK_LIB_API bool ok_64bit_equals(const void *v1, const void *v2);
+
+/// Checks if two strings are equal.
+OK_LIB_API bool ok_str_equals(const void *a, const void *b);
+
+/// Checks if two string views are equal. The lengths are compared first.
+OK_LIB_API bool ok_strview_equals(const void *a, const void *b);
+
+// MARK: Declarations: Private functions
+
+// @cond private
+
+#define OK_PTR_INC(ptr, offset) ((uint8_t *)(ptr) + (offset))
+#define OK_OFFSETOF(base_ptr, ptr) ((size_t)((uint8_t *)(ptr) - (uint8_t *)(base_ptr)))
+
+// Hashes keys in batches of OK_MAP_BATCH_SIZE, then runs `batch_statement`, which can use
+// `_ok_keys`, `_ok_hashes`, `_ok_n` (the batch size), and `_ok_i` (the index of the first key).
+#define _ok_map_batch(map, keys, count, batch_statement) do { \
+    ok_static_assert(sizeof(*(keys)) == sizeof((map)->entry.k), "Incompatible types"); \
+    ok_hash_t _ok_hashes[OK_MAP_BATCH_SIZE]; \
+    const size_t _ok_count = (count); \
+    for (size_t _ok_i = 0; _ok_i < _ok_count; _ok_i += OK_MAP_BATCH_SIZE) { \
+        const size_t _ok_n = (_ok_count - _ok_i < OK_MAP_BATCH_SIZE ? \
+                              _ok_count - _ok_i : OK_MAP_BATCH_SIZE); \
+        for (size_t _ok_j = 0; _ok_j < _ok_n; _ok_j++) { \
+            _ok_hashes[_ok_j] = (map)->key_hash_func((keys)[_ok_i + _ok_j]); \
+        } \
+        const void *_ok_keys = (const void *)((keys) + _ok_i); \
+        batch_statement; \
+    } \
+} while (0)
+
+// Creates the map's internal map, if it hasn't been created yet. Maps initialized without a
+// capacity (or statically) are created on the first put.
+#define _ok_map_alloc(map, capacity) \
+    _ok_map_alloc_if(map, true, capacity)
+
+#define _ok_map_alloc_if(map, create, capacity) \
+    _ok_map_lazy_create(&(map)->m, (create), (capacity), (map)->key_equals_func, \
+                        OK_OFFSETOF(&(map)->entry, &(map)->entry.k), \
+                        OK_OFFSETOF(&(map)->entry, &(map)->entry.v), \
+                        sizeof((map)->entry), (map)->map_options)
+
+#define _ok_set_alloc(set, capacity) \
+    _ok_set_alloc_if(set, true, capacity)
+
+#define _ok_set_alloc_if(set, create, capacity) \
+    _ok_map_lazy_create(&(set)->m, (create), (capacity), (set)->key_equals_func, \
+                        OK_OFFSETOF(&(set)->entry, &(set)->entry.k), \
+                        sizeof((set)->entry), sizeof((set)->entry), (set)->map_options)
+
+#ifdef __cplusplus
+#  define _ok_ptr_cast(ptr_var, ptr) static_cast<decltype(ptr_var)>(static_cast<void *>(ptr))
+#else
+#  define _ok_ptr_cast(ptr_var, ptr) ((void *)(ptr))
+#endif
+
+struct _ok_map;
+struct _ok_lru;
+struct _ok_agg;
+struct _ok_queue_block;
+struct _ok_queue;
+
+OK_LIB_API bool _ok_vec_realloc(void **values, size_t min_capacity, size_t element_size,
+                                size_t *capacity);
+
+OK_LIB_API struct _ok_map *_ok_map_create(size_t initial_capacity,
+                                          bool (*key_equals_func)(const void *key1,
+                                                                  const void *key2),
+                                          size_t key_offset, size_t value_offset,
+                                          size_t bucket_stride, unsigned int options);
+
+// Creates the map if `create` is true and the map hasn't been created yet. Returns `false` for
+// out-of-memory error. This is a function, rather than part of the macros, so that macros ending
+// with it can be used as statements without unused-value warnings.
+static inline bool _ok_map_lazy_create(struct _ok_map **map, bool create, size_t capacity,
+                                       bool (*key_equals_func)(const void *key1,
+                                                               const void *key2),
+                                       size_t key_offset, size_t value_offset,
+                                       size_t bucket_stride, unsigned int options) {
+    if (*map == NULL && create) {
+        *map = _ok_map_create(capacity, key_equals_func, key_offset, value_offset,
+                              bucket_stride, options);
+        return *map != NULL;
+    }
+    return true;
+}
+
+OK_LIB_API void _ok_map_free(struct _ok_map *map);
+
+OK_LIB_API bool _ok_map_set_max_load_factor(struct _ok_map **map, float max_load_factor);
+
+OK_LIB_API bool _ok_map_reserve(struct _ok_map **map, size_t count, size_t thread_count);
+
+OK_LIB_API bool _ok_map_shrink_to_fit(struct _ok_map **map);
+
+OK_LIB_API bool _ok_map_clear(struct _ok_map *map);
+
+OK_LIB_API size_t _ok_map_count(const struct _ok_map *map);
+
+OK_LIB_API size_t _ok_map_capacity(const struct _ok_map *map, unsigned int options);
+
+OK_LIB_API bool _ok_map_contains(const struct _ok_map *map, const void *key,
+                                  ok_hash_t key_hash);
+
+OK_LIB_API bool _ok_map_put(struct _ok_map **map, const void *key,
+                            size_t key_size, ok_hash_t key_hash,
+                            const void *value, size_t value_size);
+
+OK_LIB_API void _ok_map_put_and_get_ptr(struct _ok_map **map, const void *key,
+                                        size_t key_size, ok_hash_t key_hash,
+                                        void **value_ptr, size_t value_size);
+
+OK_LIB_API void _ok_map_entry(struct _ok_map **map, const void *key,
+                              size_t key_size, ok_hash_t key_hash,
+                              void **value_ptr, size_t value_size, bool *inserted,
+                              void (*init_func)(void *value, const void *key, void *context),
+                              void *context);
+
+OK_LIB_API bool _ok_map_put_all(struct _ok_map **map,
+                                const struct _ok_map *from_map,
+                                size_t key_size, size_t value_size);
+
+OK_LIB_API bool _ok_map_merge(struct _ok_map **map, const struct _ok_map *from_map,
+                              size_t key_size, size_t value_size,
+                              void (*combine_func)(void *value, const void *new_value,
+                                                   void *context),
+                              void *context);
+
+OK_LIB_API bool _ok_map_build(struct _ok_map **map, const void *keys, size_t key_stride,
+                              size_t key_size, const ok_hash_t *hashes, const void *values,
+                              size_t value_stride, size_t value_size, size_t count,
+                              unsigned int policy,
+                              void (*combine_func)(void *value, const void *new_value,
+                                                   void *context),
+                              void *context);
+
+OK_LIB_API bool _ok_map_get(const struct _ok_map *map, const void *key,
+                            ok_hash_t key_hash, void *value, size_t value_size);
+
+OK_LIB_API bool _ok_map_get_ptr(const struct _ok_map *map, const void *key,
+                                ok_hash_t key_hash, void **value_ptr);
+
+OK_LIB_API void _ok_map_get_many(const struct _ok_map *map, const void *keys, size_t key_stride,
+                                 const ok_hash_t *key_hashes, size_t count,
+                                 void *values, size_t value_size);
+
+OK_LIB_API void _ok_map_get_ptr_many(const struct _ok_map *map, const void *keys,
+                                     size_t key_stride, const ok_hash_t *key_hashes,
+                                     size_t count, void **value_ptrs);
+
+OK_LIB_API void _ok_map_contains_many(const struct _ok_map *map, const void *keys,
+                                      size_t key_stride, const ok_hash_t *key_hashes,
+                                      size_t count, uint8_t *bitmap, size_t first_index);
+
+OK_LIB_API bool _ok_map_remove(struct _ok_map *map, const void *key,
+                               ok_hash_t key_hash);
+
+OK_LIB_API void *_ok_map_next(const struct _ok_map *map, void *iterator, void *key,
+                              size_t key_size, void *value, size_t value_size);
+
+OK_LIB_API size_t _ok_map_scan(const struct _ok_map *map, size_t cursor, size_t count,
+                               void (*scan_func)(const void *key, void *value, void *context),
+                               void *context);
+
+OK_LIB_API void *_ok_map_iterator_key(const struct _ok_map *map, void *iterator);
+
+OK_LIB_API void *_ok_map_iterator_value(const struct _ok_map *map, void *iterator);
+
+OK_LIB_API bool _ok_map_intersect(struct _ok_map **map, const struct _ok_map *other_map);
+
+OK_LIB_API bool _ok_map_difference(struct _ok_map *map, const struct _ok_map *other_map);
+
+OK_LIB_API bool _ok_map_freeze(struct _ok_map *map);
+
+OK_LIB_API bool _ok_map_save(struct _ok_map *map, const char *path);
+
+OK_LIB_API struct _ok_map *_ok_map_open(const char *path,
+                                        bool (*key_equals_func)(const void *key1,
+                                                                const void *key2),
+                                        size_t key_offset, size_t value_offset,
+                                        size_t bucket_stride);
+
+OK_LIB_API struct _ok_lru *_ok_lru_create(size_t capacity,
+                                          bool (*key_equals_func)(const void *key1,
+                                                                  const void *key2),
+                                          size_t key_offset, size_t value_offset,
+                                          size_t links_offset, size_t bucket_stride);
+
+OK_LIB_API void _ok_lru_free(struct _ok_lru *lru);
+
+OK_LIB_API void _ok_lru_set_evict_func(struct _ok_lru *lru,
+                                       void (*evict_func)(void *context, void *key, void *value),
+                                       void *context);
+
+OK_LIB_API size_t _ok_lru_count(const struct _ok_lru *lru);
+
+OK_LIB_API size_t _ok_lru_capacity(const struct _ok_lru *lru);
+
+OK_LIB_API size_t _ok_lru_hits(const struct _ok_lru *lru);
+
+OK_LIB_API size_t _ok_lru_misses(const struct _ok_lru *lru);
+
+OK_LIB_API void _ok_lru_put(struct _ok_lru *lru, const void *key, size_t key_size,
+                            ok_hash_t key_hash, const void *value, size_t value_size);
+
+OK_LIB_API bool _ok_lru_get(struct _ok_lru *lru, const void *key, ok_hash_t key_hash,
+                            void *value, size_t value_size);
+
+OK_LIB_API void _ok_lru_get_ptr(struct _ok_lru *lru, const void *key, ok_hash_t key_hash,
+                                void **value_ptr);
+
+OK_LIB_API bool _ok_lru_contains(const struct _ok_lru *lru, const void *key, ok_hash_t key_hash);
+
+OK_LIB_API bool _ok_lru_remove(struct _ok_lru *lru, const void *key, ok_hash_t key_hash);
+
+OK_LIB_API void *_ok_lru_next(const struct _ok_lru *lru, void *iterator, void *key,
+                              size_t key_size, void *value, size_t value_size);
+
+OK_LIB_API struct _ok_queue_block *_ok_queue_new_block(const struct _ok_queue *queue,
+                                                       size_t value_size);
+
+OK_LIB_API void _ok_queue_free_block(struct _ok_queue_block *block);
+
+OK_LIB_API struct _ok_queue_block *_ok_queue_get_free_block(struct _ok_queue *queue,
+                                                            size_t value_size);
+
+OK_LIB_API void _ok_queue_release_free_block(struct _ok_queue *queue,
+                                             struct _ok_queue_block *block);
+
+OK_LIB_API void _ok_queue_set_value(void *values, size_t value_size, size_t index, void *value);
+
+OK_LIB_API void _ok_queue_get_value(void *values, size_t value_size, size_t index, void *value);
+
+OK_LIB_API bool _ok_queue_pop(struct _ok_queue *queue, size_t value_size, void *value);
+
+OK_LIB_API void _ok_queue_push(struct _ok_queue *queue, size_t value_size, void *value);
+
+OK_LIB_API void _ok_queue_init(struct _ok_queue *queue, size_t value_size, size_t capacity);
+
+OK_LIB_API void _ok_queue_deinit(struct _ok_queue *queue, size_t value_size,
+                                 void (*deallocator)(void *));
+
+OK_LIB_API struct _ok_cmap *_ok_cmap_create(size_t segment_count,
+                                            bool (*key_equals_func)(const void *key1,
+                                                                    const void *key2),
+                                            size_t key_offset, size_t key_size,
+                                            size_t value_offset, size_t value_size,
+                                            size_t bucket_stride);
+
+OK_LIB_API void _ok_cmap_free(struct _ok_cmap *map);
+
+OK_LIB_API void _ok_cmap_free_retired(struct _ok_cmap *map);
+
+OK_LIB_API size_t _ok_cmap_count(struct _ok_cmap *map);
+
+OK_LIB_API bool _ok_cmap_get(struct _ok_cmap *map, const void *key, ok_hash_t key_hash,
+                             void *value);
+
+OK_LIB_API bool _ok_cmap_put(struct _ok_cmap *map, const void *key, ok_hash_t key_hash,
+                             const void *value);
+
+OK_LIB_API bool _ok_cmap_get_or_insert(struct _ok_cmap *map, const void *key, ok_hash_t key_hash,
+                                       void *value, bool *inserted);
+
+OK_LIB_API bool _ok_cmap_update(struct _ok_cmap *map, const void *key, ok_hash_t key_hash,
+                                void (*update_func)(void *value, bool exists, void *context),
+                                void *context);
+
+OK_LIB_API bool _ok_cmap_remove(struct _ok_cmap *map, const void *key, ok_hash_t key_hash);
+
+OK_LIB_API struct _ok_agg *_ok_agg_create(size_t worker_count, size_t shard_count,
+                                          bool (*key_equals_func)(const void *key1,
+                                                                  const void *key2),
+                                          size_t key_offset, size_t key_size,
+                                          size_t value_offset, size_t value_size,
+                                          size_t bucket_stride);
+
+OK_LIB_API void _ok_agg_free(struct _ok_agg *agg);
+
+OK_LIB_API bool _ok_agg_update(struct _ok_agg *agg, size_t worker, const void *key,
+                               ok_hash_t key_hash,
+                               void (*update_func)(void *value, bool exists, void *context),
+                               void *context);
+
+OK_LIB_API void *_ok_agg_entry(struct _ok_agg *agg, size_t worker, const void *key,
+                               ok_hash_t key_hash, bool *inserted);
+
+OK_LIB_API bool _ok_agg_merge(struct _ok_agg *agg,
+                              void (*combine_func)(void *value, const void *new_value,
+                                                   void *context),
+                              void *context);
+
+OK_LIB_API size_t _ok_agg_count(const struct _ok_agg *agg);
+
+OK_LIB_API bool _ok_agg_get(const struct _ok_agg *agg, const void *key, ok_hash_t key_hash,
+                            void *value, size_t value_size);
+
+OK_LIB_API void *_ok_agg_next(const struct _ok_agg *agg, size_t *shard, void *iterator,
+                              void *key, size_t key_size, void *value, size_t value_size);
+
+// MARK: Implementation: Hash functions
+
+#ifdef OK_LIB_DEFINE
+
+#if defined(__GNUC__)
+#  pragma GCC diagnostic push
+#  pragma GCC diagnostic ignored "-Wunused-function"
+#elif defined (_MSC_VER)
+#  pragma warning(push)
+#  pragma warning(disable:4505)
+#endif
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#  include <intrin.h> // _umul128
+#endif
+
+// Integer hash functions from Wang http://www.cris.com/~Ttwang/tech/inthash.htm
+
+OK_LIB_API ok_hash_t ok_uint8_hash(uint8_t key) {
+    return ok_uint32_hash(key);
+}
+
+OK_LIB_API ok_hash_t ok_int8_hash(int8_t key) {
+    return ok_uint32_hash((uint32_t)key);
+}
+
+OK_LIB_API ok_hash_t ok_uint16_hash(uint16_t key) {
+    return ok_uint32_hash(key);
+}
+
+OK_LIB_API ok_hash_t ok_int16_hash(int16_t key) {
+    return ok_uint32_hash((uint32_t)key);
+}
+
+OK_LIB_API ok_hash_t ok_uint32_hash(uint32_t key) {
+#ifdef OK_LIB_USE_64BIT_HASH
+    // Use the 64-bit hash so that the upper bits are mixed, too.
+    return ok_uint64_hash(key);
+#else
+    key += ~(key << 16);
+    key ^=  (key >> 5);
+    key +=  (key << 3);
+    key ^=  (key >> 13);
+    key += ~(key << 9);
+    key ^=  (key >> 17);
+    return key;
+#endif
+}
+
+OK_LIB_API ok_hash_t ok_int32_hash(int32_t key) {
+    return ok_uint32_hash((uint32_t)key);
+}
+
+OK_LIB_API ok_hash_t ok_float_hash(float key) {
+    uint32_t int_key;
+    ok_static_assert(sizeof(key) == sizeof(int_key), "float must be be 32-bit");
+    memcpy(&int_key, &key, sizeof(int_key));
+    return ok_uint32_hash(int_key);
+}
+
+OK_LIB_API ok_hash_t ok_uint64_hash(uint64_t key) {
+    key += ~(key << 34);
+    key ^=  (key >> 29);
+    key += ~(key << 11);
+    key ^=  (key >> 14);
+    key += ~(key <<  7);
+    key ^=  (key >> 28);
+    key += ~(key << 26);
+    return (ok_hash_t)key;
+}
+
+OK_LIB_API ok_hash_t ok_int64_hash(int64_t key) {
+    return ok_uint64_hash((uint64_t)key);
+}
+
+OK_LIB_API ok_hash_t ok_double_hash(double key) {
+    uint64_t int_key;
+    ok_static_assert(sizeof(key) == sizeof(int_key), "double must be 64-bit");
+    memcpy(&int_key, &key, sizeof(int_key));
+    return ok_uint64_hash(int_key);
+}
+
+// Byte array hash based on wyhash (final version 4) by Wang Yi https://github.com/wangyi-fudan/wyhash
+
+// 64x64->128-bit multiply. On return, `a` is the low 64 bits and `b` is the high 64 bits.
+static inline void _ok_hash_mum(uint64_t *a, uint64_t *b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    *a = _umul128(*a, *b, b);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32);
+    uint64_t c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    *a = lo;
+    *b = hi;
+#endif
+}
+
+static inline uint64_t _ok_hash_mix(uint64_t a, uint64_t b) {
+    _ok_hash_mum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t _ok_hash_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t _ok_hash_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t _ok_hash_bytes(const void *data, size_t length, uint64_t seed) {
+    static const uint64_t secret[4] = {
+        0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+    };
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t a;
+    uint64_t b;
+    seed ^= _ok_hash_mix(seed ^ secret[0], secret[1]);
+    if (length <= 16) {
+        if (length >= 4) {
+            // Two overlapping reads from each end cover 4 to 16 bytes
+            size_t offset = (length >> 3) << 2;
+            a = (_ok_hash_read32(p) << 32) | _ok_hash_read32(p + offset);
+            b = (_ok_hash_read32(p + length - 4) << 32) | _ok_hash_read32(p + length - 4 - offset);
+        } else if (length > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = length;
+        if (i > 48) {
+            // Three independent lanes, so the multiplies can run in parallel
+            uint64_t seed1 = seed;
+            uint64_t seed2 = seed;
+            do {
+                seed = _ok_hash_mix(_ok_hash_read64(p) ^ secret[1],
+                                    _ok_hash_read64(p + 8) ^ seed);
+                seed1 = _ok_hash_mix(_ok_hash_read64(p + 16) ^ secret[2],
+                                     _ok_hash_read64(p + 24) ^ seed1);
+                seed2 = _ok_hash_mix(_ok_hash_read64(p + 32) ^ secret[3],
+                                     _ok_hash_read64(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16) {
+            seed = _ok_hash_mix(_ok_hash_read64(p) ^ secret[1], _ok_hash_read64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        // The last 16 bytes, which may overlap bytes that were already read
+        a = _ok_hash_read64(p + i - 16);
+        b = _ok_hash_read64(p + i - 8);
+    }
+    a ^= secret[1];
+    b ^= seed;
+    _ok_hash_mum(&a, &b);
+    return _ok_hash_mix(a ^ secret[0] ^ length, b ^ secret[1]);
+}
+
+OK_LIB_API ok_hash_t ok_hash_bytes_seeded(const void *data, size_t length, uint64_t seed) {
+    return (ok_hash_t)_ok_hash_bytes(data, length, seed);
+}
+
+OK_LIB_API ok_hash_t ok_hash_bytes(const void *data, size_t length) {
+    return (ok_hash_t)_ok_hash_bytes(data, length, 0);
+}
+
+OK_LIB_API ok_hash_t ok_const_str_hash(const char *key) {
+    return (ok_hash_t)_ok_hash_bytes(key, strlen(key), 0);
+}
+
+OK_LIB_API ok_hash_t ok_strview_hash(ok_strview_t key) {
+    return (ok_hash_t)_ok_hash_bytes(key.ptr, key.len, 0);
+}
+
+OK_LIB_API ok_hash_t ok_str_hash(char *key) {
+    return ok_const_str_hash(key);
+}
+
+OK_LIB_API ok_hash_t ok_const_ptr_hash(const void *key) {
+#if UINTPTR_MAX == UINT32_MAX
+    uint32_t int_key;
+    memcpy(&int_key, &key, sizeof(int_key));
+    return ok_uint32_hash(int_key);
+#elif UINTPTR_MAX == UINT64_MAX
+    uint64_t int_key;
+    memcpy(&int_key, &key, sizeof(int_key));
+    return ok_uint64_hash(int_key);
+#else
+    ok_static_assert(false, "Unknown pointer size");
+    return 0;
+#endif
+}
+
+OK_LIB_API ok_hash_t ok_ptr_hash(void *key) {
+    return ok_const_ptr_hash(key);
+}
+
+OK_LIB_API ok_hash_t ok_hash_combine(ok_hash_t hash_a, ok_hash_t hash_b) {
+#ifdef OK_LIB_USE_64BIT_HASH
+    return hash_a ^ (hash_b + 0x9e3779b97f4a7c15ull + (hash_a << 6) + (hash_a >> 2));
+#else
+    return hash_a ^ (hash_b + 0x9e3779b9 + (hash_a << 6) + (hash_a >> 2));
+#endif
+}
+
+// MARK: Implementation: Equals functions
+
+OK_LIB_API bool ok_8bit_equals(const void *v1, const void *v2) {
+    uint8_t a = *(const uint8_t *)v1;
+    uint8_t b = *(const uint8_t *)v2;
+    return a == b;
+}
+
+OK_LIB_API bool ok_16bit_equals(const void *v1, const void *v2) {
+    uint16_t a = *(const uint16_t *)v1;
+    uint16_t b = *(const uint16_t *)v2;
+    return a == b;
+}
+
+OK_LIB_API bool ok_32bit_equals(const void *v1, const void *v2) {
+    uint32_t a = *(const uint32_t *)v1;
+    uint32_t b = *(const uint32_t *)v2;
+    return a == b;
+}
+
+OK_LIB_API bool ok_64bit_equals(const void *v1, const void *v2) {
+    uint64_t a = *(const uint64_t *)v1;
+    uint64_t b = *(const uint64_t *)v2;
+    return a == b;
+}
+
+OK_LIB_API bool ok_str_equals(const void *a, const void *b) {
+    const char *str1 = *(const char * const *)a;
+    const char *str2 = *(const char * const *)b;
+
+    return str1 == str2 || strcmp(str1, str2) == 0;
+}
+
+OK_LIB_API bool ok_strview_equals(const void *a, const void *b) {
+    const ok_strview_t *view1 = (const ok_strview_t *)a;
+    const ok_strview_t *view2 = (const ok_strview_t *)b;
+
+    return (view1->len == view2->len &&
+            (view1->len == 0 || view1->ptr == view2->ptr ||
+             memcmp(view1->ptr, view2->ptr, view1->len) == 0));
+}
+
+OK_LIB_API bool ok_ptr_equals(const void *v1, const void *v2) {
+    const void *a = *(const void * const *)v1;
+    const void *b = *(const void * const *)v2;
+    return a == b;
+}
+
+// MARK: Implementation: Private vector functions
+
+OK_LIB_API bool _ok_vec_realloc(void **values, size_t min_capacity,
+                                size_t element_size, size_t *capacity) {
+    const size_t capacity_2 = *capacity << 1;
+    min_capacity = min_capacity < 8 ? 8 : min_capacity;
+    const size_t new_capacity = capacity_2 > min_capacity ? capacity_2 : min_capacity;
+    void *new_values = realloc(*values, element_size * new_capacity);
+    if (new_values) {
+        *values = new_values;
+        *capacity = new_capacity;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+// MARK: Implementation: Private map functions
+
+/*
+ Hashtable implementation notes:
+ 1) Open addressing
+ 2) Linear probing
+ 3) Cleanup on deletion (no lazy deletion)
+
+ Only the lower 31 bits of the hash are used. The upper bit is the "occupied" flag.
+
+ Group probing (OK_MAP_OPTION_GROUP_PROBING) is based on Abseil's "Swiss tables". A control byte
+ array is kept alongside the buckets. Each control byte is either empty, deleted, or the top 7 bits
+ of the hash of an occupied bucket. Control bytes are compared 16 at a time, and the probe sequence
+ is triangular over groups of 16. The first 16 control bytes are mirrored at the end of the array
+ so that a group can start at any bucket. Deletion leaves a tombstone unless the bucket was never
+ part of a full group, so no entries are moved.
+
+ Robin Hood probing (OK_MAP_OPTION_ROBIN_HOOD) uses the linear layout. The probe distance of an
+ entry is not stored; it is calculated from the stored hash. Insertion shifts the rest of the
+ cluster forward by one bucket, which is equivalent to swapping "richer" entries forward, and
+ backward-shift deletion stops at the first entry that is in its home bucket.
+
+ Incremental resize (OK_MAP_OPTION_INCREMENTAL_RESIZE) keeps the old map in `old_map` while
+ entries are moved to the new buckets. Entries are in exactly one of the two maps, and new entries
+ are only added to the new map. With linear probing, whole clusters (runs of occupied buckets) are
+ moved at once, starting after an empty bucket, so probe sequences in the old map are never broken.
+ With group probing, moved buckets become tombstones.
+
+ Frozen maps (ok_map_freeze) use a perfect hash based on CHD ("hash, displace, and compress",
+ without the compression) and PTHash. Keys are divided into groups of about four by their mixed
+ hash, and each group has a displacement, chosen when the map is frozen, that sends every key in the
+ group to a bucket no other key uses. The largest groups are placed first. A lookup reads the
+ group's displacement and checks one bucket. The load factor is 0.99, because placing the last few
+ keys of a minimal perfect hash is slow. Keys with the same full hash can't be separated by any
+ function of the hash, so only the first key of each hash is placed with the perfect hash. The
+ others are stored after the perfect-hash buckets, sorted by hash.
+
+ Insertion-ordered maps (OK_MAP_OPTION_INSERTION_ORDER) use `buckets` as a dense array of
+ `max_count` entries, filled in order, and `index` as the linear-probing table. Each index slot is
+ 0 (empty) or the dense bucket index + 1. Removal clears the dense bucket (counted in
+ `deleted_count`, so the usual "many tombstones" resize removes the holes) and does backward-shift
+ deletion in the index, using the hashes stored in the dense buckets.
+
+ Split values (OK_MAP_OPTION_SPLIT_VALUES) use `buckets` for the hash and key only, so
+ `bucket_stride` is the size of the hash and key, rounded up to keep them aligned. The value of the
+ bucket at index i is at `values + i * value_stride`. Code that moves a bucket also moves its value.
+
+ Maps created with a capacity of at most OK_MAP_SMALL_CAPACITY (including the default) start small,
+ except group-probing, Robin Hood, and insertion-ordered maps, which always use their own layout
+ (see _ok_map_small_allowed()). A small map is one allocation, with the buckets after the map
+ struct, and its entries are kept in the first `count` buckets: a lookup scans them, a put appends,
+ and a remove moves the last entry into the hole. A small map never resizes incrementally; when it
+ is full, the next new key copies it to a hashed map.
+
+ A resize that moves every entry at once (not incremental) places each entry by its stored hash,
+ without comparing keys, since the keys are known to be unique. With OK_LIB_USE_THREADS, a linear
+ probing (or Robin Hood) map that grows to at least OK_MAP_PARALLEL_RESIZE_MIN_CAPACITY buckets is
+ filled on several threads. The new buckets are split into ranges, one per thread. The entries
+ whose home bucket is in a range are found in one span of the old buckets, because entries are
+ only ever probed forward. An entry that would be placed (or would shift entries) past the end of
+ its range is deferred, and the deferred entries are placed after the threads finish.
+
+ References:
+ * https://en.wikipedia.org/wiki/Open_addressing
+ * http://research.cs.vt.edu/AVresearch/hashing/index.php
+ * https://abseil.io/about/design/swisstables
+ * http://cmph.sourceforge.net/papers/esa09.pdf
+ * https://arxiv.org/abs/2104.10402
+ */
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define OK_MAP_GROUP_SSE2
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#  include <arm_neon.h>
+#  define OK_MAP_GROUP_NEON
+#endif
+#if defined(_MSC_VER)
+#  include <intrin.h>
+#endif
+#if defined(OK_LIB_USE_THREADS)
+#  if defined(_WIN32)
+#    ifndef WIN32_LEAN_AND_MEAN
+#      define WIN32_LEAN_AND_MEAN
+#    endif
+#    if defined(_MSC_VER)
+#      pragma warning(push, 0)
+#    endif
+#    include <windows.h>
+#    if defined(_MSC_VER)
+#      pragma warning(pop)
+#    endif
+#  else
+#    include <pthread.h>
+#    include <unistd.h> // sysconf
+#  endif
+#endif
+
+#define OK_MAP_GROUP_WIDTH 16
+#define OK_MAP_SMALL_CAPACITY 8
+
+static const ok_hash_t OK_MAP_OCCUPIED_FLAG = (ok_hash_t)1 << (sizeof(ok_hash_t) * 8 - 1);
+static const size_t OK_MAP_MIN_CAPACITY = 32;
+static const size_t OK_MAP_SMALL_ALIGNMENT = 16;
+static const float OK_MAP_DEFAULT_MAX_LOAD = 0.75f;
+static const float OK_MAP_ROBIN_HOOD_MAX_LOAD = 0.9f;
+static const float OK_MAP_MIN_MAX_LOAD = 0.1f;
+static const float OK_MAP_MAX_MAX_LOAD = 0.95f;
+static const uint8_t OK_MAP_CTRL_EMPTY = 0x80;
+static const uint8_t OK_MAP_CTRL_DELETED = 0xfe;
+static const size_t OK_MAP_MIGRATE_STEP = 16;
+static const size_t OK_MAP_FROZEN_GROUP_SIZE = 4;
+static const size_t OK_MAP_FROZEN_KEYS_PER_EMPTY_BUCKET = 100;
+#if defined(OK_LIB_USE_THREADS)
+static const size_t OK_MAP_PARALLEL_RESIZE_MIN_CAPACITY = (size_t)1 << 20;
+static const size_t OK_MAP_PARALLEL_BUILD_MIN_COUNT = (size_t)1 << 16;
+static const size_t OK_MAP_PARALLEL_MAX_THREADS = 8;
+#endif
+
+struct _ok_map {
+    void *buckets;
+    uint8_t *ctrl; // Control bytes, if using group probing. Otherwise, NULL.
+
+    size_t key_offset;
+    size_t value_offset;
+    size_t bucket_stride;
+
+    // Split values: the value array, parallel to the buckets, and its stride. Otherwise, NULL.
+    void *values;
+    size_t value_stride;
+
+    size_t capacity_n;
+    size_t capacity_mask;
+    size_t max_count;
+    // Small maps: the entries are in the first `count` buckets, which are allocated after the map
+    // (unless opened from a file). Lookups scan the buckets.
+    bool small;
+    // The count and deleted_count are the only members that are mutated after _ok_map_init(),
+    // other than the incremental resize members.
+    size_t count;
+    size_t deleted_count;
+
+    // Incremental resize: the old map, and the next bucket index of the old map to move.
+    struct _ok_map *old_map;
+    size_t migrate_index;
+
+    // Frozen maps: the displacement of each group, and the number of buckets addressed by the
+    // perfect hash. The overflow buckets, sorted by hash, follow the perfect-hash buckets.
+    uint32_t *displacements;
+    size_t displacement_count;
+    size_t perfect_count;
+    size_t overflow_count;
+    bool frozen;
+
+    // Insertion-ordered maps: the index table, with `index_width`-byte slots, and the number of
+    // dense buckets used (including holes).
+    void *index;
+    size_t index_width;
+    size_t dense_count;
+
+    // Maps opened from a file: the file mapping, which contains the arrays above.
+    void *mapping;
+    size_t mapping_size;
+
+    bool (*key_equals_func)(const void *key1, const void *key2);
+
+    float max_load_factor;
+    unsigned int options;
+};
+
+static inline void _ok_prefetch(const void *ptr) {
+#if defined(__GNUC__)
+    __builtin_prefetch(ptr);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_prefetch((const char *)ptr, _MM_HINT_T0);
+#else
+    (void)ptr;
+#endif
+}
+
+// Index of the lowest set bit. The value must not be zero.
+static inline unsigned int _ok_ctz32(uint32_t value) {
+#if defined(__GNUC__)
+    return (unsigned int)__builtin_ctz(value);
+#elif defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (unsigned int)index;
+#else
+    unsigned int index = 0;
+    while ((value & 1) == 0) {
+        value >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+// Index of the highest set bit. The value must not be zero.
+static inline unsigned int _ok_bsr32(uint32_t value) {
+#if defined(__GNUC__)
+    return 31u - (unsigned int)__builtin_clz(value);
+#elif defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse(&index, value);
+    return (unsigned int)index;
+#else
+    unsigned int index = 0;
+    while (value >>= 1) {
+        index++;
+    }
+    return index;
+#endif
+}
+
+// The 7 bits of the hash stored in the control byte. The bucket index is the low bits of the hash,
+// which in a large table may include every bit below the occupied flag. So the hash is mixed
+// first: the top bits of the product depend on all bits of the hash, including the low bits that
+// differ between the entries of a group.
+static inline uint8_t _ok_map_h2(ok_hash_t hash) {
+#ifdef OK_LIB_USE_64BIT_HASH
+    return (uint8_t)((hash * 0x9e3779b97f4a7c15ull) >> 57);
+#else
+    return (uint8_t)((hash * 0x9e3779b1u) >> 25);
+#endif
+}
+
+#if defined(OK_MAP_GROUP_NEON)
+static inline uint32_t _ok_map_neon_mask(uint8x16_t matches) {
+    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    matches = vandq_u8(matches, vld1q_u8(bits));
+    return (uint32_t)vaddv_u8(vget_low_u8(matches)) |
+        ((uint32_t)vaddv_u8(vget_high_u8(matches)) << 8);
+}
+#endif
+
+// Gets a 16-bit mask of the control bytes in the group that are equal to the value.
+static inline uint32_t _ok_map_group_match(const uint8_t *group, uint8_t value) {
+#if defined(OK_MAP_GROUP_SSE2)
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)(const void *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)value)));
+#elif defined(OK_MAP_GROUP_NEON)
+    return _ok_map_neon_mask(vceqq_u8(vld1q_u8(group), vdupq_n_u8(value)));
+#else
+    uint32_t mask = 0;
+    for (unsigned int i = 0; i < OK_MAP_GROUP_WIDTH; i++) {
+        mask |= (uint32_t)(group[i] == value) << i;
+    }
+    return mask;
+#endif
+}
+
+// Gets a 16-bit mask of the control bytes in the group that are empty or deleted.
+static inline uint32_t _ok_map_group_match_free(const uint8_t *group) {
+#if defined(OK_MAP_GROUP_SSE2)
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(const void *)group));
+#elif defined(OK_MAP_GROUP_NEON)
+    return _ok_map_neon_mask(vcltq_s8(vreinterpretq_s8_u8(vld1q_u8(group)), vdupq_n_s8(0)));
+#else
+    uint32_t mask = 0;
+    for (unsigned int i = 0; i < OK_MAP_GROUP_WIDTH; i++) {
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+// Frozen maps: mixes the hash so that the group and the bucket of a key are independent.
+static inline uint64_t _ok_map_frozen_mix(uint64_t value) {
+    value ^= value >> 32;
+    value *= 0xd6e8feb86659fd93ull;
+    value ^= value >> 32;
+    value *= 0xd6e8feb86659fd93ull;
+    value ^= value >> 32;
+    return value;
+}
+
+// Skewed, like PTHash: 60% of keys are in the first 30% of groups. The dense groups are placed
+// first, while most buckets are free, so the groups placed last are mostly single keys.
+static inline size_t _ok_map_frozen_group(uint64_t mixed_hash, size_t group_count) {
+    const uint64_t dense_limit = 0x9999999aull; // 0.6 * 2^32
+    const uint64_t dense_count = (group_count * 3) / 10;
+    const uint64_t value = mixed_hash >> 32;
+    return (size_t)(value < dense_limit ?
+                    (value * dense_count) / dense_limit :
+                    dense_count + (((value - dense_limit) * (group_count - dense_count)) /
+                                   (0x100000000ull - dense_limit)));
+}
+
+static inline size_t _ok_map_frozen_index(uint64_t mixed_hash, uint32_t displacement,
+                                          size_t perfect_count) {
+    uint64_t value = (mixed_hash ^ (displacement * 0x9e3779b97f4a7c15ull)) * 0xd6e8feb86659fd93ull;
+    return (size_t)(((value >> 32) * perfect_count) >> 32);
+}
+
+// The number of buckets. For frozen maps, this may not be a power of two.
+static inline size_t _ok_map_bucket_count(const struct _ok_map *map) {
+    return (map->frozen ? map->perfect_count + map->overflow_count :
+            map->index ? map->dense_count : (size_t)1 << map->capacity_n);
+}
+
+// Split values: the bucket stride without the value. The key offset is the alignment of the
+// hash and key, because the key is at the first offset after the hash that is aligned for the key.
+static size_t _ok_map_split_bucket_stride(size_t key_offset, size_t value_offset) {
+    return (value_offset + key_offset - 1) / key_offset * key_offset;
+}
+
+static inline void *_ok_map_value(const struct _ok_map *map, const void *entry) {
+    if (map->values) {
+        // During an incremental resize, the entry may be in the old map. The buckets are separate
+        // allocations, so check the old map's bucket range rather than the offset in the new map.
+        const struct _ok_map *old_map = map->old_map;
+        if (old_map) {
+            const size_t old_size = _ok_map_bucket_count(old_map) * old_map->bucket_stride;
+            if ((uintptr_t)entry >= (uintptr_t)old_map->buckets &&
+                (uintptr_t)entry < (uintptr_t)OK_PTR_INC(old_map->buckets, old_size)) {
+                map = old_map;
+            }
+        }
+        size_t index = OK_OFFSETOF(map->buckets, entry) / map->bucket_stride;
+        return OK_PTR_INC(map->values, index * map->value_stride);
+    }
+    return OK_PTR_INC(entry, map->value_offset);
+}
+
+// Moves a bucket (and its value) to another bucket of the same map.
+static void _ok_map_move_entry(struct _ok_map *map, void *entry, const void *from_entry) {
+    memcpy(entry, from_entry, map->bucket_stride);
+    if (map->values) {
+        memcpy(_ok_map_value(map, entry), _ok_map_value(map, from_entry), map->value_stride);
+    }
+}
+
+// Copies the key and value (not the hash) of an entry to an entry of a map with the same layout.
+static void _ok_map_copy_entry(struct _ok_map *map, void *entry, const struct _ok_map *from_map,
+                               const void *from_entry) {
+    memcpy(OK_PTR_INC(entry, sizeof(ok_hash_t)), OK_PTR_INC(from_entry, sizeof(ok_hash_t)),
+           map->bucket_stride - sizeof(ok_hash_t));
+    if (map->values) {
+        memcpy(_ok_map_value(map, entry), _ok_map_value(from_map, from_entry),
+               map->value_stride);
+    }
+}
+
+// Insertion-ordered maps: the smallest index slot width, in bytes, for dense indexes up to max_count.
+static size_t _ok_map_index_width(size_t max_count) {
+    if (max_count < UINT8_MAX) {
+        return 1;
+    } else if (max_count < UINT16_MAX) {
+        return 2;
+    } else if ((uint64_t)max_count < UINT32_MAX) {
+        return 4;
+    } else {
+        return 8;
+    }
+}
+
+static inline size_t _ok_map_index_get(const struct _ok_map *map, size_t i) {
+    switch (map->index_width) {
+        case 1: return ((const uint8_t *)map->index)[i];
+        case 2: return ((const uint16_t *)map->index)[i];
+        case 4: return ((const uint32_t *)map->index)[i];
+        default: return (size_t)((const uint64_t *)map->index)[i];
+    }
+}
+
+static inline void _ok_map_index_set(struct _ok_map *map, size_t i, size_t value) {
+    switch (map->index_width) {
+        case 1: ((uint8_t *)map->index)[i] = (uint8_t)value; break;
+        case 2: ((uint16_t *)map->index)[i] = (uint16_t)value; break;
+        case 4: ((uint32_t *)map->index)[i] = (uint32_t)value; break;
+        default: ((uint64_t *)map->index)[i] = (uint64_t)value; break;
+    }
+}
+
+// Sets the first empty index slot in the probe sequence of the hash to point to a dense bucket.
+static void _ok_map_index_insert(struct _ok_map *map, ok_hash_t hash, size_t dense_index) {
+    size_t i = (size_t)(hash & map->capacity_mask);
+    while (_ok_map_index_get(map, i) != 0) {
+        i = (i + 1) & map->capacity_mask;
+    }
+    _ok_map_index_set(map, i, dense_index + 1);
+}
+
+static void _ok_map_file_unmap(void *mapping, size_t mapping_size);
+
+// Frees the buckets and the other arrays, which may be in a mapped file.
+static void _ok_map_free_arrays(struct _ok_map *map) {
+    if (map->mapping) {
+        _ok_map_file_unmap(map->mapping, map->mapping_size);
+        map->mapping = NULL;
+        map->mapping_size = 0;
+    } else {
+        if (!map->small) {
+            free(map->buckets);
+            free(map->values);
+        }
+        free(map->ctrl);
+        free(map->displacements);
+        free(map->index);
+    }
+    map->buckets = NULL;
+    map->ctrl = NULL;
+    map->displacements = NULL;
+    map->index = NULL;
+    map->values = NULL;
+    map->small = false;
+}
+
+// The number of entries a map with the capacity holds before it grows. There is always at least
+// one free bucket (for _ok_map_find_entry).
+static size_t _ok_map_max_count(size_t capacity, float max_load_factor) {
+    size_t max_count = (size_t)((float)capacity * max_load_factor);
+    return (max_count >= capacity ? capacity - 1 : max_count);
+}
+
+static size_t _ok_map_small_align(size_t size) {
+    return (size + OK_MAP_SMALL_ALIGNMENT - 1) & ~(OK_MAP_SMALL_ALIGNMENT - 1);
+}
+
+static void _ok_map_set_ctrl(struct _ok_map *map, size_t index, uint8_t value) {
+    map->ctrl[index] = value;
+    if (index < OK_MAP_GROUP_WIDTH) {
+        map->ctrl[index + map->capacity_mask + 1] = value;
+    }
+}
+
+// Whether maps with these options can be small. The options that choose a probing layout are kept
+// for every map size.
+static inline bool _ok_map_small_allowed(unsigned int options) {
+    return (options & (OK_MAP_OPTION_GROUP_PROBING | OK_MAP_OPTION_ROBIN_HOOD |
+                       OK_MAP_OPTION_INSERTION_ORDER)) == 0;
+}
+
+static struct _ok_map *_ok_map_init(struct _ok_map *map, size_t initial_capacity) {
+    map->count = 0;
+    const bool insertion_order = (map->options & OK_MAP_OPTION_INSERTION_ORDER) != 0;
+    const bool small = (initial_capacity <= OK_MAP_SMALL_CAPACITY &&
+                        _ok_map_small_allowed(map->options));
+    if (small) {
+        initial_capacity = OK_MAP_SMALL_CAPACITY;
+    } else if (initial_capacity < OK_MAP_MIN_CAPACITY) {
+        initial_capacity = OK_MAP_MIN_CAPACITY;
+    }
+    size_t capacity_n = 0;
+    while (((size_t)1 << capacity_n) < initial_capacity) {
+        capacity_n++;
+    }
+    size_t capacity = ((size_t)1 << capacity_n);
+    size_t max_count = _ok_map_max_count(capacity, map->max_load_factor);
+
+    if (small) {
+        // One allocation: the map, the buckets, then the values (if split). Every bucket is used.
+        max_count = capacity;
+        size_t map_size = _ok_map_small_align(sizeof(struct _ok_map));
+        size_t buckets_size = _ok_map_small_align(capacity * map->bucket_stride);
+        size_t size = map_size + buckets_size + capacity * map->value_stride;
+        struct _ok_map *small_map = (struct _ok_map *)realloc(map, size);
+        if (small_map) {
+            map = small_map;
+            map->buckets = OK_PTR_INC(map, map_size);
+            memset(map->buckets, 0, size - map_size);
+            if (map->options & OK_MAP_OPTION_SPLIT_VALUES) {
+                map->values = OK_PTR_INC(map->buckets, buckets_size);
+            }
+            map->small = true;
+        }
+    } else {
+        map->buckets = calloc(insertion_order ? max_count : capacity, map->bucket_stride);
+    }
+    if (map->buckets && !small && (map->options & OK_MAP_OPTION_SPLIT_VALUES)) {
+        map->values = calloc(capacity, map->value_stride);
+        if (!map->values) {
+            free(map->buckets);
+            map->buckets = NULL;
+        }
+    }
+    if (map->buckets && insertion_order) {
+        map->index_width = _ok_map_index_width(max_count);
+        map->index = calloc(capacity, map->index_width);
+        if (!map->index) {
+            free(map->buckets);
+            map->buckets = NULL;
+        }
+    }
+    if (map->buckets && !small && (map->options & OK_MAP_OPTION_GROUP_PROBING)) {
+        map->ctrl = (uint8_t *)malloc(capacity + OK_MAP_GROUP_WIDTH);
+        if (map->ctrl) {
+            memset(map->ctrl, OK_MAP_CTRL_EMPTY, capacity + OK_MAP_GROUP_WIDTH);
+        } else {
+            free(map->buckets);
+            free(map->values);
+            map->buckets = NULL;
+            map->values = NULL;
+        }
+    }
+    if (map->buckets) {
+        map->capacity_n = capacity_n;
+        map->capacity_mask = capacity - 1;
+        map->max_count = max_count;
+    } else {
+        free(map);
+        map = NULL;
+    }
+    return map;
+}
+
+static struct _ok_map *_ok_map_create_empty_copy(const struct _ok_map *from_map,
+                                                  size_t initial_capacity) {
+    struct _ok_map *map = (struct _ok_map *)calloc(1, sizeof(struct _ok_map));
+    if (map) {
+        map->key_equals_func = from_map->key_equals_func;
+        map->key_offset = from_map->key_offset;
+        map->value_offset = from_map->value_offset;
+        map->bucket_stride = from_map->bucket_stride;
+        map->value_stride = from_map->value_stride;
+        map->max_load_factor = from_map->max_load_factor;
+        map->options = from_map->options;
+        map = _ok_map_init(map, initial_capacity);
+    }
+    return map;
+}
+
+static void *_ok_map_group_find_entry(const struct _ok_map *map, const void *key,
+                                      ok_hash_t hash, void **empty_entry) {
+    const uint8_t h2 = _ok_map_h2(hash);
+    size_t group_index = (size_t)(hash & map->capacity_mask);
+    size_t probe_offset = 0;
+    void *free_entry = NULL;
+    while (true) {
+        const uint8_t *group = map->ctrl + group_index;
+        uint32_t matches = _ok_map_group_match(group, h2);
+        while (matches) {
+            size_t bucket_index = (group_index + _ok_ctz32(matches)) & map->capacity_mask;
+            void *bucket = OK_PTR_INC(map->buckets, bucket_index * map->bucket_stride);
+            if (hash == *(ok_hash_t *)(bucket) &&
+                map->key_equals_func(OK_PTR_INC(bucket, map->key_offset), key)) {
+                return bucket;
+            }
+            matches &= matches - 1;
+        }
+        if (empty_entry && !free_entry) {
+            uint32_t free_matches = _ok_map_group_match_free(group);
+            if (free_matches) {
+                size_t bucket_index = (group_index + _ok_ctz32(free_matches)) & map->capacity_mask;
+                free_entry = OK_PTR_INC(map->buckets, bucket_index * map->bucket_stride);
+            }
+        }
+        if (_ok_map_group_match(group, OK_MAP_CTRL_EMPTY)) {
+            if (empty_entry) {
+                *empty_entry = free_entry;
+            }
+            return NULL;
+        }
+        probe_offset += OK_MAP_GROUP_WIDTH; // Triangular probing over groups.
+        group_index = (group_index + probe_offset) & map->capacity_mask;
+    }
+}
+
+static void *_ok_map_frozen_find_entry(const struct _ok_map *map, const void *key,
+                                       ok_hash_t hash) {
+    if (map->perfect_count == 0) {
+        return NULL;
+    }
+    uint64_t mixed_hash = _ok_map_frozen_mix(hash);
+    uint32_t displacement = map->displacements[_ok_map_frozen_group(mixed_hash,
+                                                                    map->displacement_count)];
+    size_t bucket_index = _ok_map_frozen_index(mixed_hash, displacement, map->perfect_count);
+    void *bucket = OK_PTR_INC(map->buckets, bucket_index * map->bucket_stride);
+    if (hash != *(ok_hash_t *)(bucket)) {
+        // The first key of each hash is always in its perfect-hash bucket
+        return NULL;
+    } else if (map->key_equals_func(OK_PTR_INC(bucket, map->key_offset), key)) {
+        return bucket;
+    }
+    // Binary search the buckets with duplicate hashes
+    size_t low = map->perfect_count;
+    size_t high = map->perfect_count + map->overflow_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (*(ok_hash_t *)OK_PTR_INC(map->buckets, mid * map->bucket_stride) < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (; low < map->perfect_count + map->overflow_count; low++) {
+        bucket = OK_PTR_INC(map->buckets, low * map->bucket_stride);
+        if (hash != *(ok_hash_t *)(bucket)) {
+            break;
+        } else if (map->key_equals_func(OK_PTR_INC(bucket, map->key_offset), key)) {
+            return bucket;
+        }
+    }
+    return NULL;
+}
+
+// Finds an entry of an insertion-ordered map. The empty entry is the next dense bucket.
+static void *_ok_map_ordered_find_entry(const struct _ok_map *map, const void *key,
+                                        ok_hash_t hash, void **empty_entry) {
+    size_t i = (size_t)(hash & map->capacity_mask);
+    size_t slot;
+    while ((slot = _ok_map_index_get(map, i)) != 0) {
+        void *bucket = OK_PTR_INC(map->buckets, (slot - 1) * map->bucket_stride);
+        if (hash == *(ok_hash_t *)(bucket) &&
+            map->key_equals_func(OK_PTR_INC(bucket, map->key_offset), key)) {
+            return bucket;
+        }
+        i = (i + 1) & map->capacity_mask;
+    }
+    if (empty_entry) {
+        *empty_entry = OK_PTR_INC(map->buckets, map->dense_count * map->bucket_stride);
+    }
+    return NULL;
+}
+
+// Finds an entry of a small map. The hashes are compared first, without branches, and then the
+// keys of the matching hashes are compared. The empty entry is the bucket after the last entry.
+static void *_ok_map_small_find_entry(const struct _ok_map *map, const void *key,
+                                      ok_hash_t hash, void **empty_entry) {
+    ok_static_assert(OK_MAP_SMALL_CAPACITY <= 32, "The matches have one bit per entry");
+    uint32_t matches = 0;
+    for (size_t i = 0; i < map->count; i++) {
+        ok_hash_t flags_hash = *(ok_hash_t *)OK_PTR_INC(map->buckets, i * map->bucket_stride);
+        matches |= (uint32_t)(flags_hash == hash) << i;
+    }
+    while (matches) {
+        void *bucket = OK_PTR_INC(map->buckets, _ok_ctz32(matches) * map->bucket_stride);
+        if (map->key_equals_func(OK_PTR_INC(bucket, map->key_offset), key)) {
+            return bucket;
+        }
+        matches &= matches - 1;
+    }
+    if (empty_entry && map->count < map->max_count) {
+        *empty_entry = OK_PTR_INC(map->buckets, map->count * map->bucket_stride);
+    }
+    return NULL;
+}
+
+static void *_ok_map_find_entry(const struct _ok_map *map, const void *key,
+                                ok_hash_t key_hash, void **empty_entry) {
+    ok_hash_t hash = key_hash | OK_MAP_OCCUPIED_FLAG;
+    if (map->frozen) {
+        return _ok_map_frozen_find_entry(map, key, hash);
+    }
+    if (map->small) {
+        return _ok_map_small_find_entry(map, key, hash, empty_entry);
+    }
+    if (map->ctrl) {
+        return _ok_map_group_find_entry(map, key, hash, empty_entry);
+    }
+    if (map->index) {
+        return _ok_map_ordered_find_entry(map, key, hash, empty_entry);
+    }
+    const bool robin_hood = (map->options & OK_MAP_OPTION_ROBIN_HOOD) != 0;
+    size_t bucket_index = (size_t)(hash & map->capacity_mask);
+    size_t distance = 0;
+    while (true) {
+        void *bucket = OK_PTR_INC(map->buckets, bucket_index * map->bucket_stride);
+        ok_hash_t flags_hash = *(ok_hash_t *)(bucket);
+        if (hash == flags_hash &&
+            map->key_equals_func(OK_PTR_INC(bucket, map->key_offset), key)) {
+            return bucket;
+        } else if ((flags_hash & OK_MAP_OCCUPIED_FLAG) == 0 ||
+                   (robin_hood && ((bucket_index - flags_hash) & map->capacity_mask) < distance)) {
+            // With Robin Hood probing, the empty entry may be occupied. It is the insertion point.
+            if (empty_entry) {
+                *empty_entry = bucket;
+            }
+            return NULL;
+        }
+        bucket_index = (bucket_index + 1) & map->capacity_mask; // Linear probing.
+        distance++;
+    }
+}
+
+// Finds an entry in the map or its old map. The map may be NULL (not created yet).
+static void *_ok_map_lookup_entry(const struct _ok_map *map, const void *key,
+                                  ok_hash_t key_hash) {
+    if (!map) {
+        return NULL;
+    }
+    void *entry = _ok_map_find_entry(map, key, key_hash, NULL);
+    if (!entry && map->old_map) {
+        entry = _ok_map_find_entry(map->old_map, key, key_hash, NULL);
+    }
+    return entry;
+}
+
+// Finds a free bucket for a key that is known to not be in the map. No keys are compared.
+static void *_ok_map_find_free_entry(const struct _ok_map *map, ok_hash_t hash) {
+    if (map->index) {
+        return OK_PTR_INC(map->buckets, map->dense_count * map->bucket_stride);
+    }
+    if (map->small) {
+        return OK_PTR_INC(map->buckets, map->count * map->bucket_stride);
+    }
+    size_t bucket_index = (size_t)(hash & map->capacity_mask);
+    if (map->ctrl) {
+        size_t probe_offset = 0;
+        uint32_t free_matches;
+        while ((free_matches = _ok_map_group_match_free(map->ctrl + bucket_index)) == 0) {
+            probe_offset += OK_MAP_GROUP_WIDTH;
+            bucket_index = (bucket_index + probe_offset) & map->capacity_mask;
+        }
+        bucket_index = (bucket_index + _ok_ctz32(free_matches)) & map->capacity_mask;
+    } else {
+        const bool robin_hood = (map->options & OK_MAP_OPTION_ROBIN_HOOD) != 0;
+        size_t distance = 0;
+        while (true) {
+            ok_hash_t flags_hash = *(ok_hash_t *)OK_PTR_INC(map->buckets,
+                                                            bucket_index * map->bucket_stride);
+            if ((flags_hash & OK_MAP_OCCUPIED_FLAG) == 0 ||
+                (robin_hood && ((bucket_index - flags_hash) & map->capacity_mask) < distance)) {
+                break;
+            }
+            bucket_index = (bucket_index + 1) & map->capacity_mask;
+            distance++;
+        }
+    }
+    return OK_PTR_INC(map->buckets, bucket_index * map->bucket_stride);
+}
+
+// Marks a free entry as occupied. The caller sets the key and value.
+// With Robin Hood probing, the entry may be occupied, and the rest of its cluster is shifted.
+static void _ok_map_occupy_entry(struct _ok_map *map, void *entry, ok_hash_t key_hash) {
+    if (map->index) {
+        // The entry is the next dense bucket
+        key_hash |= OK_MAP_OCCUPIED_FLAG;
+        memcpy(entry, &key_hash, sizeof(ok_hash_t));
+        _ok_map_index_insert(map, key_hash, map->dense_count);
+        map->dense_count++;
+        map->count++;
+        return;
+    }
+    if (*(ok_hash_t *)(entry) & OK_MAP_OCCUPIED_FLAG) {
+        size_t i = OK_OFFSETOF(map->buckets, entry) / map->bucket_stride;
+        size_t j = i;
+        while (*(ok_hash_t *)OK_PTR_INC(map->buckets, j * map->bucket_stride) &
+               OK_MAP_OCCUPIED_FLAG) {
+            j = (j + 1) & map->capacity_mask;
+        }
+        while (j != i) {
+            size_t prev = (j - 1) & map->capacity_mask;
+            _ok_map_move_entry(map, OK_PTR_INC(map->buckets, j * map->bucket_stride),
+                               OK_PTR_INC(map->buckets, prev * map->bucket_stride));
+            j = prev;
+        }
+    }
+    key_hash |= OK_MAP_OCCUPIED_FLAG;
+    memcpy(entry, &key_hash, sizeof(ok_hash_t));
+    if (map->ctrl) {
+        size_t index = OK_OFFSETOF(map->buckets, entry) / map->bucket_stride;
+        if (map->ctrl[index] == OK_MAP_CTRL_DELETED) {
+            map->deleted_count--;
+        }
+        _ok_map_set_ctrl(map, index, _ok_map_h2(key_hash));
+    }
+    map->count++;
+}
+
+// Moves entries from the old map to the map, examining at least `step` buckets of the old map.
+// With linear probing, stops only at the end of a cluster.
+static void _ok_map_migrate(struct _ok_map *map, size_t step) {
+    struct _ok_map *old_map = map->old_map;
+    bool in_cluster = false;
+    while (old_map->count > 0 && (step > 0 || in_cluster)) {
+        void *old_entry = OK_PTR_INC(old_map->buckets, map->migrate_index * old_map->bucket_stride);
+        ok_hash_t flags_hash = *(ok_hash_t *)(old_entry);
+        bool occupied = (flags_hash & OK_MAP_OCCUPIED_FLAG) != 0;
+        if (occupied) {
+            void *entry = _ok_map_find_free_entry(map, flags_hash);
+            _ok_map_occupy_entry(map, entry, flags_hash);
+            _ok_map_copy_entry(map, entry, old_map, old_entry);
+            memset(old_entry, 0, sizeof(ok_hash_t));
+            if (old_map->ctrl) {
+                _ok_map_set_ctrl(old_map, map->migrate_index, OK_MAP_CTRL_DELETED);
+                old_map->deleted_count++;
+            }
+            old_map->count--;
+        }
+        in_cluster = occupied && !old_map->ctrl;
+        map->migrate_index = (map->migrate_index + 1) & old_map->capacity_mask;
+        if (step > 0) {
+            step--;
+        }
+    }
+    if (old_map->count == 0) {
+        _ok_map_free(old_map);
+        map->old_map = NULL;
+    }
+}
+
+// Starts an incremental resize. The map becomes the old map of a new, empty map.
+static bool _ok_map_begin_resize(struct _ok_map **map, size_t new_capacity) {
+    struct _ok_map *new_map = _ok_map_create_empty_copy(*map, new_capacity);
+    if (!new_map) {
+        return false;
+    }
+    new_map->old_map = *map;
+    new_map->migrate_index = 0;
+    if (!(*map)->ctrl) {
+        // Start after an empty bucket, so that clusters are always moved as a whole.
+        while (*(ok_hash_t *)OK_PTR_INC((*map)->buckets,
+                                        new_map->migrate_index * (*map)->bucket_stride) &
+               OK_MAP_OCCUPIED_FLAG) {
+            new_map->migrate_index++;
+        }
+    }
+    *map = new_map;
+    return true;
+}
+
+// Resizes an insertion-ordered map in place: the holes in the dense buckets are removed, the dense
+// buckets are reallocated, and the index is rebuilt. The new max count must be at least the count.
+static bool _ok_map_ordered_resize(struct _ok_map *map, size_t new_capacity) {
+    size_t max_count = _ok_map_max_count(new_capacity, map->max_load_factor);
+    size_t index_width = _ok_map_index_width(max_count);
+    void *index = calloc(new_capacity, index_width);
+    if (!index) {
+        return false;
+    }
+    if (max_count > map->max_count) {
+        void *buckets = realloc(map->buckets, max_count * map->bucket_stride);
+        if (!buckets) {
+            free(index);
+            return false;
+        }
+        map->buckets = buckets;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < map->dense_count; i++) {
+        void *bucket = OK_PTR_INC(map->buckets, i * map->bucket_stride);
+        if (*(ok_hash_t *)(bucket) & OK_MAP_OCCUPIED_FLAG) {
+            if (n != i) {
+                memcpy(OK_PTR_INC(map->buckets, n * map->bucket_stride), bucket,
+                       map->bucket_stride);
+            }
+            n++;
+        }
+    }
+    if (max_count < map->max_count) {
+        // Shrink after moving the entries. If shrinking fails, the larger array is kept.
+        void *buckets = realloc(map->buckets, max_count * map->bucket_stride);
+        if (buckets) {
+            map->buckets = buckets;
+        }
+    }
+    memset(OK_PTR_INC(map->buckets, n * map->bucket_stride), 0,
+           (max_count - n) * map->bucket_stride);
+    free(map->index);
+    map->index = index;
+    map->index_width = index_width;
+    map->capacity_n = 0;
+    while (((size_t)1 << map->capacity_n) < new_capacity) {
+        map->capacity_n++;
+    }
+    map->capacity_mask = new_capacity - 1;
+    map->max_count = max_count;
+    map->dense_count = n;
+    map->deleted_count = 0;
+    for (size_t i = 0; i < n; i++) {
+        _ok_map_index_insert(map, *(ok_hash_t *)OK_PTR_INC(map->buckets, i * map->bucket_stride),
+                             i);
+    }
+    return true;
+}
+
+// Puts the entries of a map into an empty map with the same layout. The keys are known to be
+// unique, so entries are placed by their stored hash, without comparing keys.
+static void _ok_map_rehash(struct _ok_map *map, const struct _ok_map *from_map) {
+    if (from_map->old_map) {
+        _ok_map_rehash(map, from_map->old_map);
+    }
+    const size_t bucket_count = _ok_map_bucket_count(from_map);
+    for (size_t i = 0; i < bucket_count; i++) {
+        const void *from_entry = OK_PTR_INC(from_map->buckets, i * from_map->bucket_stride);
+        ok_hash_t flags_hash = *(const ok_hash_t *)(from_entry);
+        if (flags_hash & OK_MAP_OCCUPIED_FLAG) {
+            void *entry = _ok_map_find_free_entry(map, flags_hash);
+            _ok_map_occupy_entry(map, entry, flags_hash);
+            _ok_map_copy_entry(map, entry, from_map, from_entry);
+        }
+    }
+}
+
+// The input of _ok_map_build()
+struct _ok_map_build_input {
+    const void *keys;
+    size_t key_stride;
+    size_t key_size;
+    const ok_hash_t *hashes;
+    const void *values;
+    size_t value_stride;
+    size_t value_size;
+    unsigned int policy;
+    void (*combine_func)(void *value, const void *new_value, void *context);
+    void *context;
+};
+
+// Sets the value of an entry to the value of input entry `i`, according to the duplicate policy.
+static void _ok_map_build_set_value(struct _ok_map *map, void *entry,
+                                    const struct _ok_map_build_input *input, size_t i,
+                                    bool inserted) {
+    void *value = _ok_map_value(map, entry);
+    const void *new_value = OK_PTR_INC(input->values, i * input->value_stride);
+    if (inserted || input->policy == OK_MAP_BUILD_LAST) {
+        memcpy(value, new_value, input->value_size);
+    } else if (input->policy == OK_MAP_BUILD_COMBINE) {
+        input->combine_func(value, new_value, input->context);
+    }
+}
+
+#if defined(OK_LIB_USE_THREADS)
+
+#if defined(_WIN32)
+typedef HANDLE _ok_thread_t;
+typedef LPTHREAD_START_ROUTINE _ok_thread_func_t;
+#  define OK_THREAD_FUNC(name, arg) static DWORD WINAPI name(LPVOID arg)
+#  define OK_THREAD_RETURN return 0
+#else
+typedef pthread_t _ok_thread_t;
+typedef void *(*_ok_thread_func_t)(void *);
+#  define OK_THREAD_FUNC(name, arg) static void *name(void *arg)
+#  define OK_THREAD_RETURN return NULL
+#endif
+
+// The number of threads used for a parallel resize when the thread count is automatic.
+static size_t _ok_cpu_count(void) {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long count = (long)info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    long count = 1;
+#endif
+    return (count > 0 ? (size_t)count : 1);
+}
+
+static bool _ok_thread_create(_ok_thread_t *thread, _ok_thread_func_t func, void *arg) {
+#if defined(_WIN32)
+    *thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+    return *thread != NULL;
+#else
+    return pthread_create(thread, NULL, func, arg) == 0;
+#endif
+}
+
+static void _ok_thread_join(_ok_thread_t thread) {
+#if defined(_WIN32)
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+// A range of buckets of a map, filled by one thread during a parallel rehash or build. Entries that
+// would be placed past the end of the range are deferred, and placed after all threads finish.
+struct _ok_map_range {
+    struct _ok_map *map;
+    size_t start;
+    size_t end;
+    // Rehash: the map the entries are moved from
+    const struct _ok_map *from_map;
+    // Build: the input, and the indexes of the input entries whose home bucket is in the range
+    const struct _ok_map_build_input *input;
+    size_t *input_indexes;
+    size_t input_count;
+    size_t count;
+    size_t *deferred;
+    size_t deferred_count;
+    size_t deferred_capacity;
+    bool on_thread;
+    bool success;
+};
+
+static struct _ok_map_range *_ok_map_ranges_create(struct _ok_map *map, size_t range_count) {
+    struct _ok_map_range *ranges = (struct _ok_map_range *)calloc(range_count,
+                                                                  sizeof(struct _ok_map_range));
+    if (ranges) {
+        const size_t range_size = (map->capacity_mask + 1) / range_count;
+        for (size_t i = 0; i < range_count; i++) {
+            ranges[i].map = map;
+            ranges[i].start = i * range_size;
+            ranges[i].end = ranges[i].start + range_size;
+            ranges[i].success = true;
+        }
+    }
+    return ranges;
+}
+
+static void _ok_map_ranges_free(struct _ok_map_range *ranges, size_t range_count) {
+    for (size_t i = 0; i < range_count; i++) {
+        free(ranges[i].deferred);
+    }
+    free(ranges);
+}
+
+static void _ok_map_range_defer(struct _ok_map_range *range, size_t index) {
+    if (range->deferred_count == range->deferred_capacity) {
+        size_t capacity = range->deferred_capacity ? range->deferred_capacity * 2 : 64;
+        size_t *deferred = (size_t *)realloc(range->deferred, capacity * sizeof(size_t));
+        if (!deferred) {
+            range->success = false;
+            return;
+        }
+        range->deferred = deferred;
+        range->deferred_capacity = capacity;
+    }
+    range->deferred[range->deferred_count++] = index;
+}
+
+// Finds the entry for a key within [home, end) of the map, or places a new entry there (setting
+// only its hash) like _ok_map_find_free_entry() and _ok_map_occupy_entry(), without changing the
+// count. Keys are compared only if `key` is not NULL. Returns NULL if the new entry would be
+// placed, or entries would be shifted, past the end.
+static void *_ok_map_range_find_or_place(struct _ok_map *map, size_t end, const void *key,
+                                         ok_hash_t flags_hash, bool *inserted) {
+    const bool robin_hood = (map->options & OK_MAP_OPTION_ROBIN_HOOD) != 0;
+    size_t i = (size_t)(flags_hash & map->capacity_mask);
+    size_t distance = 0;
+    *inserted = false;
+    while (i < end) {
+        void *entry = OK_PTR_INC(map->buckets, i * map->bucket_stride);
+        ok_hash_t entry_hash = *(ok_hash_t *)(entry);
+        if (key && entry_hash == flags_hash &&
+            map->key_equals_func(OK_PTR_INC(entry, map->key_offset), key)) {
+            return entry;
+        }
+        if ((entry_hash & OK_MAP_OCCUPIED_FLAG) == 0 ||
+            (robin_hood && ((i - entry_hash) & map->capacity_mask) < distance)) {
+            size_t j = i;
+            while (j < end && (*(ok_hash_t *)OK_PTR_INC(map->buckets, j * map->bucket_stride) &
+                               OK_MAP_OCCUPIED_FLAG)) {
+                j++;
+            }
+            if (j == end) {
+                return NULL;
+            }
+            for (; j > i; j--) {
+                _ok_map_move_entry(map, OK_PTR_INC(map->buckets, j * map->bucket_stride),
+                                   OK_PTR_INC(map->buckets, (j - 1) * map->bucket_stride));
+            }
+            memcpy(entry, &flags_hash, sizeof(ok_hash_t));
+            *inserted = true;
+            return entry;
+        }
+        i++;
+        distance++;
+    }
+    return NULL;
+}
+
+// Fills a range of the new map. The entries whose home bucket is in the range are in the old map
+// from (start & old mask) to the end of the cluster that contains (start + range size - 1), since
+// linear probing only moves entries forward. The range size is at most the old capacity.
+static void _ok_map_rehash_fill_range(struct _ok_map_range *range) {
+    struct _ok_map *map = range->map;
+    const struct _ok_map *from_map = range->from_map;
+    const size_t from_capacity = from_map->capacity_mask + 1;
+    const size_t range_size = range->end - range->start;
+    for (size_t k = 0; k < from_capacity; k++) {
+        size_t i = (range->start + k) & from_map->capacity_mask;
+        const void *from_entry = OK_PTR_INC(from_map->buckets, i * from_map->bucket_stride);
+        ok_hash_t flags_hash = *(const ok_hash_t *)(from_entry);
+        if ((flags_hash & OK_MAP_OCCUPIED_FLAG) == 0) {
+            if (k >= range_size) {
+                break;
+            }
+            continue;
+        }
+        size_t home = (size_t)(flags_hash & map->capacity_mask);
+        if (home < range->start || home >= range->end) {
+            continue;
+        }
+        bool inserted;
+        void *entry = _ok_map_range_find_or_place(map, range->end, NULL, flags_hash, &inserted);
+        if (entry) {
+            _ok_map_copy_entry(map, entry, from_map, from_entry);
+            range->count++;
+        } else {
+            _ok_map_range_defer(range, i);
+            if (!range->success) {
+                return;
+            }
+        }
+    }
+}
+
+// Puts the input entries of a range, in input order.
+static void _ok_map_build_fill_range(struct _ok_map_range *range) {
+    struct _ok_map *map = range->map;
+    const struct _ok_map_build_input *input = range->input;
+    for (size_t k = 0; k < range->input_count; k++) {
+        size_t i = range->input_indexes[k];
+        const void *key = OK_PTR_INC(input->keys, i * input->key_stride);
+        bool inserted;
+        void *entry = _ok_map_range_find_or_place(map, range->end, key,
+                                                  input->hashes[i] | OK_MAP_OCCUPIED_FLAG,
+                                                  &inserted);
+        if (entry) {
+            if (inserted) {
+                memcpy(OK_PTR_INC(entry, map->key_offset), key, input->key_size);
+                range->count++;
+            }
+            _ok_map_build_set_value(map, entry, input, i, inserted);
+        } else {
+            // Later entries with the same key have the same home bucket, so they are deferred too
+            _ok_map_range_defer(range, i);
+            if (!range->success) {
+                return;
+            }
+        }
+    }
+}
+
+static void _ok_map_fill_range(struct _ok_map_range *range) {
+    if (range->input) {
+        _ok_map_build_fill_range(range);
+    } else {
+        _ok_map_rehash_fill_range(range);
+    }
+}
+
+OK_THREAD_FUNC(_ok_map_fill_range_thread, arg) {
+    _ok_map_fill_range((struct _ok_map_range *)arg);
+    OK_THREAD_RETURN;
+}
+
+// Fills the ranges on `thread_count` threads, including the calling thread. If there are more
+// ranges than threads, the ranges are filled in rounds. Returns false if out of memory.
+static bool _ok_map_fill_ranges(struct _ok_map_range *ranges, size_t range_count,
+                                size_t thread_count) {
+    _ok_thread_t *threads = (_ok_thread_t *)calloc(range_count, sizeof(_ok_thread_t));
+    if (!threads) {
+        return false;
+    }
+    for (size_t r = 0; r < range_count; r += thread_count) {
+        for (size_t t = 1; t < thread_count && r + t < range_count; t++) {
+            ranges[r + t].on_thread = _ok_thread_create(&threads[r + t], _ok_map_fill_range_thread,
+                                                        &ranges[r + t]);
+        }
+        _ok_map_fill_range(&ranges[r]);
+        for (size_t t = 1; t < thread_count && r + t < range_count; t++) {
+            if (ranges[r + t].on_thread) {
+                _ok_thread_join(threads[r + t]);
+            } else {
+                _ok_map_fill_range(&ranges[r + t]);
+            }
+        }
+    }
+    free(threads);
+    bool success = true;
+    for (size_t i = 0; i < range_count; i++) {
+        success = success && ranges[i].success;
+        ranges[i].map->count += ranges[i].count;
+    }
+    return success;
+}
+
+// The number of threads to use, if the thread count is automatic (0).
+static size_t _ok_map_thread_count(size_t thread_count) {
+    if (thread_count == 0) {
+        thread_count = _ok_cpu_count();
+        if (thread_count > OK_MAP_PARALLEL_MAX_THREADS) {
+            thread_count = OK_MAP_PARALLEL_MAX_THREADS;
+        }
+    }
+    return thread_count;
+}
+
+// Like _ok_map_rehash(), splitting the new map into ranges that are filled on several threads.
+// Only for linear probing (including Robin Hood) maps, growing to at least the old capacity.
+// Returns false if out of memory, in which case the map must be freed.
+static bool _ok_map_rehash_parallel(struct _ok_map *map, const struct _ok_map *from_map,
+                                    size_t thread_count) {
+    const size_t capacity = map->capacity_mask + 1;
+    const size_t from_capacity = from_map->capacity_mask + 1;
+    size_t range_count = 1;
+    while (range_count < thread_count || capacity / range_count > from_capacity) {
+        range_count <<= 1;
+    }
+    struct _ok_map_range *ranges = _ok_map_ranges_create(map, range_count);
+    if (!ranges) {
+        return false;
+    }
+    for (size_t i = 0; i < range_count; i++) {
+        ranges[i].from_map = from_map;
+    }
+    bool success = _ok_map_fill_ranges(ranges, range_count, thread_count);
+    for (size_t i = 0; success && i < range_count; i++) {
+        for (size_t j = 0; j < ranges[i].deferred_count; j++) {
+            size_t from_index = ranges[i].deferred[j];
+            const void *from_entry = OK_PTR_INC(from_map->buckets,
+                                                from_index * from_map->bucket_stride);
+            ok_hash_t flags_hash = *(const ok_hash_t *)(from_entry);
+            void *entry = _ok_map_find_free_entry(map, flags_hash);
+            _ok_map_occupy_entry(map, entry, flags_hash);
+            _ok_map_copy_entry(map, entry, from_map, from_entry);
+        }
+    }
+    _ok_map_ranges_free(ranges, range_count);
+    return success;
+}
+
+#endif
+
+// Creates a copy of a map with a new capacity. The thread count is the number of threads used to
+// move the entries (0 for automatic).
+static struct _ok_map *_ok_map_copy(const struct _ok_map *from_map, size_t initial_capacity,
+                                    size_t thread_count) {
+    struct _ok_map *map = _ok_map_create_empty_copy(from_map, initial_capacity);
+    if (!map) {
+        return NULL;
+    }
+#if defined(OK_LIB_USE_THREADS)
+    const size_t capacity = map->capacity_mask + 1;
+    if (thread_count == 0 && capacity >= OK_MAP_PARALLEL_RESIZE_MIN_CAPACITY) {
+        thread_count = _ok_map_thread_count(0);
+    }
+    if (thread_count > 1 && !map->small && !map->ctrl && !map->index && !from_map->small &&
+        !from_map->index && !from_map->old_map && capacity >= from_map->capacity_mask + 1) {
+        if (!_ok_map_rehash_parallel(map, from_map, thread_count)) {
+            _ok_map_free(map);
+            return NULL;
+        }
+        return map;
+    }
+#else
+    (void)thread_count;
+#endif
+    _ok_map_rehash(map, from_map);
+    return map;
+}
+
+// Resizes the map to a capacity (a power of two), moving every entry at once. A capacity of at most
+// OK_MAP_SMALL_CAPACITY creates a small map. The thread count is used for large maps if
+// OK_LIB_USE_THREADS is defined (0 for automatic).
+static bool _ok_map_resize(struct _ok_map **map, size_t new_capacity, size_t thread_count) {
+    if ((*map)->index && !(*map)->mapping) {
+        return _ok_map_ordered_resize(*map, new_capacity);
+    }
+    struct _ok_map *new_map = _ok_map_copy(*map, new_capacity, thread_count);
+    if (!new_map) {
+        return false;
+    }
+    _ok_map_free(*map);
+    *map = new_map;
+    return true;
+}
+
+// The smallest capacity that holds `count` entries without growing.
+static size_t _ok_map_capacity_for_count(const struct _ok_map *map, size_t count) {
+    if (count <= OK_MAP_SMALL_CAPACITY && _ok_map_small_allowed(map->options)) {
+        return OK_MAP_SMALL_CAPACITY;
+    }
+    size_t capacity = OK_MAP_MIN_CAPACITY;
+    while (_ok_map_max_count(capacity, map->max_load_factor) < count) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+// Finds the entry for a key, or puts the key if it doesn't exist. Sets `inserted` (if not NULL) to
+// whether the key was put. Returns NULL for out-of-memory error, or if the map is frozen.
+static void *_ok_map_find_or_put_entry(struct _ok_map **map, const void *key,
+                                       size_t key_size, ok_hash_t key_hash, bool *inserted) {
+    if (inserted) {
+        *inserted = false;
+    }
+    if ((*map)->frozen) {
+        return NULL;
+    }
+    if ((*map)->old_map) {
+        _ok_map_migrate(*map, OK_MAP_MIGRATE_STEP);
+    }
+    void *new_entry = NULL;
+    void *entry = _ok_map_find_entry(*map, key, key_hash, &new_entry);
+    if (!entry && (*map)->old_map) {
+        entry = _ok_map_find_entry((*map)->old_map, key, key_hash, NULL);
+    }
+    if (!entry) {
+        if ((*map)->count + (*map)->deleted_count >= (*map)->max_count && (*map)->old_map) {
+            // Rare: finish the previous incremental resize before starting another.
+            _ok_map_migrate(*map, SIZE_MAX);
+            new_entry = NULL;
+            _ok_map_find_entry(*map, key, key_hash, &new_entry);
+        }
+        // Grow. If there are many tombstones, rehash at the same capacity instead.
+        if ((*map)->count + (*map)->deleted_count >= (*map)->max_count) {
+            size_t new_capacity = (size_t)1 << (*map)->capacity_n;
+            if ((*map)->count >= (*map)->max_count - (*map)->max_count / 4) {
+                new_capacity <<= 1;
+            }
+            if (((*map)->options & OK_MAP_OPTION_INCREMENTAL_RESIZE) && !(*map)->small) {
+                if (!_ok_map_begin_resize(map, new_capacity)) {
+                    return NULL;
+                }
+            } else if (!_ok_map_resize(map, new_capacity, 0)) {
+                return NULL;
+            }
+            new_entry = NULL;
+            _ok_map_find_entry(*map, key, key_hash, &new_entry);
+        }
+        if (new_entry) {
+            entry = new_entry;
+            _ok_map_occupy_entry(*map, entry, key_hash);
+            memcpy(OK_PTR_INC(entry, (*map)->key_offset), key, key_size);
+            if (inserted) {
+                *inserted = true;
+            }
+        }
+    }
+    return entry;
+}
+
+OK_LIB_API struct _ok_map *_ok_map_create(size_t initial_capacity,
+                                          bool (*key_equals_func)(const void *key1,
+                                                                  const void *key2),
+                                          size_t key_offset, size_t value_offset,
+                                          size_t bucket_stride, unsigned int options) {
+    struct _ok_map *map = (struct _ok_map *)calloc(1, sizeof(struct _ok_map));
+    if (map) {
+        map->key_equals_func = key_equals_func;
+        map->key_offset = key_offset;
+        map->value_offset = value_offset;
+        map->bucket_stride = bucket_stride;
+        if (options & OK_MAP_OPTION_INSERTION_ORDER) {
+            options = OK_MAP_OPTION_INSERTION_ORDER;
+        } else if ((options & OK_MAP_OPTION_SPLIT_VALUES) && value_offset >= bucket_stride) {
+            // No values (a set)
+            options &= ~OK_MAP_OPTION_SPLIT_VALUES;
+        }
+        if (options & OK_MAP_OPTION_SPLIT_VALUES) {
+            map->bucket_stride = _ok_map_split_bucket_stride(key_offset, value_offset);
+            map->value_stride = bucket_stride - value_offset;
+        }
+        if (options & OK_MAP_OPTION_GROUP_PROBING) {
+            options &= ~OK_MAP_OPTION_ROBIN_HOOD;
+        }
+        map->max_load_factor = ((options & OK_MAP_OPTION_ROBIN_HOOD) ?
+                                OK_MAP_ROBIN_HOOD_MAX_LOAD : OK_MAP_DEFAULT_MAX_LOAD);
+        map->options = options;
+        map = _ok_map_init(map, initial_capacity);
+    }
+    return map;
+}
+
+OK_LIB_API void _ok_map_free(struct _ok_map *map) {
+    if (map) {
+        _ok_map_free(map->old_map);
+        _ok_map_free_arrays(map);
+        free(map);
+    }
+}
+
+OK_LIB_API size_t _ok_map_count(const struct _ok_map *map) {
+    if (!map) {
+        return 0;
+    }
+    return map->count + (map->old_map ? map->old_map->count : 0);
+}
+
+OK_LIB_API size_t _ok_map_capacity(const struct _ok_map *map, unsigned int options) {
+    if (!map) {
+        return _ok_map_small_allowed(options) ? OK_MAP_SMALL_CAPACITY : OK_MAP_MIN_CAPACITY;
+    }
+    return map->frozen ? _ok_map_bucket_count(map) : (size_t)1 << map->capacity_n;
+}
+
+OK_LIB_API bool _ok_map_set_max_load_factor(struct _ok_map **map, float max_load_factor) {
+    if (!(max_load_factor >= OK_MAP_MIN_MAX_LOAD && max_load_factor <= OK_MAP_MAX_MAX_LOAD) ||
+        (*map)->frozen) {
+        return false;
+    }
+    float old_max_load_factor = (*map)->max_load_factor;
+    (*map)->max_load_factor = max_load_factor;
+    if ((*map)->small) {
+        // Small maps use every bucket. The load factor is used when the map grows.
+        return true;
+    }
+    size_t capacity = (size_t)1 << (*map)->capacity_n;
+    size_t max_count = _ok_map_max_count(capacity, max_load_factor);
+    size_t count = _ok_map_count(*map);
+    bool success;
+    if ((*map)->index || count + (*map)->deleted_count >= max_count) {
+        // The dense buckets of insertion-ordered maps are sized for the max count.
+        size_t new_capacity = _ok_map_capacity_for_count(*map, count + 1);
+        success = _ok_map_resize(map, (new_capacity > capacity ? new_capacity : capacity), 0);
+    } else {
+        (*map)->max_count = max_count;
+        success = true;
+    }
+    if (!success) {
+        (*map)->max_load_factor = old_max_load_factor;
+    }
+    return success;
+}
+
+OK_LIB_API bool _ok_map_reserve(struct _ok_map **map, size_t count, size_t thread_count) {
+    if ((*map)->frozen) {
+        return false;
+    }
+    if (count <= (*map)->max_count) {
+        return true;
+    }
+    return _ok_map_resize(map, _ok_map_capacity_for_count(*map, count), thread_count);
+}
+
+OK_LIB_API bool _ok_map_shrink_to_fit(struct _ok_map **map) {
+    if (!*map || (*map)->frozen) {
+        // Frozen maps are already compact
+        return true;
+    }
+    size_t capacity = (size_t)1 << (*map)->capacity_n;
+    size_t new_capacity = _ok_map_capacity_for_count(*map, _ok_map_count(*map));
+    if (new_capacity < capacity || (*map)->deleted_count > 0 || (*map)->old_map) {
+        return _ok_map_resize(map, (new_capacity < capacity ? new_capacity : capacity), 0);
+    }
+    return true;
+}
+
+OK_LIB_API bool _ok_map_clear(struct _ok_map *map) {
+    if (!map) {
+        return true;
+    }
+    if (map->frozen) {
+        return false;
+    }
+    _ok_map_free(map->old_map);
+    map->old_map = NULL;
+    memset(map->buckets, 0, _ok_map_bucket_count(map) * map->bucket_stride);
+    if (map->ctrl) {
+        memset(map->ctrl, OK_MAP_CTRL_EMPTY, map->capacity_mask + 1 + OK_MAP_GROUP_WIDTH);
+    }
+    if (map->index) {
+        memset(map->index, 0, (map->capacity_mask + 1) * map->index_width);
+        map->dense_count = 0;
+    }
+    map->count = 0;
+    map->deleted_count = 0;
+    return true;
+}
+
+OK_LIB_API bool _ok_map_contains(const struct _ok_map *map, const void *key,
+                                 ok_hash_t key_hash) {
+    return (_ok_map_lookup_entry(map, key, key_hash) != NULL);
+}
+
+OK_LIB_API bool _ok_map_put(struct _ok_map **map, const void *key,
+                            size_t key_size, ok_hash_t key_hash,
+                            const void *value, size_t value_size) {
+    void *entry = _ok_map_find_or_put_entry(map, key, key_size, key_hash, NULL);
+    if (entry) {
+        memcpy(_ok_map_value(*map, entry), value, value_size);
+        return true;
+    } else {
+        return false;
+    }
+}
+
+OK_LIB_API void _ok_map_put_and_get_ptr(struct _ok_map **map, const void *key,
+                                        size_t key_size, ok_hash_t key_hash,
+                                        void **value_ptr, size_t value_size) {
+    (void)value_size;
+    void *entry = _ok_map_find_or_put_entry(map, key, key_size, key_hash, NULL);
+    if (entry) {
+        *value_ptr = _ok_map_value(*map, entry);
+    } else {
+        *value_ptr = NULL;
+    }
+}
+
+OK_LIB_API void _ok_map_entry(struct _ok_map **map, const void *key,
+                              size_t key_size, ok_hash_t key_hash,
+                              void **value_ptr, size_t value_size, bool *inserted,
+                              void (*init_func)(void *value, const void *key, void *context),
+                              void *context) {
+    bool entry_inserted;
+    void *entry = _ok_map_find_or_put_entry(map, key, key_size, key_hash, &entry_inserted);
+    if (entry) {
+        *value_ptr = _ok_map_value(*map, entry);
+        if (entry_inserted) {
+            memset(*value_ptr, 0, value_size);
+            if (init_func) {
+                init_func(*value_ptr, OK_PTR_INC(entry, (*map)->key_offset), context);
+            }
+        }
+    } else {
+        *value_ptr = NULL;
+    }
+    if (inserted) {
+        *inserted = entry_inserted;
+    }
+}
+
+// Puts input entry `i`, according to the duplicate policy.
+static bool _ok_map_build_put(struct _ok_map **map, const struct _ok_map_build_input *input,
+                              size_t i) {
+    bool inserted;
+    void *entry = _ok_map_find_or_put_entry(map, OK_PTR_INC(input->keys, i * input->key_stride),
+                                            input->key_size, input->hashes[i], &inserted);
+    if (!entry) {
+        return false;
+    }
+    _ok_map_build_set_value(*map, entry, input, i, inserted);
+    return true;
+}
+
+#if defined(OK_LIB_USE_THREADS)
+
+// Builds an empty map on several threads. The input is partitioned by range of home buckets (the
+// top bits of the home bucket index), keeping the input order within each range, so the duplicate
+// policy is applied in order. Only for linear probing (including Robin Hood) maps.
+static bool _ok_map_build_parallel(struct _ok_map **map, const struct _ok_map_build_input *input,
+                                   size_t count, size_t thread_count) {
+    const size_t capacity = (*map)->capacity_mask + 1;
+    size_t range_count = 1;
+    while (range_count < thread_count) {
+        range_count <<= 1;
+    }
+    const size_t range_size = capacity / range_count;
+    struct _ok_map_range *ranges = _ok_map_ranges_create(*map, range_count);
+    size_t *input_indexes = (size_t *)malloc(count * sizeof(size_t));
+    bool success = (ranges && input_indexes);
+    if (success) {
+        for (size_t i = 0; i < count; i++) {
+            ranges[(input->hashes[i] & (*map)->capacity_mask) / range_size].input_count++;
+        }
+        size_t offset = 0;
+        for (size_t r = 0; r < range_count; r++) {
+            ranges[r].input = input;
+            ranges[r].input_indexes = input_indexes + offset;
+            offset += ranges[r].input_count;
+            ranges[r].input_count = 0;
+        }
+        for (size_t i = 0; i < count; i++) {
+            struct _ok_map_range *range =
+                &ranges[(input->hashes[i] & (*map)->capacity_mask) / range_size];
+            range->input_indexes[range->input_count++] = i;
+        }
+        success = _ok_map_fill_ranges(ranges, range_count, thread_count);
+        for (size_t r = 0; success && r < range_count; r++) {
+            for (size_t j = 0; success && j < ranges[r].deferred_count; j++) {
+                success = _ok_map_build_put(map, input, ranges[r].deferred[j]);
+            }
+        }
+    }
+    free(input_indexes);
+    if (ranges) {
+        _ok_map_ranges_free(ranges, range_count);
+    }
+    return success;
+}
+
+#endif
+
+OK_LIB_API bool _ok_map_build(struct _ok_map **map, const void *keys, size_t key_stride,
+                              size_t key_size, const ok_hash_t *hashes, const void *values,
+                              size_t value_stride, size_t value_size, size_t count,
+                              unsigned int policy,
+                              void (*combine_func)(void *value, const void *new_value,
+                                                   void *context),
+                              void *context) {
+    struct _ok_map_build_input input;
+    input.keys = keys;
+    input.key_stride = key_stride;
+    input.key_size = key_size;
+    input.hashes = hashes;
+    input.values = values;
+    input.value_stride = value_stride;
+    input.value_size = value_size;
+    input.policy = (policy == OK_MAP_BUILD_COMBINE && !combine_func) ? OK_MAP_BUILD_FIRST : policy;
+    input.combine_func = combine_func;
+    input.context = context;
+
+    // Resize once. Duplicate keys are counted, so the map may be larger than needed.
+    if (!_ok_map_reserve(map, _ok_map_count(*map) + count, 0)) {
+        return false;
+    }
+#if defined(OK_LIB_USE_THREADS)
+    if (count >= OK_MAP_PARALLEL_BUILD_MIN_COUNT && (*map)->count == 0 && !(*map)->old_map &&
+        !(*map)->small && !(*map)->ctrl && !(*map)->index) {
+        size_t thread_count = _ok_map_thread_count(0);
+        if (thread_count > 1) {
+            return _ok_map_build_parallel(map, &input, count, thread_count);
+        }
+    }
+#endif
+    for (size_t i = 0; i < count; i++) {
+        if (!_ok_map_build_put(map, &input, i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+OK_LIB_API bool _ok_map_put_all(struct _ok_map **map,
+                                const struct _ok_map *from_map,
+                                size_t key_size, size_t value_size) {
+    if (!from_map) {
+        return true;
+    }
+    if ((*map)->key_equals_func != from_map->key_equals_func) {
+        return false;
+    }
+
+    if (from_map->old_map) {
+        if (!_ok_map_put_all(map, from_map->old_map, key_size, value_size)) {
+            return false;
+        }
+    }
+    void *iterator = from_map->buckets;
+    void *end = OK_PTR_INC(from_map->buckets,
+                           from_map->bucket_stride * _ok_map_bucket_count(from_map));
+    while (iterator < end) {
+        ok_hash_t flags_hash = *(ok_hash_t *)(iterator);
+        if (flags_hash & OK_MAP_OCCUPIED_FLAG) {
+            void *key = OK_PTR_INC(iterator, from_map->key_offset);
+            void *value = _ok_map_value(from_map, iterator);
+            bool success = _ok_map_put(map, key, key_size, flags_hash, value, value_size);
+            if (!success) {
+                return false;
+            }
+        }
+        iterator = OK_PTR_INC(iterator, from_map->bucket_stride);
+    }
+    return true;
+}
+
+OK_LIB_API bool _ok_map_merge(struct _ok_map **map, const struct _ok_map *from_map,
+                              size_t key_size, size_t value_size,
+                              void (*combine_func)(void *value, const void *new_value,
+                                                   void *context),
+                              void *context) {
+    if (!from_map) {
+        return true;
+    }
+    if ((*map)->key_equals_func != from_map->key_equals_func) {
+        return false;
+    }
+
+    // The merged map has at least as many keys as the larger of the two maps
+    size_t count = _ok_map_count(*map);
+    if (_ok_map_count(from_map) > count) {
+        count = _ok_map_count(from_map);
+    }
+    if (!_ok_map_reserve(map, count, 0)) {
+        return false;
+    }
+    if (from_map->old_map) {
+        if (!_ok_map_merge(map, from_map->old_map, key_size, value_size, combine_func, context)) {
+            return false;
+        }
+    }
+    void *iterator = from_map->buckets;
+    void *end = OK_PTR_INC(from_map->buckets,
+                           from_map->bucket_stride * _ok_map_bucket_count(from_map));
+    while (iterator < end) {
+        ok_hash_t flags_hash = *(ok_hash_t *)(iterator);
+        if (flags_hash & OK_MAP_OCCUPIED_FLAG) {
+            bool inserted;
+            void *entry = _ok_map_find_or_put_entry(map, OK_PTR_INC(iterator, from_map->key_offset),
+                                                    key_size, flags_hash, &inserted);
+            if (!entry) {
+                return false;
+            }
+            void *value = _ok_map_value(*map, entry);
+            const void *new_value = _ok_map_value(from_map, iterator);
+            if (inserted || !combine_func) {
+                memcpy(value, new_value, value_size);
+            } else {
+                combine_func(value, new_value, context);
+            }
+        }
+        iterator = OK_PTR_INC(iterator, from_map->bucket_stride);
+    }
+    return true;
 }
 
-OK_LIB_API ok_hash_t ok_uint16_hash(uint16_t key) {
-    return ok_uint32_hash(key);
+OK_LIB_API bool _ok_map_get(const struct _ok_map *map, const void *key,
+                            ok_hash_t key_hash, void *value, size_t value_size) {
+    void *entry = _ok_map_lookup_entry(map, key, key_hash);
+    if (entry) {
+        memcpy(value, _ok_map_value(map, entry), value_size);
+        return true;
+    } else {
+        memset(value, 0, value_size);
+        return false;
+    }
 }
 
-OK_LIB_API ok_hash_t ok_int16_hash(int16_t key) {
-    return ok_uint32_hash((uint32_t)key);
+OK_LIB_API bool _ok_map_get_ptr(const struct _ok_map *map, const void *key,
+                                ok_hash_t key_hash, void **value_ptr) {
+    void *entry = _ok_map_lookup_entry(map, key, key_hash);
+    if (entry) {
+        *value_ptr = _ok_map_value(map, entry);
+    } else {
+        *value_ptr = NULL;
+    }
+    return entry != NULL;
 }
 
-OK_LIB_API ok_hash_t ok_uint32_hash(uint32_t key) {
-    key += ~(key << 16);
-    key ^=  (key >> 5);
-    key +=  (key << 3);
-    key ^=  (key >> 13);
-    key += ~(key << 9);
-    key ^=  (key >> 17);
-    return key;
+// Prefetches the home bucket (and control bytes) of each hash.
+static void _ok_map_prefetch(const struct _ok_map *map, const ok_hash_t *key_hashes,
+                             size_t count) {
+    if (!map) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (map->frozen) {
+            if (map->perfect_count > 0) {
+                uint64_t mixed_hash = _ok_map_frozen_mix(key_hashes[i] | OK_MAP_OCCUPIED_FLAG);
+                uint32_t displacement = map->displacements[
+                    _ok_map_frozen_group(mixed_hash, map->displacement_count)];
+                size_t bucket_index = _ok_map_frozen_index(mixed_hash, displacement,
+                                                           map->perfect_count);
+                _ok_prefetch(OK_PTR_INC(map->buckets, bucket_index * map->bucket_stride));
+            }
+            continue;
+        }
+        size_t bucket_index = (size_t)(key_hashes[i] & map->capacity_mask);
+        if (map->index) {
+            _ok_prefetch(OK_PTR_INC(map->index, bucket_index * map->index_width));
+            continue;
+        }
+        if (map->ctrl) {
+            _ok_prefetch(map->ctrl + bucket_index);
+        }
+        _ok_prefetch(OK_PTR_INC(map->buckets, bucket_index * map->bucket_stride));
+    }
 }
 
-OK_LIB_API ok_hash_t ok_int32_hash(int32_t key) {
-    return ok_uint32_hash((uint32_t)key);
+OK_LIB_API void _ok_map_get_many(const struct _ok_map *map, const void *keys, size_t key_stride,
+                                 const ok_hash_t *key_hashes, size_t count,
+                                 void *values, size_t value_size) {
+    _ok_map_prefetch(map, key_hashes, count);
+    for (size_t i = 0; i < count; i++) {
+        _ok_map_get(map, OK_PTR_INC(keys, i * key_stride), key_hashes[i],
+                    OK_PTR_INC(values, i * value_size), value_size);
+    }
 }
 
-OK_LIB_API ok_hash_t ok_float_hash(float key) {
-    uint32_t int_key;
-    ok_static_assert(sizeof(key) == sizeof(int_key), "float must be be 32-bit");
-    memcpy(&int_key, &key, sizeof(int_key));
-    return ok_uint32_hash(int_key);
+OK_LIB_API void _ok_map_get_ptr_many(const struct _ok_map *map, const void *keys,
+                                     size_t key_stride, const ok_hash_t *key_hashes,
+                                     size_t count, void **value_ptrs) {
+    _ok_map_prefetch(map, key_hashes, count);
+    for (size_t i = 0; i < count; i++) {
+        _ok_map_get_ptr(map, OK_PTR_INC(keys, i * key_stride), key_hashes[i], &value_ptrs[i]);
+    }
 }
 
-OK_LIB_API ok_hash_t ok_uint64_hash(uint64_t key) {
-    key += ~(key << 34);
-    key ^=  (key >> 29);
-    key += ~(key << 11);
-    key ^=  (key >> 14);
-    key += ~(key <<  7);
-    key ^=  (key >> 28);
-    key += ~(key << 26);
-    return (ok_hash_t)key;
+OK_LIB_API void _ok_map_contains_many(const struct _ok_map *map, const void *keys,
+                                      size_t key_stride, const ok_hash_t *key_hashes,
+                                      size_t count, uint8_t *bitmap, size_t first_index) {
+    _ok_map_prefetch(map, key_hashes, count);
+    for (size_t i = 0; i < count; i++) {
+        size_t index = first_index + i;
+        uint8_t bit = (uint8_t)(1u << (index & 7));
+        if (_ok_map_contains(map, OK_PTR_INC(keys, i * key_stride), key_hashes[i])) {
+            bitmap[index >> 3] |= bit;
+        } else {
+            bitmap[index >> 3] &= (uint8_t)~bit;
+        }
+    }
 }
 
-OK_LIB_API ok_hash_t ok_int64_hash(int64_t key) {
-    return ok_uint64_hash((uint64_t)key);
+OK_LIB_API void *_ok_map_next(const struct _ok_map *map, void *iterator, void *key,
+                              size_t key_size, void *value, size_t value_size) {
+    if (_ok_map_count(map) == 0) {
+        return NULL;
+    }
+    // During an incremental resize, the new buckets are iterated first, then the old buckets.
+    const struct _ok_map *old_map = map->old_map;
+    if (!iterator) {
+        iterator = map->buckets;
+    } else if (old_map && iterator >= old_map->buckets &&
+               iterator <= (void *)OK_PTR_INC(old_map->buckets, (old_map->bucket_stride *
+                                                                 _ok_map_bucket_count(old_map)))) {
+        map = old_map;
+        old_map = NULL;
+    }
+    while (true) {
+        void *begin = map->buckets;
+        void *end = OK_PTR_INC(map->buckets, map->bucket_stride * _ok_map_bucket_count(map));
+        while (iterator >= begin && iterator < end) {
+            ok_hash_t flags_hash = *(ok_hash_t *)(iterator);
+            void *next_iterator = OK_PTR_INC(iterator, map->bucket_stride);
+            if (flags_hash & OK_MAP_OCCUPIED_FLAG) {
+                if (key) {
+                    memcpy(key, OK_PTR_INC(iterator, map->key_offset), key_size);
+                }
+                if (value) {
+                    memcpy(value, _ok_map_value(map, iterator), value_size);
+                }
+                return next_iterator;
+            }
+            iterator = next_iterator;
+        }
+        if (!old_map) {
+            return NULL;
+        }
+        map = old_map;
+        old_map = NULL;
+        iterator = map->buckets;
+    }
 }
 
-OK_LIB_API ok_hash_t ok_double_hash(double key) {
-    uint64_t int_key;
-    ok_static_assert(sizeof(key) == sizeof(int_key), "double must be 64-bit");
-    memcpy(&int_key, &key, sizeof(int_key));
-    return ok_uint64_hash(int_key);
+// Calls the scan function for each entry of the map (but not its old map) whose home bucket is
+// `home`. The entries are in the probe sequence from the home bucket, which ends like a lookup:
+// at an empty bucket, or a group with an empty bucket.
+static void _ok_map_scan_home(const struct _ok_map *map, size_t home,
+                              void (*scan_func)(const void *key, void *value, void *context),
+                              void *context) {
+    const size_t mask = map->capacity_mask;
+    if (map->ctrl) {
+        size_t group_index = home;
+        size_t probe_offset = 0;
+        while (true) {
+            for (size_t i = 0; i < OK_MAP_GROUP_WIDTH; i++) {
+                size_t bucket_index = (group_index + i) & mask;
+                void *bucket = OK_PTR_INC(map->buckets, bucket_index * map->bucket_stride);
+                if ((map->ctrl[bucket_index] & OK_MAP_CTRL_EMPTY) == 0 &&
+                    (*(ok_hash_t *)(bucket) & mask) == home) {
+                    scan_func(OK_PTR_INC(bucket, map->key_offset), _ok_map_value(map, bucket),
+                              context);
+                }
+            }
+            if (_ok_map_group_match(map->ctrl + group_index, OK_MAP_CTRL_EMPTY)) {
+                break;
+            }
+            probe_offset += OK_MAP_GROUP_WIDTH;
+            group_index = (group_index + probe_offset) & mask;
+        }
+    } else if (map->index) {
+        size_t slot;
+        for (size_t i = home; (slot = _ok_map_index_get(map, i)) != 0; i = (i + 1) & mask) {
+            void *bucket = OK_PTR_INC(map->buckets, (slot - 1) * map->bucket_stride);
+            if ((*(ok_hash_t *)(bucket) & mask) == home) {
+                scan_func(OK_PTR_INC(bucket, map->key_offset), _ok_map_value(map, bucket),
+                          context);
+            }
+        }
+    } else {
+        const bool robin_hood = (map->options & OK_MAP_OPTION_ROBIN_HOOD) != 0;
+        size_t bucket_index = home;
+        size_t distance = 0;
+        while (true) {
+            void *bucket = OK_PTR_INC(map->buckets, bucket_index * map->bucket_stride);
+            ok_hash_t flags_hash = *(ok_hash_t *)(bucket);
+            if ((flags_hash & OK_MAP_OCCUPIED_FLAG) == 0 ||
+                (robin_hood && ((bucket_index - flags_hash) & mask) < distance)) {
+                // With Robin Hood probing, entries with a later home bucket come after the
+                // entries of this home bucket.
+                break;
+            }
+            if ((flags_hash & mask) == home) {
+                scan_func(OK_PTR_INC(bucket, map->key_offset), _ok_map_value(map, bucket),
+                          context);
+            }
+            bucket_index = (bucket_index + 1) & mask;
+            distance++;
+        }
+    }
+}
+
+static size_t _ok_map_reverse_bits(size_t v) {
+    size_t shift = sizeof(size_t) * 8;
+    size_t mask = ~(size_t)0;
+    while ((shift >>= 1) > 0) {
+        mask ^= (mask << shift);
+        v = ((v >> shift) & mask) | ((v << shift) & ~mask);
+    }
+    return v;
+}
+
+// Increments the bits of a cursor covered by the mask, in reverse-binary order.
+static size_t _ok_map_scan_increment(size_t cursor, size_t mask) {
+    cursor |= ~mask;
+    cursor = _ok_map_reverse_bits(cursor);
+    cursor++;
+    return _ok_map_reverse_bits(cursor);
+}
+
+OK_LIB_API size_t _ok_map_scan(const struct _ok_map *map, size_t cursor, size_t count,
+                               void (*scan_func)(const void *key, void *value, void *context),
+                               void *context) {
+    if (_ok_map_count(map) == 0) {
+        return 0;
+    }
+    if (count == 0) {
+        count = 1;
+    }
+    if (map->small || map->frozen) {
+        // Small maps are visited all at once. Frozen maps can't be modified, so the cursor is
+        // the next bucket.
+        const size_t bucket_count = _ok_map_bucket_count(map);
+        size_t i = (map->small ? 0 : cursor);
+        for (; i < bucket_count && (map->small || count > 0); i++, count--) {
+            void *bucket = OK_PTR_INC(map->buckets, i * map->bucket_stride);
+            if (*(ok_hash_t *)(bucket) & OK_MAP_OCCUPIED_FLAG) {
+                scan_func(OK_PTR_INC(bucket, map->key_offset), _ok_map_value(map, bucket),
+                          context);
+            }
+        }
+        return (i < bucket_count ? i : 0);
+    }
+
+    // During an incremental resize, the cursor's bucket in the smaller map is visited, and then
+    // every bucket in the larger map whose index ends with the same bits (like Redis's dictScan).
+    const struct _ok_map *small_map = map;
+    const struct _ok_map *large_map = map->old_map;
+    if (large_map && large_map->capacity_mask < small_map->capacity_mask) {
+        small_map = map->old_map;
+        large_map = map;
+    }
+    const size_t small_mask = small_map->capacity_mask;
+    do {
+        _ok_map_scan_home(small_map, cursor & small_mask, scan_func, context);
+        if (large_map) {
+            const size_t large_mask = large_map->capacity_mask;
+            size_t large_cursor = cursor;
+            do {
+                _ok_map_scan_home(large_map, large_cursor & large_mask, scan_func, context);
+                large_cursor = _ok_map_scan_increment(large_cursor, large_mask);
+            } while (large_cursor & (small_mask ^ large_mask));
+        }
+        cursor = _ok_map_scan_increment(cursor, small_mask);
+    } while (cursor != 0 && --count > 0);
+    return cursor;
+}
+
+// Gets the map (or old map, during an incremental resize) that contains the bucket before an
+// iterator returned by _ok_map_next().
+static const struct _ok_map *_ok_map_iterator_map(const struct _ok_map *map, void *iterator) {
+    const struct _ok_map *old_map = map->old_map;
+    if (old_map && iterator > old_map->buckets &&
+        iterator <= (void *)OK_PTR_INC(old_map->buckets, (old_map->bucket_stride *
+                                                          _ok_map_bucket_count(old_map)))) {
+        return old_map;
+    }
+    return map;
+}
+
+OK_LIB_API void *_ok_map_iterator_key(const struct _ok_map *map, void *iterator) {
+    return OK_PTR_INC(iterator, map->key_offset) - map->bucket_stride;
+}
+
+OK_LIB_API void *_ok_map_iterator_value(const struct _ok_map *map, void *iterator) {
+    map = _ok_map_iterator_map(map, iterator);
+    return _ok_map_value(map, (uint8_t *)iterator - map->bucket_stride);
+}
+
+// Removes an entry of an insertion-ordered map. The dense bucket becomes a hole (holes at the end are
+// reused), and the index slots after it in its cluster are shifted backward.
+static void _ok_map_ordered_remove_entry(struct _ok_map *map, void *removed_entry) {
+    const size_t mask = map->capacity_mask;
+    const size_t slot = OK_OFFSETOF(map->buckets, removed_entry) / map->bucket_stride + 1;
+    size_t i = (size_t)(*(ok_hash_t *)(removed_entry) & mask);
+    while (_ok_map_index_get(map, i) != slot) {
+        i = (i + 1) & mask;
+    }
+    size_t j = i;
+    while (true) {
+        j = (j + 1) & mask;
+        size_t next_slot = _ok_map_index_get(map, j);
+        if (next_slot == 0) {
+            break;
+        }
+        size_t k = (size_t)(*(ok_hash_t *)OK_PTR_INC(map->buckets,
+                                                     (next_slot - 1) * map->bucket_stride)) & mask;
+        if ((i <= j) ? ((k <= i) || (k > j)) : ((k <= i) && (k > j))) {
+            _ok_map_index_set(map, i, next_slot);
+            i = j;
+        }
+    }
+    _ok_map_index_set(map, i, 0);
+    memset(removed_entry, 0, sizeof(ok_hash_t));
+    map->count--;
+    map->deleted_count++;
+    while (map->dense_count > 0 &&
+           (*(ok_hash_t *)OK_PTR_INC(map->buckets, (map->dense_count - 1) * map->bucket_stride) &
+            OK_MAP_OCCUPIED_FLAG) == 0) {
+        map->dense_count--;
+        map->deleted_count--;
+    }
+}
+
+// Removes an entry. With linear probing, later entries in the cluster may be moved backward. In a
+// small map, the last entry is moved to the removed entry's bucket. If `moved_func` is not NULL,
+// it is called with the old and new bucket index of each moved entry.
+static void _ok_map_remove_entry_and_notify(struct _ok_map *map, void *removed_entry,
+                                            void (*moved_func)(void *context, size_t from_index,
+                                                               size_t to_index),
+                                            void *context) {
+    if (map->index) {
+        _ok_map_ordered_remove_entry(map, removed_entry);
+        return;
+    }
+    if (map->small) {
+        size_t i = OK_OFFSETOF(map->buckets, removed_entry) / map->bucket_stride;
+        size_t last = map->count - 1;
+        void *last_entry = OK_PTR_INC(map->buckets, last * map->bucket_stride);
+        if (i != last) {
+            _ok_map_move_entry(map, removed_entry, last_entry);
+            if (moved_func) {
+                moved_func(context, last, i);
+            }
+        }
+        memset(last_entry, 0, sizeof(ok_hash_t));
+        map->count--;
+        return;
+    }
+    memset(removed_entry, 0, sizeof(ok_hash_t));
+    map->count--;
+
+    size_t i = OK_OFFSETOF(map->buckets, removed_entry) / map->bucket_stride;
+    size_t j = i;
+
+    if (map->ctrl) {
+        // If there was never a full group around this bucket, no probe sequence could have
+        // continued past it, so it can be marked as empty instead of deleted.
+        size_t i_before = (i - OK_MAP_GROUP_WIDTH) & map->capacity_mask;
+        uint32_t empty_after = _ok_map_group_match(map->ctrl + i, OK_MAP_CTRL_EMPTY);
+        uint32_t empty_before = _ok_map_group_match(map->ctrl + i_before, OK_MAP_CTRL_EMPTY);
+        bool was_never_full = (empty_before && empty_after &&
+                               _ok_ctz32(empty_after) + (15 - _ok_bsr32(empty_before)) <
+                               OK_MAP_GROUP_WIDTH);
+        if (was_never_full) {
+            _ok_map_set_ctrl(map, i, OK_MAP_CTRL_EMPTY);
+        } else {
+            _ok_map_set_ctrl(map, i, OK_MAP_CTRL_DELETED);
+            map->deleted_count++;
+        }
+        return;
+    }
+
+    // NOTE: This only works with linear probing
+    const size_t mask = map->capacity_mask;
+    while (true) {
+        j = (j + 1) & mask;
+        void *entry = OK_PTR_INC(map->buckets, j * map->bucket_stride);
+
+        ok_hash_t flags_hash = *(ok_hash_t *)(entry);
+        if ((flags_hash & OK_MAP_OCCUPIED_FLAG) == 0) {
+            break;
+        }
+        size_t k = flags_hash & mask;
+        if ((i <= j) ? ((k <= i) || (k > j)) : ((k <= i) && (k > j))) {
+            _ok_map_move_entry(map, removed_entry, entry);
+            if (moved_func) {
+                moved_func(context, j, i);
+            }
+            i = j;
+            removed_entry = entry;
+            memset(removed_entry, 0, sizeof(ok_hash_t));
+        } else if (map->options & OK_MAP_OPTION_ROBIN_HOOD) {
+            // The cluster is ordered by home bucket, so no later entry can move.
+            break;
+        }
+    }
+}
+
+static void _ok_map_remove_entry(struct _ok_map *map, void *removed_entry) {
+    _ok_map_remove_entry_and_notify(map, removed_entry, NULL, NULL);
+}
+
+OK_LIB_API bool _ok_map_remove(struct _ok_map *map, const void *key, ok_hash_t key_hash) {
+    if (!map || map->frozen) {
+        return false;
+    }
+    if (map->old_map) {
+        _ok_map_migrate(map, OK_MAP_MIGRATE_STEP);
+    }
+    void *removed_entry = _ok_map_find_entry(map, key, key_hash, NULL);
+    if (removed_entry) {
+        _ok_map_remove_entry(map, removed_entry);
+        return true;
+    } else if (map->old_map) {
+        removed_entry = _ok_map_find_entry(map->old_map, key, key_hash, NULL);
+        if (removed_entry) {
+            _ok_map_remove_entry(map->old_map, removed_entry);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Removes the entries that are in the other map (or, if `in_other_map` is false, that are not in
+// the other map). The buckets are visited backward, starting at an empty bucket. Removal only
+// moves entries backward, from buckets that were already visited, so every entry is visited once.
+static void _ok_map_remove_matching(struct _ok_map *map, const struct _ok_map *other_map,
+                                    bool in_other_map) {
+    if (map->index) {
+        // Removal doesn't move dense buckets
+        for (size_t i = 0; i < map->dense_count && map->count > 0; i++) {
+            void *bucket = OK_PTR_INC(map->buckets, i * map->bucket_stride);
+            ok_hash_t flags_hash = *(ok_hash_t *)(bucket);
+            if ((flags_hash & OK_MAP_OCCUPIED_FLAG) &&
+                (_ok_map_lookup_entry(other_map, OK_PTR_INC(bucket, map->key_offset),
+                                      flags_hash) != NULL) == in_other_map) {
+                _ok_map_remove_entry(map, bucket);
+            }
+        }
+        return;
+    }
+    if (map->small) {
+        // Removal moves the last entry, which was already visited
+        for (size_t i = map->count; i > 0; i--) {
+            void *bucket = OK_PTR_INC(map->buckets, (i - 1) * map->bucket_stride);
+            ok_hash_t flags_hash = *(ok_hash_t *)(bucket);
+            if ((_ok_map_lookup_entry(other_map, OK_PTR_INC(bucket, map->key_offset),
+                                      flags_hash) != NULL) == in_other_map) {
+                _ok_map_remove_entry(map, bucket);
+            }
+        }
+        return;
+    }
+    size_t start = 0;
+    if (!map->ctrl) {
+        while (*(ok_hash_t *)OK_PTR_INC(map->buckets, start * map->bucket_stride) &
+               OK_MAP_OCCUPIED_FLAG) {
+            start++;
+        }
+    }
+    for (size_t n = 0; n <= map->capacity_mask && map->count > 0; n++) {
+        size_t i = (start - n) & map->capacity_mask;
+        void *bucket = OK_PTR_INC(map->buckets, i * map->bucket_stride);
+        ok_hash_t flags_hash = *(ok_hash_t *)(bucket);
+        if ((flags_hash & OK_MAP_OCCUPIED_FLAG) &&
+            (_ok_map_lookup_entry(other_map, OK_PTR_INC(bucket, map->key_offset),
+                                  flags_hash) != NULL) == in_other_map) {
+            _ok_map_remove_entry(map, bucket);
+        }
+    }
+}
+
+OK_LIB_API bool _ok_map_intersect(struct _ok_map **map, const struct _ok_map *other_map) {
+    if (!*map) {
+        return true;
+    }
+    if ((*map)->frozen || (other_map && (*map)->key_equals_func != other_map->key_equals_func)) {
+        return false;
+    }
+    if ((*map)->old_map) {
+        _ok_map_migrate(*map, SIZE_MAX);
+    }
+    const size_t other_count = _ok_map_count(other_map);
+    if ((*map)->count <= other_count || (*map)->index) {
+        // Insertion-ordered maps keep their own order
+        _ok_map_remove_matching(*map, other_map, false);
+        return true;
+    }
+    // Iterate the other map, and create a new map with the entries that are in both.
+    struct _ok_map *new_map = _ok_map_create_empty_copy(*map, (size_t)((float)other_count /
+                                                                      (*map)->max_load_factor) + 1);
+    if (!new_map) {
+        return false;
+    }
+    void *iterator = NULL;
+    while ((iterator = _ok_map_next(other_map, iterator, NULL, 0, NULL, 0)) != NULL) {
+        void *other_entry = (uint8_t *)iterator - other_map->bucket_stride;
+        ok_hash_t flags_hash = *(ok_hash_t *)(other_entry);
+        void *entry = _ok_map_find_entry(*map, OK_PTR_INC(other_entry, other_map->key_offset),
+                                         flags_hash, NULL);
+        if (entry) {
+            void *new_entry = _ok_map_find_free_entry(new_map, flags_hash);
+            _ok_map_occupy_entry(new_map, new_entry, flags_hash);
+            _ok_map_copy_entry(new_map, new_entry, *map, entry);
+        }
+    }
+    _ok_map_free(*map);
+    *map = new_map;
+    return true;
+}
+
+OK_LIB_API bool _ok_map_difference(struct _ok_map *map, const struct _ok_map *other_map) {
+    if (!map || !other_map) {
+        return !map || !map->frozen;
+    }
+    if (map->frozen || map->key_equals_func != other_map->key_equals_func) {
+        return false;
+    }
+    if (map->old_map) {
+        _ok_map_migrate(map, SIZE_MAX);
+    }
+    if (map->count <= _ok_map_count(other_map)) {
+        _ok_map_remove_matching(map, other_map, true);
+        return true;
+    }
+    // Iterate the other map, removing its entries from this map.
+    void *iterator = NULL;
+    while (map->count > 0 &&
+           (iterator = _ok_map_next(other_map, iterator, NULL, 0, NULL, 0)) != NULL) {
+        void *other_entry = (uint8_t *)iterator - other_map->bucket_stride;
+        ok_hash_t flags_hash = *(ok_hash_t *)(other_entry);
+        void *entry = _ok_map_find_entry(map, OK_PTR_INC(other_entry, other_map->key_offset),
+                                         flags_hash, NULL);
+        if (entry) {
+            _ok_map_remove_entry(map, entry);
+        }
+    }
+    return true;
+}
+
+static int _ok_map_bucket_hash_cmp(const void *a, const void *b) {
+    ok_hash_t hash_a = **(const ok_hash_t *const *)a;
+    ok_hash_t hash_b = **(const ok_hash_t *const *)b;
+    return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+// Sorts groups by size (in the upper 32 bits), largest first.
+static int _ok_map_group_size_cmp(const void *a, const void *b) {
+    uint64_t group_a = *(const uint64_t *)a;
+    uint64_t group_b = *(const uint64_t *)b;
+    return (group_a < group_b) - (group_a > group_b);
+}
+
+OK_LIB_API bool _ok_map_freeze(struct _ok_map *map) {
+    if (map->frozen) {
+        return true;
+    }
+    if (map->old_map) {
+        _ok_map_migrate(map, SIZE_MAX);
+    }
+    const size_t count = map->count;
+    if ((uint64_t)count > UINT32_MAX) {
+        return false;
+    }
+    const size_t group_count = (count + OK_MAP_FROZEN_GROUP_SIZE - 1) / OK_MAP_FROZEN_GROUP_SIZE;
+    void **entries = (void **)malloc((count + 1) * sizeof(void *));
+    uint64_t *mixed_hashes = (uint64_t *)malloc((count + 1) * sizeof(uint64_t));
+    uint32_t *group_start = (uint32_t *)calloc(group_count + 2, sizeof(uint32_t));
+    uint32_t *group_keys = (uint32_t *)malloc((count + 1) * sizeof(uint32_t));
+    void **overflow_entries = (void **)malloc((count + 1) * sizeof(void *));
+    uint64_t *group_order = (uint64_t *)malloc((group_count + 1) * sizeof(uint64_t));
+    uint32_t *displacements = (uint32_t *)calloc(group_count + 1, sizeof(uint32_t));
+    const size_t max_bucket_count = count + count / OK_MAP_FROZEN_KEYS_PER_EMPTY_BUCKET + 1;
+    uint8_t *taken = (uint8_t *)calloc(max_bucket_count / 8 + 1, 1);
+    void *buckets = calloc(max_bucket_count, map->bucket_stride);
+    void *values = (map->values ? calloc(max_bucket_count, map->value_stride) : NULL);
+    bool success = (entries && mixed_hashes && group_start && group_keys && overflow_entries &&
+                    group_order && displacements && taken && buckets &&
+                    (values || !map->values));
+    size_t unique_count = 0;
+    size_t perfect_count = 0;
+    size_t overflow_count = 0;
+    if (success) {
+        // Divide the keys into groups
+        size_t n = 0;
+        for (size_t i = 0; n < count; i++) {
+            void *bucket = OK_PTR_INC(map->buckets, i * map->bucket_stride);
+            if (*(ok_hash_t *)(bucket) & OK_MAP_OCCUPIED_FLAG) {
+                entries[n] = bucket;
+                mixed_hashes[n] = _ok_map_frozen_mix(*(ok_hash_t *)(bucket));
+                group_start[_ok_map_frozen_group(mixed_hashes[n], group_count) + 2]++;
+                n++;
+            }
+        }
+        for (size_t g = 0; g < group_count; g++) {
+            group_start[g + 2] += group_start[g + 1];
+        }
+        for (size_t i = 0; i < count; i++) {
+            group_keys[group_start[_ok_map_frozen_group(mixed_hashes[i], group_count) + 1]++] =
+                (uint32_t)i;
+        }
+
+        // Keys with the same hash are in the same group. Sort each group (they are small, so
+        // insertion sort is used), and move all but the first key of each hash to the overflow.
+        for (size_t g = 0; g < group_count; g++) {
+            uint32_t *keys = group_keys + group_start[g];
+            const size_t size = group_start[g + 1] - group_start[g];
+            for (size_t i = 1; i < size; i++) {
+                uint32_t key = keys[i];
+                size_t j = i;
+                while (j > 0 && mixed_hashes[keys[j - 1]] > mixed_hashes[key]) {
+                    keys[j] = keys[j - 1];
+                    j--;
+                }
+                keys[j] = key;
+            }
+            group_start[g] = (uint32_t)unique_count;
+            for (size_t i = 0; i < size; i++) {
+                if (i > 0 && mixed_hashes[keys[i]] == mixed_hashes[keys[i - 1]]) {
+                    overflow_entries[overflow_count++] = entries[keys[i]];
+                } else {
+                    group_keys[unique_count++] = keys[i];
+                }
+            }
+        }
+        group_start[group_count] = (uint32_t)unique_count;
+        // A few empty buckets make finding displacements for the last groups much faster
+        perfect_count = unique_count + unique_count / OK_MAP_FROZEN_KEYS_PER_EMPTY_BUCKET;
+        for (size_t g = 0; g < group_count; g++) {
+            group_order[g] = ((uint64_t)(group_start[g + 1] - group_start[g]) << 32) | g;
+        }
+        qsort(group_order, group_count, sizeof(uint64_t), _ok_map_group_size_cmp);
+    }
+
+    // Find a displacement for each group, largest groups first
+    for (size_t i = 0; success && i < group_count && (group_order[i] >> 32) > 0; i++) {
+        const size_t g = (size_t)(group_order[i] & 0xffffffff);
+        const uint32_t *keys = group_keys + group_start[g];
+        const size_t size = group_start[g + 1] - group_start[g];
+        uint32_t displacement = 0;
+        while (true) {
+            size_t placed = 0;
+            while (placed < size) {
+                size_t index = _ok_map_frozen_index(mixed_hashes[keys[placed]], displacement,
+                                                    perfect_count);
+                uint8_t bit = (uint8_t)(1u << (index & 7));
+                if (taken[index >> 3] & bit) {
+                    break;
+                }
+                taken[index >> 3] |= bit;
+                placed++;
+            }
+            if (placed == size) {
+                break;
+            }
+            while (placed > 0) {
+                placed--;
+                size_t index = _ok_map_frozen_index(mixed_hashes[keys[placed]], displacement,
+                                                    perfect_count);
+                taken[index >> 3] &= (uint8_t)~(1u << (index & 7));
+            }
+            if (displacement == UINT32_MAX) {
+                success = false;
+                break;
+            }
+            displacement++;
+        }
+        displacements[g] = displacement;
+    }
+
+    if (success) {
+        for (size_t g = 0; g < group_count; g++) {
+            for (size_t i = group_start[g]; i < group_start[g + 1]; i++) {
+                uint32_t key = group_keys[i];
+                size_t index = _ok_map_frozen_index(mixed_hashes[key], displacements[g],
+                                                    perfect_count);
+                memcpy(OK_PTR_INC(buckets, index * map->bucket_stride), entries[key],
+                       map->bucket_stride);
+                if (values) {
+                    memcpy(OK_PTR_INC(values, index * map->value_stride),
+                           _ok_map_value(map, entries[key]), map->value_stride);
+                }
+            }
+        }
+        // Overflow, sorted by hash
+        qsort(overflow_entries, overflow_count, sizeof(void *), _ok_map_bucket_hash_cmp);
+        for (size_t i = 0; i < overflow_count; i++) {
+            memcpy(OK_PTR_INC(buckets, (perfect_count + i) * map->bucket_stride),
+                   overflow_entries[i], map->bucket_stride);
+            if (values) {
+                memcpy(OK_PTR_INC(values, (perfect_count + i) * map->value_stride),
+                       _ok_map_value(map, overflow_entries[i]), map->value_stride);
+            }
+        }
+        _ok_map_free_arrays(map);
+        map->buckets = buckets;
+        map->values = values;
+        map->deleted_count = 0;
+        map->displacements = displacements;
+        map->displacement_count = group_count;
+        map->perfect_count = perfect_count;
+        map->overflow_count = overflow_count;
+        map->dense_count = 0;
+        map->frozen = true;
+    } else {
+        free(buckets);
+        free(values);
+        free(displacements);
+    }
+    free(entries);
+    free(mixed_hashes);
+    free(group_start);
+    free(group_keys);
+    free(overflow_entries);
+    free(group_order);
+    free(taken);
+    return success;
+}
+
+// MARK: Implementation: Private map file functions
+
+/*
+ Map file format. All values are in native byte order, and the file is only valid on machines with
+ the same byte order and the same ok_hash_t size. The header is followed by the bucket array, the
+ control bytes (group probing only), the displacements (frozen maps only), and the index
+ (insertion-ordered maps only), each starting at a multiple of OK_MAP_FILE_ALIGNMENT. The arrays
+ are used in place when the file is mapped.
+ */
+
+#if defined(_WIN32)
+#  ifndef WIN32_LEAN_AND_MEAN
+#    define WIN32_LEAN_AND_MEAN
+#  endif
+#  if defined(_MSC_VER)
+#    pragma warning(push, 0)
+#  endif
+#  include <windows.h>
+#  if defined(_MSC_VER)
+#    pragma warning(pop)
+#  endif
+#  define OK_MAP_FILE_MMAP_WIN32
+#elif defined(__unix__) || defined(__APPLE__)
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#  define OK_MAP_FILE_MMAP_POSIX
+#endif
+#include <stdio.h> // fopen, fwrite, rename
+
+#define OK_MAP_FILE_ALIGNMENT 64
+#define OK_MAP_FILE_VERSION 4
+
+static const char OK_MAP_FILE_MAGIC[8] = { 'o', 'k', '_', 'm', 'a', 'p', '\0', '\0' };
+
+struct _ok_map_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // 0x01020304
+    uint32_t hash_size;
+    uint32_t options;
+    uint64_t hash_check; // Changes if the ok_lib hash functions change
+    uint64_t key_offset;
+    uint64_t value_offset;
+    uint64_t bucket_stride;
+    uint64_t capacity_n;
+    uint64_t count;
+    uint64_t deleted_count;
+    uint64_t frozen;
+    uint64_t displacement_count;
+    uint64_t perfect_count;
+    uint64_t overflow_count;
+    uint64_t buckets_offset;
+    uint64_t buckets_size;
+    uint64_t ctrl_offset;
+    uint64_t ctrl_size;
+    uint64_t displacements_offset;
+    uint64_t displacements_size;
+    uint64_t index_offset;
+    uint64_t index_size;
+    uint64_t values_offset;
+    uint64_t values_size;
+    float max_load_factor;
+    uint32_t small;
+};
+
+static uint64_t _ok_map_file_hash_check(void) {
+    return (uint64_t)(ok_uint64_hash(0x0123456789abcdefull) ^ ok_const_str_hash("ok_map"));
 }
 
-OK_LIB_API ok_hash_t ok_const_str_hash(const char *key) {
-    ok_hash_t hash = 0;
-    char ch;
-    while ((ch = *key++) != 0) {
-        hash += (ok_hash_t)ch;
-        hash += (hash << 10);
-        hash ^= (hash >> 6);
-    }
-    hash += (hash << 3);
-    hash ^= (hash >> 11);
-    hash += (hash << 15);
-    return hash;
+static uint64_t _ok_map_file_align(uint64_t offset) {
+    return (offset + OK_MAP_FILE_ALIGNMENT - 1) & ~(uint64_t)(OK_MAP_FILE_ALIGNMENT - 1);
 }
 
-OK_LIB_API ok_hash_t ok_str_hash(char *key) {
-    return ok_const_str_hash(key);
+// Maps a file as private, copy-on-write memory. If mapping isn't supported, the file is read.
+static void *_ok_map_file_map(const char *path, size_t *mapping_size) {
+    void *mapping = NULL;
+#if defined(OK_MAP_FILE_MMAP_WIN32)
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    LARGE_INTEGER file_size;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 &&
+        (uint64_t)file_size.QuadPart <= SIZE_MAX) {
+        HANDLE file_mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+        if (file_mapping) {
+            mapping = MapViewOfFile(file_mapping, FILE_MAP_COPY, 0, 0, 0);
+            CloseHandle(file_mapping);
+            *mapping_size = (size_t)file_size.QuadPart;
+        }
+    }
+    CloseHandle(file);
+#elif defined(OK_MAP_FILE_MMAP_POSIX)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0 &&
+        (uint64_t)file_stat.st_size <= SIZE_MAX) {
+        mapping = mmap(NULL, (size_t)file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                       fd, 0);
+        if (mapping == MAP_FAILED) {
+            mapping = NULL;
+        } else {
+            *mapping_size = (size_t)file_stat.st_size;
+        }
+    }
+    close(fd);
+#else
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    long file_size = 0;
+    if (fseek(file, 0, SEEK_END) == 0 && (file_size = ftell(file)) > 0 &&
+        fseek(file, 0, SEEK_SET) == 0) {
+        mapping = malloc((size_t)file_size);
+        if (mapping && fread(mapping, 1, (size_t)file_size, file) != (size_t)file_size) {
+            free(mapping);
+            mapping = NULL;
+        }
+        *mapping_size = (size_t)file_size;
+    }
+    fclose(file);
+#endif
+    return mapping;
 }
 
-OK_LIB_API ok_hash_t ok_const_ptr_hash(const void *key) {
-#if UINTPTR_MAX == UINT32_MAX
-    uint32_t int_key;
-    memcpy(&int_key, &key, sizeof(int_key));
-    return ok_uint32_hash(int_key);
-#elif UINTPTR_MAX == UINT64_MAX
-    uint64_t int_key;
-    memcpy(&int_key, &key, sizeof(int_key));
-    return ok_uint64_hash(int_key);
+static void _ok_map_file_unmap(void *mapping, size_t mapping_size) {
+#if defined(OK_MAP_FILE_MMAP_WIN32)
+    (void)mapping_size;
+    UnmapViewOfFile(mapping);
+#elif defined(OK_MAP_FILE_MMAP_POSIX)
+    munmap(mapping, mapping_size);
 #else
-    ok_static_assert(false, "Unknown pointer size");
-    return 0;
+    (void)mapping_size;
+    free(mapping);
 #endif
 }
 
-OK_LIB_API ok_hash_t ok_ptr_hash(void *key) {
-    return ok_const_ptr_hash(key);
+// Writes padding up to the offset, then the data. The padding is less than OK_MAP_FILE_ALIGNMENT.
+static bool _ok_map_file_write(FILE *file, uint64_t *position, const void *data, uint64_t offset,
+                               uint64_t size) {
+    static const uint8_t padding[OK_MAP_FILE_ALIGNMENT] = { 0 };
+    size_t padding_size = (size_t)(offset - *position);
+    bool success = (fwrite(padding, 1, padding_size, file) == padding_size &&
+                    fwrite(data, 1, (size_t)size, file) == (size_t)size);
+    *position = offset + size;
+    return success;
 }
 
-OK_LIB_API ok_hash_t ok_hash_combine(ok_hash_t hash_a, ok_hash_t hash_b) {
-    return hash_a ^ (hash_b + 0x9e3779b9 + (hash_a << 6) + (hash_a >> 2));
+// Replaces the file at `to_path` with the file at `from_path`. Existing mappings of the old file
+// are not affected.
+static bool _ok_map_file_replace(const char *from_path, const char *to_path) {
+#if defined(OK_MAP_FILE_MMAP_WIN32)
+    return MoveFileExA(from_path, to_path, MOVEFILE_REPLACE_EXISTING) != 0;
+#elif defined(OK_MAP_FILE_MMAP_POSIX)
+    return rename(from_path, to_path) == 0;
+#else
+    // rename() may fail if the destination exists
+    return (rename(from_path, to_path) == 0 ||
+            (remove(to_path) == 0 && rename(from_path, to_path) == 0));
+#endif
 }
 
-// MARK: Implementation: Equals functions
+OK_LIB_API bool _ok_map_save(struct _ok_map *map, const char *path) {
+    if (map->old_map) {
+        _ok_map_migrate(map, SIZE_MAX);
+    }
+    struct _ok_map_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OK_MAP_FILE_MAGIC, sizeof(header.magic));
+    header.version = OK_MAP_FILE_VERSION;
+    header.byte_order = 0x01020304;
+    header.hash_size = sizeof(ok_hash_t);
+    header.options = map->options;
+    header.hash_check = _ok_map_file_hash_check();
+    header.key_offset = map->key_offset;
+    header.value_offset = map->value_offset;
+    // The entry size, which is the bucket stride unless the values are split
+    header.bucket_stride = (map->values ? map->value_offset + map->value_stride :
+                            map->bucket_stride);
+    header.capacity_n = map->capacity_n;
+    header.count = map->count;
+    header.deleted_count = map->deleted_count;
+    header.frozen = map->frozen;
+    header.displacement_count = map->displacement_count;
+    header.perfect_count = map->perfect_count;
+    header.overflow_count = map->overflow_count;
+    header.max_load_factor = map->max_load_factor;
+    header.small = map->small;
+    header.buckets_offset = _ok_map_file_align(sizeof(header));
+    header.buckets_size = (uint64_t)_ok_map_bucket_count(map) * map->bucket_stride;
+    uint64_t offset = header.buckets_offset + header.buckets_size;
+    if (map->ctrl) {
+        header.ctrl_offset = _ok_map_file_align(offset);
+        header.ctrl_size = ((uint64_t)1 << map->capacity_n) + OK_MAP_GROUP_WIDTH;
+        offset = header.ctrl_offset + header.ctrl_size;
+    }
+    if (map->frozen) {
+        header.displacements_offset = _ok_map_file_align(offset);
+        header.displacements_size = map->displacement_count * sizeof(uint32_t);
+        offset = header.displacements_offset + header.displacements_size;
+    }
+    if (map->index) {
+        header.index_offset = _ok_map_file_align(offset);
+        header.index_size = ((uint64_t)1 << map->capacity_n) * map->index_width;
+        offset = header.index_offset + header.index_size;
+    }
+    if (map->values) {
+        header.values_offset = _ok_map_file_align(offset);
+        header.values_size = (uint64_t)_ok_map_bucket_count(map) * map->value_stride;
+    }
 
-OK_LIB_API bool ok_8bit_equals(const void *v1, const void *v2) {
-    uint8_t a = *(const uint8_t *)v1;
-    uint8_t b = *(const uint8_t *)v2;
-    return a == b;
+    // Write to a temporary file, then replace the file at `path`. Truncating `path` in place would
+    // pull the pages out from under a map opened from it.
+    static const char temp_suffix[] = ".tmp";
+    const size_t path_length = strlen(path);
+    char *temp_path = (char *)malloc(path_length + sizeof(temp_suffix));
+    if (!temp_path) {
+        return false;
+    }
+    memcpy(temp_path, path, path_length);
+    memcpy(temp_path + path_length, temp_suffix, sizeof(temp_suffix));
+    FILE *file = fopen(temp_path, "wb");
+    if (!file) {
+        free(temp_path);
+        return false;
+    }
+    uint64_t position = 0;
+    bool success = (_ok_map_file_write(file, &position, &header, 0, sizeof(header)) &&
+                    _ok_map_file_write(file, &position, map->buckets, header.buckets_offset,
+                                       header.buckets_size) &&
+                    (!map->ctrl || _ok_map_file_write(file, &position, map->ctrl,
+                                                      header.ctrl_offset, header.ctrl_size)) &&
+                    (!map->frozen || _ok_map_file_write(file, &position, map->displacements,
+                                                        header.displacements_offset,
+                                                        header.displacements_size)) &&
+                    (!map->index || _ok_map_file_write(file, &position, map->index,
+                                                       header.index_offset, header.index_size)) &&
+                    (!map->values || _ok_map_file_write(file, &position, map->values,
+                                                        header.values_offset,
+                                                        header.values_size)));
+    success = (fclose(file) == 0) && success;
+    success = success && _ok_map_file_replace(temp_path, path);
+    if (!success) {
+        remove(temp_path);
+    }
+    free(temp_path);
+    return success;
 }
 
-OK_LIB_API bool ok_16bit_equals(const void *v1, const void *v2) {
-    uint16_t a = *(const uint16_t *)v1;
-    uint16_t b = *(const uint16_t *)v2;
-    return a == b;
+// Checks that an array in the file is within the file.
+static bool _ok_map_file_array_valid(uint64_t offset, uint64_t size, uint64_t file_size) {
+    return (offset % OK_MAP_FILE_ALIGNMENT == 0 && offset <= file_size &&
+            size <= file_size - offset);
 }
 
-OK_LIB_API bool ok_32bit_equals(const void *v1, const void *v2) {
-    uint32_t a = *(const uint32_t *)v1;
-    uint32_t b = *(const uint32_t *)v2;
-    return a == b;
+// Checks that the index slot width is valid, and that its slots can point to every dense bucket.
+static bool _ok_map_file_index_width_valid(uint64_t index_width, uint64_t dense_count) {
+    return ((index_width == 1 && dense_count < UINT8_MAX) ||
+            (index_width == 2 && dense_count < UINT16_MAX) ||
+            (index_width == 4 && dense_count < UINT32_MAX) ||
+            index_width == 8);
 }
 
-OK_LIB_API bool ok_64bit_equals(const void *v1, const void *v2) {
-    uint64_t a = *(const uint64_t *)v1;
-    uint64_t b = *(const uint64_t *)v2;
-    return a == b;
+OK_LIB_API struct _ok_map *_ok_map_open(const char *path,
+                                        bool (*key_equals_func)(const void *key1,
+                                                                const void *key2),
+                                        size_t key_offset, size_t value_offset,
+                                        size_t bucket_stride) {
+    size_t mapping_size = 0;
+    void *mapping = _ok_map_file_map(path, &mapping_size);
+    if (!mapping) {
+        return NULL;
+    }
+    struct _ok_map_file_header header;
+    bool valid = mapping_size >= sizeof(header);
+    if (valid) {
+        memcpy(&header, mapping, sizeof(header));
+        valid = (memcmp(header.magic, OK_MAP_FILE_MAGIC, sizeof(header.magic)) == 0 &&
+                 header.version == OK_MAP_FILE_VERSION &&
+                 header.byte_order == 0x01020304 &&
+                 header.hash_size == sizeof(ok_hash_t) &&
+                 header.hash_check == _ok_map_file_hash_check() &&
+                 header.key_offset == key_offset &&
+                 header.value_offset == value_offset &&
+                 header.bucket_stride == bucket_stride &&
+                 header.capacity_n < sizeof(size_t) * 8 &&
+                 header.max_load_factor >= OK_MAP_MIN_MAX_LOAD &&
+                 header.max_load_factor <= OK_MAP_MAX_MAX_LOAD &&
+                 _ok_map_file_array_valid(header.buckets_offset, header.buckets_size,
+                                          mapping_size));
+    }
+    bool has_values = false;
+    size_t value_stride = 0;
+    if (valid) {
+        has_values = (header.options & OK_MAP_OPTION_SPLIT_VALUES) != 0;
+        if (has_values) {
+            valid = value_offset < bucket_stride;
+            value_stride = bucket_stride - value_offset;
+            bucket_stride = _ok_map_split_bucket_stride(key_offset, value_offset);
+        }
+    }
+    if (valid) {
+        bool has_ctrl = ((header.options & OK_MAP_OPTION_GROUP_PROBING) && !header.frozen &&
+                         !header.small);
+        bool has_index = (header.options & OK_MAP_OPTION_INSERTION_ORDER) && !header.frozen;
+        uint64_t bucket_count = (header.frozen ?
+                                 header.perfect_count + header.overflow_count :
+                                 has_index ? header.buckets_size / bucket_stride :
+                                 (uint64_t)1 << header.capacity_n);
+        valid = ((!header.small ||
+                  ((uint64_t)1 << header.capacity_n == OK_MAP_SMALL_CAPACITY &&
+                   !header.frozen && !has_index)) &&
+                 header.buckets_size / bucket_stride == bucket_count &&
+                 header.buckets_size % bucket_stride == 0 &&
+                 (has_values ?
+                  (header.values_size == bucket_count * value_stride &&
+                   _ok_map_file_array_valid(header.values_offset, header.values_size,
+                                            mapping_size)) :
+                  header.values_size == 0) &&
+                 header.count <= bucket_count &&
+                 (has_ctrl ?
+                  (header.ctrl_size == bucket_count + OK_MAP_GROUP_WIDTH &&
+                   _ok_map_file_array_valid(header.ctrl_offset, header.ctrl_size,
+                                            mapping_size)) :
+                  header.ctrl_size == 0) &&
+                 (has_index ?
+                  (_ok_map_file_index_width_valid(header.index_size >> header.capacity_n,
+                                                  bucket_count) &&
+                   header.index_size == (header.index_size >> header.capacity_n) <<
+                   header.capacity_n &&
+                   bucket_count < ((uint64_t)1 << header.capacity_n) &&
+                   _ok_map_file_array_valid(header.index_offset, header.index_size,
+                                            mapping_size)) :
+                  header.index_size == 0) &&
+                 (!header.frozen ||
+                  (header.displacements_size == header.displacement_count * sizeof(uint32_t) &&
+                   _ok_map_file_array_valid(header.displacements_offset,
+                                            header.displacements_size, mapping_size))));
+    }
+    struct _ok_map *map = NULL;
+    if (valid) {
+        map = (struct _ok_map *)calloc(1, sizeof(struct _ok_map));
+    }
+    if (!map) {
+        _ok_map_file_unmap(mapping, mapping_size);
+        return NULL;
+    }
+    map->key_equals_func = key_equals_func;
+    map->key_offset = key_offset;
+    map->value_offset = value_offset;
+    map->bucket_stride = bucket_stride;
+    map->value_stride = value_stride;
+    map->options = header.options;
+    map->max_load_factor = header.max_load_factor;
+    map->capacity_n = (size_t)header.capacity_n;
+    map->capacity_mask = ((size_t)1 << map->capacity_n) - 1;
+    map->max_count = _ok_map_max_count((size_t)1 << map->capacity_n, map->max_load_factor);
+    if (header.small) {
+        map->small = true;
+        map->max_count = OK_MAP_SMALL_CAPACITY;
+    }
+    map->count = (size_t)header.count;
+    map->deleted_count = (size_t)header.deleted_count;
+    map->frozen = (header.frozen != 0);
+    map->displacement_count = (size_t)header.displacement_count;
+    map->perfect_count = (size_t)header.perfect_count;
+    map->overflow_count = (size_t)header.overflow_count;
+    map->mapping = mapping;
+    map->mapping_size = mapping_size;
+    map->buckets = OK_PTR_INC(mapping, header.buckets_offset);
+    if (header.ctrl_size > 0) {
+        map->ctrl = (uint8_t *)OK_PTR_INC(mapping, header.ctrl_offset);
+    }
+    if (has_values) {
+        map->values = OK_PTR_INC(mapping, header.values_offset);
+    }
+    if (map->frozen) {
+        map->displacements = (uint32_t *)(void *)OK_PTR_INC(mapping,
+                                                            header.displacements_offset);
+    }
+    if (header.index_size > 0) {
+        map->index = OK_PTR_INC(mapping, header.index_offset);
+        map->index_width = (size_t)(header.index_size >> map->capacity_n);
+        map->dense_count = (size_t)(header.buckets_size / bucket_stride);
+        // The mapped dense array has no free buckets, so the next new key rebuilds the map.
+        map->max_count = map->dense_count;
+    }
+    return map;
 }
 
-OK_LIB_API bool ok_str_equals(const void *a, const void *b) {
-    const char *str1 = *(const char * const *)a;
-    const char *str2 = *(const char * const *)b;
+// MARK: Implementation: Private LRU cache functions
 
-    return strcmp(str1, str2) == 0;
-}
+/*
+ The cache is a map with the default layout (linear probing) that never grows: the bucket count is
+ chosen so that a full cache is at most at the default max load factor. The recency list is a
+ doubly linked list of bucket indexes, stored in the buckets. Removal may move entries backward in
+ their cluster, and the links of each moved entry's neighbors are updated when it moves.
+ */
 
-OK_LIB_API bool ok_ptr_equals(const void *v1, const void *v2) {
-    const void *a = *(const void * const *)v1;
-    const void *b = *(const void * const *)v2;
-    return a == b;
+static const size_t OK_LRU_NONE = SIZE_MAX;
+
+struct _ok_lru {
+    struct _ok_map *map;
+    size_t links_offset;
+    size_t capacity;
+
+    // Bucket indexes of the most recently used and least recently used entries.
+    size_t head;
+    size_t tail;
+
+    size_t hits;
+    size_t misses;
+
+    void (*evict_func)(void *context, void *key, void *value);
+    void *evict_context;
+};
+
+static inline size_t *_ok_lru_links(const struct _ok_lru *lru, size_t index) {
+    return (size_t *)(void *)OK_PTR_INC(lru->map->buckets,
+                                        index * lru->map->bucket_stride + lru->links_offset);
 }
 
-// MARK: Implementation: Private vector functions
+static void _ok_lru_unlink(struct _ok_lru *lru, size_t index) {
+    size_t *links = _ok_lru_links(lru, index);
+    if (links[0] == OK_LRU_NONE) {
+        lru->head = links[1];
+    } else {
+        _ok_lru_links(lru, links[0])[1] = links[1];
+    }
+    if (links[1] == OK_LRU_NONE) {
+        lru->tail = links[0];
+    } else {
+        _ok_lru_links(lru, links[1])[0] = links[0];
+    }
+}
 
-OK_LIB_API bool _ok_vec_realloc(void **values, size_t min_capacity,
-                                size_t element_size, size_t *capacity) {
-    const size_t capacity_2 = *capacity << 1;
-    min_capacity = min_capacity < 8 ? 8 : min_capacity;
-    const size_t new_capacity = capacity_2 > min_capacity ? capacity_2 : min_capacity;
-    void *new_values = realloc(*values, element_size * new_capacity);
-    if (new_values) {
-        *values = new_values;
-        *capacity = new_capacity;
-        return true;
+static void _ok_lru_push_front(struct _ok_lru *lru, size_t index) {
+    size_t *links = _ok_lru_links(lru, index);
+    links[0] = OK_LRU_NONE;
+    links[1] = lru->head;
+    if (lru->head == OK_LRU_NONE) {
+        lru->tail = index;
     } else {
-        return false;
+        _ok_lru_links(lru, lru->head)[0] = index;
     }
+    lru->head = index;
 }
 
-// MARK: Implementation: Private map functions
+static void _ok_lru_touch(struct _ok_lru *lru, void *entry) {
+    size_t index = OK_OFFSETOF(lru->map->buckets, entry) / lru->map->bucket_stride;
+    if (lru->head != index) {
+        _ok_lru_unlink(lru, index);
+        _ok_lru_push_front(lru, index);
+    }
+}
 
-/*
- Hashtable implementation notes:
- 1) Open addressing
- 2) Linear probing
- 3) Cleanup on deletion (no lazy deletion)
+// Called when removal moves an entry. The entry's links were moved with it.
+static void _ok_lru_entry_moved(void *context, size_t from_index, size_t to_index) {
+    struct _ok_lru *lru = (struct _ok_lru *)context;
+    size_t *links = _ok_lru_links(lru, to_index);
+    (void)from_index;
+    if (links[0] == OK_LRU_NONE) {
+        lru->head = to_index;
+    } else {
+        _ok_lru_links(lru, links[0])[1] = to_index;
+    }
+    if (links[1] == OK_LRU_NONE) {
+        lru->tail = to_index;
+    } else {
+        _ok_lru_links(lru, links[1])[0] = to_index;
+    }
+}
 
- Only the lower 31 bits of the hash are used. The upper bit is the "occupied" flag.
+static void _ok_lru_remove_entry(struct _ok_lru *lru, void *entry) {
+    _ok_lru_unlink(lru, OK_OFFSETOF(lru->map->buckets, entry) / lru->map->bucket_stride);
+    _ok_map_remove_entry_and_notify(lru->map, entry, _ok_lru_entry_moved, lru);
+}
 
- References:
- * https://en.wikipedia.org/wiki/Open_addressing
- * http://research.cs.vt.edu/AVresearch/hashing/index.php
- */
+OK_LIB_API struct _ok_lru *_ok_lru_create(size_t capacity,
+                                          bool (*key_equals_func)(const void *key1,
+                                                                  const void *key2),
+                                          size_t key_offset, size_t value_offset,
+                                          size_t links_offset, size_t bucket_stride) {
+    if (capacity == 0) {
+        return NULL;
+    }
+    struct _ok_lru *lru = (struct _ok_lru *)calloc(1, sizeof(struct _ok_lru));
+    if (lru) {
+        // A full cache is at most 3/4 full (OK_MAP_DEFAULT_MAX_LOAD), so the map never grows.
+        lru->map = _ok_map_create(capacity + capacity / 3 + 1, key_equals_func, key_offset,
+                                  value_offset, bucket_stride, OK_MAP_OPTION_NONE);
+        if (!lru->map) {
+            free(lru);
+            return NULL;
+        }
+        lru->links_offset = links_offset;
+        lru->capacity = capacity;
+        lru->head = OK_LRU_NONE;
+        lru->tail = OK_LRU_NONE;
+    }
+    return lru;
+}
 
-static const ok_hash_t OK_MAP_OCCUPIED_FLAG = 0x80000000;
-static const size_t OK_MAP_MIN_CAPACITY = 32;
-static const float OK_MAP_DEFAULT_MAX_LOAD = 0.75f;
+OK_LIB_API void _ok_lru_free(struct _ok_lru *lru) {
+    if (lru) {
+        _ok_map_free(lru->map);
+        free(lru);
+    }
+}
 
-struct _ok_map {
-    void *buckets;
+OK_LIB_API void _ok_lru_set_evict_func(struct _ok_lru *lru,
+                                       void (*evict_func)(void *context, void *key, void *value),
+                                       void *context) {
+    lru->evict_func = evict_func;
+    lru->evict_context = context;
+}
 
-    size_t key_offset;
-    size_t value_offset;
-    size_t bucket_stride;
+OK_LIB_API size_t _ok_lru_count(const struct _ok_lru *lru) {
+    return lru->map->count;
+}
 
-    size_t capacity_n;
-    size_t capacity_mask;
-    size_t max_count;
-    size_t count; // The count is the only member that is mutated after _ok_map_init()
+OK_LIB_API size_t _ok_lru_capacity(const struct _ok_lru *lru) {
+    return lru->capacity;
+}
 
-    bool (*key_equals_func)(const void *key1, const void *key2);
+OK_LIB_API size_t _ok_lru_hits(const struct _ok_lru *lru) {
+    return lru->hits;
+}
 
-    float max_load_factor;
-};
+OK_LIB_API size_t _ok_lru_misses(const struct _ok_lru *lru) {
+    return lru->misses;
+}
 
-static struct _ok_map *_ok_map_init(struct _ok_map *map, size_t initial_capacity) {
-    map->count = 0;
-    if (initial_capacity < OK_MAP_MIN_CAPACITY) {
-        initial_capacity = OK_MAP_MIN_CAPACITY;
-    }
-    size_t capacity_n = 0;
-    while ((1u << capacity_n) < initial_capacity) {
-        capacity_n++;
+OK_LIB_API void _ok_lru_put(struct _ok_lru *lru, const void *key, size_t key_size,
+                            ok_hash_t key_hash, const void *value, size_t value_size) {
+    struct _ok_map *map = lru->map;
+    void *new_entry = NULL;
+    void *entry = _ok_map_find_entry(map, key, key_hash, &new_entry);
+    if (entry) {
+        _ok_lru_touch(lru, entry);
+    } else {
+        if (map->count >= lru->capacity) {
+            // Evicting may move entries, including into the free bucket that was found.
+            void *evicted_entry = OK_PTR_INC(map->buckets, lru->tail * map->bucket_stride);
+            if (lru->evict_func) {
+                lru->evict_func(lru->evict_context, OK_PTR_INC(evicted_entry, map->key_offset),
+                                OK_PTR_INC(evicted_entry, map->value_offset));
+            }
+            _ok_lru_remove_entry(lru, evicted_entry);
+            new_entry = _ok_map_find_free_entry(map, key_hash);
+        }
+        entry = new_entry;
+        _ok_map_occupy_entry(map, entry, key_hash);
+        memcpy(OK_PTR_INC(entry, map->key_offset), key, key_size);
+        _ok_lru_push_front(lru, OK_OFFSETOF(map->buckets, entry) / map->bucket_stride);
     }
-    size_t capacity = (1u << capacity_n);
+    memcpy(OK_PTR_INC(entry, map->value_offset), value, value_size);
+}
 
-    map->buckets = calloc(capacity, map->bucket_stride);
-    if (map->buckets) {
-        map->capacity_n = capacity_n;
-        map->capacity_mask = capacity - 1;
-        map->max_count = (size_t)(capacity * map->max_load_factor);
-        // Make sure there is always at least one free entry (for _ok_map_find_entry)
-        if (map->max_count >= capacity) {
-            map->max_count = capacity - 1;
-        }
+OK_LIB_API bool _ok_lru_get(struct _ok_lru *lru, const void *key, ok_hash_t key_hash,
+                            void *value, size_t value_size) {
+    void *value_ptr;
+    _ok_lru_get_ptr(lru, key, key_hash, &value_ptr);
+    if (value_ptr) {
+        memcpy(value, value_ptr, value_size);
+        return true;
     } else {
-        free(map);
-        map = NULL;
+        memset(value, 0, value_size);
+        return false;
     }
-    return map;
 }
 
-static struct _ok_map *_ok_map_copy(const struct _ok_map *from_map,
-                                    size_t initial_capacity,
-                                    size_t key_size, size_t value_size) {
-    struct _ok_map *map = (struct _ok_map *)calloc(1, sizeof(struct _ok_map));
-    if (map) {
-        map->key_equals_func = from_map->key_equals_func;
-        map->key_offset = from_map->key_offset;
-        map->value_offset = from_map->value_offset;
-        map->bucket_stride = from_map->bucket_stride;
-        map->max_load_factor = from_map->max_load_factor;
-        map = _ok_map_init(map, initial_capacity);
-        if (map) {
-            bool success = _ok_map_put_all(&map, from_map, key_size, value_size);
-            if (!success) {
-                _ok_map_free(map);
-                map = NULL;
-            }
-        }
+OK_LIB_API void _ok_lru_get_ptr(struct _ok_lru *lru, const void *key, ok_hash_t key_hash,
+                                void **value_ptr) {
+    void *entry = _ok_map_find_entry(lru->map, key, key_hash, NULL);
+    if (entry) {
+        lru->hits++;
+        _ok_lru_touch(lru, entry);
+        *value_ptr = OK_PTR_INC(entry, lru->map->value_offset);
+    } else {
+        lru->misses++;
+        *value_ptr = NULL;
     }
+}
 
-    return map;
+OK_LIB_API bool _ok_lru_contains(const struct _ok_lru *lru, const void *key, ok_hash_t key_hash) {
+    return (_ok_map_find_entry(lru->map, key, key_hash, NULL) != NULL);
 }
 
-static void *_ok_map_find_entry(const struct _ok_map *map, const void *key,
-                                ok_hash_t key_hash, void **empty_entry) {
-    ok_hash_t hash = key_hash | OK_MAP_OCCUPIED_FLAG;
-    size_t bucket_index = (size_t)(hash & map->capacity_mask);
-    while (true) {
-        void *bucket = OK_PTR_INC(map->buckets, bucket_index * map->bucket_stride);
-        ok_hash_t flags_hash = *(ok_hash_t *)(bucket);
-        if (hash == flags_hash &&
-            map->key_equals_func(OK_PTR_INC(bucket, map->key_offset), key)) {
-            return bucket;
-        } else if ((flags_hash & OK_MAP_OCCUPIED_FLAG) == 0) {
-            if (empty_entry) {
-                *empty_entry = bucket;
-            }
-            return NULL;
-        }
-        bucket_index = (bucket_index + 1) & map->capacity_mask; // Linear probing.
+OK_LIB_API bool _ok_lru_remove(struct _ok_lru *lru, const void *key, ok_hash_t key_hash) {
+    void *entry = _ok_map_find_entry(lru->map, key, key_hash, NULL);
+    if (entry) {
+        _ok_lru_remove_entry(lru, entry);
+        return true;
     }
+    return false;
 }
 
-static void *_ok_map_find_or_put_entry(struct _ok_map **map, const void *key,
-                                       size_t key_size, ok_hash_t key_hash, size_t value_size) {
-    void *new_entry = NULL;
-    void *entry = _ok_map_find_entry(*map, key, key_hash, &new_entry);
-    if (!entry) {
-        // Grow
-        if ((*map)->count >= (*map)->max_count) {
-            struct _ok_map *new_map = _ok_map_copy(*map, (1u << ((*map)->capacity_n + 1)),
-                                                     key_size, value_size);
-            if (!new_map) {
-                return NULL;
-            }
-            _ok_map_free(*map);
-            *map = new_map;
-            new_entry = NULL;
-            _ok_map_find_entry(*map, key, key_hash, &new_entry);
-        }
-        if (new_entry) {
-            entry = new_entry;
-            key_hash |= OK_MAP_OCCUPIED_FLAG;
-            memcpy(entry, &key_hash, sizeof(ok_hash_t));
-            memcpy(OK_PTR_INC(entry, (*map)->key_offset), key, key_size);
-            (*map)->count++;
-        }
+OK_LIB_API void *_ok_lru_next(const struct _ok_lru *lru, void *iterator, void *key,
+                              size_t key_size, void *value, size_t value_size) {
+    size_t index = (iterator ? ((size_t *)(void *)OK_PTR_INC(iterator, lru->links_offset))[1] :
+                    lru->head);
+    if (index == OK_LRU_NONE) {
+        return NULL;
+    }
+    const struct _ok_map *map = lru->map;
+    void *entry = OK_PTR_INC(map->buckets, index * map->bucket_stride);
+    if (key) {
+        memcpy(key, OK_PTR_INC(entry, map->key_offset), key_size);
+    }
+    if (value) {
+        memcpy(value, OK_PTR_INC(entry, map->value_offset), value_size);
     }
     return entry;
 }
 
-OK_LIB_API struct _ok_map *_ok_map_create(size_t initial_capacity,
-                                          bool (*key_equals_func)(const void *key1,
-                                                                  const void *key2),
-                                          size_t key_offset, size_t value_offset,
-                                          size_t bucket_stride) {
-    struct _ok_map *map = (struct _ok_map *)calloc(1, sizeof(struct _ok_map));
-    if (map) {
-        map->key_equals_func = key_equals_func;
-        map->key_offset = key_offset;
-        map->value_offset = value_offset;
-        map->bucket_stride = bucket_stride;
-        map->max_load_factor = OK_MAP_DEFAULT_MAX_LOAD;
-        map = _ok_map_init(map, initial_capacity);
+// MARK: Implementation: Private aggregator functions
+
+/*
+ Aggregator
+ - Each worker has one map per shard, created on first use. The shard is chosen by the upper bits
+   of the hash (below the occupied flag), like _ok_cmap_segment(), so the lower bits still choose
+   the bucket within the shard's map.
+ - Merging moves or merges every worker's map of a shard into worker 0's map of the shard. A shard
+   is only touched by the thread merging it.
+ */
+
+static const size_t OK_AGG_MAX_SHARD_COUNT = 128;
+
+struct _ok_agg {
+    struct _ok_map **maps; // worker_count * shard_count maps, worker-major
+    size_t worker_count;
+    size_t shard_mask;
+    bool (*key_equals_func)(const void *key1, const void *key2);
+    size_t key_offset;
+    size_t key_size;
+    size_t value_offset;
+    size_t value_size;
+    size_t bucket_stride;
+};
+
+// The state of merging shards on one thread: shards `first_shard`, `first_shard + shard_step`, ...
+struct _ok_agg_merge_task {
+    struct _ok_agg *agg;
+    size_t first_shard;
+    size_t shard_step;
+    void (*combine_func)(void *value, const void *new_value, void *context);
+    void *context;
+    bool on_thread;
+    bool success;
+};
+
+static inline size_t _ok_agg_shard(const struct _ok_agg *agg, ok_hash_t key_hash) {
+    return (size_t)(key_hash >> (sizeof(ok_hash_t) * 8 - 8)) & agg->shard_mask;
+}
+
+// Gets the map of a worker for a hash, creating it if needed. Returns NULL for out-of-memory error.
+static struct _ok_map **_ok_agg_map(struct _ok_agg *agg, size_t worker, ok_hash_t key_hash) {
+    if (worker >= agg->worker_count) {
+        return NULL;
+    }
+    struct _ok_map **map = &agg->maps[worker * (agg->shard_mask + 1) +
+                                      _ok_agg_shard(agg, key_hash)];
+    if (!*map) {
+        *map = _ok_map_create(0, agg->key_equals_func, agg->key_offset, agg->value_offset,
+                              agg->bucket_stride, OK_MAP_OPTION_NONE);
+        if (!*map) {
+            return NULL;
+        }
     }
     return map;
 }
 
-OK_LIB_API void _ok_map_free(struct _ok_map *map) {
-    if (map) {
-        free(map->buckets);
-        free(map);
+static void _ok_agg_merge_shards(struct _ok_agg_merge_task *task) {
+    struct _ok_agg *agg = task->agg;
+    const size_t shard_count = agg->shard_mask + 1;
+    for (size_t s = task->first_shard; s < shard_count; s += task->shard_step) {
+        struct _ok_map **map = &agg->maps[s];
+        for (size_t w = 1; w < agg->worker_count; w++) {
+            struct _ok_map **from_map = &agg->maps[w * shard_count + s];
+            if (!*from_map) {
+                continue;
+            }
+            if (!*map) {
+                *map = *from_map;
+            } else if (_ok_map_merge(map, *from_map, agg->key_size, agg->value_size,
+                                     task->combine_func, task->context)) {
+                _ok_map_free(*from_map);
+            } else {
+                task->success = false;
+                return;
+            }
+            *from_map = NULL;
+        }
     }
 }
 
-OK_LIB_API size_t _ok_map_count(const struct _ok_map *map) {
-    return map->count;
-}
+#if defined(OK_LIB_USE_THREADS)
 
-OK_LIB_API size_t _ok_map_capacity(const struct _ok_map *map) {
-    return map ? (1u << map->capacity_n) : OK_MAP_MIN_CAPACITY;
+OK_THREAD_FUNC(_ok_agg_merge_thread, arg) {
+    _ok_agg_merge_shards((struct _ok_agg_merge_task *)arg);
+    OK_THREAD_RETURN;
 }
 
-OK_LIB_API bool _ok_map_contains(const struct _ok_map *map, const void *key,
-                                 ok_hash_t key_hash) {
-    return (_ok_map_find_entry(map, key, key_hash, NULL) != NULL);
-}
+#endif
 
-OK_LIB_API bool _ok_map_put(struct _ok_map **map, const void *key,
-                            size_t key_size, ok_hash_t key_hash,
-                            const void *value, size_t value_size) {
-    void *entry = _ok_map_find_or_put_entry(map, key, key_size, key_hash, value_size);
-    if (entry) {
-        memcpy(OK_PTR_INC(entry, (*map)->value_offset), value, value_size);
-        return true;
-    } else {
-        return false;
+OK_LIB_API struct _ok_agg *_ok_agg_create(size_t worker_count, size_t shard_count,
+                                          bool (*key_equals_func)(const void *key1,
+                                                                  const void *key2),
+                                          size_t key_offset, size_t key_size,
+                                          size_t value_offset, size_t value_size,
+                                          size_t bucket_stride) {
+    if (worker_count == 0) {
+        return NULL;
+    }
+    struct _ok_agg *agg = (struct _ok_agg *)calloc(1, sizeof(struct _ok_agg));
+    if (!agg) {
+        return NULL;
+    }
+    size_t n = 1;
+    while (n < shard_count && n < OK_AGG_MAX_SHARD_COUNT) {
+        n <<= 1;
+    }
+    agg->worker_count = worker_count;
+    agg->shard_mask = n - 1;
+    agg->key_equals_func = key_equals_func;
+    agg->key_offset = key_offset;
+    agg->key_size = key_size;
+    agg->value_offset = value_offset;
+    agg->value_size = value_size;
+    agg->bucket_stride = bucket_stride;
+    agg->maps = (struct _ok_map **)calloc(worker_count * n, sizeof(struct _ok_map *));
+    if (!agg->maps) {
+        free(agg);
+        return NULL;
     }
+    return agg;
 }
 
-OK_LIB_API void _ok_map_put_and_get_ptr(struct _ok_map **map, const void *key,
-                                        size_t key_size, ok_hash_t key_hash,
-                                        void **value_ptr, size_t value_size) {
-    void *entry = _ok_map_find_or_put_entry(map, key, key_size, key_hash, value_size);
-    if (entry) {
-        *value_ptr = OK_PTR_INC(entry, (*map)->value_offset);
-    } else {
-        *value_ptr = NULL;
+OK_LIB_API void _ok_agg_free(struct _ok_agg *agg) {
+    if (agg) {
+        for (size_t i = 0; i < agg->worker_count * (agg->shard_mask + 1); i++) {
+            _ok_map_free(agg->maps[i]);
+        }
+        free(agg->maps);
+        free(agg);
     }
 }
 
-OK_LIB_API bool _ok_map_put_all(struct _ok_map **map,
-                                const struct _ok_map *from_map,
-                                size_t key_size, size_t value_size) {
-    if ((*map)->key_equals_func != from_map->key_equals_func) {
+OK_LIB_API bool _ok_agg_update(struct _ok_agg *agg, size_t worker, const void *key,
+                               ok_hash_t key_hash,
+                               void (*update_func)(void *value, bool exists, void *context),
+                               void *context) {
+    bool inserted;
+    void *value = _ok_agg_entry(agg, worker, key, key_hash, &inserted);
+    if (!value) {
         return false;
     }
-
-    void *iterator = from_map->buckets;
-    void *end = OK_PTR_INC(from_map->buckets, (from_map->bucket_stride << from_map->capacity_n));
-    while (iterator < end) {
-        ok_hash_t flags_hash = *(ok_hash_t *)(iterator);
-        if (flags_hash & OK_MAP_OCCUPIED_FLAG) {
-            void *key = OK_PTR_INC(iterator, from_map->key_offset);
-            void *value = OK_PTR_INC(iterator, from_map->value_offset);
-            bool success = _ok_map_put(map, key, key_size, flags_hash, value, value_size);
-            if (!success) {
-                return false;
-            }
-        }
-        iterator = OK_PTR_INC(iterator, from_map->bucket_stride);
-    }
+    update_func(value, !inserted, context);
     return true;
 }
 
-OK_LIB_API void _ok_map_get(const struct _ok_map *map, const void *key,
-                            ok_hash_t key_hash, void *value, size_t value_size) {
-    void *entry = _ok_map_find_entry(map, key, key_hash, NULL);
-    if (entry) {
-        memcpy(value, OK_PTR_INC(entry, map->value_offset), value_size);
-    } else {
-        memset(value, 0, value_size);
+OK_LIB_API void *_ok_agg_entry(struct _ok_agg *agg, size_t worker, const void *key,
+                               ok_hash_t key_hash, bool *inserted) {
+    void *value = NULL;
+    struct _ok_map **map = _ok_agg_map(agg, worker, key_hash);
+    if (map) {
+        _ok_map_entry(map, key, agg->key_size, key_hash, &value, agg->value_size, inserted,
+                      NULL, NULL);
+    } else if (inserted) {
+        *inserted = false;
     }
+    return value;
 }
 
-OK_LIB_API void _ok_map_get_ptr(const struct _ok_map *map, const void *key,
-                                ok_hash_t key_hash, void **value_ptr) {
-    void *entry = _ok_map_find_entry(map, key, key_hash, NULL);
-    if (entry) {
-        *value_ptr = OK_PTR_INC(entry, map->value_offset);
-    } else {
-        *value_ptr = NULL;
+OK_LIB_API bool _ok_agg_merge(struct _ok_agg *agg,
+                              void (*combine_func)(void *value, const void *new_value,
+                                                   void *context),
+                              void *context) {
+    size_t thread_count = 1;
+#if defined(OK_LIB_USE_THREADS)
+    if (agg->worker_count > 1) {
+        thread_count = _ok_map_thread_count(0);
+        if (thread_count > agg->shard_mask + 1) {
+            thread_count = agg->shard_mask + 1;
+        }
     }
-}
-
-OK_LIB_API void *_ok_map_next(const struct _ok_map *map, void *iterator, void *key,
-                              size_t key_size, void *value, size_t value_size) {
-    if (map->count == 0) {
-        return NULL;
+#endif
+    struct _ok_agg_merge_task *tasks =
+        (struct _ok_agg_merge_task *)calloc(thread_count, sizeof(struct _ok_agg_merge_task));
+    if (!tasks) {
+        return false;
     }
-    void *begin = map->buckets;
-    void *end = OK_PTR_INC(map->buckets, (map->bucket_stride << map->capacity_n));
-    if (!iterator) {
-        iterator = map->buckets;
+    for (size_t t = 0; t < thread_count; t++) {
+        tasks[t].agg = agg;
+        tasks[t].first_shard = t;
+        tasks[t].shard_step = thread_count;
+        tasks[t].combine_func = combine_func;
+        tasks[t].context = context;
+        tasks[t].success = true;
     }
-    while (iterator >= begin && iterator < end) {
-        ok_hash_t flags_hash = *(ok_hash_t *)(iterator);
-        void *next_iterator = OK_PTR_INC(iterator, map->bucket_stride);
-        if (flags_hash & OK_MAP_OCCUPIED_FLAG) {
-            if (key) {
-                memcpy(key, OK_PTR_INC(iterator, map->key_offset), key_size);
-            }
-            if (value) {
-                memcpy(value, OK_PTR_INC(iterator, map->value_offset), value_size);
-            }
-            return next_iterator;
+#if defined(OK_LIB_USE_THREADS)
+    _ok_thread_t *threads = NULL;
+    if (thread_count > 1) {
+        threads = (_ok_thread_t *)calloc(thread_count, sizeof(_ok_thread_t));
+    }
+    for (size_t t = 1; threads && t < thread_count; t++) {
+        tasks[t].on_thread = _ok_thread_create(&threads[t], _ok_agg_merge_thread, &tasks[t]);
+    }
+#endif
+    _ok_agg_merge_shards(&tasks[0]);
+    bool success = tasks[0].success;
+    for (size_t t = 1; t < thread_count; t++) {
+#if defined(OK_LIB_USE_THREADS)
+        if (tasks[t].on_thread) {
+            _ok_thread_join(threads[t]);
+        } else {
+            _ok_agg_merge_shards(&tasks[t]);
         }
-        iterator = next_iterator;
+#endif
+        success = success && tasks[t].success;
     }
-    return NULL;
+#if defined(OK_LIB_USE_THREADS)
+    free(threads);
+#endif
+    free(tasks);
+    return success;
 }
 
-OK_LIB_API bool _ok_map_remove(struct _ok_map *map, const void *key, ok_hash_t key_hash) {
-    void *removed_entry = _ok_map_find_entry(map, key, key_hash, NULL);
-    if (!removed_entry) {
-        return false;
+OK_LIB_API size_t _ok_agg_count(const struct _ok_agg *agg) {
+    size_t count = 0;
+    for (size_t i = 0; i < agg->worker_count * (agg->shard_mask + 1); i++) {
+        count += _ok_map_count(agg->maps[i]);
     }
-    memset(removed_entry, 0, sizeof(ok_hash_t));
-    map->count--;
-
-    size_t i = OK_OFFSETOF(map->buckets, removed_entry) / map->bucket_stride;
-    size_t j = i;
+    return count;
+}
 
-    // NOTE: This only works with linear probing
-    const size_t mask = (1u << map->capacity_n) - 1u;
-    while (true) {
-        j = (j + 1) & mask;
-        void *entry = OK_PTR_INC(map->buckets, j * map->bucket_stride);
+OK_LIB_API bool _ok_agg_get(const struct _ok_agg *agg, const void *key, ok_hash_t key_hash,
+                            void *value, size_t value_size) {
+    return _ok_map_get(agg->maps[_ok_agg_shard(agg, key_hash)], key, key_hash, value,
+                       value_size);
+}
 
-        ok_hash_t flags_hash = *(ok_hash_t *)(entry);
-        if ((flags_hash & OK_MAP_OCCUPIED_FLAG) == 0) {
-            break;
-        }
-        size_t k = flags_hash & mask;
-        if ((i <= j) ? ((k <= i) || (k > j)) : ((k <= i) && (k > j))) {
-            memcpy(removed_entry, entry, map->bucket_stride);
-            i = j;
-            removed_entry = entry;
-            memset(removed_entry, 0, sizeof(ok_hash_t));
+OK_LIB_API void *_ok_agg_next(const struct _ok_agg *agg, size_t *shard, void *iterator,
+                              void *key, size_t key_size, void *value, size_t value_size) {
+    while (*shard <= agg->shard_mask) {
+        iterator = _ok_map_next(agg->maps[*shard], iterator, key, key_size, value, value_size);
+        if (iterator) {
+            return iterator;
         }
+        (*shard)++;
     }
-    return true;
+    return NULL;
 }
 
 // MARK: Implementation: Private queue functions
@@ -1531,6 +6698,8 @@ OK_LIB_API bool _ok_map_remove(struct _ok_map *map, const void *key, ok_hash_t k
 #  define atomic_store(object, value) *(object) = value
 #  define atomic_compare_exchange_strong(object, expected, desired) \
      (*(object) == *(expected) ? ((*(object) = desired), true) : false)
+#  define atomic_fetch_add(object, operand) ((*(object) += (operand)) - (operand))
+#  define atomic_fetch_sub(object, operand) ((*(object) -= (operand)) + (operand))
 #  define OK_LOCK_TYPE _Atomic(bool)
 #  define OK_TRYLOCK(lock) (*(lock) == false ? (*(lock) = true) : false)
 #  define OK_LOCK(lock) do { } while (!OK_TRYLOCK(lock))
@@ -1546,6 +6715,8 @@ OK_LIB_API bool _ok_map_remove(struct _ok_map *map, const void *key, ok_hash_t k
 #  define atomic_compare_exchange_strong(object, expected, desired) \
      (InterlockedCompareExchangePointer((PVOID volatile *)(object), (desired), *(expected)) \
        == *(expected))
+#  define atomic_fetch_add(object, operand) InterlockedExchangeAddSizeT((object), (operand))
+#  define atomic_fetch_sub(object, operand) InterlockedExchangeAddSizeT((object), 0 - (operand))
 #  define OK_LOCK_TYPE LONG volatile
 #  define OK_TRYLOCK(lock) (InterlockedExchange((lock), 1) == 0)
 #  define OK_LOCK(lock) do { } while (!OK_TRYLOCK(lock))
@@ -1557,6 +6728,10 @@ OK_LIB_API bool _ok_map_remove(struct _ok_map *map, const void *key, ok_hash_t k
 #  define atomic_compare_exchange_strong(object, expected, desired) \
      __atomic_compare_exchange_n((object), (expected), (desired), 0, __ATOMIC_SEQ_CST, \
                                  __ATOMIC_SEQ_CST)
+#  define atomic_fetch_add(object, operand) \
+     __atomic_fetch_add((object), (operand), __ATOMIC_SEQ_CST)
+#  define atomic_fetch_sub(object, operand) \
+     __atomic_fetch_sub((object), (operand), __ATOMIC_SEQ_CST)
 #  define OK_LOCK_TYPE bool volatile
 #  define OK_TRYLOCK(lock) (__atomic_exchange_n((lock), true, __ATOMIC_ACQUIRE) == false)
 #  define OK_LOCK(lock) do { } while (!OK_TRYLOCK(lock))
@@ -1754,6 +6929,485 @@ OK_LIB_API void _ok_queue_deinit(struct _ok_queue *queue, size_t value_size,
     OK_UNLOCK(&queue->tail_lock);
 }
 
+// MARK: Implementation: Private concurrent map functions
+
+/*
+ Concurrent map
+ - The map is divided into segments, chosen by the upper bits of the hash. Each segment has its
+   own table (linear probing), spinlock, and sequence counter.
+ - Writers lock the segment. Readers never lock.
+ - A bucket's key is written before the bucket's hash is published (with an atomic store).
+   Removal leaves a tombstone instead of moving entries. The tombstone holds the segment's epoch
+   at removal (see below). An insert reuses the first tombstone of its probe sequence whose
+   readers are gone, so removing and putting keys doesn't fill the table with tombstones.
+ - Values can be changed in place, so the value is read like a seqlock: the writer makes the
+   segment's sequence odd while changing a value, and a reader retries if the sequence was odd or
+   changed while it copied the value.
+ - Reusing a tombstone writes a new key, which a reader that found the bucket before the removal
+   could be comparing, and the sequence can't protect a call to the equals function. So a
+   tombstone is only reused once every reader that may have found the bucket has finished: the
+   epoch advanced twice since the removal, or once and the removal epoch's slot is zero.
+ - A segment is resized by building a new table and publishing it with an atomic store. A reader
+   also retries if the table changed while it read, so it never returns a value from a table that
+   was already replaced (like a value changed in the new table after the resize).
+ - Replaced tables may still be read, so they are retired, and freed by epochs: a reader counts
+   itself in the `readers` slot of the segment's current epoch while it reads. A writer advances
+   the epoch when tables were retired or keys were removed, but only once the previous epoch's
+   slot is zero, so only readers of the current and previous epochs can be reading. Tables
+   retired before the previous epoch ended are then freed. A reader checks that the epoch didn't
+   change after counting itself, so a slot is never counted in after its epoch ended.
+ */
+
+#if defined(OK_LIB_USE_STDATOMIC)
+#  define OK_ATOMIC_FENCE() atomic_thread_fence(memory_order_seq_cst)
+#elif defined(__EMSCRIPTEN__)
+#  define OK_ATOMIC_FENCE() ((void)0)
+#elif defined(_MSC_VER)
+#  define OK_ATOMIC_FENCE() MemoryBarrier()
+#else
+#  define OK_ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+static const size_t OK_CMAP_MIN_CAPACITY = 16;
+static const size_t OK_CMAP_MAX_SEGMENT_COUNT = 128;
+
+struct _ok_cmap_table {
+    void *buckets;
+    size_t capacity_mask;
+    size_t max_count; // Maximum number of occupied buckets plus tombstones
+    struct _ok_cmap_table *next_retired;
+};
+
+struct _ok_cmap_segment {
+    OK_ALIGNAS(OK_CACHELINE_SIZE) _Atomic(struct _ok_cmap_table *) table;
+    _Atomic(size_t) seq;
+    _Atomic(size_t) count;
+    _Atomic(size_t) epoch;
+    size_t tombstone_count;
+    size_t tombstone_epoch; // The epoch of the most recent removal
+    // Tables replaced during the current epoch, and tables replaced before it (which are freed
+    // once no reader of the previous epoch remains)
+    struct _ok_cmap_table *retired;
+    struct _ok_cmap_table *expired;
+    OK_LOCK_TYPE lock;
+    // The number of readers in each epoch (by parity). Written by readers, so on its own line.
+    OK_ALIGNAS(OK_CACHELINE_SIZE) _Atomic(size_t) readers[2];
+};
+
+struct _ok_cmap {
+    struct _ok_cmap_segment *segments;
+    size_t segment_mask;
+    bool (*key_equals_func)(const void *key1, const void *key2);
+    size_t key_offset;
+    size_t key_size;
+    size_t value_offset;
+    size_t value_size;
+    size_t bucket_stride;
+};
+
+static struct _ok_cmap_table *_ok_cmap_table_create(const struct _ok_cmap *map, size_t capacity) {
+    struct _ok_cmap_table *table = (struct _ok_cmap_table *)malloc(sizeof(struct _ok_cmap_table));
+    if (table) {
+        table->buckets = calloc(capacity, map->bucket_stride);
+        if (!table->buckets) {
+            free(table);
+            return NULL;
+        }
+        table->capacity_mask = capacity - 1;
+        table->max_count = capacity - capacity / 4;
+        table->next_retired = NULL;
+    }
+    return table;
+}
+
+static void _ok_cmap_table_free(struct _ok_cmap_table *table) {
+    while (table) {
+        struct _ok_cmap_table *next_retired = table->next_retired;
+        free(table->buckets);
+        free(table);
+        table = next_retired;
+    }
+}
+
+static inline struct _ok_cmap_segment *_ok_cmap_segment(const struct _ok_cmap *map,
+                                                        ok_hash_t key_hash) {
+    // The upper bits (below the occupied flag) choose the segment; the lower bits choose the bucket
+    size_t index = (size_t)(key_hash >> (sizeof(ok_hash_t) * 8 - 8)) & map->segment_mask;
+    return map->segments + index;
+}
+
+static inline ok_hash_t _ok_cmap_load_hash(const void *bucket) {
+    return atomic_load((_Atomic(ok_hash_t) *)bucket);
+}
+
+// The hash of a bucket removed in an epoch: not occupied, not zero (empty), and holding the low
+// bits of the epoch.
+static inline ok_hash_t _ok_cmap_tombstone(size_t epoch) {
+    return (((ok_hash_t)epoch << 1) | 1) & ~OK_MAP_OCCUPIED_FLAG;
+}
+
+// Checks if a tombstone can be reused: no reader that may have found the bucket before it was
+// removed is still reading. The segment must be locked.
+static bool _ok_cmap_tombstone_reusable(struct _ok_cmap_segment *segment, ok_hash_t tombstone) {
+    const ok_hash_t epoch_mask = (OK_MAP_OCCUPIED_FLAG >> 1) - 1;
+    size_t epoch = atomic_load(&segment->epoch);
+    ok_hash_t age = ((ok_hash_t)epoch - (tombstone >> 1)) & epoch_mask;
+    return age >= 2 || (age == 1 && atomic_load(&segment->readers[(epoch - 1) & 1]) == 0);
+}
+
+// Finds the bucket of a key. If `empty_bucket` is not NULL, it is set to the bucket to insert the
+// key into if the key isn't found: the first reusable tombstone of the probe sequence, or the
+// empty bucket at its end. The segment must be locked if `empty_bucket` is not NULL.
+static void *_ok_cmap_find(const struct _ok_cmap *map, struct _ok_cmap_segment *segment,
+                           const struct _ok_cmap_table *table, const void *key, ok_hash_t hash,
+                           void **empty_bucket) {
+    size_t bucket_index = (size_t)(hash & table->capacity_mask);
+    void *tombstone = NULL;
+    while (true) {
+        void *bucket = OK_PTR_INC(table->buckets, bucket_index * map->bucket_stride);
+        ok_hash_t bucket_hash = _ok_cmap_load_hash(bucket);
+        if (bucket_hash == hash &&
+            map->key_equals_func(OK_PTR_INC(bucket, map->key_offset), key)) {
+            return bucket;
+        } else if (bucket_hash == 0) {
+            if (empty_bucket) {
+                *empty_bucket = (tombstone ? tombstone : bucket);
+            }
+            return NULL;
+        } else if (empty_bucket && !tombstone && !(bucket_hash & OK_MAP_OCCUPIED_FLAG) &&
+                   _ok_cmap_tombstone_reusable(segment, bucket_hash)) {
+            tombstone = bucket;
+        }
+        bucket_index = (bucket_index + 1) & table->capacity_mask;
+    }
+}
+
+// Counts a reader in the current epoch's slot, so the tables it may read aren't freed. Returns the
+// slot, which is passed to _ok_cmap_read_end().
+static size_t _ok_cmap_read_begin(struct _ok_cmap_segment *segment) {
+    while (true) {
+        size_t epoch = atomic_load(&segment->epoch);
+        atomic_fetch_add(&segment->readers[epoch & 1], 1);
+        if (atomic_load(&segment->epoch) == epoch) {
+            return epoch & 1;
+        }
+        atomic_fetch_sub(&segment->readers[epoch & 1], 1);
+    }
+}
+
+static void _ok_cmap_read_end(struct _ok_cmap_segment *segment, size_t slot) {
+    atomic_fetch_sub(&segment->readers[slot], 1);
+}
+
+// Advances the epoch if tables were retired or keys were removed in the current epoch, and frees
+// retired tables that no reader can be reading. The segment must be locked.
+static void _ok_cmap_reclaim(struct _ok_cmap_segment *segment) {
+    size_t epoch = atomic_load(&segment->epoch);
+    bool removed = (segment->tombstone_count > 0 && segment->tombstone_epoch == epoch);
+    if (!segment->expired && !segment->retired && !removed) {
+        return;
+    }
+    if (atomic_load(&segment->readers[(epoch - 1) & 1]) != 0) {
+        return;
+    }
+    _ok_cmap_table_free(segment->expired);
+    segment->expired = NULL;
+    if (segment->retired || removed) {
+        // New readers are counted in the other slot, can only load the current table, and can't
+        // find the keys removed so far
+        atomic_store(&segment->epoch, epoch + 1);
+        segment->expired = segment->retired;
+        segment->retired = NULL;
+        if (segment->expired && atomic_load(&segment->readers[epoch & 1]) == 0) {
+            _ok_cmap_table_free(segment->expired);
+            segment->expired = NULL;
+        }
+    }
+}
+
+// Replaces the segment's table with a new table without tombstones. The segment must be locked.
+static bool _ok_cmap_resize(const struct _ok_cmap *map, struct _ok_cmap_segment *segment) {
+    struct _ok_cmap_table *table = atomic_load(&segment->table);
+    size_t count = atomic_load(&segment->count);
+    size_t capacity = table->capacity_mask + 1;
+    if (count >= table->max_count / 2) {
+        capacity <<= 1;
+    }
+    struct _ok_cmap_table *new_table = _ok_cmap_table_create(map, capacity);
+    if (!new_table) {
+        return false;
+    }
+    for (size_t i = 0; i <= table->capacity_mask; i++) {
+        void *bucket = OK_PTR_INC(table->buckets, i * map->bucket_stride);
+        ok_hash_t hash = *(ok_hash_t *)bucket;
+        if (hash & OK_MAP_OCCUPIED_FLAG) {
+            size_t bucket_index = (size_t)(hash & new_table->capacity_mask);
+            void *new_bucket;
+            while (true) {
+                new_bucket = OK_PTR_INC(new_table->buckets, bucket_index * map->bucket_stride);
+                if (*(ok_hash_t *)new_bucket == 0) {
+                    break;
+                }
+                bucket_index = (bucket_index + 1) & new_table->capacity_mask;
+            }
+            memcpy(new_bucket, bucket, map->bucket_stride);
+        }
+    }
+    // Publish the new table. The old table can still be read, so it is retired instead of freed.
+    atomic_store(&segment->table, new_table);
+    table->next_retired = segment->retired;
+    segment->retired = table;
+    segment->tombstone_count = 0;
+    _ok_cmap_reclaim(segment);
+    return true;
+}
+
+// Makes the segment's sequence odd while a value is changed in place. The segment must be locked.
+static void _ok_cmap_begin_write(struct _ok_cmap_segment *segment) {
+    atomic_store(&segment->seq, atomic_load(&segment->seq) + 1);
+    OK_ATOMIC_FENCE();
+}
+
+static void _ok_cmap_end_write(struct _ok_cmap_segment *segment) {
+    atomic_store(&segment->seq, atomic_load(&segment->seq) + 1);
+}
+
+// Inserts a key that is not in the segment, into the bucket found by _ok_cmap_find(). The segment
+// must be locked.
+static void *_ok_cmap_insert(const struct _ok_cmap *map, struct _ok_cmap_segment *segment,
+                             const void *key, ok_hash_t hash, void *empty_bucket) {
+    if (_ok_cmap_load_hash(empty_bucket) != 0) {
+        // A reusable tombstone, so no reader is comparing the key that is overwritten
+        segment->tombstone_count--;
+    } else {
+        struct _ok_cmap_table *table = atomic_load(&segment->table);
+        size_t count = atomic_load(&segment->count);
+        if (count + segment->tombstone_count >= table->max_count) {
+            if (!_ok_cmap_resize(map, segment)) {
+                return NULL;
+            }
+            table = atomic_load(&segment->table);
+            _ok_cmap_find(map, segment, table, key, hash, &empty_bucket);
+        }
+    }
+    memcpy(OK_PTR_INC(empty_bucket, map->key_offset), key, map->key_size);
+    return empty_bucket;
+}
+
+// Publishes a bucket that was filled by _ok_cmap_insert(), so readers can find it.
+static void _ok_cmap_publish(struct _ok_cmap_segment *segment, void *bucket, ok_hash_t hash) {
+    atomic_store((_Atomic(ok_hash_t) *)bucket, hash);
+    atomic_store(&segment->count, atomic_load(&segment->count) + 1);
+}
+
+OK_LIB_API struct _ok_cmap *_ok_cmap_create(size_t segment_count,
+                                            bool (*key_equals_func)(const void *key1,
+                                                                    const void *key2),
+                                            size_t key_offset, size_t key_size,
+                                            size_t value_offset, size_t value_size,
+                                            size_t bucket_stride) {
+    struct _ok_cmap *map = (struct _ok_cmap *)calloc(1, sizeof(struct _ok_cmap));
+    if (!map) {
+        return NULL;
+    }
+    size_t n = 1;
+    while (n < segment_count && n < OK_CMAP_MAX_SEGMENT_COUNT) {
+        n <<= 1;
+    }
+    map->segment_mask = n - 1;
+    map->key_equals_func = key_equals_func;
+    map->key_offset = key_offset;
+    map->key_size = key_size;
+    map->value_offset = value_offset;
+    map->value_size = value_size;
+    map->bucket_stride = bucket_stride;
+    map->segments = (struct _ok_cmap_segment *)calloc(n, sizeof(struct _ok_cmap_segment));
+    if (!map->segments) {
+        free(map);
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) {
+        struct _ok_cmap_segment *segment = map->segments + i;
+        struct _ok_cmap_table *table = _ok_cmap_table_create(map, OK_CMAP_MIN_CAPACITY);
+        if (!table) {
+            _ok_cmap_free(map);
+            return NULL;
+        }
+        atomic_store(&segment->table, table);
+        atomic_store(&segment->seq, 0);
+        atomic_store(&segment->count, 0);
+        atomic_store(&segment->epoch, 0);
+        atomic_store(&segment->readers[0], 0);
+        atomic_store(&segment->readers[1], 0);
+        atomic_store(&segment->lock, false);
+    }
+    return map;
+}
+
+OK_LIB_API void _ok_cmap_free(struct _ok_cmap *map) {
+    if (map) {
+        for (size_t i = 0; i <= map->segment_mask; i++) {
+            struct _ok_cmap_segment *segment = map->segments + i;
+            _ok_cmap_table_free(atomic_load(&segment->table));
+            _ok_cmap_table_free(segment->retired);
+            _ok_cmap_table_free(segment->expired);
+        }
+        free(map->segments);
+        free(map);
+    }
+}
+
+OK_LIB_API void _ok_cmap_free_retired(struct _ok_cmap *map) {
+    for (size_t i = 0; i <= map->segment_mask; i++) {
+        struct _ok_cmap_segment *segment = map->segments + i;
+        _ok_cmap_table_free(segment->retired);
+        _ok_cmap_table_free(segment->expired);
+        segment->retired = NULL;
+        segment->expired = NULL;
+    }
+}
+
+OK_LIB_API size_t _ok_cmap_count(struct _ok_cmap *map) {
+    size_t count = 0;
+    for (size_t i = 0; i <= map->segment_mask; i++) {
+        count += atomic_load(&map->segments[i].count);
+    }
+    return count;
+}
+
+OK_LIB_API bool _ok_cmap_get(struct _ok_cmap *map, const void *key, ok_hash_t key_hash,
+                             void *value) {
+    struct _ok_cmap_segment *segment = _ok_cmap_segment(map, key_hash);
+    ok_hash_t hash = key_hash | OK_MAP_OCCUPIED_FLAG;
+    size_t slot = _ok_cmap_read_begin(segment);
+    while (true) {
+        size_t seq = atomic_load(&segment->seq);
+        if (seq & 1) {
+            continue; // A value is being written
+        }
+        struct _ok_cmap_table *table = atomic_load(&segment->table);
+        void *bucket = _ok_cmap_find(map, segment, table, key, hash, NULL);
+        if (bucket && value) {
+            memcpy(value, OK_PTR_INC(bucket, map->value_offset), map->value_size);
+        }
+        OK_ATOMIC_FENCE();
+        if (atomic_load(&segment->seq) == seq && atomic_load(&segment->table) == table) {
+            _ok_cmap_read_end(segment, slot);
+            if (!bucket && value) {
+                memset(value, 0, map->value_size);
+            }
+            return bucket != NULL;
+        }
+    }
+}
+
+OK_LIB_API bool _ok_cmap_put(struct _ok_cmap *map, const void *key, ok_hash_t key_hash,
+                             const void *value) {
+    struct _ok_cmap_segment *segment = _ok_cmap_segment(map, key_hash);
+    ok_hash_t hash = key_hash | OK_MAP_OCCUPIED_FLAG;
+    bool success = true;
+    OK_LOCK(&segment->lock);
+    void *empty_bucket = NULL;
+    void *bucket = _ok_cmap_find(map, segment, atomic_load(&segment->table), key, hash,
+                                 &empty_bucket);
+    if (bucket) {
+        _ok_cmap_begin_write(segment);
+        memcpy(OK_PTR_INC(bucket, map->value_offset), value, map->value_size);
+        _ok_cmap_end_write(segment);
+    } else {
+        bucket = _ok_cmap_insert(map, segment, key, hash, empty_bucket);
+        if (bucket) {
+            memcpy(OK_PTR_INC(bucket, map->value_offset), value, map->value_size);
+            _ok_cmap_publish(segment, bucket, hash);
+        } else {
+            success = false;
+        }
+    }
+    _ok_cmap_reclaim(segment);
+    OK_UNLOCK(&segment->lock);
+    return success;
+}
+
+OK_LIB_API bool _ok_cmap_get_or_insert(struct _ok_cmap *map, const void *key, ok_hash_t key_hash,
+                                       void *value, bool *inserted) {
+    if (inserted) {
+        *inserted = false;
+    }
+    struct _ok_cmap_segment *segment = _ok_cmap_segment(map, key_hash);
+    ok_hash_t hash = key_hash | OK_MAP_OCCUPIED_FLAG;
+    bool success = true;
+    OK_LOCK(&segment->lock);
+    void *empty_bucket = NULL;
+    void *bucket = _ok_cmap_find(map, segment, atomic_load(&segment->table), key, hash,
+                                 &empty_bucket);
+    if (bucket) {
+        memcpy(value, OK_PTR_INC(bucket, map->value_offset), map->value_size);
+    } else {
+        bucket = _ok_cmap_insert(map, segment, key, hash, empty_bucket);
+        if (bucket) {
+            memcpy(OK_PTR_INC(bucket, map->value_offset), value, map->value_size);
+            _ok_cmap_publish(segment, bucket, hash);
+            if (inserted) {
+                *inserted = true;
+            }
+        } else {
+            success = false;
+        }
+    }
+    _ok_cmap_reclaim(segment);
+    OK_UNLOCK(&segment->lock);
+    return success;
+}
+
+OK_LIB_API bool _ok_cmap_update(struct _ok_cmap *map, const void *key, ok_hash_t key_hash,
+                                void (*update_func)(void *value, bool exists, void *context),
+                                void *context) {
+    struct _ok_cmap_segment *segment = _ok_cmap_segment(map, key_hash);
+    ok_hash_t hash = key_hash | OK_MAP_OCCUPIED_FLAG;
+    bool success = true;
+    OK_LOCK(&segment->lock);
+    void *empty_bucket = NULL;
+    void *bucket = _ok_cmap_find(map, segment, atomic_load(&segment->table), key, hash,
+                                 &empty_bucket);
+    if (bucket) {
+        _ok_cmap_begin_write(segment);
+        update_func(OK_PTR_INC(bucket, map->value_offset), true, context);
+        _ok_cmap_end_write(segment);
+    } else {
+        bucket = _ok_cmap_insert(map, segment, key, hash, empty_bucket);
+        if (bucket) {
+            // Not yet published, so readers can't see the value
+            void *value = OK_PTR_INC(bucket, map->value_offset);
+            memset(value, 0, map->value_size);
+            update_func(value, false, context);
+            _ok_cmap_publish(segment, bucket, hash);
+        } else {
+            success = false;
+        }
+    }
+    _ok_cmap_reclaim(segment);
+    OK_UNLOCK(&segment->lock);
+    return success;
+}
+
+OK_LIB_API bool _ok_cmap_remove(struct _ok_cmap *map, const void *key, ok_hash_t key_hash) {
+    struct _ok_cmap_segment *segment = _ok_cmap_segment(map, key_hash);
+    ok_hash_t hash = key_hash | OK_MAP_OCCUPIED_FLAG;
+    OK_LOCK(&segment->lock);
+    void *bucket = _ok_cmap_find(map, segment, atomic_load(&segment->table), key, hash, NULL);
+    if (bucket) {
+        // The key and value are left as-is for readers that already found this bucket
+        size_t epoch = atomic_load(&segment->epoch);
+        atomic_store((_Atomic(ok_hash_t) *)bucket, _ok_cmap_tombstone(epoch));
+        atomic_store(&segment->count, atomic_load(&segment->count) - 1);
+        segment->tombstone_count++;
+        segment->tombstone_epoch = epoch;
+    }
+    _ok_cmap_reclaim(segment);
+    OK_UNLOCK(&segment->lock);
+    return bucket != NULL;
+}
+
 #if defined(__GNUC__)
 #  pragma GCC diagnostic pop
 #elif defined (_MSC_VER)